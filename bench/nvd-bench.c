@@ -0,0 +1,739 @@
+#define _GNU_SOURCE
+
+/* Headless decode benchmark. Each stream decodes a file through libavcodec's VA-API hwaccel on a display shared by
+ * all the streams, and then does whatever the mode asks of every frame:
+ *   decode   - vaSyncSurface only
+ *   readback - vaGetImage into an image of the surface's format, the way a copy-back player reads frames
+ *   export   - vaExportSurfaceHandle with separate layers, the way a zero-copy player imports frames
+ *   roundtrip - 8-bit 4:2:0 only, vaGetImage as NV12 and I420, then vaPutImage of the I420 image into another surface
+ *              and back out as NV12. Any sample that differs fails the run, which checks the conversion kernels
+ *   vpp      - 8-bit 4:2:0 only, each frame is put through video processing's high quality (Lanczos) scaler at it's
+ *              own size, which should leave it as it was, and a flat BT.601 frame is converted to BT.709 once and
+ *              checked against the colour it should be. A sample more than 1 out fails the run
+ * At the end a line is printed with the decode rate, percentiles of each frame's latency from being sent to the
+ * decoder to being synced, the CPU time used and the most VRAM in use over the run. */
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/hwcontext_vaapi.h>
+#include <va/va.h>
+#include <va/va_drmcommon.h>
+#include <va/va_vpp.h>
+
+//packets that can be in the decoder at once before their frames come out, far more than any codec reorders
+#define MAX_PENDING 64
+//how often the VRAM in use is sampled
+#define VRAM_SAMPLE_NS 5000000
+
+typedef enum {
+    MODE_DECODE,
+    MODE_READBACK,
+    MODE_EXPORT,
+    MODE_ROUNDTRIP,
+    MODE_VPP,
+} BenchMode;
+
+//the images and surface the roundtrip mode converts each frame through
+typedef struct {
+    VAImage     planar;     //I420 read back from the decoded surface, then put into scratch
+    VAImage     check;      //NV12 read back from scratch
+    VASurfaceID scratch;
+} RoundTrip;
+
+//the video processing context and surfaces the vpp mode converts frames through
+typedef struct {
+    VAConfigID  config;
+    VAContextID context;
+    VASurfaceID scaled;     //each frame through the scaler
+    VASurfaceID flat;       //a single colour, converted into converted
+    VASurfaceID converted;
+    VAImage     check;      //NV12, read back from scaled and converted
+    bool        flatChecked;
+} VideoProc;
+
+typedef struct {
+    int64_t     pts;
+    uint64_t    sent;
+} PendingPacket;
+
+typedef struct {
+    const char      *path;
+    BenchMode       mode;
+    AVBufferRef     *device;
+    int             maxFrames;
+    RoundTrip       roundTrip;
+    VideoProc       videoProc;
+    pthread_t       thread;
+    bool            started;
+    //results
+    bool            failed;
+    int             frameCount;
+    uint64_t        *latencies;
+    int             latencyCount;
+    int             latencyCapacity;
+} BenchStream;
+
+typedef struct {
+    int     (*nvmlInit)(void);
+    int     (*nvmlShutdown)(void);
+    int     (*nvmlDeviceGetHandleByIndex)(unsigned int index, void **device);
+    int     (*nvmlDeviceGetMemoryInfo)(void *device, void *memory);
+} NvmlFunctions;
+
+//matches nvmlMemory_t
+typedef struct {
+    unsigned long long total;
+    unsigned long long free;
+    unsigned long long used;
+} NvmlMemory;
+
+static NvmlFunctions nvml;
+static void *nvmlDevice;
+static _Atomic bool sampling;
+static _Atomic unsigned long long vramPeak;
+
+static uint64_t nowNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
+
+static uint64_t cpuTimeNs(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (uint64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ull
+         + (uint64_t) (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ull;
+}
+
+//VRAM is read through NVML, if it isn't there the peak just isn't reported
+static bool openNvml(unsigned int gpu) {
+    void *lib = dlopen("libnvidia-ml.so.1", RTLD_LAZY | RTLD_LOCAL);
+    if (lib == NULL) {
+        return false;
+    }
+    nvml.nvmlInit = dlsym(lib, "nvmlInit_v2");
+    nvml.nvmlShutdown = dlsym(lib, "nvmlShutdown");
+    nvml.nvmlDeviceGetHandleByIndex = dlsym(lib, "nvmlDeviceGetHandleByIndex_v2");
+    nvml.nvmlDeviceGetMemoryInfo = dlsym(lib, "nvmlDeviceGetMemoryInfo");
+    if (nvml.nvmlInit == NULL || nvml.nvmlShutdown == NULL || nvml.nvmlDeviceGetHandleByIndex == NULL
+            || nvml.nvmlDeviceGetMemoryInfo == NULL || nvml.nvmlInit() != 0) {
+        return false;
+    }
+    if (nvml.nvmlDeviceGetHandleByIndex(gpu, &nvmlDevice) != 0) {
+        nvml.nvmlShutdown();
+        return false;
+    }
+    return true;
+}
+
+static unsigned long long vramUsed(void) {
+    NvmlMemory memory = {0};
+    if (nvmlDevice == NULL || nvml.nvmlDeviceGetMemoryInfo(nvmlDevice, &memory) != 0) {
+        return 0;
+    }
+    return memory.used;
+}
+
+static void *sampleVram(void *arg) {
+    while (sampling) {
+        unsigned long long used = vramUsed();
+        unsigned long long peak = atomic_load(&vramPeak);
+        while (used > peak && !atomic_compare_exchange_weak(&vramPeak, &peak, used));
+        struct timespec interval = { .tv_nsec = VRAM_SAMPLE_NS };
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+static enum AVPixelFormat pickVaapi(AVCodecContext *avctx, const enum AVPixelFormat *formats) {
+    for (const enum AVPixelFormat *f = formats; *f != AV_PIX_FMT_NONE; f++) {
+        if (*f == AV_PIX_FMT_VAAPI) {
+            return *f;
+        }
+    }
+    fprintf(stderr, "VA-API can't decode this stream\n");
+    return AV_PIX_FMT_NONE;
+}
+
+static void recordLatency(BenchStream *stream, uint64_t latency) {
+    if (stream->latencyCount == stream->latencyCapacity) {
+        int capacity = stream->latencyCapacity > 0 ? stream->latencyCapacity * 2 : 1024;
+        uint64_t *latencies = realloc(stream->latencies, (size_t) capacity * sizeof(uint64_t));
+        if (latencies == NULL) {
+            return;
+        }
+        stream->latencies = latencies;
+        stream->latencyCapacity = capacity;
+    }
+    stream->latencies[stream->latencyCount++] = latency;
+}
+
+//the samples of an NV12 image that an I420 one should match, false if any differ
+static bool matchesPlanar(VADisplay display, const VAImage *nv12, const VAImage *i420) {
+    uint8_t *a, *b;
+    if (vaMapBuffer(display, nv12->buf, (void**) &a) != VA_STATUS_SUCCESS) {
+        return false;
+    }
+    if (vaMapBuffer(display, i420->buf, (void**) &b) != VA_STATUS_SUCCESS) {
+        vaUnmapBuffer(display, nv12->buf);
+        return false;
+    }
+    bool match = true;
+    for (uint32_t y = 0; match && y < nv12->height; y++) {
+        match = memcmp(a + nv12->offsets[0] + y * nv12->pitches[0], b + i420->offsets[0] + y * i420->pitches[0], nv12->width) == 0;
+    }
+    for (uint32_t y = 0; match && y < nv12->height / 2u; y++) {
+        const uint8_t *uv = a + nv12->offsets[1] + y * nv12->pitches[1];
+        const uint8_t *u = b + i420->offsets[1] + y * i420->pitches[1];
+        const uint8_t *v = b + i420->offsets[2] + y * i420->pitches[2];
+        for (uint32_t x = 0; match && x < nv12->width / 2u; x++) {
+            match = uv[2 * x] == u[x] && uv[2 * x + 1] == v[x];
+        }
+    }
+    vaUnmapBuffer(display, i420->buf);
+    vaUnmapBuffer(display, nv12->buf);
+    return match;
+}
+
+static bool roundTripFrame(RoundTrip *roundTrip, VADisplay display, VASurfaceID surface, const VAImage *image) {
+    if (roundTrip->planar.image_id == VA_INVALID_ID) {
+        VAImageFormat i420 = { .fourcc = VA_FOURCC_I420, .byte_order = VA_LSB_FIRST, .bits_per_pixel = 12 };
+        VAImageFormat nv12 = { .fourcc = VA_FOURCC_NV12, .byte_order = VA_LSB_FIRST, .bits_per_pixel = 12 };
+        if (vaCreateImage(display, &i420, image->width, image->height, &roundTrip->planar) != VA_STATUS_SUCCESS) {
+            roundTrip->planar.image_id = VA_INVALID_ID;
+            return false;
+        }
+        if (vaCreateImage(display, &nv12, image->width, image->height, &roundTrip->check) != VA_STATUS_SUCCESS) {
+            roundTrip->check.image_id = VA_INVALID_ID;
+            return false;
+        }
+        if (vaCreateSurfaces(display, VA_RT_FORMAT_YUV420, image->width, image->height, &roundTrip->scratch, 1, NULL, 0) != VA_STATUS_SUCCESS) {
+            roundTrip->scratch = VA_INVALID_ID;
+            return false;
+        }
+    }
+    //the planar read back splits the chroma, putting it interleaves it again
+    bool ok = vaGetImage(display, surface, 0, 0, image->width, image->height, roundTrip->planar.image_id) == VA_STATUS_SUCCESS
+            && matchesPlanar(display, image, &roundTrip->planar)
+            && vaPutImage(display, roundTrip->scratch, roundTrip->planar.image_id, 0, 0, image->width, image->height,
+                          0, 0, image->width, image->height) == VA_STATUS_SUCCESS
+            && vaGetImage(display, roundTrip->scratch, 0, 0, image->width, image->height, roundTrip->check.image_id) == VA_STATUS_SUCCESS
+            && matchesPlanar(display, &roundTrip->check, &roundTrip->planar);
+    if (!ok) {
+        fprintf(stderr, "Frame didn't survive the round trip through I420\n");
+    }
+    return ok;
+}
+
+static void destroyRoundTrip(RoundTrip *roundTrip, VADisplay display) {
+    if (roundTrip->planar.image_id != VA_INVALID_ID) {
+        vaDestroyImage(display, roundTrip->planar.image_id);
+    }
+    if (roundTrip->check.image_id != VA_INVALID_ID) {
+        vaDestroyImage(display, roundTrip->check.image_id);
+    }
+    if (roundTrip->scratch != VA_INVALID_ID) {
+        vaDestroySurfaces(display, &roundTrip->scratch, 1);
+    }
+}
+
+//the largest difference between the samples of two NV12 images of the same size, -1 if they couldn't be mapped
+static int maxDifference(VADisplay display, const VAImage *a, const VAImage *b) {
+    uint8_t *x, *y;
+    if (vaMapBuffer(display, a->buf, (void**) &x) != VA_STATUS_SUCCESS) {
+        return -1;
+    }
+    if (vaMapBuffer(display, b->buf, (void**) &y) != VA_STATUS_SUCCESS) {
+        vaUnmapBuffer(display, a->buf);
+        return -1;
+    }
+    int difference = 0;
+    for (uint32_t plane = 0; plane < 2; plane++) {
+        for (uint32_t row = 0; row < (plane == 0 ? a->height : a->height / 2u); row++) {
+            const uint8_t *p = x + a->offsets[plane] + row * a->pitches[plane];
+            const uint8_t *q = y + b->offsets[plane] + row * b->pitches[plane];
+            for (uint32_t i = 0; i < a->width; i++) {
+                difference = MAX(difference, abs(p[i] - q[i]));
+            }
+        }
+    }
+    vaUnmapBuffer(display, b->buf);
+    vaUnmapBuffer(display, a->buf);
+    return difference;
+}
+
+static bool processSurface(VADisplay display, VAContextID context, VASurfaceID src, VASurfaceID dst,
+                           VAProcColorStandardType inStandard, VAProcColorStandardType outStandard) {
+    VAProcPipelineParameterBuffer params = {
+        .surface = src,
+        .surface_color_standard = inStandard,
+        .output_color_standard = outStandard,
+        .filter_flags = VA_FILTER_SCALING_HQ,
+    };
+    VABufferID buf;
+    if (vaCreateBuffer(display, context, VAProcPipelineParameterBufferType, sizeof(params), 1, &params, &buf) != VA_STATUS_SUCCESS) {
+        return false;
+    }
+    bool ok = vaBeginPicture(display, context, dst) == VA_STATUS_SUCCESS
+            && vaRenderPicture(display, context, &buf, 1) == VA_STATUS_SUCCESS
+            && vaEndPicture(display, context) == VA_STATUS_SUCCESS
+            && vaSyncSurface(display, dst) == VA_STATUS_SUCCESS;
+    vaDestroyBuffer(display, buf);
+    return ok;
+}
+
+static bool setUpVideoProc(VideoProc *videoProc, VADisplay display, const VAImage *image) {
+    VAImageFormat nv12 = { .fourcc = VA_FOURCC_NV12, .byte_order = VA_LSB_FIRST, .bits_per_pixel = 12 };
+    VASurfaceID surfaces[3];
+    if (vaCreateConfig(display, VAProfileNone, VAEntrypointVideoProc, NULL, 0, &videoProc->config) != VA_STATUS_SUCCESS) {
+        videoProc->config = VA_INVALID_ID;
+        return false;
+    }
+    if (vaCreateSurfaces(display, VA_RT_FORMAT_YUV420, image->width, image->height, surfaces, 3, NULL, 0) != VA_STATUS_SUCCESS) {
+        return false;
+    }
+    videoProc->scaled = surfaces[0];
+    videoProc->flat = surfaces[1];
+    videoProc->converted = surfaces[2];
+    if (vaCreateContext(display, videoProc->config, image->width, image->height, VA_PROGRESSIVE, surfaces, 3,
+                        &videoProc->context) != VA_STATUS_SUCCESS) {
+        videoProc->context = VA_INVALID_ID;
+        return false;
+    }
+    if (vaCreateImage(display, &nv12, image->width, image->height, &videoProc->check) != VA_STATUS_SUCCESS) {
+        videoProc->check.image_id = VA_INVALID_ID;
+        return false;
+    }
+    return true;
+}
+
+//converts a frame of a single colour from limited range BT.601 to BT.709, every sample should come out as the same
+//colour worked out here
+static bool checkFlatConversion(VideoProc *videoProc, VADisplay display) {
+    static const uint8_t colour[3] = { 100, 90, 160 };
+    VAImage *check = &videoProc->check;
+    float y = (colour[0] - 16) / 219.0f, cb = (colour[1] - 128) / 224.0f, cr = (colour[2] - 128) / 224.0f;
+    float r = y + 1.402f * cr, g = y - 0.344136f * cb - 0.714136f * cr, b = y + 1.772f * cb;
+    float y709 = 0.2126f * r + 0.7152f * g + 0.0722f * b;
+    int expected[3] = { (int) (16.0f + 219.0f * y709 + 0.5f), (int) (128.0f + 224.0f * (b - y709) / 1.8556f + 0.5f),
+                        (int) (128.0f + 224.0f * (r - y709) / 1.5748f + 0.5f) };
+
+    uint8_t *data;
+    if (vaMapBuffer(display, check->buf, (void**) &data) != VA_STATUS_SUCCESS) {
+        return false;
+    }
+    for (uint32_t row = 0; row < check->height; row++) {
+        memset(data + check->offsets[0] + row * check->pitches[0], colour[0], check->width);
+    }
+    for (uint32_t row = 0; row < check->height / 2u; row++) {
+        uint8_t *uv = data + check->offsets[1] + row * check->pitches[1];
+        for (uint32_t x = 0; x < check->width / 2u; x++) {
+            uv[2 * x] = colour[1];
+            uv[2 * x + 1] = colour[2];
+        }
+    }
+    vaUnmapBuffer(display, check->buf);
+    if (vaPutImage(display, videoProc->flat, check->image_id, 0, 0, check->width, check->height,
+                   0, 0, check->width, check->height) != VA_STATUS_SUCCESS
+            || !processSurface(display, videoProc->context, videoProc->flat, videoProc->converted,
+                               VAProcColorStandardBT601, VAProcColorStandardBT709)
+            || vaGetImage(display, videoProc->converted, 0, 0, check->width, check->height, check->image_id) != VA_STATUS_SUCCESS
+            || vaMapBuffer(display, check->buf, (void**) &data) != VA_STATUS_SUCCESS) {
+        return false;
+    }
+    bool match = true;
+    for (uint32_t row = 0; match && row < check->height; row++) {
+        const uint8_t *luma = data + check->offsets[0] + row * check->pitches[0];
+        for (uint32_t x = 0; match && x < check->width; x++) {
+            match = abs(luma[x] - expected[0]) <= 1;
+        }
+    }
+    for (uint32_t row = 0; match && row < check->height / 2u; row++) {
+        const uint8_t *uv = data + check->offsets[1] + row * check->pitches[1];
+        for (uint32_t x = 0; match && x < check->width / 2u; x++) {
+            match = abs(uv[2 * x] - expected[1]) <= 1 && abs(uv[2 * x + 1] - expected[2]) <= 1;
+        }
+    }
+    vaUnmapBuffer(display, check->buf);
+    return match;
+}
+
+static bool videoProcFrame(VideoProc *videoProc, VADisplay display, VASurfaceID surface, const VAImage *image) {
+    if (videoProc->config == VA_INVALID_ID && !setUpVideoProc(videoProc, display, image)) {
+        fprintf(stderr, "Unable to set up video processing\n");
+        return false;
+    }
+    if (!videoProc->flatChecked) {
+        if (!checkFlatConversion(videoProc, display)) {
+            fprintf(stderr, "Converting a flat frame from BT.601 to BT.709 gave the wrong colour\n");
+            return false;
+        }
+        videoProc->flatChecked = true;
+    }
+    const VAImage *check = &videoProc->check;
+    int difference = -1;
+    if (processSurface(display, videoProc->context, surface, videoProc->scaled, VAProcColorStandardBT601, VAProcColorStandardBT601)
+            && vaGetImage(display, videoProc->scaled, 0, 0, check->width, check->height, check->image_id) == VA_STATUS_SUCCESS) {
+        difference = maxDifference(display, image, check);
+    }
+    if (difference < 0 || difference > 1) {
+        fprintf(stderr, "Frame changed going through the high quality scaler at it's own size\n");
+        return false;
+    }
+    return true;
+}
+
+static void destroyVideoProc(VideoProc *videoProc, VADisplay display) {
+    if (videoProc->check.image_id != VA_INVALID_ID) {
+        vaDestroyImage(display, videoProc->check.image_id);
+    }
+    if (videoProc->context != VA_INVALID_ID) {
+        vaDestroyContext(display, videoProc->context);
+    }
+    VASurfaceID surfaces[] = { videoProc->scaled, videoProc->flat, videoProc->converted };
+    if (videoProc->scaled != VA_INVALID_ID) {
+        vaDestroySurfaces(display, surfaces, 3);
+    }
+    if (videoProc->config != VA_INVALID_ID) {
+        vaDestroyConfig(display, videoProc->config);
+    }
+}
+
+//whatever the mode does with a decoded frame, which always ends with it having been synced
+static bool consumeFrame(BenchStream *stream, VADisplay display, const AVFrame *frame, VAImage *image) {
+    VASurfaceID surface = (VASurfaceID) (uintptr_t) frame->data[3];
+    if (stream->mode == MODE_EXPORT) {
+        VADRMPRIMESurfaceDescriptor desc;
+        if (vaExportSurfaceHandle(display, surface, VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2,
+                                  VA_EXPORT_SURFACE_READ_ONLY | VA_EXPORT_SURFACE_SEPARATE_LAYERS, &desc) != VA_STATUS_SUCCESS) {
+            return false;
+        }
+        for (uint32_t i = 0; i < desc.num_objects; i++) {
+            close(desc.objects[i].fd);
+        }
+    }
+    if (vaSyncSurface(display, surface) != VA_STATUS_SUCCESS) {
+        return false;
+    }
+    if (stream->mode != MODE_DECODE && stream->mode != MODE_EXPORT) {
+        if (image->image_id == VA_INVALID_ID) {
+            AVHWFramesContext *frames = (AVHWFramesContext*) frame->hw_frames_ctx->data;
+            if ((stream->mode == MODE_ROUNDTRIP || stream->mode == MODE_VPP) && frames->sw_format != AV_PIX_FMT_NV12) {
+                fprintf(stderr, "The round trip and video processing checks are only for 8-bit 4:2:0 streams\n");
+                return false;
+            }
+            VAImageFormat format = { .fourcc = VA_FOURCC_NV12, .byte_order = VA_LSB_FIRST };
+            switch (frames->sw_format) {
+            case AV_PIX_FMT_P010:
+                format.fourcc = VA_FOURCC_P010;
+                break;
+            case AV_PIX_FMT_P016:
+                format.fourcc = VA_FOURCC_P016;
+                break;
+            case AV_PIX_FMT_YUV444P:
+                format.fourcc = VA_FOURCC_444P;
+                break;
+            default:
+                break;
+            }
+            if (vaCreateImage(display, &format, frames->width, frames->height, image) != VA_STATUS_SUCCESS) {
+                image->image_id = VA_INVALID_ID;
+                return false;
+            }
+        }
+        if (vaGetImage(display, surface, 0, 0, image->width, image->height, image->image_id) != VA_STATUS_SUCCESS) {
+            return false;
+        }
+        void *data;
+        if (vaMapBuffer(display, image->buf, &data) != VA_STATUS_SUCCESS) {
+            return false;
+        }
+        vaUnmapBuffer(display, image->buf);
+        if (stream->mode == MODE_ROUNDTRIP && !roundTripFrame(&stream->roundTrip, display, surface, image)) {
+            return false;
+        }
+        if (stream->mode == MODE_VPP && !videoProcFrame(&stream->videoProc, display, surface, image)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//takes every frame the decoder has ready
+static bool receiveFrames(BenchStream *stream, AVCodecContext *avctx, AVFrame *frame, VADisplay display, VAImage *image,
+                          PendingPacket *pending) {
+    while (stream->maxFrames == 0 || stream->frameCount < stream->maxFrames) {
+        int ret = avcodec_receive_frame(avctx, frame);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            return true;
+        }
+        if (ret < 0 || !consumeFrame(stream, display, frame, image)) {
+            return false;
+        }
+        uint64_t sent = 0;
+        for (int i = 0; i < MAX_PENDING; i++) {
+            if (pending[i].sent != 0 && pending[i].pts == frame->pts) {
+                sent = pending[i].sent;
+                pending[i].sent = 0;
+                break;
+            }
+        }
+        //frames without a timestamp of their own can't be matched to their packet
+        if (sent != 0) {
+            recordLatency(stream, nowNs() - sent);
+        }
+        stream->frameCount++;
+        av_frame_unref(frame);
+    }
+    return true;
+}
+
+static void *runStream(void *arg) {
+    BenchStream *stream = (BenchStream*) arg;
+    AVFormatContext *format = NULL;
+    AVCodecContext *avctx = NULL;
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    VADisplay display = ((AVVAAPIDeviceContext*) ((AVHWDeviceContext*) stream->device->data)->hwctx)->display;
+    VAImage image = { .image_id = VA_INVALID_ID };
+    PendingPacket pending[MAX_PENDING] = {0};
+    int nextPending = 0;
+    stream->failed = true;
+
+    const AVCodec *codec = NULL;
+    if (packet == NULL || frame == NULL || avformat_open_input(&format, stream->path, NULL, NULL) < 0
+            || avformat_find_stream_info(format, NULL) < 0) {
+        fprintf(stderr, "Unable to open %s\n", stream->path);
+        goto done;
+    }
+    int index = av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (index < 0 || (avctx = avcodec_alloc_context3(codec)) == NULL
+            || avcodec_parameters_to_context(avctx, format->streams[index]->codecpar) < 0) {
+        fprintf(stderr, "No video stream in %s\n", stream->path);
+        goto done;
+    }
+    avctx->hw_device_ctx = av_buffer_ref(stream->device);
+    avctx->get_format = pickVaapi;
+    //the driver's own profile checks are what's being measured, not lavc's
+    avctx->hwaccel_flags |= AV_HWACCEL_FLAG_ALLOW_PROFILE_MISMATCH;
+    if (avcodec_open2(avctx, codec, NULL) < 0) {
+        fprintf(stderr, "Unable to open decoder for %s\n", stream->path);
+        goto done;
+    }
+
+    bool ok = true;
+    while (ok && (stream->maxFrames == 0 || stream->frameCount < stream->maxFrames) && av_read_frame(format, packet) >= 0) {
+        if (packet->stream_index == index) {
+            pending[nextPending] = (PendingPacket) { .pts = packet->pts, .sent = nowNs() };
+            nextPending = (nextPending + 1) % MAX_PENDING;
+            ok = avcodec_send_packet(avctx, packet) >= 0 && receiveFrames(stream, avctx, frame, display, &image, pending);
+        }
+        av_packet_unref(packet);
+    }
+    if (ok) {
+        avcodec_send_packet(avctx, NULL);
+        ok = receiveFrames(stream, avctx, frame, display, &image, pending);
+    }
+    stream->failed = !ok;
+    if (!ok) {
+        fprintf(stderr, "Decoding %s failed after %d frames\n", stream->path, stream->frameCount);
+    }
+
+done:
+    if (image.image_id != VA_INVALID_ID) {
+        vaDestroyImage(display, image.image_id);
+    }
+    destroyRoundTrip(&stream->roundTrip, display);
+    destroyVideoProc(&stream->videoProc, display);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    avcodec_free_context(&avctx);
+    avformat_close_input(&format);
+    return NULL;
+}
+
+static int compareLatency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentileMs(const uint64_t *sorted, int count, double percent) {
+    if (count == 0) {
+        return 0;
+    }
+    int i = (int) (percent / 100.0 * (count - 1) + 0.5);
+    return sorted[i] / 1e6;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [--mode decode|readback|export|roundtrip|vpp] [--streams N] [--frames N] [--device PATH] [--gpu N] FILE...\n"
+                    "Set NVD_BACKEND to pick the driver's backend, every stream decodes each of the files in turn\n", name);
+}
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        { "mode", required_argument, NULL, 'm' },
+        { "streams", required_argument, NULL, 's' },
+        { "frames", required_argument, NULL, 'f' },
+        { "device", required_argument, NULL, 'd' },
+        { "gpu", required_argument, NULL, 'g' },
+        { "help", no_argument, NULL, 'h' },
+        { 0 }
+    };
+    static const char *modeNames[] = { "decode", "readback", "export", "roundtrip", "vpp" };
+    BenchMode mode = MODE_DECODE;
+    int streamCount = 1;
+    int maxFrames = 0;
+    const char *device = "/dev/dri/renderD128";
+    unsigned int gpu = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "m:s:f:d:g:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "decode") == 0) {
+                mode = MODE_DECODE;
+            } else if (strcmp(optarg, "readback") == 0) {
+                mode = MODE_READBACK;
+            } else if (strcmp(optarg, "export") == 0) {
+                mode = MODE_EXPORT;
+            } else if (strcmp(optarg, "roundtrip") == 0) {
+                mode = MODE_ROUNDTRIP;
+            } else if (strcmp(optarg, "vpp") == 0) {
+                mode = MODE_VPP;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 's':
+            streamCount = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        case 'f':
+            maxFrames = atoi(optarg) > 0 ? atoi(optarg) : 0;
+            break;
+        case 'd':
+            device = optarg;
+            break;
+        case 'g':
+            gpu = (unsigned int) atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind == argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    //meson counts 77 as skipped, for samples that haven't been generated
+    for (int i = optind; i < argc; i++) {
+        if (access(argv[i], R_OK) != 0) {
+            fprintf(stderr, "%s is missing, run samples/gensamples.sh in the samples directory\n", argv[i]);
+            return 77;
+        }
+    }
+    av_log_set_level(AV_LOG_ERROR);
+
+    AVBufferRef *hwDevice = NULL;
+    if (av_hwdevice_ctx_create(&hwDevice, AV_HWDEVICE_TYPE_VAAPI, device, NULL, 0) < 0) {
+        fprintf(stderr, "Unable to open VA-API on %s\n", device);
+        return 1;
+    }
+    bool haveNvml = openNvml(gpu);
+    pthread_t sampler;
+    sampling = haveNvml;
+    if (haveNvml && pthread_create(&sampler, NULL, sampleVram, NULL) != 0) {
+        sampling = false;
+    }
+
+    int status = 0;
+    for (int file = optind; file < argc; file++) {
+        BenchStream *streams = calloc((size_t) streamCount, sizeof(BenchStream));
+        if (streams == NULL) {
+            return 1;
+        }
+        unsigned long long vramBaseline = vramUsed();
+        atomic_store(&vramPeak, vramBaseline);
+        uint64_t cpuStart = cpuTimeNs();
+        uint64_t start = nowNs();
+        for (int i = 0; i < streamCount; i++) {
+            streams[i] = (BenchStream) { .path = argv[file], .mode = mode, .device = hwDevice, .maxFrames = maxFrames,
+                                         .roundTrip = { .planar.image_id = VA_INVALID_ID, .check.image_id = VA_INVALID_ID,
+                                                        .scratch = VA_INVALID_ID },
+                                         .videoProc = { .config = VA_INVALID_ID, .context = VA_INVALID_ID, .scaled = VA_INVALID_ID,
+                                                        .flat = VA_INVALID_ID, .converted = VA_INVALID_ID,
+                                                        .check.image_id = VA_INVALID_ID } };
+            streams[i].started = pthread_create(&streams[i].thread, NULL, runStream, &streams[i]) == 0;
+            streams[i].failed = !streams[i].started;
+        }
+        for (int i = 0; i < streamCount; i++) {
+            if (streams[i].started) {
+                pthread_join(streams[i].thread, NULL);
+            }
+        }
+        double seconds = (nowNs() - start) / 1e9;
+        double cpuSeconds = (cpuTimeNs() - cpuStart) / 1e9;
+
+        int frames = 0, samples = 0;
+        bool failed = false;
+        for (int i = 0; i < streamCount; i++) {
+            frames += streams[i].frameCount;
+            samples += streams[i].latencyCount;
+            failed = failed || streams[i].failed;
+        }
+        uint64_t *latencies = malloc((size_t) MAX(samples, 1) * sizeof(uint64_t));
+        int count = 0;
+        for (int i = 0; i < streamCount; i++) {
+            if (latencies != NULL) {
+                memcpy(latencies + count, streams[i].latencies, (size_t) streams[i].latencyCount * sizeof(uint64_t));
+                count += streams[i].latencyCount;
+            }
+            free(streams[i].latencies);
+        }
+        if (latencies != NULL) {
+            qsort(latencies, (size_t) count, sizeof(uint64_t), compareLatency);
+        }
+        const char *backend = getenv("NVD_BACKEND");
+        printf("%s: backend %s, mode %s, %d stream(s), %d frames in %.2fs, %.1f fps, latency ms p50 %.2f p90 %.2f p99 %.2f max %.2f, "
+               "cpu %.0f%%",
+               argv[file], backend != NULL ? backend : "default", modeNames[mode], streamCount, frames, seconds,
+               frames / seconds, percentileMs(latencies, count, 50), percentileMs(latencies, count, 90),
+               percentileMs(latencies, count, 99), percentileMs(latencies, count, 100), 100.0 * cpuSeconds / seconds);
+        if (haveNvml) {
+            unsigned long long peak = atomic_load(&vramPeak);
+            printf(", peak vram +%llu MiB", (peak - MIN(vramBaseline, peak)) >> 20);
+        }
+        printf("%s\n", failed ? ", FAILED" : "");
+        free(latencies);
+        free(streams);
+        status = failed ? 1 : status;
+    }
+
+    if (sampling) {
+        sampling = false;
+        pthread_join(sampler, NULL);
+    }
+    if (haveNvml) {
+        nvml.nvmlShutdown();
+    }
+    av_buffer_unref(&hwDevice);
+    return status;
+}
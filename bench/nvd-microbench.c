@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+
+/* Microbenchmarks of the driver's own data structures, linked straight against the sources so they run without a
+ * GPU. Each prints the cost per operation, run one with its name as the only argument or every one with none. */
+
+#include "../src/list.h"
+#include "../src/log.h"
+#include "../src/stats.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOOKUPS         (1u << 24)
+#define CHURN_OPS       (1u << 22)
+#define HANDOFFS        (1u << 22)
+#define PING_PONGS      (1u << 18)
+#define RECORDS         (1u << 22)
+#define MAX_THREADS     8
+
+typedef struct {
+    const char  *name;
+    void        (*run)(void);
+} MicroBench;
+
+static uint64_t nowNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
+
+//xorshift, so the lookup pattern is the same every run and costs nothing next to what's measured
+static uint32_t nextRandom(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void report(const char *name, const char *what, uint64_t ops, uint64_t elapsed) {
+    printf("%-32s %12.2f ns/%s  (%.1f M/s)\n", name, (double) elapsed / ops, what, ops * 1e3 / elapsed);
+}
+
+//fills a table with count objects, returning their handles
+static uint32_t *fillTable(HandleTable *table, uint32_t count) {
+    uint32_t *handles = malloc(count * sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++) {
+        handles[i] = handle_table_insert(table, &handles[i]);
+    }
+    return handles;
+}
+
+static void handleLookup(void) {
+    static const uint32_t counts[] = { 16, 256, 4096, 65536, 1u << 19 };
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        HandleTable table = {0};
+        uint32_t *handles = fillTable(&table, counts[c]);
+        uint32_t state = 1;
+        uintptr_t sum = 0;
+        uint64_t start = nowNs();
+        for (uint32_t i = 0; i < LOOKUPS; i++) {
+            sum += (uintptr_t) handle_table_get(&table, handles[nextRandom(&state) % counts[c]]);
+        }
+        uint64_t elapsed = nowNs() - start;
+        char name[64];
+        snprintf(name, sizeof(name), "handle-lookup/%u", counts[c]);
+        report(name, "lookup", LOOKUPS, elapsed);
+        //keeps the lookups from being optimised away
+        if (sum == 0) {
+            printf("unexpected\n");
+        }
+        free(handles);
+        handle_table_free(&table);
+    }
+}
+
+//objects coming and going the way buffers do every picture, with a steady population of surfaces and contexts
+static void handleChurn(void) {
+    HandleTable table = {0};
+    uint32_t *resident = fillTable(&table, 1024);
+    uint32_t live[64];
+    for (int i = 0; i < 64; i++) {
+        live[i] = handle_table_insert(&table, resident);
+    }
+    uint32_t state = 1;
+    uint64_t start = nowNs();
+    for (uint32_t i = 0; i < CHURN_OPS; i++) {
+        uint32_t j = nextRandom(&state) % 64;
+        handle_table_remove(&table, live[j]);
+        live[j] = handle_table_insert(&table, resident);
+    }
+    report("handle-churn", "remove+insert", CHURN_OPS, nowNs() - start);
+    free(resident);
+    handle_table_free(&table);
+}
+
+typedef struct {
+    HandleTable         *table;
+    uint32_t            *handles;
+    uint32_t            count;
+    uint64_t            lookups;
+    uint64_t            elapsed;
+} LookupThread;
+
+static void *lookupWorker(void *arg) {
+    LookupThread *t = (LookupThread*) arg;
+    uint32_t state = (uint32_t) (uintptr_t) t | 1;
+    uintptr_t sum = 0;
+    uint64_t start = nowNs();
+    for (uint32_t i = 0; i < LOOKUPS; i++) {
+        sum += (uintptr_t) handle_table_get(t->table, t->handles[nextRandom(&state) % t->count]);
+    }
+    t->elapsed = nowNs() - start;
+    t->lookups = sum != 0 ? LOOKUPS : 0;
+    return NULL;
+}
+
+typedef struct {
+    HandleTable         *table;
+    pthread_mutex_t     *mutex;
+    _Atomic bool        *stop;
+    uint64_t            ops;
+} ChurnThread;
+
+//inserts and removes under a mutex, like allocateObject and deleteObject do
+static void *churnWorker(void *arg) {
+    ChurnThread *t = (ChurnThread*) arg;
+    uint32_t live[64] = {0};
+    uint32_t state = 7;
+    while (!atomic_load_explicit(t->stop, memory_order_relaxed)) {
+        uint32_t j = nextRandom(&state) % 64;
+        pthread_mutex_lock(t->mutex);
+        handle_table_remove(t->table, live[j]);
+        live[j] = handle_table_insert(t->table, t);
+        pthread_mutex_unlock(t->mutex);
+        t->ops++;
+    }
+    return NULL;
+}
+
+//lookups on every thread while one thread creates and destroys objects, which is how decode, export and the
+//application's own threads share the object table
+static void handleContention(void) {
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        HandleTable table = {0};
+        pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+        uint32_t *handles = fillTable(&table, 4096);
+        _Atomic bool stop = false;
+        ChurnThread churn = { .table = &table, .mutex = &mutex, .stop = &stop };
+        pthread_t churnThread;
+        pthread_create(&churnThread, NULL, churnWorker, &churn);
+        LookupThread lookups[MAX_THREADS];
+        pthread_t lookupThreads[MAX_THREADS];
+        for (int i = 0; i < threads; i++) {
+            lookups[i] = (LookupThread) { .table = &table, .handles = handles, .count = 4096 };
+            pthread_create(&lookupThreads[i], NULL, lookupWorker, &lookups[i]);
+        }
+        uint64_t total = 0, elapsed = 0;
+        for (int i = 0; i < threads; i++) {
+            pthread_join(lookupThreads[i], NULL);
+            total += lookups[i].lookups;
+            elapsed = lookups[i].elapsed > elapsed ? lookups[i].elapsed : elapsed;
+        }
+        atomic_store(&stop, true);
+        pthread_join(churnThread, NULL);
+        char name[64];
+        snprintf(name, sizeof(name), "handle-contention/%d+churn", threads);
+        //per lookup thread, so flat is perfect scaling
+        report(name, "lookup", total / threads, elapsed);
+        printf("%-32s %12.2f M/s remove+insert alongside\n", "", churn.ops * 1e3 / elapsed);
+        free(handles);
+        handle_table_free(&table);
+    }
+}
+
+//the image list's pattern, adding at the end and removing from anywhere
+static void arrayChurn(void) {
+    Array arr = {0};
+    for (int i = 0; i < 64; i++) {
+        add_element(&arr, &arr);
+    }
+    uint32_t state = 1;
+    uint64_t start = nowNs();
+    for (uint32_t i = 0; i < CHURN_OPS; i++) {
+        remove_element_at(&arr, nextRandom(&state) % arr.size);
+        add_element(&arr, &arr);
+    }
+    report("array-churn/64", "remove+add", CHURN_OPS, nowNs() - start);
+    free(arr.buf);
+}
+
+typedef struct {
+    SPSCQueue       *queue;
+    SPSCQueue       *reply;
+    uint32_t        count;
+} QueueThread;
+
+static void *queueConsumer(void *arg) {
+    QueueThread *t = (QueueThread*) arg;
+    for (uint32_t received = 0; received < t->count;) {
+        void *element = spsc_queue_pop(t->queue);
+        if (element == NULL) {
+            sched_yield();
+            continue;
+        }
+        received++;
+        if (t->reply != NULL) {
+            while (!spsc_queue_push(t->reply, element)) {
+                sched_yield();
+            }
+        }
+    }
+    return NULL;
+}
+
+//nvEndPicture handing surfaces to the resolve thread. Both sides spin, yielding so it still finishes on one core,
+//rather than sleeping like the driver does so it's only the queue that's measured
+static void spscHandoff(void) {
+    static const uint32_t depths[] = { 4, 16, 64 };
+    for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+        SPSCQueue queue;
+        spsc_queue_init(&queue, depths[d]);
+        QueueThread consumer = { .queue = &queue, .count = HANDOFFS };
+        pthread_t thread;
+        pthread_create(&thread, NULL, queueConsumer, &consumer);
+        uint64_t start = nowNs();
+        for (uint32_t i = 0; i < HANDOFFS; i++) {
+            while (!spsc_queue_push(&queue, &queue)) {
+                sched_yield();
+            }
+        }
+        pthread_join(thread, NULL);
+        char name[64];
+        snprintf(name, sizeof(name), "spsc-handoff/depth %u", depths[d]);
+        report(name, "push", HANDOFFS, nowNs() - start);
+        spsc_queue_free(&queue);
+    }
+
+    //a surface there and back, the time from queueing a picture to the resolve thread seeing it is half of this
+    SPSCQueue there, back;
+    spsc_queue_init(&there, 16);
+    spsc_queue_init(&back, 16);
+    QueueThread consumer = { .queue = &there, .reply = &back, .count = PING_PONGS };
+    pthread_t thread;
+    pthread_create(&thread, NULL, queueConsumer, &consumer);
+    uint64_t start = nowNs();
+    for (uint32_t i = 0; i < PING_PONGS; i++) {
+        spsc_queue_push(&there, &there);
+        while (spsc_queue_pop(&back) == NULL) {
+            sched_yield();
+        }
+    }
+    uint64_t elapsed = nowNs() - start;
+    pthread_join(thread, NULL);
+    report("spsc-round-trip", "round trip", PING_PONGS, elapsed);
+    spsc_queue_free(&there);
+    spsc_queue_free(&back);
+}
+
+typedef struct {
+    NVStats     *stats;
+    uint64_t    elapsed;
+} StatsThread;
+
+static void *statsWorker(void *arg) {
+    StatsThread *t = (StatsThread*) arg;
+    uint64_t start = nowNs();
+    for (uint32_t i = 0; i < RECORDS; i++) {
+        statsRecordValue(t->stats, NV_STAT_DECODE, i);
+    }
+    t->elapsed = nowNs() - start;
+    return NULL;
+}
+
+//every thread recording into the same context's counters, the resolve thread and nvEndPicture do this
+static void statsContention(void) {
+    statsConfigure("1", NULL);
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        NVStats *stats = statsCreate("microbench", 0);
+        StatsThread workers[MAX_THREADS];
+        pthread_t ids[MAX_THREADS];
+        for (int i = 0; i < threads; i++) {
+            workers[i] = (StatsThread) { .stats = stats };
+            pthread_create(&ids[i], NULL, statsWorker, &workers[i]);
+        }
+        uint64_t elapsed = 0;
+        for (int i = 0; i < threads; i++) {
+            pthread_join(ids[i], NULL);
+            elapsed = workers[i].elapsed > elapsed ? workers[i].elapsed : elapsed;
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "stats-record/%d threads", threads);
+        report(name, "record", RECORDS, elapsed);
+        //the dump goes nowhere as NVD_LOG isn't configured
+        statsDestroy(stats);
+    }
+    NVStats *disabled = NULL;
+    uint64_t start = nowNs();
+    for (uint32_t i = 0; i < RECORDS; i++) {
+        statsRecord(disabled, NV_STAT_DECODE, statsStart(disabled));
+    }
+    report("stats-record/disabled", "record", RECORDS, nowNs() - start);
+}
+
+//what a LOG costs when it's filtered out, which is every LOG with NVD_LOG unset
+static void logFiltered(void) {
+    uint64_t start = nowNs();
+    for (uint32_t i = 0; i < RECORDS; i++) {
+        LOG_TRACE("filtered %u %p", i, (void*) &start);
+    }
+    report("log-filtered", "message", RECORDS, nowNs() - start);
+}
+
+static const MicroBench benches[] = {
+    { "handle-lookup", handleLookup },
+    { "handle-churn", handleChurn },
+    { "handle-contention", handleContention },
+    { "array-churn", arrayChurn },
+    { "spsc-handoff", spscHandoff },
+    { "stats-record", statsContention },
+    { "log-filtered", logFiltered },
+};
+
+int main(int argc, char **argv) {
+    bool found = false;
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if (argc < 2 || strcmp(argv[1], benches[i].name) == 0) {
+            benches[i].run();
+            found = true;
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "usage: %s [", argv[0]);
+        for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+            fprintf(stderr, "%s%s", i > 0 ? "|" : "", benches[i].name);
+        }
+        fprintf(stderr, "]\n");
+        return 1;
+    }
+    return 0;
+}
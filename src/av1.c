@@ -17,6 +17,11 @@ static void copyAV1PicParam(NVContext *ctx, NVBuffer* buffer, CUVIDPICPARAMS *pi
     VADecPictureParameterBufferAV1* buf = (VADecPictureParameterBufferAV1*) buffer->ptr;
     CUVIDAV1PICPARAMS *pps = &picParams->CodecSpecific.av1;
 
+    //frames after the keyframe can be scaled from references of another size, so only a keyframe resizes the decoder
+    if (buf->pic_info_fields.bits.frame_type == 0) {
+        resizeForPicture(ctx, buf->frame_width_minus1 + 1u, buf->frame_height_minus1 + 1u, 8);
+    }
+
     picParams->PicWidthInMbs = (ctx->width + 15)/16;
     picParams->FrameHeightInMbs = (ctx->height + 15)/16;
 
@@ -191,7 +196,22 @@ static void copyAV1PicParam(NVContext *ctx, NVBuffer* buffer, CUVIDPICPARAMS *pi
     //pps->temporal_layer_id = buf->;
     //pps->spatial_layer_id = buf->;
 
-    pps->apply_grain = buf->film_grain_info.film_grain_info_fields.bits.apply_grain;
+    //with NVD_AV1_FILM_GRAIN=driver the decoder outputs the clean frame and the grain is added as it's copied out, which
+    //the resolve can only do for 4:2:0 frames that aren't being scaled. With off nobody adds it
+    bool applyGrain = buf->film_grain_info.film_grain_info_fields.bits.apply_grain;
+    NVSurface *target = ctx->renderTarget;
+    target->applyFilmGrain = applyGrain && ctx->drv->filmGrainMode == NV_FILM_GRAIN_DRIVER && !ctx->decProcessing
+                             && (target->format == cudaVideoSurfaceFormat_NV12 || target->format == cudaVideoSurfaceFormat_P016);
+    if (target->applyFilmGrain) {
+        target->filmGrain = (NVFilmGrainParams) {
+            .info = buf->film_grain_info,
+            .bitDepth = 8 + bit_depth_map[buf->bit_depth_idx],
+            .width = buf->frame_width_minus1 + 1u,
+            .height = buf->frame_height_minus1 + 1u,
+            .identityMatrix = buf->matrix_coefficients == 0,
+        };
+    }
+    pps->apply_grain = applyGrain && !target->applyFilmGrain && ctx->drv->filmGrainMode != NV_FILM_GRAIN_OFF;
     pps->overlap_flag = buf->film_grain_info.film_grain_info_fields.bits.overlap_flag;
     pps->scaling_shift_minus8 = buf->film_grain_info.film_grain_info_fields.bits.grain_scaling_minus_8;
     pps->chroma_scaling_from_luma = buf->film_grain_info.film_grain_info_fields.bits.chroma_scaling_from_luma;
@@ -306,20 +326,48 @@ static void copyAV1SliceParam(NVContext *ctx, NVBuffer* buf, CUVIDPICPARAMS *pic
 }
 
 static void copyAV1SliceData(NVContext *ctx, NVBuffer* buf, CUVIDPICPARAMS *picParams) {
+    uint32_t base;
+    if (claimSliceData(ctx, buf, &base)) {
+        //the tile data is already in the bitstream arena, just record where each tile is
+        for (unsigned int i = 0; i < ctx->lastSliceParamsCount; i++) {
+            VASliceParameterBufferAV1 *sliceParams = &((VASliceParameterBufferAV1*) ctx->lastSliceParams)[i];
+            if (!sliceInBuffer(ctx, buf, sliceParams->slice_data_offset, sliceParams->slice_data_size)) {
+                return;
+            }
+            uint32_t start = base + sliceParams->slice_data_offset;
+            uint32_t end = start + sliceParams->slice_data_size;
+            if (!appendBuffer(&ctx->sliceOffsets, &start, sizeof(start)) || !appendBuffer(&ctx->sliceOffsets, &end, sizeof(end))) {
+                failPicture(ctx, VA_STATUS_ERROR_ALLOCATION_FAILED);
+                return;
+            }
+        }
+        picParams->nBitstreamDataLen = bitstreamLength(ctx);
+        return;
+    }
+
+    if (!spillSliceData(ctx)) {
+        return;
+    }
     uint32_t offset = (uint32_t) ctx->bitstreamBuffer.size;
     for (unsigned int i = 0; i < ctx->lastSliceParamsCount; i++) {
         VASliceParameterBufferAV1 *sliceParams = &((VASliceParameterBufferAV1*) ctx->lastSliceParams)[i];
+        if (!sliceInBuffer(ctx, buf, sliceParams->slice_data_offset, sliceParams->slice_data_size)) {
+            return;
+        }
 
         //copy just the slice we're looking at
-        appendBuffer(&ctx->bitstreamBuffer, PTROFF(buf->ptr, sliceParams->slice_data_offset), sliceParams->slice_data_size);
+        bool appended = appendBuffer(&ctx->bitstreamBuffer, PTROFF(buf->ptr, sliceParams->slice_data_offset), sliceParams->slice_data_size);
 
         //now append the offset and size of the slice we just copied
-        appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset));
+        appended = appended && appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset));
         offset += sliceParams->slice_data_size;
-        appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset));
+        if (!appended || !appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset))) {
+            failPicture(ctx, VA_STATUS_ERROR_ALLOCATION_FAILED);
+            return;
+        }
     }
 
-    picParams->nBitstreamDataLen = ctx->bitstreamBuffer.size;
+    picParams->nBitstreamDataLen = bitstreamLength(ctx);
 }
 
 static cudaVideoCodec computeAV1CudaCodec(VAProfile profile) {
@@ -346,4 +394,6 @@ const DECLARE_CODEC(av1Codec) = {
     },
     .supportedProfileCount = ARRAY_SIZE(av1SupportedProfiles),
     .supportedProfiles = av1SupportedProfiles,
+    .inPlaceSliceData = true,
+    .adaptiveDecoder = true,
 };
@@ -2,6 +2,7 @@
 #include "backend-common.h"
 #include <sys/ioctl.h>
 #include <string.h>
+#include <errno.h>
 
 bool checkModesetParameterFromFd(int fd) {
     if (fd > 0) {
@@ -10,7 +11,7 @@ bool checkModesetParameterFromFd(int fd) {
         int ret = ioctl(fd, DRM_IOCTL_GET_CAP, &caps);
         if (ret != 0) {
             //the modeset parameter is set to 0
-            LOG("ERROR: This driver requires the nvidia_drm.modeset kernel module parameter set to 1");
+            LOG_ERROR("ERROR: This driver requires the nvidia_drm.modeset kernel module parameter set to 1");
             return false;
         }
         return true;
@@ -36,3 +37,40 @@ bool isNvidiaDrmFd(int fd, bool log) {
     }
     return false;
 }
+
+bool supportsTimelineSyncobj(int fd) {
+    struct drm_get_cap caps = { .capability = DRM_CAP_SYNCOBJ_TIMELINE };
+    return fd > 0 && ioctl(fd, DRM_IOCTL_GET_CAP, &caps) == 0 && caps.value != 0;
+}
+
+uint32_t createSyncobj(int fd) {
+    struct drm_syncobj_create create = {0};
+    if (ioctl(fd, DRM_IOCTL_SYNCOBJ_CREATE, &create) != 0) {
+        LOG("Unable to create syncobj: %d", errno);
+        return 0;
+    }
+    return create.handle;
+}
+
+void destroySyncobj(int fd, uint32_t handle) {
+    struct drm_syncobj_destroy destroy = { .handle = handle };
+    ioctl(fd, DRM_IOCTL_SYNCOBJ_DESTROY, &destroy);
+}
+
+bool signalSyncobjPoint(int fd, uint32_t handle, uint64_t point) {
+    struct drm_syncobj_timeline_array signal = {
+        .handles = (uint64_t) (uintptr_t) &handle,
+        .points = (uint64_t) (uintptr_t) &point,
+        .count_handles = 1
+    };
+    return ioctl(fd, DRM_IOCTL_SYNCOBJ_TIMELINE_SIGNAL, &signal) == 0;
+}
+
+int exportSyncobj(int fd, uint32_t handle) {
+    struct drm_syncobj_handle args = { .handle = handle };
+    if (ioctl(fd, DRM_IOCTL_SYNCOBJ_HANDLE_TO_FD, &args) != 0) {
+        LOG("Unable to export syncobj: %d", errno);
+        return -1;
+    }
+    return args.fd;
+}
@@ -2,8 +2,17 @@
 #define BACKENDCOMMON_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 bool checkModesetParameterFromFd(int fd);
 bool isNvidiaDrmFd(int fd, bool log);
 
+//timeline DRM syncobjs on the device's fd, a handle of 0 is never valid
+bool supportsTimelineSyncobj(int fd);
+uint32_t createSyncobj(int fd);
+void destroySyncobj(int fd, uint32_t handle);
+bool signalSyncobjPoint(int fd, uint32_t handle, uint64_t point);
+//returns a new fd for the syncobj, or -1
+int exportSyncobj(int fd, uint32_t handle);
+
 #endif // BACKENDCOMMON_H
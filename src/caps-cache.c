@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+
+#include "caps-cache.h"
+#include "vabackend.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CAPS_CACHE_MAGIC    0x5041434e  //"NCAP"
+#define CAPS_CACHE_VERSION  3
+#define MAX_CACHED_GPUS     16
+
+typedef struct {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    size;
+    char        driverVersion[32];
+} CapsFileHeader;
+
+static pthread_mutex_t tablesMutex = PTHREAD_MUTEX_INITIALIZER;
+static NVCapsTable *tables[MAX_CACHED_GPUS];
+static int tableCount = 0;
+
+static void readDriverVersion(char version[32]) {
+    memset(version, 0, 32);
+    FILE *f = fopen("/sys/module/nvidia/version", "r");
+    if (f == NULL) {
+        return;
+    }
+    if (fgets(version, 32, f) != NULL) {
+        version[strcspn(version, "\n")] = '\0';
+    }
+    fclose(f);
+}
+
+//builds the path of the cache file for the table, returns false if there's nowhere to put it
+static bool capsCachePath(const NVCapsTable *table, char *path, size_t len, bool createDir) {
+    char dir[PATH_MAX];
+    const char *cacheHome = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (cacheHome != NULL && cacheHome[0] == '/') {
+        snprintf(dir, sizeof(dir), "%s/nvidia-vaapi-driver", cacheHome);
+    } else if (home != NULL && home[0] == '/') {
+        snprintf(dir, sizeof(dir), "%s/.cache/nvidia-vaapi-driver", home);
+    } else {
+        return false;
+    }
+    if (createDir) {
+        //create both levels, the parent may not exist on a fresh account
+        char *slash = strrchr(dir, '/');
+        *slash = '\0';
+        mkdir(dir, 0755);
+        *slash = '/';
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+            return false;
+        }
+    }
+    return snprintf(path, len, "%s/caps-%s.bin", dir, table->key) < (int) len;
+}
+
+static void loadCapsTable(NVCapsTable *table) {
+    char path[PATH_MAX];
+    if (!capsCachePath(table, path, sizeof(path), false)) {
+        return;
+    }
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return;
+    }
+    CapsFileHeader header;
+    if (fread(&header, sizeof(header), 1, f) == 1 && header.magic == CAPS_CACHE_MAGIC
+            && header.version == CAPS_CACHE_VERSION && header.size == sizeof(table->data)
+            && strncmp(header.driverVersion, table->driverVersion, sizeof(header.driverVersion)) == 0) {
+        if (fread(&table->data, sizeof(table->data), 1, f) == 1) {
+            LOG("Loaded decoder caps from %s", path);
+        } else {
+            memset(&table->data, 0, sizeof(table->data));
+        }
+    } else {
+        LOG("Ignoring stale decoder caps cache %s", path);
+    }
+    fclose(f);
+}
+
+void saveCapsTable(NVCapsTable *table) {
+    char path[PATH_MAX];
+    char tmpPath[PATH_MAX + 16];
+    pthread_mutex_lock(&table->mutex);
+    //without the driver version we can't tell when the cache goes stale
+    if (!table->dirty || table->driverVersion[0] == '\0' || !capsCachePath(table, path, sizeof(path), true)) {
+        pthread_mutex_unlock(&table->mutex);
+        return;
+    }
+    //write to a temporary file and rename it over the old one, so concurrent processes never read a partial file
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, getpid());
+    FILE *f = fopen(tmpPath, "wb");
+    if (f != NULL) {
+        CapsFileHeader header = {
+            .magic = CAPS_CACHE_MAGIC,
+            .version = CAPS_CACHE_VERSION,
+            .size = sizeof(table->data)
+        };
+        memcpy(header.driverVersion, table->driverVersion, sizeof(header.driverVersion));
+        bool written = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(&table->data, sizeof(table->data), 1, f) == 1;
+        written = fclose(f) == 0 && written;
+        if (written && rename(tmpPath, path) == 0) {
+            table->dirty = false;
+        } else {
+            unlink(tmpPath);
+        }
+    }
+    pthread_mutex_unlock(&table->mutex);
+}
+
+NVCapsTable *getCapsTable(const char *deviceKey, bool useDisk) {
+    pthread_mutex_lock(&tablesMutex);
+    for (int i = 0; i < tableCount; i++) {
+        if (strcmp(tables[i]->key, deviceKey) == 0) {
+            NVCapsTable *table = tables[i];
+            pthread_mutex_unlock(&tablesMutex);
+            return table;
+        }
+    }
+
+    NVCapsTable *table = calloc(1, sizeof(NVCapsTable));
+    snprintf(table->key, sizeof(table->key), "%s", deviceKey);
+    pthread_mutex_init(&table->mutex, NULL);
+    //without the driver version we can't tell when the cache goes stale, and an empty version also stops it being saved
+    if (useDisk) {
+        readDriverVersion(table->driverVersion);
+        if (table->driverVersion[0] != '\0') {
+            loadCapsTable(table);
+        }
+    }
+    //tables are kept for the lifetime of the process, if there are somehow more GPUs than slots the extras are
+    //just not shared
+    if (tableCount < MAX_CACHED_GPUS) {
+        tables[tableCount++] = table;
+    }
+    pthread_mutex_unlock(&tablesMutex);
+    return table;
+}
+
+void setCapsTableDevice(NVCapsTable *table, const uint8_t uuid[16], bool supports16BitSurface, bool supports444Surface) {
+    pthread_mutex_lock(&table->mutex);
+    if (table->data.uuidKnown && memcmp(table->data.uuid, uuid, 16) != 0) {
+        LOG("Decoder caps cache %s was for a different GPU, discarding it", table->key);
+        memset(&table->data, 0, sizeof(table->data));
+    }
+    if (!table->data.uuidKnown || !table->data.surfaceSupportKnown
+            || table->data.supports16BitSurface != supports16BitSurface || table->data.supports444Surface != supports444Surface) {
+        memcpy(table->data.uuid, uuid, 16);
+        table->data.uuidKnown = true;
+        table->data.surfaceSupportKnown = true;
+        table->data.supports16BitSurface = supports16BitSurface;
+        table->data.supports444Surface = supports444Surface;
+        table->dirty = true;
+    }
+    pthread_mutex_unlock(&table->mutex);
+}
+
+bool getCachedSurfaceSupport(NVCapsTable *table, bool *supports16BitSurface, bool *supports444Surface) {
+    pthread_mutex_lock(&table->mutex);
+    bool known = table->data.surfaceSupportKnown;
+    if (known) {
+        *supports16BitSurface = table->data.supports16BitSurface;
+        *supports444Surface = table->data.supports444Surface;
+    }
+    pthread_mutex_unlock(&table->mutex);
+    return known;
+}
+
+bool getCachedDeviceUuid(NVCapsTable *table, uint8_t uuid[16]) {
+    pthread_mutex_lock(&table->mutex);
+    bool known = table->data.uuidKnown;
+    if (known) {
+        memcpy(uuid, table->data.uuid, 16);
+    }
+    pthread_mutex_unlock(&table->mutex);
+    return known;
+}
+
+static NVCodecCaps *capsEntry(NVCapsTable *table, cudaVideoCodec codec, int bitDepth, cudaVideoChromaFormat chromaFormat) {
+    int depthIdx = (bitDepth - 8) / 2;
+    if (codec < 0 || codec >= cudaVideoCodec_NumCodecs || chromaFormat < 0 || chromaFormat > cudaVideoChromaFormat_444
+            || depthIdx < 0 || depthIdx >= CAPS_BIT_DEPTHS) {
+        return NULL;
+    }
+    return &table->data.caps[codec][chromaFormat][depthIdx];
+}
+
+bool lookupCodecCaps(NVCapsTable *table, cudaVideoCodec codec, int bitDepth, cudaVideoChromaFormat chromaFormat,
+                     bool *supported, uint32_t *width, uint32_t *height) {
+    NVCodecCaps *caps = capsEntry(table, codec, bitDepth, chromaFormat);
+    if (caps == NULL) {
+        //nothing we could ever decode, which is as good as a cached answer
+        *supported = false;
+        return true;
+    }
+
+    pthread_mutex_lock(&table->mutex);
+    bool hit = caps->queried;
+    if (hit) {
+        *supported = caps->supported;
+        if (width != NULL) {
+            *width = caps->maxWidth;
+        }
+        if (height != NULL) {
+            *height = caps->maxHeight;
+        }
+    }
+    pthread_mutex_unlock(&table->mutex);
+    return hit;
+}
+
+bool queryCodecCaps(CuvidFunctions *cv, NVCapsTable *table, cudaVideoCodec codec, int bitDepth,
+                    cudaVideoChromaFormat chromaFormat, uint32_t *width, uint32_t *height) {
+    NVCodecCaps *caps = capsEntry(table, codec, bitDepth, chromaFormat);
+    if (caps == NULL) {
+        return false;
+    }
+
+    CUVIDDECODECAPS videoDecodeCaps = {
+        .eCodecType      = codec,
+        .eChromaFormat   = chromaFormat,
+        .nBitDepthMinus8 = bitDepth - 8
+    };
+    //don't cache failures, they may be transient
+    CHECK_CUDA_RESULT_RETURN(cv->cuvidGetDecoderCaps(&videoDecodeCaps), false);
+
+    pthread_mutex_lock(&table->mutex);
+    caps->queried = true;
+    caps->supported = videoDecodeCaps.bIsSupported == 1;
+    caps->maxWidth = videoDecodeCaps.nMaxWidth;
+    caps->maxHeight = videoDecodeCaps.nMaxHeight;
+    table->dirty = true;
+    pthread_mutex_unlock(&table->mutex);
+
+    if (width != NULL) {
+        *width = videoDecodeCaps.nMaxWidth;
+    }
+    if (height != NULL) {
+        *height = videoDecodeCaps.nMaxHeight;
+    }
+    return videoDecodeCaps.bIsSupported == 1;
+}
+
+static NVCodecCaps *encodeCapsEntry(NVCapsTable *table, int codec, int bitDepth) {
+    int depthIdx = (bitDepth - 8) / 2;
+    if (codec < 0 || codec >= ENCODE_CODECS || depthIdx < 0 || depthIdx >= ENCODE_BIT_DEPTHS) {
+        return NULL;
+    }
+    return &table->data.encodeCaps[codec][depthIdx];
+}
+
+bool lookupEncodeCaps(NVCapsTable *table, int codec, int bitDepth, bool *supported, uint32_t *width, uint32_t *height) {
+    NVCodecCaps *caps = encodeCapsEntry(table, codec, bitDepth);
+    if (caps == NULL) {
+        *supported = false;
+        return true;
+    }
+
+    pthread_mutex_lock(&table->mutex);
+    bool hit = caps->queried;
+    if (hit) {
+        *supported = caps->supported;
+        if (width != NULL) {
+            *width = caps->maxWidth;
+        }
+        if (height != NULL) {
+            *height = caps->maxHeight;
+        }
+    }
+    pthread_mutex_unlock(&table->mutex);
+    return hit;
+}
+
+void recordEncodeCaps(NVCapsTable *table, int codec, int bitDepth, bool supported, uint32_t width, uint32_t height) {
+    NVCodecCaps *caps = encodeCapsEntry(table, codec, bitDepth);
+    if (caps == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&table->mutex);
+    caps->queried = true;
+    caps->supported = supported;
+    caps->maxWidth = width;
+    caps->maxHeight = height;
+    table->dirty = true;
+    pthread_mutex_unlock(&table->mutex);
+}
@@ -0,0 +1,68 @@
+#ifndef CAPS_CACHE_H
+#define CAPS_CACHE_H
+
+#include <ffnvcodec/dynlink_loader.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+//bit depths 8, 10 and 12
+#define CAPS_BIT_DEPTHS 3
+//H.264, HEVC and AV1, indexed by NVEncodeCodec
+#define ENCODE_CODECS 3
+//bit depths 8 and 10
+#define ENCODE_BIT_DEPTHS 2
+
+typedef struct {
+    bool        queried;
+    bool        supported;
+    uint32_t    maxWidth;
+    uint32_t    maxHeight;
+} NVCodecCaps;
+
+//everything that's persisted to disk
+typedef struct {
+    uint8_t     uuid[16];
+    bool        uuidKnown;
+    bool        surfaceSupportKnown;
+    bool        supports16BitSurface;
+    bool        supports444Surface;
+    NVCodecCaps caps[cudaVideoCodec_NumCodecs][cudaVideoChromaFormat_444 + 1][CAPS_BIT_DEPTHS];
+    NVCodecCaps encodeCaps[ENCODE_CODECS][ENCODE_BIT_DEPTHS];   //4:2:0 only
+} NVCapsData;
+
+//the decoder caps of one GPU. These are shared between every VADisplay opened on the GPU in the process, and can
+//be persisted to disk so short lived processes can enumerate profiles without initialising CUDA at all.
+//Tables are keyed by a description of the device that can be built without CUDA (the backend and DRM node or GPU
+//index), the UUID is only checked once CUDA has been initialised.
+typedef struct {
+    char                key[64];
+    char                driverVersion[32];
+    pthread_mutex_t     mutex;
+    bool                dirty;
+    NVCapsData          data;
+} NVCapsTable;
+
+//returns the table for the device, loading it from the disk cache if enabled. Never returns NULL
+NVCapsTable *getCapsTable(const char *deviceKey, bool useDisk);
+//records the identity of the device the table turned out to be for, once CUDA is initialised. If that doesn't
+//match what the table was loaded for, all the cached caps are dropped
+void setCapsTableDevice(NVCapsTable *table, const uint8_t uuid[16], bool supports16BitSurface, bool supports444Surface);
+//returns false if the surface support hasn't been recorded yet
+bool getCachedSurfaceSupport(NVCapsTable *table, bool *supports16BitSurface, bool *supports444Surface);
+//returns false if the table doesn't know which GPU it's for yet
+bool getCachedDeviceUuid(NVCapsTable *table, uint8_t uuid[16]);
+//looks up the caps without querying NVDEC, returns false on a miss
+bool lookupCodecCaps(NVCapsTable *table, cudaVideoCodec codec, int bitDepth, cudaVideoChromaFormat chromaFormat,
+                     bool *supported, uint32_t *width, uint32_t *height);
+//queries NVDEC and records the result. Must be called with the CUDA context current
+bool queryCodecCaps(CuvidFunctions *cv, NVCapsTable *table, cudaVideoCodec codec, int bitDepth,
+                    cudaVideoChromaFormat chromaFormat, uint32_t *width, uint32_t *height);
+//looks up the NVENC caps of the codec, returns false on a miss
+bool lookupEncodeCaps(NVCapsTable *table, int codec, int bitDepth, bool *supported, uint32_t *width, uint32_t *height);
+//records what NVENC reported for the codec
+void recordEncodeCaps(NVCapsTable *table, int codec, int bitDepth, bool supported, uint32_t width, uint32_t height);
+//writes the table back to the disk cache if anything new was queried
+void saveCapsTable(NVCapsTable *table);
+
+#endif // CAPS_CACHE_H
@@ -0,0 +1,53 @@
+#define _GNU_SOURCE
+
+#include "cuda-extra.h"
+
+#include <dlfcn.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+typedef struct {
+    const char  *name;
+    size_t      offset;
+} CudaExtraSymbol;
+
+#define CUDA_EXTRA_SYMBOL(sym, name) { name, offsetof(CudaExtraFunctions, sym) }
+
+static const CudaExtraSymbol cudaExtraSymbols[] = {
+    CUDA_EXTRA_SYMBOL(cuMemAllocHost, "cuMemAllocHost_v2"),
+    CUDA_EXTRA_SYMBOL(cuMemFreeHost, "cuMemFreeHost"),
+    CUDA_EXTRA_SYMBOL(cuMemGetInfo, "cuMemGetInfo_v2"),
+    CUDA_EXTRA_SYMBOL(cuDeviceGetPCIBusId, "cuDeviceGetPCIBusId"),
+};
+
+bool loadCudaExtraFunctions(CudaExtraFunctions **funcs) {
+    CudaExtraFunctions *f = calloc(1, sizeof(CudaExtraFunctions));
+    if (f == NULL) {
+        return false;
+    }
+
+    f->lib = dlopen("libcuda.so.1", RTLD_LAZY | RTLD_LOCAL);
+    if (f->lib == NULL) {
+        free(f);
+        return false;
+    }
+
+    for (size_t i = 0; i < sizeof(cudaExtraSymbols) / sizeof(cudaExtraSymbols[0]); i++) {
+        void *sym = dlsym(f->lib, cudaExtraSymbols[i].name);
+        *(void**) ((char*) f + cudaExtraSymbols[i].offset) = sym;
+    }
+
+    *funcs = f;
+    return true;
+}
+
+void freeCudaExtraFunctions(CudaExtraFunctions **funcs) {
+    if (*funcs == NULL) {
+        return;
+    }
+    if ((*funcs)->lib != NULL) {
+        dlclose((*funcs)->lib);
+    }
+    free(*funcs);
+    *funcs = NULL;
+}
@@ -0,0 +1,20 @@
+#ifndef CUDAEXTRA_H
+#define CUDAEXTRA_H
+
+#include <ffnvcodec/dynlink_loader.h>
+#include <stdbool.h>
+
+//CUDA driver API entry points we need that aren't exposed by the ffnvcodec loader.
+//Any of these can be NULL if the installed driver doesn't provide them, so callers need to check.
+typedef struct {
+    void        *lib;
+    CUresult    (*cuMemAllocHost)(void **pp, size_t bytesize);
+    CUresult    (*cuMemFreeHost)(void *p);
+    CUresult    (*cuMemGetInfo)(size_t *free, size_t *total);
+    CUresult    (*cuDeviceGetPCIBusId)(char *pciBusId, int len, CUdevice dev);
+} CudaExtraFunctions;
+
+bool loadCudaExtraFunctions(CudaExtraFunctions **funcs);
+void freeCudaExtraFunctions(CudaExtraFunctions **funcs);
+
+#endif // CUDAEXTRA_H
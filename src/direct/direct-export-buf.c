@@ -11,6 +11,7 @@
 #include <sys/sysmacros.h>
 #endif
 #include <string.h>
+#include <inttypes.h>
 #include "../backend-common.h"
 
 #include <drm.h>
@@ -18,6 +19,73 @@
 
 static void destroyBackingImage(NVDriver *drv, BackingImage *img);
 
+//with a shared CUDA context, displays on the same GPU also share the RM client and it's objects
+#define MAX_SHARED_DRIVER_CONTEXTS 16
+typedef struct {
+    dev_t           device;
+    int             refs;
+    NVDriverContext context;
+} SharedDriverContext;
+static pthread_mutex_t sharedDriverContextsMutex = PTHREAD_MUTEX_INITIALIZER;
+static SharedDriverContext sharedDriverContexts[MAX_SHARED_DRIVER_CONTEXTS];
+static int sharedDriverContextCount = 0;
+
+//initialises drv->driverContext, or copies an existing one for the same device. Takes ownership of drv->drmFd
+static bool acquireDriverContext(NVDriver *drv) {
+    struct stat st;
+    drv->driverContextShared = false;
+    if (!drv->sharedContext || fstat(drv->drmFd, &st) != 0) {
+        return init_nvdriver(&drv->driverContext, drv->drmFd);
+    }
+
+    pthread_mutex_lock(&sharedDriverContextsMutex);
+    for (int i = 0; i < sharedDriverContextCount; i++) {
+        if (sharedDriverContexts[i].device == st.st_rdev) {
+            sharedDriverContexts[i].refs++;
+            drv->driverContext = sharedDriverContexts[i].context;
+            drv->driverContextShared = true;
+            pthread_mutex_unlock(&sharedDriverContextsMutex);
+            //the shared context owns an fd for the device already
+            close(drv->drmFd);
+            drv->drmFd = drv->driverContext.drmFd;
+            LOG("Sharing driver context with fd %d", drv->drmFd);
+            return true;
+        }
+    }
+    bool ret = init_nvdriver(&drv->driverContext, drv->drmFd);
+    if (ret && sharedDriverContextCount < MAX_SHARED_DRIVER_CONTEXTS) {
+        sharedDriverContexts[sharedDriverContextCount++] = (SharedDriverContext) {
+            .device = st.st_rdev,
+            .refs = 1,
+            .context = drv->driverContext
+        };
+        drv->driverContextShared = true;
+    }
+    pthread_mutex_unlock(&sharedDriverContextsMutex);
+    return ret;
+}
+
+static void releaseDriverContext(NVDriver *drv) {
+    if (!drv->driverContextShared) {
+        free_nvdriver(&drv->driverContext);
+        return;
+    }
+    pthread_mutex_lock(&sharedDriverContextsMutex);
+    for (int i = 0; i < sharedDriverContextCount; i++) {
+        SharedDriverContext *shared = &sharedDriverContexts[i];
+        if (shared->context.clientObject == drv->driverContext.clientObject && shared->context.nvctlFd == drv->driverContext.nvctlFd) {
+            if (--shared->refs == 0) {
+                free_nvdriver(&shared->context);
+                *shared = sharedDriverContexts[--sharedDriverContextCount];
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sharedDriverContextsMutex);
+    memset(&drv->driverContext, 0, sizeof(NVDriverContext));
+    drv->driverContextShared = false;
+}
+
 static void findGPUIndexFromFd(NVDriver *drv) {
     //find the CUDA device id
     uint8_t drmUuid[16];
@@ -42,7 +110,7 @@ static void findGPUIndexFromFd(NVDriver *drv) {
     drv->cudaGpuId = 0;
 }
 
-static bool import_to_cuda(NVDriver *drv, NVDriverImage *image, int bpc, int channels, NVCudaImage *cudaImage, CUarray *array) {
+static bool import_to_cuda(NVDriver *drv, NVDriverImage *image, int bpc, BackingImage *backingImage) {
     CUDA_EXTERNAL_MEMORY_HANDLE_DESC extMemDesc = {
         .type      = CU_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD,
         .handle.fd = image->nvFd,
@@ -50,37 +118,45 @@ static bool import_to_cuda(NVDriver *drv, NVDriverImage *image, int bpc, int cha
         .size      = image->memorySize
     };
 
-    //LOG("importing memory size: %dx%d = %x", image->width, image->height, image->memorySize);
+    //LOG("importing memory size: %x", image->memorySize);
 
-    CHECK_CUDA_RESULT_RETURN(drv->cu->cuImportExternalMemory(&cudaImage->extMem, &extMemDesc), false);
+    //all the planes live in the one allocation, so they share a single external memory object
+    CHECK_CUDA_RESULT_RETURN(drv->cu->cuImportExternalMemory(&backingImage->cudaImages[0].extMem, &extMemDesc), false);
 
     //For some reason, this close *must* be *here*, otherwise we will get random visual glitches.
-    close(image->nvFd2);
+    for (uint32_t i = 0; i < image->numPlanes; i++) {
+        if (image->planes[i].nvFd2 > 0) {
+            close(image->planes[i].nvFd2);
+        }
+        image->planes[i].nvFd2 = 0;
+    }
     image->nvFd = 0;
-    image->nvFd2 = 0;
-
-    CUDA_EXTERNAL_MEMORY_MIPMAPPED_ARRAY_DESC mipmapArrayDesc = {
-        .arrayDesc = {
-            .Width = image->width,
-            .Height = image->height,
-            .Depth = 0,
-            .Format = bpc == 8 ? CU_AD_FORMAT_UNSIGNED_INT8 : CU_AD_FORMAT_UNSIGNED_INT16,
-            .NumChannels = channels,
-            .Flags = 0
-        },
-        .numLevels = 1,
-        .offset = 0
-    };
-    //create a mimap array from the imported memory
-    CHECK_CUDA_RESULT_RETURN(drv->cu->cuExternalMemoryGetMappedMipmappedArray(&cudaImage->mipmapArray, cudaImage->extMem, &mipmapArrayDesc), false);
 
-    //create an array from the mipmap array
-    CHECK_CUDA_RESULT_RETURN(drv->cu->cuMipmappedArrayGetLevel(array, cudaImage->mipmapArray, 0), false);
+    for (uint32_t i = 0; i < image->numPlanes; i++) {
+        const NVDriverPlane *plane = &image->planes[i];
+        NVCudaImage *cudaImage = &backingImage->cudaImages[i];
+        CUDA_EXTERNAL_MEMORY_MIPMAPPED_ARRAY_DESC mipmapArrayDesc = {
+            .arrayDesc = {
+                .Width = plane->width,
+                .Height = plane->height,
+                .Depth = 0,
+                .Format = bpc == 8 ? CU_AD_FORMAT_UNSIGNED_INT8 : CU_AD_FORMAT_UNSIGNED_INT16,
+                .NumChannels = plane->channels,
+                .Flags = 0
+            },
+            .numLevels = 1,
+            .offset = plane->offset
+        };
+        //create a mimap array from the imported memory
+        CHECK_CUDA_RESULT_RETURN(drv->cu->cuExternalMemoryGetMappedMipmappedArray(&cudaImage->mipmapArray, backingImage->cudaImages[0].extMem, &mipmapArrayDesc), false);
+
+        //create an array from the mipmap array
+        CHECK_CUDA_RESULT_RETURN(drv->cu->cuMipmappedArrayGetLevel(&backingImage->arrays[i], cudaImage->mipmapArray, 0), false);
+    }
 
     return true;
 }
 
-
 static void debug(EGLenum error,const char *command,EGLint messageType,EGLLabelKHR threadLabel,EGLLabelKHR objectLabel,const char* message) {
     LOG("[EGL] %s: %s", command, message);
 }
@@ -136,7 +212,7 @@ static bool direct_initExporter(NVDriver *drv) {
         drv->drmFd = dup(drv->drmFd);
     }
 
-    const bool ret = init_nvdriver(&drv->driverContext, drv->drmFd);
+    const bool ret = acquireDriverContext(drv);
 
     //TODO this isn't really correct as we don't know if the driver version actually supports importing them
     //but we don't have an easy way to find out.
@@ -148,63 +224,72 @@ static bool direct_initExporter(NVDriver *drv) {
 }
 
 static void direct_releaseExporter(NVDriver *drv) {
-    free_nvdriver(&drv->driverContext);
+    releaseDriverContext(drv);
 }
 
-static BackingImage *direct_allocateBackingImage(NVDriver *drv, NVSurface *surface) {
-    NVDriverImage driverImages[3] = { 0 };
-    BackingImage *backingImage = calloc(1, sizeof(BackingImage));
+//fills in the planes of an image for the surface, returning roughly how big it will be
+static uint64_t describeDriverImage(const NVSurface *surface, const NVFormatInfo *fmtInfo, NVDriverImage *driverImage) {
+    const NVFormatPlane *p = fmtInfo->plane;
+    driverImage->numPlanes = fmtInfo->numPlanes;
+    uint64_t estimate = 0;
+    for (uint32_t i = 0; i < fmtInfo->numPlanes; i++) {
+        driverImage->planes[i].width = surface->width >> p[i].ss.x;
+        driverImage->planes[i].height = surface->height >> p[i].ss.y;
+        driverImage->planes[i].channels = p[i].channelCount;
+        driverImage->planes[i].bitsPerChannel = 8 * fmtInfo->bppc;
+        driverImage->planes[i].fourcc = p[i].fourcc;
+        estimate += (uint64_t) driverImage->planes[i].width * driverImage->planes[i].height * p[i].channelCount * fmtInfo->bppc;
+    }
+    return estimate;
+}
 
-    switch (surface->format)
-    {
-    case cudaVideoSurfaceFormat_P016:
-        switch (surface->bitDepth) {
-        case 10:
-            backingImage->format = NV_FORMAT_P010;
-            break;
-        case 12:
-            backingImage->format = NV_FORMAT_P012;
-            break;
-        default:
-            backingImage->format = NV_FORMAT_P016;
-            break;
+static void closeDriverImage(NVDriverImage *driverImage) {
+    if (driverImage->nvFd != 0) {
+        close(driverImage->nvFd);
+    }
+    for (uint32_t i = 0; i < driverImage->numPlanes; i++) {
+        if (driverImage->planes[i].nvFd2 != 0) {
+            close(driverImage->planes[i].nvFd2);
+        }
+        if (driverImage->planes[i].drmFd != 0) {
+            close(driverImage->planes[i].drmFd);
         }
-        break;
+    }
+}
 
-    case cudaVideoSurfaceFormat_YUV444_16Bit:
-        backingImage->format = NV_FORMAT_Q416;
-        break;
+static BackingImage *direct_allocateBackingImage(NVDriver *drv, NVSurface *surface) {
+    NVTX_RANGE("Allocate backing image for surface %u", surface->id);
+    NVDriverImage driverImage = { 0 };
+    BackingImage *backingImage = calloc(1, sizeof(BackingImage));
 
-    case cudaVideoSurfaceFormat_YUV444:
-        backingImage->format = NV_FORMAT_444P;
-        break;
-    
-    default:
-        backingImage->format = NV_FORMAT_NV12;
-        break;
-    }
+    backingImage->format = nvSurfaceFormat(surface);
 
     const NVFormatInfo *fmtInfo = &formatsInfo[backingImage->format];
-    const NVFormatPlane *p = fmtInfo->plane;
 
-    LOG("Allocating BackingImages: %p %dx%d", backingImage, surface->width, surface->height);
-    for (uint32_t i = 0; i < fmtInfo->numPlanes; i++) {
-        alloc_image(&drv->driverContext, surface->width >> p[i].ss.x, surface->height >> p[i].ss.y,
-                    p[i].channelCount, 8 * fmtInfo->bppc, p[i].fourcc, &driverImages[i]);
+    LOG_TRACE("Allocating BackingImage: %p %dx%d", backingImage, surface->width, surface->height);
+    uint64_t estimate = describeDriverImage(surface, fmtInfo, &driverImage);
+
+    //the real size includes the kernel driver's padding, which isn't known until it's allocated
+    vramMakeRoom(drv, estimate);
+
+    if (!alloc_image(&drv->driverContext, &driverImage)) {
+        goto bail;
     }
 
-    for (uint32_t i = 0; i < fmtInfo->numPlanes; i++) {
-        if (!import_to_cuda(drv, &driverImages[i], 8 * fmtInfo->bppc, p[i].channelCount, &backingImage->cudaImages[i], &backingImage->arrays[i]))
-            goto bail;
+    if (!import_to_cuda(drv, &driverImage, 8 * fmtInfo->bppc, backingImage)) {
+        goto bail;
     }
 
     backingImage->width = surface->width;
     backingImage->height = surface->height;
+    vramAccount(drv, NV_VRAM_IMAGES, driverImage.memorySize);
+    //a single allocation backs every plane, each with a dma-buf of it's own carrying the plane's layout
     for (uint32_t i = 0; i < fmtInfo->numPlanes; i++) {
-        backingImage->fds[i] = driverImages[i].drmFd;
-        backingImage->strides[i] = driverImages[i].pitch;
-        backingImage->mods[i] = driverImages[i].mods;
-        backingImage->size[i] = driverImages[i].memorySize;
+        backingImage->fds[i] = driverImage.planes[i].drmFd;
+        backingImage->size[i] = driverImage.memorySize;
+        backingImage->offsets[i] = driverImage.planes[i].offset;
+        backingImage->strides[i] = driverImage.planes[i].pitch;
+        backingImage->mods[i] = driverImage.planes[i].mods;
     }
 
     return backingImage;
@@ -212,17 +297,7 @@ static BackingImage *direct_allocateBackingImage(NVDriver *drv, NVSurface *surfa
 bail:
     //another 'free' might occur on this pointer.
     //hence, set it to NULL to ensure no operation is performed if this really happens.
-    for (uint32_t i = 0; i < fmtInfo->numPlanes; i++) {
-        if (driverImages[i].nvFd != 0) {
-            close(driverImages[i].nvFd);
-        }
-        if (driverImages[i].nvFd2 != 0) {
-            close(driverImages[i].nvFd2);
-        }
-        if (driverImages[i].drmFd != 0) {
-            close(driverImages[i].drmFd);
-        }
-    }
+    closeDriverImage(&driverImage);
 
     if (backingImage != NULL) {
         destroyBackingImage(drv, backingImage);
@@ -235,6 +310,12 @@ static void destroyBackingImage(NVDriver *drv, BackingImage *img) {
     const NVFormatInfo *fmtInfo = &formatsInfo[img->format];
     if (img->surface != NULL) {
         img->surface->backingImage = NULL;
+    } else if (!img->imported) {
+        vramAccount(drv, NV_VRAM_POOLED, -(int64_t) img->size[0]);
+    }
+    //an imported image's memory belongs to the client
+    if (!img->imported) {
+        vramAccount(drv, NV_VRAM_IMAGES, -(int64_t) img->size[0]);
     }
 
     for (int i = 0; i < 4; i++) {
@@ -251,10 +332,11 @@ static void destroyBackingImage(NVDriver *drv, BackingImage *img) {
         if (img->cudaImages[i].mipmapArray != NULL) {
             CHECK_CUDA_RESULT(drv->cu->cuMipmappedArrayDestroy(img->cudaImages[i].mipmapArray));
         }
+    }
 
-        if (img->cudaImages[i].extMem != NULL) {
-            CHECK_CUDA_RESULT(drv->cu->cuDestroyExternalMemory(img->cudaImages[i].extMem));
-        }
+    //the planes all share the first plane's external memory, so it has to outlive every array
+    if (img->cudaImages[0].extMem != NULL) {
+        CHECK_CUDA_RESULT(drv->cu->cuDestroyExternalMemory(img->cudaImages[0].extMem));
     }
 
     memset(img, 0, sizeof(BackingImage));
@@ -266,13 +348,108 @@ static void direct_attachBackingImageToSurface(NVSurface *surface, BackingImage
     img->surface = surface;
 }
 
+//finds the least recently released unattached image, and counts how many there are.
+//must be called with imagesMutex held
+static BackingImage *findOldestFreeBackingImage(NVDriver *drv, uint32_t *oldestIdx, int *freeCount) {
+    BackingImage *oldest = NULL;
+    *freeCount = 0;
+    ARRAY_FOR_EACH(BackingImage*, img, &drv->images)
+        if (img->surface == NULL) {
+            (*freeCount)++;
+            if (oldest == NULL || img->lastUsed < oldest->lastUsed) {
+                oldest = img;
+                *oldestIdx = img_idx;
+            }
+        }
+    END_FOR_EACH
+    return oldest;
+}
+
+//destroys the least recently released unattached images until no more than imagePoolSize are left.
+//must be called with imagesMutex held
+static void trimBackingImagePool(NVDriver *drv) {
+    while (true) {
+        uint32_t oldestIdx = 0;
+        int freeCount;
+        BackingImage *oldest = findOldestFreeBackingImage(drv, &oldestIdx, &freeCount);
+        if (freeCount <= drv->imagePoolSize) {
+            return;
+        }
+
+        LOG_TRACE("Trimming BackingImage %p from pool", oldest);
+        remove_element_at(&drv->images, oldestIdx);
+        destroyBackingImage(drv, oldest);
+    }
+}
+
+static uint64_t direct_evictBackingImages(NVDriver *drv, uint64_t bytes) {
+    uint64_t freed = 0;
+    pthread_mutex_lock(&drv->imagesMutex);
+    while (freed < bytes) {
+        uint32_t oldestIdx = 0;
+        int freeCount;
+        BackingImage *oldest = findOldestFreeBackingImage(drv, &oldestIdx, &freeCount);
+        if (oldest == NULL) {
+            break;
+        }
+
+        LOG_TRACE("Evicting BackingImage %p from pool", oldest);
+        freed += oldest->size[0];
+        remove_element_at(&drv->images, oldestIdx);
+        destroyBackingImage(drv, oldest);
+    }
+    pthread_mutex_unlock(&drv->imagesMutex);
+    return freed;
+}
+
 static void direct_detachBackingImageFromSurface(NVDriver *drv, NVSurface *surface) {
     if (surface->backingImage == NULL) {
         return;
     }
 
-    destroyBackingImage(drv, surface->backingImage);
+    //hand the image back to the pool rather than destroying it, the next surface of the same size and format
+    //can pick it up without allocating and importing new memory
+    pthread_mutex_lock(&drv->imagesMutex);
+    BackingImage *img = surface->backingImage;
+    //the client's buffer is only ever used by the surface it was imported for, and an exported one may still be on
+    //screen, so reusing it would show another surface's frames in it
+    if (img->imported || (img->handedOut && !drv->poolExportedImages)) {
+        ARRAY_FOR_EACH(BackingImage*, it, &drv->images)
+            if (it == img) {
+                remove_element_at(&drv->images, it_idx);
+                break;
+            }
+        END_FOR_EACH
+        destroyBackingImage(drv, img);
+        pthread_mutex_unlock(&drv->imagesMutex);
+        return;
+    }
+    img->surface = NULL;
+    img->lastUsed = ++drv->imagePoolClock;
     surface->backingImage = NULL;
+    vramAccount(drv, NV_VRAM_POOLED, img->size[0]);
+    trimBackingImagePool(drv);
+    pthread_mutex_unlock(&drv->imagesMutex);
+}
+
+static BackingImage *findFreeBackingImage(NVDriver *drv, NVSurface *surface) {
+    NVFormat format = nvSurfaceFormat(surface);
+    BackingImage *ret = NULL;
+    pthread_mutex_lock(&drv->imagesMutex);
+    //prefer the most recently released match, it's the one most likely to still be resident
+    ARRAY_FOR_EACH(BackingImage*, img, &drv->images)
+        if (img->surface == NULL && img->width == surface->width && img->height == surface->height && img->format == format
+                && (ret == NULL || img->lastUsed > ret->lastUsed)) {
+            ret = img;
+        }
+    END_FOR_EACH
+    if (ret != NULL) {
+        LOG_TRACE("Using BackingImage %p for Surface %p", ret, surface);
+        direct_attachBackingImageToSurface(surface, ret);
+        vramAccount(drv, NV_VRAM_POOLED, -(int64_t) ret->size[0]);
+    }
+    pthread_mutex_unlock(&drv->imagesMutex);
+    return ret;
 }
 
 static void direct_destroyAllBackingImage(NVDriver *drv) {
@@ -286,7 +463,7 @@ static void direct_destroyAllBackingImage(NVDriver *drv) {
     pthread_mutex_unlock(&drv->imagesMutex);
 }
 
-static bool copyFrameToSurface(NVDriver *drv, CUdeviceptr ptr, NVSurface *surface, uint32_t pitch) {
+static bool copyFrameToSurface(NVDriver *drv, CUdeviceptr ptr, NVSurface *surface, uint32_t pitch, CUstream stream) {
     const NVFormatInfo *fmtInfo = &formatsInfo[surface->backingImage->format];
     uint32_t y = 0;
 
@@ -302,20 +479,10 @@ static bool copyFrameToSurface(NVDriver *drv, CUdeviceptr ptr, NVSurface *surfac
             .Height = surface->height >> p->ss.y,
             .WidthInBytes = (surface->width >> p->ss.x) * fmtInfo->bppc * p->channelCount
         };
-        if (i == fmtInfo->numPlanes - 1) {
-            CHECK_CUDA_RESULT(drv->cu->cuMemcpy2D(&cpy));
-        } else {
-            CHECK_CUDA_RESULT(drv->cu->cuMemcpy2DAsync(&cpy, 0));
-        }
+        CHECK_CUDA_RESULT_RETURN(drv->cu->cuMemcpy2DAsync(&cpy, stream), false);
         y += surface->height >> p->ss.y;
     }
 
-    //notify anyone waiting for us to be resolved
-    pthread_mutex_lock(&surface->mutex);
-    surface->resolving = 0;
-    pthread_cond_signal(&surface->cond);
-    pthread_mutex_unlock(&surface->mutex);
-
     return true;
 }
 
@@ -323,8 +490,8 @@ static bool direct_realiseSurface(NVDriver *drv, NVSurface *surface) {
     //make sure we're the only thread updating this surface
     pthread_mutex_lock(&surface->mutex);
     //check again to see if it's just been created
-    if (surface->backingImage == NULL) {
-        //try to find a free surface
+    if (surface->backingImage == NULL && findFreeBackingImage(drv, surface) == NULL) {
+        //nothing suitable in the pool, allocate a new one
         BackingImage *img = direct_allocateBackingImage(drv, surface);
         if (img == NULL) {
             LOG("Unable to realise surface: %p (%d)", surface, surface->pictureIdx)
@@ -332,20 +499,114 @@ static bool direct_realiseSurface(NVDriver *drv, NVSurface *surface) {
             return false;
         }
 
+        pthread_mutex_lock(&drv->imagesMutex);
         direct_attachBackingImageToSurface(surface, img);
+        add_element(&drv->images, img);
+        pthread_mutex_unlock(&drv->imagesMutex);
     }
     pthread_mutex_unlock(&surface->mutex);
 
     return true;
 }
 
-static bool direct_exportCudaPtr(NVDriver *drv, CUdeviceptr ptr, NVSurface *surface, uint32_t pitch) {
+//the planes of a PRIME_2 descriptor, whether each is it's own layer or they're all in one
+static bool descriptorPlane(const VADRMPRIMESurfaceDescriptor *desc, uint32_t plane, uint32_t *object, uint32_t *offset, uint32_t *pitch) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < desc->num_layers && i < 4; i++) {
+        for (uint32_t j = 0; j < desc->layers[i].num_planes && j < 4; j++, n++) {
+            if (n == plane) {
+                if (desc->layers[i].object_index[j] >= desc->num_objects) {
+                    return false;
+                }
+                *object = desc->layers[i].object_index[j];
+                *offset = desc->layers[i].offset[j];
+                *pitch = desc->layers[i].pitch[j];
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static bool direct_importBackingImage(NVDriver *drv, NVSurface *surface, const VADRMPRIMESurfaceDescriptor *desc) {
+    NVTX_RANGE("Import backing image for surface %u", surface->id);
+    NVDriverImage driverImage = { 0 };
+    NVFormat format = nvSurfaceFormat(surface);
+    const NVFormatInfo *fmtInfo = &formatsInfo[format];
+
+    //every plane has to be in the one allocation, as they are in the images alloc_image makes, either as a single
+    //object or as one object per plane like our exports
+    if (desc->fourcc != fmtInfo->fourcc || (desc->num_objects != 1 && desc->num_objects != fmtInfo->numPlanes)
+            || desc->width < surface->width || desc->height < surface->height) {
+        LOG("Unable to import %ux%u %.4s dma-buf with %u objects for a %ux%u %.4s surface", desc->width, desc->height,
+            (const char*) &desc->fourcc, desc->num_objects, surface->width, surface->height, (const char*) &fmtInfo->fourcc);
+        return false;
+    }
+
+    describeDriverImage(surface, fmtInfo, &driverImage);
+    uint32_t objects[3] = { 0 };
+    int planeFds[3] = { 0 };
+    bool described = true;
+    for (uint32_t i = 0; described && i < fmtInfo->numPlanes; i++) {
+        uint32_t offset, pitch;
+        described = descriptorPlane(desc, i, &objects[i], &offset, &pitch) && desc->objects[objects[i]].size == desc->objects[0].size;
+        planeFds[i] = desc->objects[objects[i]].fd;
+    }
+    if (!described || !import_image(&drv->driverContext, planeFds, &driverImage)) {
+        closeDriverImage(&driverImage);
+        return false;
+    }
+
+    //CUDA picks the layout of the arrays itself, so the buffer is only usable if it's laid out exactly as ours are
+    bool matches = true;
+    for (uint32_t i = 0; matches && i < fmtInfo->numPlanes; i++) {
+        uint32_t object, offset, pitch;
+        matches = descriptorPlane(desc, i, &object, &offset, &pitch) && offset == driverImage.planes[i].offset && pitch == driverImage.planes[i].pitch
+                && desc->objects[object].drm_format_modifier == driverImage.planes[i].mods;
+    }
+    if (!matches) {
+        LOG("Unable to import dma-buf with modifier %" PRIx64 ", it isn't laid out like a %ux%u surface (%" PRIx64 ")",
+            desc->objects[0].drm_format_modifier, surface->width, surface->height, driverImage.planes[0].mods);
+        closeDriverImage(&driverImage);
+        return false;
+    }
+
+    BackingImage *backingImage = calloc(1, sizeof(BackingImage));
+    backingImage->format = format;
+    backingImage->imported = true;
+    if (!import_to_cuda(drv, &driverImage, 8 * fmtInfo->bppc, backingImage)) {
+        closeDriverImage(&driverImage);
+        destroyBackingImage(drv, backingImage);
+        return false;
+    }
+
+    backingImage->width = surface->width;
+    backingImage->height = surface->height;
+    for (uint32_t i = 0; i < fmtInfo->numPlanes; i++) {
+        backingImage->fds[i] = driverImage.planes[i].drmFd;
+        backingImage->size[i] = driverImage.memorySize;
+        backingImage->offsets[i] = driverImage.planes[i].offset;
+        backingImage->strides[i] = driverImage.planes[i].pitch;
+        backingImage->mods[i] = driverImage.planes[i].mods;
+    }
+    LOG_TRACE("Imported BackingImage %p for Surface %p", backingImage, surface);
+
+    pthread_mutex_lock(&drv->imagesMutex);
+    direct_attachBackingImageToSurface(surface, backingImage);
+    add_element(&drv->images, backingImage);
+    pthread_mutex_unlock(&drv->imagesMutex);
+    return true;
+}
+
+static bool direct_exportCudaPtr(NVDriver *drv, CUdeviceptr ptr, NVSurface *surface, uint32_t pitch, CUstream stream) {
     if (!direct_realiseSurface(drv, surface)) {
         return false;
     }
 
     if (ptr != 0) {
-        copyFrameToSurface(drv, ptr, surface, pitch);
+        if (!copyFrameToSurface(drv, ptr, surface, pitch, stream)) {
+            return false;
+        }
     } else {
         LOG("exporting with null ptr")
     }
@@ -354,8 +615,9 @@ static bool direct_exportCudaPtr(NVDriver *drv, CUdeviceptr ptr, NVSurface *surf
 }
 
 static bool direct_fillExportDescriptor(NVDriver *drv, NVSurface *surface, VADRMPRIMESurfaceDescriptor *desc) {
-    const BackingImage *img = surface->backingImage;
+    BackingImage *img = surface->backingImage;
     const NVFormatInfo *fmtInfo = &formatsInfo[img->format];
+    img->handedOut = true;
 
     desc->fourcc = fmtInfo->fourcc;
     desc->width = surface->width;
@@ -364,6 +626,7 @@ static bool direct_fillExportDescriptor(NVDriver *drv, NVSurface *surface, VADRM
     desc->num_layers = fmtInfo->numPlanes;
     desc->num_objects = fmtInfo->numPlanes;
 
+    //the planes share an allocation, but each has a block height of it's own and so needs an object to carry it
     for (uint32_t i = 0; i < fmtInfo->numPlanes; i++) {
         desc->objects[i].fd = dup(img->fds[i]);
         desc->objects[i].size = img->size[i];
@@ -387,5 +650,7 @@ const NVBackend DIRECT_BACKEND = {
     .detachBackingImageFromSurface = direct_detachBackingImageFromSurface,
     .realiseSurface = direct_realiseSurface,
     .fillExportDescriptor = direct_fillExportDescriptor,
-    .destroyAllBackingImage = direct_destroyAllBackingImage
+    .destroyAllBackingImage = direct_destroyAllBackingImage,
+    .evictBackingImages = direct_evictBackingImages,
+    .importBackingImage = direct_importBackingImage
 };
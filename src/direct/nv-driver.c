@@ -68,7 +68,7 @@ static bool nv_alloc_object(const int fd, const uint32_t driverMajorVersion, con
     }
 
     if (ret != 0 || status != NV_OK) {
-        LOG("nv_alloc_object failed: %d %X %d", ret, status, errno)
+        LOG_ERROR("nv_alloc_object failed: %d %X %d", ret, status, errno)
         return false;
     }
 
@@ -91,7 +91,7 @@ static bool nv_free_object(const int fd, const NvHandle hRoot, const NvHandle hO
     const int ret = ioctl(fd, _IOC(_IOC_READ|_IOC_WRITE, NV_IOCTL_MAGIC, NV_ESC_RM_FREE, sizeof(NVOS00_PARAMETERS)), &freeParams);
 
     if (ret != 0 || freeParams.status != NV_OK) {
-        LOG("nv_free_object failed: %d %X %d", ret, freeParams.status, errno)
+        LOG_ERROR("nv_free_object failed: %d %X %d", ret, freeParams.status, errno)
         return false;
     }
 
@@ -112,7 +112,7 @@ static bool nv_rm_control(const int fd, const NvHandle hClient, const NvHandle h
     const int ret = ioctl(fd, _IOC(_IOC_READ|_IOC_WRITE, NV_IOCTL_MAGIC, NV_ESC_RM_CONTROL, sizeof(NVOS54_PARAMETERS)), &control);
 
     if (ret != 0 || control.status != NV_OK) {
-        LOG("nv_rm_control failed: %d %X %d", ret, control.status, errno)
+        LOG_ERROR("nv_rm_control failed: %d %X %d", ret, control.status, errno)
         return false;
     }
 
@@ -127,7 +127,7 @@ static NvU64 nv_sys_params(int fd) {
     int ret = ioctl(fd, _IOC(_IOC_READ|_IOC_WRITE, NV_IOCTL_MAGIC, NV_ESC_SYS_PARAMS, sizeof(obj)), &obj);
 
     if (ret != 0) {
-        LOG("nv_sys_params failed: %d %d", ret, errno);
+        LOG_ERROR("nv_sys_params failed: %d %d", ret, errno);
         return 0;
     }
 
@@ -138,7 +138,7 @@ static bool nv_card_info(int fd, nv_ioctl_card_info_t (*card_info)[32]) {
     int ret = ioctl(fd, _IOC(_IOC_READ|_IOC_WRITE, NV_IOCTL_MAGIC, NV_ESC_CARD_INFO, sizeof(nv_ioctl_card_info_t) * 32), card_info);
 
     if (ret != 0) {
-        LOG("nv_card_info failed: %d %d", ret, errno);
+        LOG_ERROR("nv_card_info failed: %d %d", ret, errno);
         return false;
     }
 
@@ -150,7 +150,7 @@ static bool nv_attach_gpus(const int fd, uint32_t gpu) {
     const int ret = ioctl(fd, _IOC(_IOC_READ|_IOC_WRITE, NV_IOCTL_MAGIC, NV_ESC_ATTACH_GPUS_TO_FD, sizeof(gpu)), &gpu);
 
     if (ret != 0) {
-        LOG("nv_attach_gpus failed: %d %d", ret, errno)
+        LOG_ERROR("nv_attach_gpus failed: %d %d", ret, errno)
         return false;
     }
 
@@ -183,7 +183,7 @@ static bool nv_get_versions(const int fd, char **versionString) {
     const int ret = ioctl(fd, _IOC(_IOC_READ|_IOC_WRITE, NV_IOCTL_MAGIC, NV_ESC_CHECK_VERSION_STR, sizeof(obj)), &obj);
 
     if (ret != 0) {
-        LOG("nv_check_version failed: %d %d", ret, errno)
+        LOG_ERROR("nv_check_version failed: %d %d", ret, errno)
         return false;
     }
 
@@ -229,7 +229,7 @@ static bool nv0_register_fd(const int nv0_fd, int nvctl_fd) {
     const int ret = ioctl(nv0_fd, _IOC(_IOC_READ|_IOC_WRITE, NV_IOCTL_MAGIC, NV_ESC_REGISTER_FD, sizeof(int)), &nvctl_fd);
 
     if (ret != 0) {
-        LOG("nv0_register_fd failed: %d %d", ret, errno)
+        LOG_ERROR("nv0_register_fd failed: %d %d", ret, errno)
         return false;
     }
 
@@ -244,7 +244,7 @@ static bool get_device_info(const int fd, NVDriverContext *context) {
         const int ret = ioctl(fd, DRM_IOCTL_NVIDIA_GET_DEV_INFO_545, &devInfo545);
 
         if (ret != 0) {
-            LOG("get_device_info failed: %d %d", ret, errno)
+            LOG_ERROR("get_device_info failed: %d %d", ret, errno)
             return false;
         }
 
@@ -257,7 +257,7 @@ static bool get_device_info(const int fd, NVDriverContext *context) {
         const int ret = ioctl(fd, DRM_IOCTL_NVIDIA_GET_DEV_INFO, &devInfo);
 
         if (ret != 0) {
-            LOG("get_device_info failed: %d %d", ret, errno)
+            LOG_ERROR("get_device_info failed: %d %d", ret, errno)
             return false;
         }
 
@@ -319,14 +319,14 @@ bool init_nvdriver(NVDriverContext *context, const int drmFd) {
     //allocate the root object
     bool ret = nv_alloc_object(nvctlFd, context->driverMajorVersion, NULL_OBJECT, NULL_OBJECT, &context->clientObject, NV01_ROOT_CLIENT, 0, (void*)0);
     if (!ret) {
-        LOG("nv_alloc_object NV01_ROOT_CLIENT failed")
+        LOG_ERROR("nv_alloc_object NV01_ROOT_CLIENT failed")
         goto err;
     }
 
     //attach the drm fd to this handle
     ret = nv_attach_gpus(nvctlFd, context->gpu_id);
     if (!ret) {
-        LOG("nv_attach_gpu failed")
+        LOG_ERROR("nv_attach_gpu failed")
         goto err;
     }
 
@@ -338,7 +338,7 @@ bool init_nvdriver(NVDriverContext *context, const int drmFd) {
     //allocate the device object
     ret = nv_alloc_object(nvctlFd, context->driverMajorVersion, context->clientObject, context->clientObject, &context->deviceObject, NV01_DEVICE_0, sizeof(deviceParams), &deviceParams);
     if (!ret) {
-        LOG("nv_alloc_object NV01_DEVICE_0 failed")
+        LOG_ERROR("nv_alloc_object NV01_DEVICE_0 failed")
         goto err;
     }
 
@@ -346,14 +346,14 @@ bool init_nvdriver(NVDriverContext *context, const int drmFd) {
     NV2080_ALLOC_PARAMETERS subdevice = { 0 };
     ret = nv_alloc_object(nvctlFd, context->driverMajorVersion, context->clientObject, context->deviceObject, &context->subdeviceObject, NV20_SUBDEVICE_0, sizeof(subdevice), &subdevice);
     if (!ret) {
-        LOG("nv_alloc_object NV20_SUBDEVICE_0 failed")
+        LOG_ERROR("nv_alloc_object NV20_SUBDEVICE_0 failed")
         goto err;
     }
 
     //TODO honestly not sure if this is needed
     ret = nv0_register_fd(nv0Fd, nvctlFd);
     if (!ret) {
-        LOG("nv0_register_fd failed")
+        LOG_ERROR("nv0_register_fd failed")
         goto err;
     }
 
@@ -429,34 +429,34 @@ bool alloc_memory(const NVDriverContext *context, const uint32_t size, int *fd)
     };
     bool ret = nv_alloc_object(context->nvctlFd, context->driverMajorVersion, context->clientObject, context->deviceObject, &bufferObject, NV01_MEMORY_LOCAL_USER, sizeof(memParams), &memParams);
     if (!ret) {
-        LOG("nv_alloc_object NV01_MEMORY_LOCAL_USER failed")
+        LOG_ERROR("nv_alloc_object NV01_MEMORY_LOCAL_USER failed")
         return false;
     }
 
     //open a new handle to return
     int nvctlFd2 = open("/dev/nvidiactl", O_RDWR|O_CLOEXEC);
     if (nvctlFd2 == -1) {
-        LOG("open /dev/nvidiactl failed")
+        LOG_ERROR("open /dev/nvidiactl failed")
         goto err;
     }
 
     //attach the new fd to the correct gpus
     ret = nv_attach_gpus(nvctlFd2, context->gpu_id);
     if (!ret) {
-        LOG("nv_attach_gpus failed")
+        LOG_ERROR("nv_attach_gpus failed")
         goto err;
     }
 
     //actually export the object
     ret = nv_export_object_to_fd(context->nvctlFd, nvctlFd2, context->clientObject, context->deviceObject, context->deviceObject, bufferObject);
     if (!ret) {
-        LOG("nv_export_object_to_fd failed")
+        LOG_ERROR("nv_export_object_to_fd failed")
         goto err;
     }
 
     ret = nv_free_object(context->nvctlFd, context->clientObject, bufferObject);
     if (!ret) {
-        LOG("nv_free_object failed")
+        LOG_ERROR("nv_free_object failed")
         goto err;
     }
 
@@ -471,53 +471,73 @@ bool alloc_memory(const NVDriverContext *context, const uint32_t size, int *fd)
 
     ret = nv_free_object(context->nvctlFd, context->clientObject, bufferObject);
     if (!ret) {
-        LOG("nv_free_object failed")
+        LOG_ERROR("nv_free_object failed")
     }
 
     return false;
 }
 
- bool alloc_image(NVDriverContext *context, uint32_t width, uint32_t height, uint8_t channels, uint8_t bitsPerChannel, uint32_t fourcc, NVDriverImage *image) {
+//CUDA lays out the arrays the image is imported as itself, so the block height has to be the one it would pick.
+//80px high needs 8 GOBs and 86px, 88px, 96px and 112px need 16, which fits the block doubling once the plane is a
+//third taller than the current one. Nothing has been seen to use more than 16 GOBs
+static uint32_t blockHeightForPlane(uint32_t height) {
+    uint32_t log2GobsPerBlockY = 0;
+    while (log2GobsPerBlockY < 4 && height * 3 >= (8u << log2GobsPerBlockY) * 4) {
+        log2GobsPerBlockY++;
+    }
+    return log2GobsPerBlockY;
+}
+
+uint64_t get_image_modifier(const NVDriverContext *context, uint32_t height) {
+    return DRM_FORMAT_MOD_NVIDIA_BLOCK_LINEAR_2D(0, context->sector_layout, context->page_kind_generation, context->generic_page_kind, blockHeightForPlane(height));
+}
+
+//fills in the layout of the image's planes, returning the size of the allocation they need
+static uint32_t layout_image(const NVDriverContext *context, NVDriverImage *image) {
      uint32_t gobWidthInBytes = 64;
      uint32_t gobHeightInBytes = 8;
 
-     uint32_t bytesPerChannel = bitsPerChannel/8;
-     uint32_t bytesPerPixel = channels * bytesPerChannel;
-
      //first figure out the gob layout
      uint32_t log2GobsPerBlockX = 0; //TODO not sure if these are the correct numbers to start with, but they're the largest ones i've seen used
-     uint32_t log2GobsPerBlockY = height < 86 ? 3 : 4; //TODO 86 is a guess, 80px high needs 3, 112px needs 4, 96px needs 4, 88px needs 4, 86px needs 4
-     if (height < 43) log2GobsPerBlockY = 2;
-     if (height < 22) log2GobsPerBlockY = 1;
-     if (height < 11) log2GobsPerBlockY = 0;
-     uint32_t log2GobsPerBlockZ = 0;
-
-     //LOG("Calculated GOB size: %dx%d (%dx%d)", gobWidthInBytes << log2GobsPerBlockX, gobHeightInBytes << log2GobsPerBlockY, log2GobsPerBlockX, log2GobsPerBlockY);
-
-     //These two seem to be correct, but it was discovered by trial and error so I'm not 100% sure
-     uint32_t widthInBytes = ROUND_UP(width * bytesPerPixel, gobWidthInBytes << log2GobsPerBlockX);
-     uint32_t alignedHeight = ROUND_UP(height, gobHeightInBytes << log2GobsPerBlockY);
 
-     uint32_t imageSizeInBytes = widthInBytes * alignedHeight;
-     uint32_t size = imageSizeInBytes;
-
-     //this gets us some memory, and the fd to import into cuda
-     int memFd = -1;
-     bool ret = alloc_memory(context, size, &memFd);
-     if (!ret) {
-         LOG("alloc_memory failed");
-         return false;
+     //lay the planes out one after the other, each one starting on a big page boundary. CUDA picks the block height
+     //of each plane's array from that plane's height, so each plane gets it's own modifier
+     uint32_t size = 0;
+     for (uint32_t i = 0; i < image->numPlanes; i++) {
+         NVDriverPlane *plane = &image->planes[i];
+         uint32_t bytesPerPixel = plane->channels * (plane->bitsPerChannel / 8);
+         uint32_t log2GobsPerBlockY = blockHeightForPlane(plane->height);
+
+         //LOG("Calculated GOB size: %dx%d (%dx%d)", gobWidthInBytes << log2GobsPerBlockX, gobHeightInBytes << log2GobsPerBlockY, log2GobsPerBlockX, log2GobsPerBlockY);
+
+         //These two seem to be correct, but it was discovered by trial and error so I'm not 100% sure
+         uint32_t widthInBytes = ROUND_UP(plane->width * bytesPerPixel, gobWidthInBytes << log2GobsPerBlockX);
+         uint32_t alignedHeight = ROUND_UP(plane->height, gobHeightInBytes << log2GobsPerBlockY);
+
+         plane->offset = ROUND_UP(size, PLANE_ALIGNMENT);
+         plane->pitch = widthInBytes;
+         plane->size = widthInBytes * alignedHeight;
+         plane->mods = get_image_modifier(context, plane->height);
+         size = plane->offset + plane->size;
      }
+     return size;
+}
 
-     //now export the dma-buf
-     uint32_t pitchInBlocks = widthInBytes / (gobWidthInBytes << log2GobsPerBlockX);
+//nvkms only takes a single surface layout per import, so each plane imports the whole allocation with it's own
+//layout and gets a dma-buf of it's own
+static bool export_plane(NVDriverContext *context, int memFd, uint32_t size, NVDriverPlane *plane) {
+     uint32_t gobWidthInBytes = 64;
+     uint32_t log2GobsPerBlockX = 0;
+     uint32_t log2GobsPerBlockY = blockHeightForPlane(plane->height);
+     uint32_t log2GobsPerBlockZ = 0;
+     uint32_t pitchInBlocks = plane->pitch / (gobWidthInBytes << log2GobsPerBlockX);
 
      //printf("got gobsPerBlock: %ux%u %u %u %u %d\n", width, height, log2GobsPerBlockX, log2GobsPerBlockY, log2GobsPerBlockZ, pitchInBlocks);
      //duplicate the fd so we don't invalidate it by importing it
      int memFd2 = dup(memFd);
      if (memFd2 == -1) {
-         LOG("dup failed");
-         goto err;
+         LOG_ERROR("dup failed");
+         return false;
      }
 
      struct NvKmsKapiPrivImportMemoryParams nvkmsParams = {
@@ -535,14 +555,15 @@ bool alloc_memory(const NVDriverContext *context, const uint32_t size, int *fd)
      };
 
      struct drm_nvidia_gem_import_nvkms_memory_params params = {
-         .mem_size = imageSizeInBytes,
+         .mem_size = size,
          .nvkms_params_ptr = (uint64_t) &nvkmsParams,
          .nvkms_params_size = context->driverMajorVersion == 470 ? 0x20 : sizeof(nvkmsParams) //needs to be 0x20 in the 470 series driver
      };
      int drmret = ioctl(context->drmFd, DRM_IOCTL_NVIDIA_GEM_IMPORT_NVKMS_MEMORY, &params);
      if (drmret != 0) {
-         LOG("DRM_IOCTL_NVIDIA_GEM_IMPORT_NVKMS_MEMORY failed: %d %d", drmret, errno);
-         goto err;
+         LOG_ERROR("DRM_IOCTL_NVIDIA_GEM_IMPORT_NVKMS_MEMORY failed: %d %d", drmret, errno);
+         close(memFd2);
+         return false;
      }
 
      //export dma-buf
@@ -551,8 +572,9 @@ bool alloc_memory(const NVDriverContext *context, const uint32_t size, int *fd)
      };
      drmret = ioctl(context->drmFd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &prime_handle);
      if (drmret != 0) {
-         LOG("DRM_IOCTL_PRIME_HANDLE_TO_FD failed: %d %d", drmret, errno);
-         goto err;
+         LOG_ERROR("DRM_IOCTL_PRIME_HANDLE_TO_FD failed: %d %d", drmret, errno);
+         close(memFd2);
+         return false;
      }
 
      struct drm_gem_close gem_close = {
@@ -560,35 +582,118 @@ bool alloc_memory(const NVDriverContext *context, const uint32_t size, int *fd)
      };
      drmret = ioctl(context->drmFd, DRM_IOCTL_GEM_CLOSE, &gem_close);
      if (drmret != 0) {
-         LOG("DRM_IOCTL_GEM_CLOSE failed: %d %d", drmret, errno);
-         goto prime_err;
+         LOG_ERROR("DRM_IOCTL_GEM_CLOSE failed: %d %d", drmret, errno);
+         close(prime_handle.fd);
+         close(memFd2);
+         return false;
      }
 
-     image->width = width;
-     image->height = height;
-     image->nvFd = memFd;
-     image->nvFd2 = memFd2; //not sure why we can't close this one, we shouldn't need it after importing the image
-     image->drmFd = prime_handle.fd;
-     image->mods = DRM_FORMAT_MOD_NVIDIA_BLOCK_LINEAR_2D(0, context->sector_layout, context->page_kind_generation, context->generic_page_kind, log2GobsPerBlockY);
-     image->offset = 0;
-     image->pitch = widthInBytes;
-     image->memorySize = imageSizeInBytes;
-     image->fourcc = fourcc;
-
-     //LOG("created image: %dx%d %lx %d %x", width, height, image->mods, widthInBytes, imageSizeInBytes);
-
+     plane->nvFd2 = memFd2; //not sure why we can't close this one, we shouldn't need it after importing the image
+     plane->drmFd = prime_handle.fd;
      return true;
+}
 
- prime_err:
-     if (prime_handle.fd > 0) {
-         close(prime_handle.fd);
+ bool alloc_image(NVDriverContext *context, NVDriverImage *image) {
+     uint32_t size = layout_image(context, image);
+
+     //this gets us some memory, and the fd to import into cuda
+     int memFd = -1;
+     bool ret = alloc_memory(context, size, &memFd);
+     if (!ret) {
+         LOG_ERROR("alloc_memory failed");
+         return false;
      }
 
- err:
-     if (memFd > 0) {
-         close(memFd);
+     //the caller cleans up the planes that were exported if a later one fails
+     image->nvFd = memFd;
+     image->memorySize = size;
+     for (uint32_t i = 0; i < image->numPlanes; i++) {
+         if (!export_plane(context, memFd, size, &image->planes[i])) {
+             return false;
+         }
      }
 
-     return false;
+     //LOG("created image: %dx%d %lx %d %x", width, height, mods, image->planes[0].pitch, size);
+
+     return true;
  }
 
+bool import_image(NVDriverContext *context, const int *planeFds, NVDriverImage *image) {
+    uint32_t size = layout_image(context, image);
+    int dmabufFd = planeFds[0];
+
+    off_t dmabufSize = lseek(dmabufFd, 0, SEEK_END);
+    if (dmabufSize < (off_t) size) {
+        LOG_ERROR("dma-buf is %ld bytes, the image needs %u", (long) dmabufSize, size);
+        return false;
+    }
+
+    struct drm_prime_handle prime_handle = {
+        .fd = dmabufFd
+    };
+    int drmret = ioctl(context->drmFd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &prime_handle);
+    if (drmret != 0) {
+        LOG_ERROR("DRM_IOCTL_PRIME_FD_TO_HANDLE failed: %d %d", drmret, errno);
+        return false;
+    }
+    struct drm_gem_close gem_close = {
+        .handle = prime_handle.handle
+    };
+
+    //only memory nvkms allocated can be handed to RM, dma-bufs from other devices can't be
+    struct drm_nvidia_gem_identify_object_params identify = {
+        .handle = prime_handle.handle
+    };
+    if (ioctl(context->drmFd, DRM_IOCTL_NVIDIA_GEM_IDENTIFY_OBJECT, &identify) == 0 && identify.object_type != NV_GEM_OBJECT_NVKMS) {
+        LOG_ERROR("dma-buf isn't NVIDIA video memory: %d", identify.object_type);
+        goto err;
+    }
+
+    //the memory is exported into a new handle, the same way alloc_memory exports it's allocations
+    int nvctlFd2 = open("/dev/nvidiactl", O_RDWR|O_CLOEXEC);
+    if (nvctlFd2 == -1) {
+        LOG_ERROR("open /dev/nvidiactl failed")
+        goto err;
+    }
+
+    if (!nv_attach_gpus(nvctlFd2, context->gpu_id)) {
+        LOG_ERROR("nv_attach_gpus failed")
+        goto fd_err;
+    }
+
+    struct NvKmsKapiPrivExportMemoryParams nvkmsParams = {
+        .memFd = nvctlFd2
+    };
+    struct drm_nvidia_gem_export_nvkms_memory_params params = {
+        .handle = prime_handle.handle,
+        .nvkms_params_ptr = (uint64_t) &nvkmsParams,
+        .nvkms_params_size = sizeof(nvkmsParams)
+    };
+    drmret = ioctl(context->drmFd, DRM_IOCTL_NVIDIA_GEM_EXPORT_NVKMS_MEMORY, &params);
+    if (drmret != 0) {
+        LOG_ERROR("DRM_IOCTL_NVIDIA_GEM_EXPORT_NVKMS_MEMORY failed: %d %d", drmret, errno);
+        goto fd_err;
+    }
+
+    ioctl(context->drmFd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+
+    image->nvFd = nvctlFd2;
+    image->memorySize = (uint32_t) dmabufSize;
+    //the caller cleans up the planes that were dup'd if a later one fails
+    for (uint32_t i = 0; i < image->numPlanes; i++) {
+        image->planes[i].drmFd = dup(planeFds[i]);
+        if (image->planes[i].drmFd == -1) {
+            LOG_ERROR("dup failed");
+            image->planes[i].drmFd = 0;
+            return false;
+        }
+    }
+    return true;
+
+ fd_err:
+    close(nvctlFd2);
+
+ err:
+    ioctl(context->drmFd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+    return false;
+}
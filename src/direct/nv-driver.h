@@ -9,6 +9,9 @@
 
 #define ROUND_UP(N, S) ((((N) + (S) - 1) / (S)) * (S))
 
+//planes sharing an allocation start on a big page boundary
+#define PLANE_ALIGNMENT (64 * 1024)
+
 typedef struct {
     int nvctlFd;
     int nv0Fd;
@@ -25,23 +28,40 @@ typedef struct {
     uint32_t sector_layout;
 } NVDriverContext;
 
+//the layout of a single plane within an NVDriverImage
 typedef struct {
-    int nvFd;
-    int nvFd2;
-    int drmFd;
+    //filled in by the caller
     uint32_t width;
     uint32_t height;
+    uint8_t channels;
+    uint8_t bitsPerChannel;
+    uint32_t fourcc;
+    //filled in by alloc_image
     uint64_t mods;
-    uint32_t memorySize;
     uint32_t offset;
     uint32_t pitch;
-    uint32_t fourcc;
+    uint32_t size;
+    int nvFd2;
+    int drmFd;  //a dma-buf of the whole allocation, carrying this plane's layout
+} NVDriverPlane;
+
+typedef struct {
+    int nvFd;
+    uint32_t memorySize;
+    uint32_t numPlanes;
+    NVDriverPlane planes[3];
 } NVDriverImage;
 
 bool init_nvdriver(NVDriverContext *context, int drmFd);
 bool free_nvdriver(NVDriverContext *context);
 bool get_device_uuid(const NVDriverContext *context, uint8_t uuid[16]);
 bool alloc_memory(const NVDriverContext *context, uint32_t size, int *fd);
-bool alloc_image(NVDriverContext *context, uint32_t width, uint32_t height, uint8_t channels, uint8_t bytesPerChannel, uint32_t fourcc, NVDriverImage *image);
+bool alloc_image(NVDriverContext *context, NVDriverImage *image);
+//wraps an existing dma-buf of NVIDIA memory as an image, laying the planes out as alloc_image would. The memory is
+//taken from the first plane's fd, the others have to be of the same allocation. The dma-buf must already be laid out
+//that way, the caller has to check the planes against whatever described it
+bool import_image(NVDriverContext *context, const int *planeFds, NVDriverImage *image);
+//the modifier alloc_image gives a plane this high
+uint64_t get_image_modifier(const NVDriverContext *context, uint32_t height);
 
 #endif
@@ -6,6 +6,7 @@
 #include <EGL/eglext.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/param.h>
 #include <fcntl.h>
 #include <unistd.h>
 #ifdef __linux__
@@ -68,7 +69,7 @@ static void egl_releaseExporter(NVDriver *drv) {
         drv->numFramesPresented--;
         for (int i = 0; i < 3; i++) {
             if (eglframe.frame.pArray[i] != NULL) {
-                LOG("Cleaning up CUDA array %p (%d outstanding)", eglframe.frame.pArray[i], drv->numFramesPresented);
+                LOG_TRACE("Cleaning up CUDA array %p (%d outstanding)", eglframe.frame.pArray[i], drv->numFramesPresented);
                 drv->cu->cuArrayDestroy(eglframe.frame.pArray[i]);
                 eglframe.frame.pArray[i] = NULL;
             }
@@ -164,7 +165,7 @@ static void findGPUIndexFromFd(NVDriver *drv) {
         if (drmRenderNodeFile != NULL) {
             //if we have one, try and get the CUDA device id
             if (eglQueryDeviceAttribEXT(devices[i], EGL_CUDA_DEVICE_NV, &attr)) {
-                LOG("Got EGL_CUDA_DEVICE_NV value '%d' for EGLDevice %d", attr, i);
+                LOG("Got EGL_CUDA_DEVICE_NV value '%ld' for EGLDevice %d", (long) attr, i);
 
                 //if we're looking for a matching drm device index check it here
                 if (drv->cudaGpuId == -1 && drv->drmFd != -1) {
@@ -270,7 +271,7 @@ static bool exportBackingImage(NVDriver *drv, BackingImage *img) {
         return false;
     }
 
-    LOG("eglExportDMABUFImageQueryMESA: %p %.4s (%x) planes:%d mods:%lx %lx", img, (char*)&img->fourcc, img->fourcc, planes, img->mods[0], img->mods[1]);
+    LOG_TRACE("eglExportDMABUFImageQueryMESA: %p %.4s (%x) planes:%d mods:%lx %lx", img, (char*)&img->fourcc, img->fourcc, planes, img->mods[0], img->mods[1]);
     EGLBoolean r = eglExportDMABUFImageMESA(drv->eglDisplay, img->image, img->fds, img->strides, img->offsets);
     //LOG("Offset/Pitch: %d %d %d %d", surface->offsets[0], surface->offsets[1], surface->strides[0], surface->strides[1]);
 
@@ -281,6 +282,10 @@ static bool exportBackingImage(NVDriver *drv, BackingImage *img) {
     return true;
 }
 
+static uint64_t imageSize(const BackingImage *img) {
+    return (uint64_t) img->size[0] + img->size[1];
+}
+
 static BackingImage* createBackingImage(NVDriver *drv, uint32_t width, uint32_t height, EGLImage image, CUarray arrays[]) {
     BackingImage* img = (BackingImage*) calloc(1, sizeof(BackingImage));
     img->image = image;
@@ -294,6 +299,9 @@ static BackingImage* createBackingImage(NVDriver *drv, uint32_t width, uint32_t
         free(img);
         return NULL;
     }
+    img->size[0] = img->strides[0] * height;
+    img->size[1] = img->strides[1] * (height >> 1);
+    vramAccount(drv, NV_VRAM_IMAGES, imageSize(img));
 
     return img;
 }
@@ -305,7 +313,8 @@ static bool egl_destroyBackingImage(NVDriver *drv, BackingImage *img) {
         img->surface->backingImage = NULL;
     }
 
-    LOG("Destroying BackingImage: %p", img);
+    LOG_TRACE("Destroying BackingImage: %p", img);
+    vramAccount(drv, NV_VRAM_IMAGES, -(int64_t) imageSize(img));
     for (int i = 0; i < 4; i++) {
         if (img->fds[i] != 0) {
             close(img->fds[i]);
@@ -333,25 +342,29 @@ static void egl_detachBackingImageFromSurface(NVDriver *drv, NVSurface *surface)
         return;
     }
 
-    if (surface->backingImage->fourcc == DRM_FORMAT_NV21) {
-        if (!egl_destroyBackingImage(drv, surface->backingImage)) {
-            LOG("Unable to destroy backing image");
-        }
-    } else {
-        pthread_mutex_lock(&drv->imagesMutex);
-
-        ARRAY_FOR_EACH(BackingImage*, img, &drv->images)
-            //find the entry for this surface
-            if (img->surface == surface) {
-                LOG("Detaching BackingImage %p from Surface %p", img, surface);
+    //an exported image may still be on screen, so reusing it would show another surface's frames in it
+    BackingImage *detached = surface->backingImage;
+    bool recycle = detached->fourcc != DRM_FORMAT_NV21 && (!detached->handedOut || drv->poolExportedImages);
+    pthread_mutex_lock(&drv->imagesMutex);
+    ARRAY_FOR_EACH(BackingImage*, img, &drv->images)
+        //find the entry for this surface
+        if (img == detached) {
+            if (recycle) {
+                LOG_TRACE("Detaching BackingImage %p from Surface %p", img, surface);
                 img->surface = NULL;
-                break;
+                img->lastUsed = ++drv->imagePoolClock;
+                vramAccount(drv, NV_VRAM_POOLED, imageSize(img));
+            } else {
+                remove_element_at(&drv->images, img_idx);
             }
-        END_FOR_EACH
+            break;
+        }
+    END_FOR_EACH
+    pthread_mutex_unlock(&drv->imagesMutex);
 
-        pthread_mutex_unlock(&drv->imagesMutex);
+    if (!recycle && !egl_destroyBackingImage(drv, detached)) {
+        LOG("Unable to destroy backing image");
     }
-
     surface->backingImage = NULL;
 }
 
@@ -359,6 +372,9 @@ static void egl_destroyAllBackingImage(NVDriver *drv) {
     pthread_mutex_lock(&drv->imagesMutex);
 
     ARRAY_FOR_EACH_REV(BackingImage*, it, &drv->images)
+        if (it->surface == NULL) {
+            vramAccount(drv, NV_VRAM_POOLED, -(int64_t) imageSize(it));
+        }
         egl_destroyBackingImage(drv, it);
         remove_element_at(&drv->images, it_idx);
     END_FOR_EACH
@@ -366,14 +382,41 @@ static void egl_destroyAllBackingImage(NVDriver *drv) {
     pthread_mutex_unlock(&drv->imagesMutex);
 }
 
+static uint64_t egl_evictBackingImages(NVDriver *drv, uint64_t bytes) {
+    uint64_t freed = 0;
+    pthread_mutex_lock(&drv->imagesMutex);
+    while (freed < bytes) {
+        BackingImage *oldest = NULL;
+        uint32_t oldestIdx = 0;
+        ARRAY_FOR_EACH(BackingImage*, img, &drv->images)
+            if (img->surface == NULL && (oldest == NULL || img->lastUsed < oldest->lastUsed)) {
+                oldest = img;
+                oldestIdx = img_idx;
+            }
+        END_FOR_EACH
+        if (oldest == NULL) {
+            break;
+        }
+
+        LOG_TRACE("Evicting BackingImage %p from pool", oldest);
+        freed += imageSize(oldest);
+        vramAccount(drv, NV_VRAM_POOLED, -(int64_t) imageSize(oldest));
+        remove_element_at(&drv->images, oldestIdx);
+        egl_destroyBackingImage(drv, oldest);
+    }
+    pthread_mutex_unlock(&drv->imagesMutex);
+    return freed;
+}
+
 static BackingImage* findFreeBackingImage(NVDriver *drv, NVSurface *surface) {
     BackingImage *ret = NULL;
     pthread_mutex_lock(&drv->imagesMutex);
     //look through the free'd surfaces and see if we can reuse one
     ARRAY_FOR_EACH(BackingImage*, img, &drv->images)
         if (img->surface == NULL && img->width == surface->width && img->height == surface->height) {
-            LOG("Using BackingImage %p for Surface %p", img, surface);
+            LOG_TRACE("Using BackingImage %p for Surface %p", img, surface);
             egl_attachBackingImageToSurface(surface, img);
+            vramAccount(drv, NV_VRAM_POOLED, -(int64_t) imageSize(img));
             ret = img;
             break;
         }
@@ -383,8 +426,12 @@ static BackingImage* findFreeBackingImage(NVDriver *drv, NVSurface *surface) {
 }
 
 
-static BackingImage *egl_allocateBackingImage(NVDriver *drv, const NVSurface *surface) {
-    CUeglFrame eglframe = {
+//frames presented to the stream by one allocation at most, enough for every surface of a context
+#define MAX_FRAME_BATCH 32
+
+//fills in the frame's format and creates it's arrays, which doesn't need exportMutex
+static bool createFrame(NVDriver *drv, const NVSurface *surface, CUeglFrame *eglframe) {
+    *eglframe = (CUeglFrame) {
         .width = surface->width,
         .height = surface->height,
         .depth = 1,
@@ -395,52 +442,59 @@ static BackingImage *egl_allocateBackingImage(NVDriver *drv, const NVSurface *su
     };
 
     if (surface->format == cudaVideoSurfaceFormat_NV12) {
-        eglframe.eglColorFormat = drv->useCorrectNV12Format ? CU_EGL_COLOR_FORMAT_YUV420_SEMIPLANAR :
-                                                              CU_EGL_COLOR_FORMAT_YVU420_SEMIPLANAR;
-        eglframe.cuFormat = CU_AD_FORMAT_UNSIGNED_INT8;
+        eglframe->eglColorFormat = drv->useCorrectNV12Format ? CU_EGL_COLOR_FORMAT_YUV420_SEMIPLANAR :
+                                                               CU_EGL_COLOR_FORMAT_YVU420_SEMIPLANAR;
+        eglframe->cuFormat = CU_AD_FORMAT_UNSIGNED_INT8;
     } else if (surface->format == cudaVideoSurfaceFormat_P016) {
         if (surface->bitDepth == 10) {
-            eglframe.eglColorFormat = CU_EGL_COLOR_FORMAT_Y10V10U10_420_SEMIPLANAR;
+            eglframe->eglColorFormat = CU_EGL_COLOR_FORMAT_Y10V10U10_420_SEMIPLANAR;
         } else if (surface->bitDepth == 12) {
             // Logically, we should use the explicit 12bit format here, but it fails
             // to export to a dmabuf if we do. In practice, that should be fine as the
             // data is still stored in 16 bits and they (surely?) aren't going to
             // zero out the extra bits.
-            // eglframe.eglColorFormat = CU_EGL_COLOR_FORMAT_Y12V12U12_420_SEMIPLANAR;
-            eglframe.eglColorFormat = CU_EGL_COLOR_FORMAT_Y10V10U10_420_SEMIPLANAR;
+            // eglframe->eglColorFormat = CU_EGL_COLOR_FORMAT_Y12V12U12_420_SEMIPLANAR;
+            eglframe->eglColorFormat = CU_EGL_COLOR_FORMAT_Y10V10U10_420_SEMIPLANAR;
         } else {
             LOG("Unknown bitdepth");
         }
-        eglframe.cuFormat = CU_AD_FORMAT_UNSIGNED_INT16;
+        eglframe->cuFormat = CU_AD_FORMAT_UNSIGNED_INT16;
     }
     CUDA_ARRAY3D_DESCRIPTOR arrDesc = {
-        .Width = eglframe.width,
-        .Height = eglframe.height,
+        .Width = eglframe->width,
+        .Height = eglframe->height,
         .Depth = 0,
         .NumChannels = 1,
         .Flags = 0,
-        .Format = eglframe.cuFormat
+        .Format = eglframe->cuFormat
     };
     CUDA_ARRAY3D_DESCRIPTOR arr2Desc = {
-        .Width = eglframe.width >> 1,
-        .Height = eglframe.height >> 1,
+        .Width = eglframe->width >> 1,
+        .Height = eglframe->height >> 1,
         .Depth = 0,
         .NumChannels = 2,
         .Flags = 0,
-        .Format = eglframe.cuFormat
+        .Format = eglframe->cuFormat
     };
-    CHECK_CUDA_RESULT_RETURN(drv->cu->cuArray3DCreate(&eglframe.frame.pArray[0], &arrDesc), NULL);
-    CHECK_CUDA_RESULT_RETURN(drv->cu->cuArray3DCreate(&eglframe.frame.pArray[1], &arr2Desc), NULL);
-
-    pthread_mutex_lock(&drv->exportMutex);
+    CHECK_CUDA_RESULT_RETURN(drv->cu->cuArray3DCreate(&eglframe->frame.pArray[0], &arrDesc), false);
+    if (CHECK_CUDA_RESULT(drv->cu->cuArray3DCreate(&eglframe->frame.pArray[1], &arr2Desc))) {
+        CHECK_CUDA_RESULT(drv->cu->cuArrayDestroy(eglframe->frame.pArray[0]));
+        return false;
+    }
+    return true;
+}
 
-    LOG("Presenting frame %d %dx%d (%p, %p, %p)", surface->pictureIdx, eglframe.width, eglframe.height, surface, eglframe.frame.pArray[0], eglframe.frame.pArray[1]);
-    if (CHECK_CUDA_RESULT(drv->cu->cuEGLStreamProducerPresentFrame( &drv->cuStreamConnection, eglframe, NULL))) {
+//hands the frame to the stream and makes a backing image out of what comes back.
+//must be called with exportMutex held
+static BackingImage *presentFrame(NVDriver *drv, const NVSurface *surface, CUeglFrame *eglframe) {
+    LOG_TRACE("Presenting frame %d %dx%d (%p, %p, %p)", surface->pictureIdx, eglframe->width, eglframe->height, surface, eglframe->frame.pArray[0], eglframe->frame.pArray[1]);
+    if (CHECK_CUDA_RESULT(drv->cu->cuEGLStreamProducerPresentFrame( &drv->cuStreamConnection, *eglframe, NULL))) {
         //if we got an error here, try to reconnect to the EGLStream
         if (!reconnect(drv) ||
-            CHECK_CUDA_RESULT(drv->cu->cuEGLStreamProducerPresentFrame( &drv->cuStreamConnection, eglframe, NULL))) {
-            pthread_mutex_unlock(&drv->exportMutex);
-
+            CHECK_CUDA_RESULT(drv->cu->cuEGLStreamProducerPresentFrame( &drv->cuStreamConnection, *eglframe, NULL))) {
+            //the stream never took them, so they're still ours
+            CHECK_CUDA_RESULT(drv->cu->cuArrayDestroy(eglframe->frame.pArray[0]));
+            CHECK_CUDA_RESULT(drv->cu->cuArrayDestroy(eglframe->frame.pArray[1]));
             return NULL;
         }
     }
@@ -456,30 +510,97 @@ static BackingImage *egl_allocateBackingImage(NVDriver *drv, const NVSurface *su
 
         if (event == EGL_STREAM_IMAGE_ADD_NV) {
             EGLImage image = eglCreateImage(drv->eglDisplay, EGL_NO_CONTEXT, EGL_STREAM_CONSUMER_IMAGE_NV, drv->eglStream, NULL);
-            LOG("Adding frame from EGLStream: %p", image);
+            LOG_TRACE("Adding frame from EGLStream: %p", image);
         } else if (event == EGL_STREAM_IMAGE_REMOVE_NV) {
             //Not sure if this is ever called
             eglDestroyImage(drv->eglDisplay, (EGLImage) aux);
-            LOG("Removing frame from EGLStream: %p", aux);
+            LOG_TRACE("Removing frame from EGLStream: %p", (void*) aux);
         } else if (event == EGL_STREAM_IMAGE_AVAILABLE_NV) {
             EGLImage img;
             if (!eglStreamAcquireImageNV(drv->eglDisplay, drv->eglStream, &img, EGL_NO_SYNC_NV)) {
                 LOG("eglStreamAcquireImageNV failed");
                 break;
             }
-            LOG("Acquired image from EGLStream: %p", img);
+            LOG_TRACE("Acquired image from EGLStream: %p", img);
 
-            ret = createBackingImage(drv, surface->width, surface->height, img, eglframe.frame.pArray);
+            ret = createBackingImage(drv, surface->width, surface->height, img, eglframe->frame.pArray);
         } else {
             LOG("Unhandled event: %X", event);
         }
     }
 
-    pthread_mutex_unlock(&drv->exportMutex);
     return ret;
 }
 
-static bool copyFrameToSurface(NVDriver *drv, CUdeviceptr ptr, NVSurface *surface, uint32_t pitch) {
+//how many images this size the surface's context could still want. Any that already exist, attached or not, are
+//assumed to be it's
+static int frameBatchSize(NVDriver *drv, const NVSurface *surface) {
+    int wanted = surface->context != NULL ? surface->context->surfaceCount : 1;
+    pthread_mutex_lock(&drv->imagesMutex);
+    ARRAY_FOR_EACH(BackingImage*, img, &drv->images)
+        if (img->width == surface->width && img->height == surface->height) {
+            wanted--;
+        }
+    END_FOR_EACH
+    pthread_mutex_unlock(&drv->imagesMutex);
+    return MIN(MAX(wanted, 1), MAX_FRAME_BATCH);
+}
+
+//Every frame goes through the one EGLStream, so has to hold exportMutex for the round trip. Rather than doing that
+//for each surface, the first surface of a size allocates enough for the rest of it's context and puts them all in
+//the pool, where the others will find them without touching the stream.
+static bool egl_allocateBackingImages(NVDriver *drv, const NVSurface *surface, bool retrying) {
+    int count = frameBatchSize(drv, surface);
+    //an estimate, the exported images' real pitch isn't known yet
+    int bpp = surface->format == cudaVideoSurfaceFormat_NV12 ? 1 : 2;
+    vramMakeRoom(drv, (uint64_t) count * surface->width * surface->height * bpp * 3 / 2);
+
+    CUeglFrame frames[MAX_FRAME_BATCH];
+    int created = 0;
+    while (created < count && createFrame(drv, surface, &frames[created])) {
+        created++;
+    }
+
+    BackingImage *images[MAX_FRAME_BATCH];
+    int made = 0;
+    pthread_mutex_lock(&drv->exportMutex);
+    for (int i = 0; i < created; i++) {
+        images[made] = presentFrame(drv, surface, &frames[i]);
+        if (images[made] != NULL) {
+            made++;
+        }
+    }
+    pthread_mutex_unlock(&drv->exportMutex);
+    LOG("Allocated %d backing images of %ux%u", made, surface->width, surface->height);
+
+    if (made > 0 && images[0]->fourcc == DRM_FORMAT_NV21) {
+        if (!retrying) {
+            LOG("Detected NV12/NV21 NVIDIA driver bug, attempting to work around");
+            //free the old images to prevent leaking them
+            for (int i = 0; i < made; i++) {
+                if (!egl_destroyBackingImage(drv, images[i])) {
+                    LOG("Unable to destroy backing image");
+                }
+            }
+            //this is a caused by a bug in old versions the driver that was fixed in the 510 series
+            drv->useCorrectNV12Format = !drv->useCorrectNV12Format;
+            //re-export the frames in the correct format
+            return egl_allocateBackingImages(drv, surface, true);
+        }
+        LOG("Work around unsuccessful");
+    }
+
+    pthread_mutex_lock(&drv->imagesMutex);
+    for (int i = 0; i < made; i++) {
+        images[i]->lastUsed = ++drv->imagePoolClock;
+        vramAccount(drv, NV_VRAM_POOLED, imageSize(images[i]));
+        add_element(&drv->images, images[i]);
+    }
+    pthread_mutex_unlock(&drv->imagesMutex);
+    return made > 0;
+}
+
+static bool copyFrameToSurface(NVDriver *drv, CUdeviceptr ptr, NVSurface *surface, uint32_t pitch, CUstream stream) {
     int bpp = surface->format == cudaVideoSurfaceFormat_NV12 ? 1 : 2;
     CUDA_MEMCPY2D cpy = {
         .srcMemoryType = CU_MEMORYTYPE_DEVICE,
@@ -490,7 +611,7 @@ static bool copyFrameToSurface(NVDriver *drv, CUdeviceptr ptr, NVSurface *surfac
         .Height = surface->height,
         .WidthInBytes = surface->width * bpp
     };
-    CHECK_CUDA_RESULT_RETURN(drv->cu->cuMemcpy2DAsync(&cpy, 0), false);
+    CHECK_CUDA_RESULT_RETURN(drv->cu->cuMemcpy2DAsync(&cpy, stream), false);
     CUDA_MEMCPY2D cpy2 = {
         .srcMemoryType = CU_MEMORYTYPE_DEVICE,
         .srcDevice = ptr,
@@ -501,13 +622,7 @@ static bool copyFrameToSurface(NVDriver *drv, CUdeviceptr ptr, NVSurface *surfac
         .Height = surface->height >> 1,
         .WidthInBytes = surface->width * bpp
     };
-    CHECK_CUDA_RESULT_RETURN(drv->cu->cuMemcpy2D(&cpy2), false);
-
-    //notify anyone waiting for us to be resolved
-    pthread_mutex_lock(&surface->mutex);
-    surface->resolving = 0;
-    pthread_cond_signal(&surface->cond);
-    pthread_mutex_unlock(&surface->mutex);
+    CHECK_CUDA_RESULT_RETURN(drv->cu->cuMemcpy2DAsync(&cpy2, stream), false);
 
     return true;
 }
@@ -517,41 +632,16 @@ static bool egl_realiseSurface(NVDriver *drv, NVSurface *surface) {
     pthread_mutex_lock(&surface->mutex);
     //check again to see if it's just been created
     if (surface->backingImage == NULL) {
-        //try to find a free surface
+        //try to find a free surface, allocating a batch if there isn't one. Another surface can take the one that
+        //was meant for this, in which case there's a second go
         BackingImage *img = findFreeBackingImage(drv, surface);
-
-        //if we can't find a free backing image...
+        for (int attempt = 0; img == NULL && attempt < 2 && egl_allocateBackingImages(drv, surface, false); attempt++) {
+            img = findFreeBackingImage(drv, surface);
+        }
         if (img == NULL) {
-            LOG("No free surfaces found");
-
-            //...allocate one
-            img = egl_allocateBackingImage(drv, surface);
-            if (img == NULL) {
-                LOG("Unable to realise surface: %p (%d)", surface, surface->pictureIdx)
-                pthread_mutex_unlock(&surface->mutex);
-                return false;
-            }
-
-            if (img->fourcc == DRM_FORMAT_NV21) {
-                LOG("Detected NV12/NV21 NVIDIA driver bug, attempting to work around");
-                //free the old surface to prevent leaking them
-                if (!egl_destroyBackingImage(drv, img)) {
-                    LOG("Unable to destroy backing image");
-                }
-                //this is a caused by a bug in old versions the driver that was fixed in the 510 series
-                drv->useCorrectNV12Format = !drv->useCorrectNV12Format;
-                //re-export the frame in the correct format
-                img = egl_allocateBackingImage(drv, surface);
-                if (img->fourcc != DRM_FORMAT_NV12) {
-                    LOG("Work around unsuccessful");
-                }
-            }
-
-            egl_attachBackingImageToSurface(surface, img);
-            //add our newly created BackingImage to the list
-            pthread_mutex_lock(&drv->imagesMutex);
-            add_element(&drv->images, img);
-            pthread_mutex_unlock(&drv->imagesMutex);
+            LOG("Unable to realise surface: %p (%d)", surface, surface->pictureIdx)
+            pthread_mutex_unlock(&surface->mutex);
+            return false;
         }
     }
     pthread_mutex_unlock(&surface->mutex);
@@ -559,12 +649,12 @@ static bool egl_realiseSurface(NVDriver *drv, NVSurface *surface) {
     return true;
 }
 
-static bool egl_exportCudaPtr(NVDriver *drv, CUdeviceptr ptr, NVSurface *surface, uint32_t pitch) {
+static bool egl_exportCudaPtr(NVDriver *drv, CUdeviceptr ptr, NVSurface *surface, uint32_t pitch, CUstream stream) {
     if (!egl_realiseSurface(drv, surface)) {
         return false;
     }
 
-    if (ptr != 0 && !copyFrameToSurface(drv, ptr, surface, pitch)) {
+    if (ptr != 0 && !copyFrameToSurface(drv, ptr, surface, pitch, stream)) {
         LOG("Unable to update surface from frame");
         return false;
     } else if (ptr == 0) {
@@ -576,6 +666,7 @@ static bool egl_exportCudaPtr(NVDriver *drv, CUdeviceptr ptr, NVSurface *surface
 
 static bool egl_fillExportDescriptor(NVDriver *drv, NVSurface *surface, VADRMPRIMESurfaceDescriptor *desc) {
     BackingImage *img = surface->backingImage;
+    img->handedOut = true;
 
     int bpp = img->fourcc == DRM_FORMAT_NV12 ? 1 : 2;
 
@@ -617,5 +708,6 @@ const NVBackend EGL_BACKEND = {
     .detachBackingImageFromSurface = egl_detachBackingImageFromSurface,
     .realiseSurface = egl_realiseSurface,
     .fillExportDescriptor = egl_fillExportDescriptor,
-    .destroyAllBackingImage = egl_destroyAllBackingImage
+    .destroyAllBackingImage = egl_destroyAllBackingImage,
+    .evictBackingImages = egl_evictBackingImages
 };
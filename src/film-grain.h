@@ -0,0 +1,64 @@
+#ifndef FILM_GRAIN_H
+#define FILM_GRAIN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <va/va.h>
+
+//AV1 film grain synthesis (section 7.18.3 of the spec) for NVD_AV1_FILM_GRAIN=driver, where NVDEC outputs the clean
+//frame and the grain is added as it's copied out. The grain templates, the random offset of each 32x32 block and the
+//scaling functions only depend on the picture's parameters and size, so they're generated here on the host and the
+//kernels in kernels.c just look them up for every sample.
+
+//NVDEC's largest AV1 frame, which bounds the number of blocks
+#define FILM_GRAIN_MAX_WIDTH    8192
+#define FILM_GRAIN_MAX_HEIGHT   8192
+#define FILM_GRAIN_MAX_OFFSETS  ((FILM_GRAIN_MAX_WIDTH / 32) * (FILM_GRAIN_MAX_HEIGHT / 32))
+
+#define FILM_GRAIN_LUMA_WIDTH       82
+#define FILM_GRAIN_LUMA_HEIGHT      73
+//only 4:2:0 frames are synthesised by the driver
+#define FILM_GRAIN_CHROMA_WIDTH     44
+#define FILM_GRAIN_CHROMA_HEIGHT    38
+
+//what's needed from the picture to synthesise it's grain, kept with the surface until it's resolved
+typedef struct {
+    VAFilmGrainStructAV1    info;
+    uint32_t                bitDepth;
+    uint32_t                width;              //of the upscaled frame, the blocks are laid out over it
+    uint32_t                height;
+    bool                    identityMatrix;     //matrix_coefficients is MC_IDENTITY, so chroma is clipped like luma
+} NVFilmGrainParams;
+
+//uploaded to the device as it is, the kernels read the fields at fixed offsets so the layout mustn't change
+typedef struct {
+    int32_t     blocksPerStripe;    //the offsets of each stripe of 32 rows are this far apart
+    int32_t     overlap;
+    int32_t     scalingShift;
+    int32_t     grainMin;
+    int32_t     grainMax;
+    int32_t     maxSample;
+    //Y, Cb and Cr. Planes without grain are given the full range, so they come out as they went in
+    int32_t     clipMin[3];
+    int32_t     clipMax[3];
+    //Cb and Cr are scaled by ((lumaMult * luma + mult * chroma) >> 6) + offset, which is just luma when the chroma
+    //scaling is taken from it
+    int32_t     lumaMult[2];
+    int32_t     mult[2];
+    int32_t     offset[2];
+    int16_t     lumaGrain[FILM_GRAIN_LUMA_HEIGHT][FILM_GRAIN_LUMA_WIDTH];
+    int16_t     cbGrain[FILM_GRAIN_CHROMA_HEIGHT][FILM_GRAIN_CHROMA_WIDTH];
+    int16_t     crGrain[FILM_GRAIN_CHROMA_HEIGHT][FILM_GRAIN_CHROMA_WIDTH];
+    //indexed by sample at the frame's bit depth, with the interpolation above 8-bit already done
+    uint8_t     scaling[3][4096];
+    //the random value each block's offsets into the templates come from, a row of blocksPerStripe for each stripe.
+    //Only as many as the frame has are uploaded
+    uint8_t     offsets[FILM_GRAIN_MAX_OFFSETS];
+} NVFilmGrainTables;
+
+//fills in tables for a 4:2:0 frame of the params' size, returning how many bytes of it the kernels need, or 0 if
+//the frame is too big
+size_t generateFilmGrain(const NVFilmGrainParams *params, NVFilmGrainTables *tables);
+
+#endif // FILM_GRAIN_H
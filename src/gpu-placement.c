@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+
+#include "gpu-placement.h"
+#include "backend-common.h"
+#include "vabackend.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+//the direct backend looks through the same range of render nodes
+#define FIRST_RENDER_NODE   128
+#define MAX_RENDER_NODES    16
+
+typedef struct {
+    int     minor;
+    int     numaNode;
+    char    pciAddress[32];
+} NVRenderNode;
+
+bool parseGpuPlacement(const char *name, NVGpuPlacement *policy) {
+    if (strcmp(name, "none") == 0) {
+        *policy = NV_PLACEMENT_NONE;
+    } else if (strcmp(name, "round-robin") == 0) {
+        *policy = NV_PLACEMENT_ROUND_ROBIN;
+    } else if (strcmp(name, "least-loaded") == 0) {
+        *policy = NV_PLACEMENT_LEAST_LOADED;
+    } else if (strcmp(name, "numa") == 0) {
+        *policy = NV_PLACEMENT_NUMA;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static int readSysfsInt(const char *path, int fallback) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return fallback;
+    }
+    int value;
+    if (fscanf(f, "%d", &value) != 1) {
+        value = fallback;
+    }
+    fclose(f);
+    return value;
+}
+
+//finds the render nodes of the NVIDIA GPUs that can be used, in the order NVD_GPU counts them
+static int findRenderNodes(NVRenderNode nodes[MAX_RENDER_NODES]) {
+    int count = 0;
+    for (int minor = FIRST_RENDER_NODE; minor < FIRST_RENDER_NODE + MAX_RENDER_NODES; minor++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "/dev/dri/renderD%d", minor);
+        int fd = open(path, O_RDWR|O_CLOEXEC);
+        if (fd == -1) {
+            break;
+        }
+        bool usable = isNvidiaDrmFd(fd, false) && checkModesetParameterFromFd(fd);
+        close(fd);
+        if (!usable) {
+            continue;
+        }
+
+        NVRenderNode *node = &nodes[count++];
+        node->minor = minor;
+        snprintf(path, sizeof(path), "/sys/class/drm/renderD%d/device/numa_node", minor);
+        node->numaNode = readSysfsInt(path, -1);
+        //the device link points at the PCI device, which is named after its address
+        snprintf(path, sizeof(path), "/sys/class/drm/renderD%d/device", minor);
+        char target[PATH_MAX];
+        node->pciAddress[0] = '\0';
+        if (realpath(path, target) != NULL) {
+            const char *name = strrchr(target, '/');
+            snprintf(node->pciAddress, sizeof(node->pciAddress), "%s", name != NULL ? name + 1 : target);
+        }
+    }
+    return count;
+}
+
+//a number that goes up by one every time it's taken, shared by all the processes of the user so they spread out
+//over the GPUs between them. If the counter file can't be used each process at least starts somewhere different
+static unsigned int takePlacementTicket(void) {
+    char path[PATH_MAX];
+    const char *runtimeDir = getenv("XDG_RUNTIME_DIR");
+    if (runtimeDir != NULL && runtimeDir[0] == '/') {
+        snprintf(path, sizeof(path), "%s/nvidia-vaapi-driver-placement", runtimeDir);
+    } else {
+        snprintf(path, sizeof(path), "/tmp/nvidia-vaapi-driver-placement-%u", (unsigned int) getuid());
+    }
+    int fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return (unsigned int) getpid();
+    }
+    unsigned int ticket = 0;
+    if (flock(fd, LOCK_EX) == 0) {
+        if (pread(fd, &ticket, sizeof(ticket), 0) != sizeof(ticket)) {
+            ticket = 0;
+        }
+        unsigned int next = ticket + 1;
+        if (pwrite(fd, &next, sizeof(next), 0) != sizeof(next)) {
+            LOG("Unable to update GPU placement counter %s", path);
+        }
+        flock(fd, LOCK_UN);
+    } else {
+        ticket = (unsigned int) getpid();
+    }
+    close(fd);
+    return ticket;
+}
+
+//NUMA node of the CPU the calling thread is running on, or -1 if it isn't known
+static int currentNumaNode(void) {
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+        return -1;
+    }
+    return (int) node;
+}
+
+//free VRAM of the CUDA device at the PCI address. Retaining the primary context is cheap if the process already uses
+//the GPU, otherwise it creates one briefly, which is the cost of picking the least loaded GPU
+static bool freeDeviceMemory(CudaFunctions *cu, CudaExtraFunctions *cux, const char *pciAddress, size_t *freeMemory) {
+    int deviceCount = 0;
+    if (pciAddress[0] == '\0' || CHECK_CUDA_RESULT(cu->cuDeviceGetCount(&deviceCount))) {
+        return false;
+    }
+    for (int i = 0; i < deviceCount; i++) {
+        char busId[32];
+        if (CHECK_CUDA_RESULT(cux->cuDeviceGetPCIBusId(busId, sizeof(busId), i)) || strcasecmp(busId, pciAddress) != 0) {
+            continue;
+        }
+        CUcontext context;
+        if (CHECK_CUDA_RESULT(cu->cuDevicePrimaryCtxRetain(&context, i))) {
+            return false;
+        }
+        size_t total = 0;
+        bool ret = !CHECK_CUDA_RESULT(cu->cuCtxPushCurrent(context));
+        if (ret) {
+            ret = !CHECK_CUDA_RESULT(cux->cuMemGetInfo(freeMemory, &total));
+            CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+        }
+        CHECK_CUDA_RESULT(cu->cuDevicePrimaryCtxRelease(i));
+        return ret;
+    }
+    return false;
+}
+
+//the GPU with the most free memory, starting from a different one each time so GPUs that tie share the work
+static int leastLoadedGpu(CudaFunctions *cu, CudaExtraFunctions *cux, const NVRenderNode *nodes, int count, unsigned int ticket) {
+    int chosen = -1;
+    size_t mostFree = 0;
+    for (int n = 0; n < count; n++) {
+        int i = (int) ((ticket + (unsigned int) n) % (unsigned int) count);
+        size_t freeMemory = 0;
+        if (!freeDeviceMemory(cu, cux, nodes[i].pciAddress, &freeMemory)) {
+            continue;
+        }
+        LOG("GPU %d (%s) has %zu MiB free", i, nodes[i].pciAddress, freeMemory >> 20);
+        if (chosen == -1 || freeMemory > mostFree) {
+            chosen = i;
+            mostFree = freeMemory;
+        }
+    }
+    return chosen;
+}
+
+//takes turns between the GPUs attached to the thread's NUMA node
+static int numaLocalGpu(const NVRenderNode *nodes, int count, unsigned int ticket) {
+    int numaNode = currentNumaNode();
+    int local[MAX_RENDER_NODES];
+    int localCount = 0;
+    for (int i = 0; i < count; i++) {
+        if (numaNode != -1 && nodes[i].numaNode == numaNode) {
+            local[localCount++] = i;
+        }
+    }
+    if (localCount == 0) {
+        LOG("No GPU is attached to NUMA node %d, placing round robin", numaNode);
+        return -1;
+    }
+    return local[ticket % (unsigned int) localCount];
+}
+
+int placeGpu(NVGpuPlacement policy, CudaFunctions *cu, CudaExtraFunctions *cux, char *node, size_t nodeLen) {
+    NVRenderNode nodes[MAX_RENDER_NODES];
+    int count = findRenderNodes(nodes);
+    if (count == 0) {
+        return -1;
+    }
+
+    unsigned int ticket = policy == NV_PLACEMENT_NONE ? 0 : takePlacementTicket();
+    int chosen = -1;
+    if (policy == NV_PLACEMENT_LEAST_LOADED) {
+        if (cu == NULL || cux == NULL || cux->cuMemGetInfo == NULL || cux->cuDeviceGetPCIBusId == NULL) {
+            LOG("Unable to query GPU memory, placing round robin");
+        } else {
+            chosen = leastLoadedGpu(cu, cux, nodes, count, ticket);
+        }
+    } else if (policy == NV_PLACEMENT_NUMA) {
+        chosen = numaLocalGpu(nodes, count, ticket);
+    }
+    if (chosen == -1) {
+        chosen = (int) (ticket % (unsigned int) count);
+    }
+    snprintf(node, nodeLen, "/dev/dri/renderD%d", nodes[chosen].minor);
+    return chosen;
+}
@@ -0,0 +1,29 @@
+#ifndef GPU_PLACEMENT_H
+#define GPU_PLACEMENT_H
+
+#include "cuda-extra.h"
+
+#include <ffnvcodec/dynlink_loader.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+//how a display picks its GPU when neither NVD_GPU nor the application chose one
+typedef enum {
+    //the first GPU, or the one the DRM fd libva passed in is for
+    NV_PLACEMENT_NONE,
+    //the next GPU in turn, counted across every process of the user
+    NV_PLACEMENT_ROUND_ROBIN,
+    //the GPU with the most free VRAM
+    NV_PLACEMENT_LEAST_LOADED,
+    //a GPU attached to the NUMA node the calling thread is running on, in turn
+    NV_PLACEMENT_NUMA,
+} NVGpuPlacement;
+
+//parses the value of NVD_GPU_PLACEMENT, returns false if it isn't a policy
+bool parseGpuPlacement(const char *name, NVGpuPlacement *policy);
+//returns the index of the GPU picked, counting only the NVIDIA render nodes in the order of their minor numbers
+//(the same numbering NVD_GPU uses with the direct backend), or -1 if there aren't any. Least loaded needs CUDA to
+//have been initialised, if cu is NULL it falls back to round robin. The render node is written to node
+int placeGpu(NVGpuPlacement policy, CudaFunctions *cu, CudaExtraFunctions *cux, char *node, size_t nodeLen);
+
+#endif // GPU_PLACEMENT_H
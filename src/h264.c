@@ -8,6 +8,11 @@ static void copyH264PicParam(NVContext *ctx, NVBuffer* buffer, CUVIDPICPARAMS *p
     picParams->PicWidthInMbs    = buf->picture_width_in_mbs_minus1 + 1; //int
     picParams->FrameHeightInMbs = buf->picture_height_in_mbs_minus1 + 1; //int
 
+    //the height is only the frame's for progressive streams, interlaced ones keep the size they started with
+    if (buf->seq_fields.bits.frame_mbs_only_flag && !buf->pic_fields.bits.field_pic_flag) {
+        resizeForPicture(ctx, picParams->PicWidthInMbs * 16, picParams->FrameHeightInMbs * 16, 16);
+    }
+
     ctx->renderTarget->progressiveFrame = !buf->pic_fields.bits.field_pic_flag;
     picParams->field_pic_flag    = buf->pic_fields.bits.field_pic_flag;
     picParams->bottom_field_flag = (buf->CurrPic.flags & VA_PICTURE_H264_BOTTOM_FIELD) != 0;
@@ -84,23 +89,27 @@ static void copyH264SliceParam(NVContext *ctx, NVBuffer* buffer, CUVIDPICPARAMS
 
     ctx->lastSliceParams = buffer->ptr;
     ctx->lastSliceParamsCount = buffer->elements;
+    ctx->lastSliceParamsSize = sizeof(VASliceParameterBufferH264);
 
     picParams->nNumSlices += buffer->elements;
 }
 
 static void copyH264SliceData(NVContext *ctx, NVBuffer* buf, CUVIDPICPARAMS *picParams)
 {
-    for (unsigned int i = 0; i < ctx->lastSliceParamsCount; i++)
-    {
-        static const uint8_t header[] = { 0, 0, 1 }; //1 as a 24-bit Big Endian
-
-        VASliceParameterBufferH264 *sliceParams = &((VASliceParameterBufferH264*) ctx->lastSliceParams)[i];
-        uint32_t offset = (uint32_t) ctx->bitstreamBuffer.size;
-        appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset));
-        appendBuffer(&ctx->bitstreamBuffer, header, sizeof(header));
-        appendBuffer(&ctx->bitstreamBuffer, PTROFF(buf->ptr, sliceParams->slice_data_offset), sliceParams->slice_data_size);
-        picParams->nBitstreamDataLen += sliceParams->slice_data_size + 3;
+    //a single slice covering the whole buffer is already in the bitstream arena, start code included
+    VASliceParameterBufferH264 *firstSlice = (VASliceParameterBufferH264*) ctx->lastSliceParams;
+    uint32_t offset;
+    if (ctx->lastSliceParamsCount == 1 && firstSlice->slice_data_offset == 0 && firstSlice->slice_data_size == (uint32_t) buf->size
+            && claimSliceData(ctx, buf, &offset)) {
+        if (!appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset))) {
+            failPicture(ctx, VA_STATUS_ERROR_ALLOCATION_FAILED);
+            return;
+        }
+        picParams->nBitstreamDataLen += firstSlice->slice_data_size + 3;
+        return;
     }
+
+    picParams->nBitstreamDataLen += gatherSliceData(ctx, buf, true);
 }
 
 static void copyH264IQMatrix(NVContext *ctx, NVBuffer* buf, CUVIDPICPARAMS *picParams)
@@ -140,4 +149,7 @@ const DECLARE_CODEC(h264Codec) = {
     },
     .supportedProfileCount = ARRAY_SIZE(h264SupportedProfiles),
     .supportedProfiles = h264SupportedProfiles,
+    .inPlaceSliceData = true,
+    .sliceDataStartCode = true,
+    .adaptiveDecoder = true,
 };
@@ -81,6 +81,10 @@ static void copyHEVCPicParam(NVContext *ctx, NVBuffer* buffer, CUVIDPICPARAMS *p
     picParams->PicWidthInMbs    = buf->pic_width_in_luma_samples / 16;
     picParams->FrameHeightInMbs = buf->pic_height_in_luma_samples / 16;
 
+    //a change of size needs a new SPS, so this is always an IRAP picture
+    resizeForPicture(ctx, buf->pic_width_in_luma_samples, buf->pic_height_in_luma_samples,
+                     1 << (buf->log2_min_luma_coding_block_size_minus3 + 3));
+
     picParams->field_pic_flag    = !!(buf->CurrPic.flags & VA_PICTURE_HEVC_FIELD_PIC);
     picParams->bottom_field_flag = !!(buf->CurrPic.flags & VA_PICTURE_HEVC_BOTTOM_FIELD);
     picParams->second_field      = 0;
@@ -252,23 +256,27 @@ static void copyHEVCSliceParam(NVContext *ctx, NVBuffer* buffer, CUVIDPICPARAMS
 {
     ctx->lastSliceParams = buffer->ptr;
     ctx->lastSliceParamsCount = buffer->elements;
+    ctx->lastSliceParamsSize = sizeof(VASliceParameterBufferHEVC);
 
     picParams->nNumSlices += buffer->elements;
 }
 
 static void copyHEVCSliceData(NVContext *ctx, NVBuffer* buf, CUVIDPICPARAMS *picParams)
 {
-    for (unsigned int i = 0; i < ctx->lastSliceParamsCount; i++)
-    {
-        static const uint8_t header[] = { 0, 0, 1 }; //1 as a 24-bit Big Endian
-
-        VASliceParameterBufferHEVC *sliceParams = &((VASliceParameterBufferHEVC*) ctx->lastSliceParams)[i];
-        uint32_t offset = (uint32_t) ctx->bitstreamBuffer.size;
-        appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset));
-        appendBuffer(&ctx->bitstreamBuffer, header, sizeof(header));
-        appendBuffer(&ctx->bitstreamBuffer, PTROFF(buf->ptr, sliceParams->slice_data_offset), sliceParams->slice_data_size);
-        picParams->nBitstreamDataLen += sliceParams->slice_data_size + 3;
+    //a single slice covering the whole buffer is already in the bitstream arena, start code included
+    VASliceParameterBufferHEVC *firstSlice = (VASliceParameterBufferHEVC*) ctx->lastSliceParams;
+    uint32_t offset;
+    if (ctx->lastSliceParamsCount == 1 && firstSlice->slice_data_offset == 0 && firstSlice->slice_data_size == (uint32_t) buf->size
+            && claimSliceData(ctx, buf, &offset)) {
+        if (!appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset))) {
+            failPicture(ctx, VA_STATUS_ERROR_ALLOCATION_FAILED);
+            return;
+        }
+        picParams->nBitstreamDataLen += firstSlice->slice_data_size + 3;
+        return;
     }
+
+    picParams->nBitstreamDataLen += gatherSliceData(ctx, buf, true);
 }
 
 static void copyHEVCIQMatrix(NVContext *ctx, NVBuffer* buf, CUVIDPICPARAMS *picParams)
@@ -330,4 +338,7 @@ const DECLARE_CODEC(hevcCodec) = {
     },
     .supportedProfileCount = ARRAY_SIZE(hevcSupportedProfiles),
     .supportedProfiles = hevcSupportedProfiles,
+    .inPlaceSliceData = true,
+    .sliceDataStartCode = true,
+    .adaptiveDecoder = true,
 };
@@ -1,11 +1,105 @@
 #include "vabackend.h"
+#include <stdlib.h>
 #include <string.h>
+#include <sys/param.h>
 
-/* This one looks difficult to implement as NVDEC wants the whole JPEG file, and VA-API only supplied part of it */
+/* NVDEC wants the whole JPEG file, and VA-API only supplies the parsed headers and the entropy coded scans,
+ * so the file is put back together from them: SOI, DQT, SOF0, DHT, DRI, then SOS and the scan data for each
+ * scan, and EOI. The decoder is created with room for larger pictures, so a stream changing size only costs
+ * a reconfigure. */
+
+typedef struct
+{
+    //the tables persist between pictures, as VA-API only requires them to be sent when they change
+    VAIQMatrixBufferJPEGBaseline        iqMatrix;
+    VAHuffmanTableBufferJPEGBaseline    huffmanTables;
+    VAPictureParameterBufferJPEGBaseline picture;
+    bool                                havePicture;
+    bool                                headerWritten;
+} JPEGContext;
+
+static bool initJPEGContext(NVContext *ctx) {
+    JPEGContext *jpeg = calloc(1, sizeof(JPEGContext));
+    if (jpeg == NULL) {
+        return false;
+    }
+    ctx->codecData = jpeg;
+    return true;
+}
+
+static void deinitJPEGContext(NVContext *ctx) {
+    free(ctx->codecData);
+}
+
+static bool appendMarker(AppendableBuffer *ab, uint8_t marker, uint16_t length) {
+    //the length includes itself, but not the marker
+    uint8_t bytes[] = { 0xff, marker, (uint8_t) (length >> 8), (uint8_t) length };
+    return appendBuffer(ab, bytes, length > 0 ? 4 : 2);
+}
+
+static bool appendHuffmanTable(AppendableBuffer *ab, uint8_t classAndId, const uint8_t counts[16], const uint8_t *values, uint32_t maxValues) {
+    uint32_t count = 0;
+    for (int i = 0; i < 16; i++) {
+        count += counts[i];
+    }
+    count = MIN(count, maxValues);
+    return appendMarker(ab, 0xc4, (uint16_t) (2 + 1 + 16 + count))
+        && appendBuffer(ab, &classAndId, 1)
+        && appendBuffer(ab, counts, 16)
+        && appendBuffer(ab, values, count);
+}
+
+//everything up to the first SOS, returns false if the bitstream couldn't be grown
+static bool writeJPEGHeader(NVContext *ctx, const VASliceParameterBufferJPEGBaseline *slice) {
+    JPEGContext *jpeg = (JPEGContext*) ctx->codecData;
+    AppendableBuffer *ab = &ctx->bitstreamBuffer;
+    const VAPictureParameterBufferJPEGBaseline *pic = &jpeg->picture;
+
+    bool ok = appendMarker(ab, 0xd8, 0);
+
+    for (uint8_t i = 0; ok && i < ARRAY_SIZE(jpeg->iqMatrix.load_quantiser_table); i++) {
+        if (jpeg->iqMatrix.load_quantiser_table[i]) {
+            //VA-API has them in zig-zag order already, same as the file
+            ok = appendMarker(ab, 0xdb, 2 + 1 + 64)
+                && appendBuffer(ab, &i, 1)
+                && appendBuffer(ab, jpeg->iqMatrix.quantiser_table[i], 64);
+        }
+    }
+
+    uint8_t numComponents = MIN(pic->num_components, 4);
+    uint8_t frame[] = { 8, (uint8_t) (pic->picture_height >> 8), (uint8_t) pic->picture_height,
+                        (uint8_t) (pic->picture_width >> 8), (uint8_t) pic->picture_width, numComponents };
+    ok = ok && appendMarker(ab, 0xc0, (uint16_t) (2 + 6 + 3 * numComponents)) && appendBuffer(ab, frame, sizeof(frame));
+    for (int i = 0; ok && i < numComponents; i++) {
+        uint8_t component[] = { pic->components[i].component_id,
+                                (uint8_t) ((pic->components[i].h_sampling_factor << 4) | pic->components[i].v_sampling_factor),
+                                pic->components[i].quantiser_table_selector };
+        ok = appendBuffer(ab, component, sizeof(component));
+    }
+
+    for (uint8_t i = 0; ok && i < ARRAY_SIZE(jpeg->huffmanTables.load_huffman_table); i++) {
+        if (jpeg->huffmanTables.load_huffman_table[i]) {
+            ok = appendHuffmanTable(ab, i, jpeg->huffmanTables.huffman_table[i].num_dc_codes,
+                                    jpeg->huffmanTables.huffman_table[i].dc_values, sizeof(jpeg->huffmanTables.huffman_table[i].dc_values))
+                && appendHuffmanTable(ab, 0x10 | i, jpeg->huffmanTables.huffman_table[i].num_ac_codes,
+                                      jpeg->huffmanTables.huffman_table[i].ac_values, sizeof(jpeg->huffmanTables.huffman_table[i].ac_values));
+        }
+    }
+
+    if (ok && slice->restart_interval != 0) {
+        uint8_t interval[] = { (uint8_t) (slice->restart_interval >> 8), (uint8_t) slice->restart_interval };
+        ok = appendMarker(ab, 0xdd, 4) && appendBuffer(ab, interval, sizeof(interval));
+    }
+    return ok;
+}
 
 static void copyJPEGPicParam(NVContext *ctx, NVBuffer* buffer, CUVIDPICPARAMS *picParams)
 {
     VAPictureParameterBufferJPEGBaseline* buf = (VAPictureParameterBufferJPEGBaseline*) buffer->ptr;
+    JPEGContext *jpeg = (JPEGContext*) ctx->codecData;
+
+    jpeg->picture = *buf;
+    jpeg->havePicture = true;
 
     picParams->PicWidthInMbs = (int) ( buf->picture_width + 15) / 16; //int
     picParams->FrameHeightInMbs = (int) ( buf->picture_height + 15) / 16; //int
@@ -18,23 +112,97 @@ static void copyJPEGPicParam(NVContext *ctx, NVBuffer* buffer, CUVIDPICPARAMS *p
     picParams->ref_pic_flag      = 0;
 }
 
+static void copyJPEGIQMatrix(NVContext *ctx, NVBuffer* buffer, CUVIDPICPARAMS *picParams)
+{
+    JPEGContext *jpeg = (JPEGContext*) ctx->codecData;
+    const VAIQMatrixBufferJPEGBaseline *buf = (const VAIQMatrixBufferJPEGBaseline*) buffer->ptr;
+    //only the tables flagged are being sent, the others keep what they were last loaded with
+    for (unsigned int i = 0; i < ARRAY_SIZE(buf->load_quantiser_table); i++) {
+        if (buf->load_quantiser_table[i]) {
+            memcpy(jpeg->iqMatrix.quantiser_table[i], buf->quantiser_table[i], sizeof(buf->quantiser_table[i]));
+            jpeg->iqMatrix.load_quantiser_table[i] = 1;
+        }
+    }
+}
+
+static void copyJPEGHuffmanTable(NVContext *ctx, NVBuffer* buffer, CUVIDPICPARAMS *picParams)
+{
+    JPEGContext *jpeg = (JPEGContext*) ctx->codecData;
+    const VAHuffmanTableBufferJPEGBaseline *buf = (const VAHuffmanTableBufferJPEGBaseline*) buffer->ptr;
+    for (unsigned int i = 0; i < ARRAY_SIZE(buf->load_huffman_table); i++) {
+        if (buf->load_huffman_table[i]) {
+            jpeg->huffmanTables.huffman_table[i] = buf->huffman_table[i];
+            jpeg->huffmanTables.load_huffman_table[i] = 1;
+        }
+    }
+}
+
 static void copyJPEGSliceParam(NVContext *ctx, NVBuffer* buf, CUVIDPICPARAMS *picParams)
 {
     ctx->lastSliceParams = buf->ptr;
     ctx->lastSliceParamsCount = buf->elements;
-
-    picParams->nNumSlices += buf->elements;
 }
 
 static void copyJPEGSliceData(NVContext *ctx, NVBuffer* buf, CUVIDPICPARAMS *picParams)
 {
+    JPEGContext *jpeg = (JPEGContext*) ctx->codecData;
+    AppendableBuffer *ab = &ctx->bitstreamBuffer;
     for (unsigned int i = 0; i < ctx->lastSliceParamsCount; i++)
     {
         VASliceParameterBufferJPEGBaseline *sliceParams = &((VASliceParameterBufferJPEGBaseline*) ctx->lastSliceParams)[i];
-        uint32_t offset = (uint32_t) ctx->bitstreamBuffer.size;
-        appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset));
-        appendBuffer(&ctx->bitstreamBuffer, PTROFF(buf->ptr, sliceParams->slice_data_offset), sliceParams->slice_data_size);
-        picParams->nBitstreamDataLen += sliceParams->slice_data_size;
+        if (!sliceInBuffer(ctx, buf, sliceParams->slice_data_offset, sliceParams->slice_data_size)) {
+            return;
+        }
+        if (!jpeg->headerWritten) {
+            //the whole file goes to NVDEC as a single slice
+            uint32_t offset = (uint32_t) ab->size;
+            picParams->nNumSlices = 1;
+            jpeg->headerWritten = true;
+            if (!appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset)) || !writeJPEGHeader(ctx, sliceParams)) {
+                failPicture(ctx, VA_STATUS_ERROR_ALLOCATION_FAILED);
+                return;
+            }
+        }
+
+        uint8_t numComponents = MIN(sliceParams->num_components, 4);
+        bool ok = appendMarker(ab, 0xda, (uint16_t) (2 + 1 + 2 * numComponents + 3)) && appendBuffer(ab, &numComponents, 1);
+        for (int c = 0; ok && c < numComponents; c++) {
+            uint8_t component[] = { sliceParams->components[c].component_selector,
+                                    (uint8_t) ((sliceParams->components[c].dc_table_selector << 4) | sliceParams->components[c].ac_table_selector) };
+            ok = appendBuffer(ab, component, sizeof(component));
+        }
+        //baseline is always a single sequential scan over all the coefficients
+        uint8_t spectral[] = { 0, 63, 0 };
+        ok = ok && appendBuffer(ab, spectral, sizeof(spectral))
+                && appendBuffer(ab, PTROFF(buf->ptr, sliceParams->slice_data_offset), sliceParams->slice_data_size);
+        if (!ok) {
+            failPicture(ctx, VA_STATUS_ERROR_ALLOCATION_FAILED);
+            return;
+        }
+    }
+}
+
+static void endJPEGPicture(NVContext *ctx, CUVIDPICPARAMS *picParams) {
+    JPEGContext *jpeg = (JPEGContext*) ctx->codecData;
+    if (!jpeg->headerWritten) {
+        return;
+    }
+    jpeg->headerWritten = false;
+    if (!appendMarker(&ctx->bitstreamBuffer, 0xd9, 0)) {
+        failPicture(ctx, VA_STATUS_ERROR_ALLOCATION_FAILED);
+        return;
+    }
+    //appending may have moved the buffer
+    picParams->pBitstreamData = ctx->bitstreamBuffer.buf;
+    picParams->nBitstreamDataLen = (unsigned int) ctx->bitstreamBuffer.size;
+
+    if (jpeg->havePicture) {
+        //pictures from the same stream can change size, so reuse the decoder rather than needing a new context.
+        //The output is always the size of the surface, as that's what's copied out of the decoder
+        if (!resizeDecoder(ctx, jpeg->picture.picture_width, jpeg->picture.picture_height,
+                           ctx->renderTarget->width, ctx->renderTarget->height)) {
+            failPicture(ctx, VA_STATUS_ERROR_RESOLUTION_NOT_SUPPORTED);
+        }
     }
 }
 
@@ -51,13 +219,19 @@ static const VAProfile jpegSupportedProfiles[] = {
     VAProfileJPEGBaseline,
 };
 
-const DECLARE_DISABLED_CODEC(jpegCodec) = {
+const DECLARE_CODEC(jpegCodec) = {
     .computeCudaCodec = computeJPEGCudaCodec,
     .handlers = {
         [VAPictureParameterBufferType] = copyJPEGPicParam,
+        [VAIQMatrixBufferType] = copyJPEGIQMatrix,
+        [VAHuffmanTableBufferType] = copyJPEGHuffmanTable,
         [VASliceParameterBufferType] = copyJPEGSliceParam,
         [VASliceDataBufferType] = copyJPEGSliceData,
     },
     .supportedProfileCount = ARRAY_SIZE(jpegSupportedProfiles),
     .supportedProfiles = jpegSupportedProfiles,
+    .initContext = initJPEGContext,
+    .deinitContext = deinitJPEGContext,
+    .endPicture = endJPEGPicture,
+    .resizableDecoder = true,
 };
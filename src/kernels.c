@@ -0,0 +1,1184 @@
+#include "kernels.h"
+#include "film-grain.h"
+#include "vabackend.h"
+
+#include <stddef.h>
+
+//generated by hand, it's small enough that it's simpler than adding nvcc to the build
+static const char kernelsPtx[] =
+    ".version 6.0\n"
+    ".target sm_50\n"
+    ".address_size 64\n"
+    "\n"
+    ".visible .entry nvd_pack_plane(\n"
+    "    .param .u64 dst,\n"
+    "    .param .u32 dstPitch,\n"
+    "    .param .u64 srcA,\n"
+    "    .param .u64 srcB,\n"
+    "    .param .u32 srcPitch,\n"
+    "    .param .u32 width,\n"
+    "    .param .u32 height,\n"
+    "    .param .u32 wide\n"
+    ")\n"
+    "{\n"
+    "    .reg .pred %p<4>;\n"
+    "    .reg .b32 %r<16>;\n"
+    "    .reg .b64 %rd<16>;\n"
+    "\n"
+    "    mov.u32 %r1, %ctaid.x;\n"
+    "    mov.u32 %r2, %ntid.x;\n"
+    "    mov.u32 %r3, %tid.x;\n"
+    "    mad.lo.u32 %r4, %r1, %r2, %r3;\n"
+    "    mov.u32 %r1, %ctaid.y;\n"
+    "    mov.u32 %r2, %ntid.y;\n"
+    "    mov.u32 %r3, %tid.y;\n"
+    "    mad.lo.u32 %r5, %r1, %r2, %r3;\n"
+    "    ld.param.u32 %r6, [width];\n"
+    "    ld.param.u32 %r7, [height];\n"
+    "    setp.ge.u32 %p1, %r4, %r6;\n"
+    "    setp.ge.u32 %p2, %r5, %r7;\n"
+    "    or.pred %p1, %p1, %p2;\n"
+    "    @%p1 bra DONE;\n"
+    "\n"
+    "    ld.param.u64 %rd1, [dst];\n"
+    "    ld.param.u32 %r8, [dstPitch];\n"
+    "    ld.param.u64 %rd2, [srcA];\n"
+    "    ld.param.u64 %rd3, [srcB];\n"
+    "    ld.param.u32 %r9, [srcPitch];\n"
+    "    ld.param.u32 %r10, [wide];\n"
+    "\n"
+    "    mul.wide.u32 %rd4, %r5, %r9;\n"
+    "    cvt.u64.u32 %rd5, %r4;\n"
+    "    add.u64 %rd4, %rd4, %rd5;\n"
+    "    mul.wide.u32 %rd6, %r5, %r8;\n"
+    "    add.u64 %rd1, %rd1, %rd6;\n"
+    "    add.u64 %rd7, %rd2, %rd4;\n"
+    "    ld.global.u8 %r11, [%rd7];\n"
+    "    setp.ne.u32 %p3, %r10, 0;\n"
+    "    setp.eq.u64 %p2, %rd3, 0;\n"
+    "    @%p2 bra SINGLE;\n"
+    "\n"
+    "    add.u64 %rd8, %rd3, %rd4;\n"
+    "    ld.global.u8 %r12, [%rd8];\n"
+    "    @%p3 bra INTERLEAVE_WIDE;\n"
+    "    mul.wide.u32 %rd9, %r4, 2;\n"
+    "    add.u64 %rd9, %rd1, %rd9;\n"
+    "    st.global.u8 [%rd9], %r11;\n"
+    "    st.global.u8 [%rd9+1], %r12;\n"
+    "    bra DONE;\n"
+    "INTERLEAVE_WIDE:\n"
+    "    mul.wide.u32 %rd9, %r4, 4;\n"
+    "    add.u64 %rd9, %rd1, %rd9;\n"
+    "    shl.b32 %r11, %r11, 8;\n"
+    "    shl.b32 %r12, %r12, 8;\n"
+    "    st.global.u16 [%rd9], %r11;\n"
+    "    st.global.u16 [%rd9+2], %r12;\n"
+    "    bra DONE;\n"
+    "\n"
+    "SINGLE:\n"
+    "    @%p3 bra SINGLE_WIDE;\n"
+    "    add.u64 %rd9, %rd1, %rd5;\n"
+    "    st.global.u8 [%rd9], %r11;\n"
+    "    bra DONE;\n"
+    "SINGLE_WIDE:\n"
+    "    mul.wide.u32 %rd9, %r4, 2;\n"
+    "    add.u64 %rd9, %rd1, %rd9;\n"
+    "    shl.b32 %r11, %r11, 8;\n"
+    "    st.global.u16 [%rd9], %r11;\n"
+    "\n"
+    "DONE:\n"
+    "    ret;\n"
+    "}\n"
+    "\n"
+    ".visible .entry nvd_scale_plane(\n"
+    "    .param .u64 dst,\n"
+    "    .param .u32 dstPitch,\n"
+    "    .param .u32 dstStride,\n"
+    "    .param .u32 dstWide,\n"
+    "    .param .u32 dstWidth,\n"
+    "    .param .u32 dstHeight,\n"
+    "    .param .u64 src,\n"
+    "    .param .u32 srcPitch,\n"
+    "    .param .u32 srcStride,\n"
+    "    .param .u32 srcWide,\n"
+    "    .param .u32 srcWidth,\n"
+    "    .param .u32 srcHeight,\n"
+    "    .param .u32 bilinear\n"
+    ")\n"
+    "{\n"
+    "    .reg .pred %p<8>;\n"
+    "    .reg .b32 %r<32>;\n"
+    "    .reg .f32 %f<32>;\n"
+    "    .reg .b64 %rd<16>;\n"
+    "\n"
+    "    mov.u32 %r1, %ctaid.x;\n"
+    "    mov.u32 %r2, %ntid.x;\n"
+    "    mov.u32 %r3, %tid.x;\n"
+    "    mad.lo.u32 %r4, %r1, %r2, %r3;\n"
+    "    mov.u32 %r1, %ctaid.y;\n"
+    "    mov.u32 %r2, %ntid.y;\n"
+    "    mov.u32 %r3, %tid.y;\n"
+    "    mad.lo.u32 %r5, %r1, %r2, %r3;\n"
+    "    ld.param.u32 %r6, [dstWidth];\n"
+    "    ld.param.u32 %r7, [dstHeight];\n"
+    "    setp.ge.u32 %p1, %r4, %r6;\n"
+    "    setp.ge.u32 %p2, %r5, %r7;\n"
+    "    or.pred %p1, %p1, %p2;\n"
+    "    @%p1 bra SCALE_DONE;\n"
+    "\n"
+    "    ld.param.u32 %r8, [srcWidth];\n"
+    "    ld.param.u32 %r9, [srcHeight];\n"
+    "    ld.param.u32 %r10, [bilinear];\n"
+    "\n"
+    "    // centre of the destination sample in source coordinates, (x + 0.5) * srcWidth / dstWidth\n"
+    "    cvt.rn.f32.u32 %f1, %r4;\n"
+    "    cvt.rn.f32.u32 %f2, %r5;\n"
+    "    cvt.rn.f32.u32 %f3, %r6;\n"
+    "    cvt.rn.f32.u32 %f4, %r7;\n"
+    "    cvt.rn.f32.u32 %f5, %r8;\n"
+    "    cvt.rn.f32.u32 %f6, %r9;\n"
+    "    div.rn.f32 %f7, %f5, %f3;\n"
+    "    div.rn.f32 %f8, %f6, %f4;\n"
+    "    add.f32 %f1, %f1, 0f3F000000;\n"
+    "    add.f32 %f2, %f2, 0f3F000000;\n"
+    "    mul.f32 %f1, %f1, %f7;\n"
+    "    mul.f32 %f2, %f2, %f8;\n"
+    "    sub.f32 %f9, %f5, 0f3F800000;\n"
+    "    sub.f32 %f10, %f6, 0f3F800000;\n"
+    "    setp.ne.u32 %p3, %r10, 0;\n"
+    "    @%p3 bra SCALE_BILINEAR;\n"
+    "\n"
+    "    cvt.rmi.f32.f32 %f1, %f1;\n"
+    "    cvt.rmi.f32.f32 %f2, %f2;\n"
+    "    min.f32 %f1, %f1, %f9;\n"
+    "    min.f32 %f2, %f2, %f10;\n"
+    "    mov.f32 %f11, 0f00000000;\n"
+    "    mov.f32 %f12, 0f00000000;\n"
+    "    bra SCALE_SAMPLE;\n"
+    "\n"
+    "SCALE_BILINEAR:\n"
+    "    // samples are centred on .5, so the four around the point start half a sample up and left\n"
+    "    sub.f32 %f1, %f1, 0f3F000000;\n"
+    "    sub.f32 %f2, %f2, 0f3F000000;\n"
+    "    max.f32 %f1, %f1, 0f00000000;\n"
+    "    max.f32 %f2, %f2, 0f00000000;\n"
+    "    min.f32 %f1, %f1, %f9;\n"
+    "    min.f32 %f2, %f2, %f10;\n"
+    "    cvt.rmi.f32.f32 %f13, %f1;\n"
+    "    cvt.rmi.f32.f32 %f14, %f2;\n"
+    "    sub.f32 %f11, %f1, %f13;\n"
+    "    sub.f32 %f12, %f2, %f14;\n"
+    "    mov.f32 %f1, %f13;\n"
+    "    mov.f32 %f2, %f14;\n"
+    "\n"
+    "SCALE_SAMPLE:\n"
+    "    cvt.rzi.u32.f32 %r11, %f1;\n"
+    "    cvt.rzi.u32.f32 %r12, %f2;\n"
+    "    add.u32 %r13, %r11, 1;\n"
+    "    add.u32 %r14, %r12, 1;\n"
+    "    sub.u32 %r15, %r8, 1;\n"
+    "    sub.u32 %r16, %r9, 1;\n"
+    "    min.u32 %r13, %r13, %r15;\n"
+    "    min.u32 %r14, %r14, %r16;\n"
+    "\n"
+    "    ld.param.u64 %rd1, [src];\n"
+    "    ld.param.u32 %r17, [srcPitch];\n"
+    "    ld.param.u32 %r18, [srcStride];\n"
+    "    ld.param.u32 %r19, [srcWide];\n"
+    "    mul.wide.u32 %rd2, %r12, %r17;\n"
+    "    add.u64 %rd2, %rd1, %rd2;\n"
+    "    mul.wide.u32 %rd3, %r14, %r17;\n"
+    "    add.u64 %rd3, %rd1, %rd3;\n"
+    "    mul.wide.u32 %rd4, %r11, %r18;\n"
+    "    mul.wide.u32 %rd5, %r13, %r18;\n"
+    "    add.u64 %rd6, %rd2, %rd4;\n"
+    "    add.u64 %rd7, %rd2, %rd5;\n"
+    "    add.u64 %rd8, %rd3, %rd4;\n"
+    "    add.u64 %rd9, %rd3, %rd5;\n"
+    "    setp.ne.u32 %p4, %r19, 0;\n"
+    "    @%p4 bra SCALE_LOAD_WIDE;\n"
+    "    ld.global.u8 %r20, [%rd6];\n"
+    "    ld.global.u8 %r21, [%rd7];\n"
+    "    ld.global.u8 %r22, [%rd8];\n"
+    "    ld.global.u8 %r23, [%rd9];\n"
+    "    // widen to 16 bits with the samples in the most significant bits, like P010\n"
+    "    shl.b32 %r20, %r20, 8;\n"
+    "    shl.b32 %r21, %r21, 8;\n"
+    "    shl.b32 %r22, %r22, 8;\n"
+    "    shl.b32 %r23, %r23, 8;\n"
+    "    bra SCALE_FILTER;\n"
+    "SCALE_LOAD_WIDE:\n"
+    "    ld.global.u16 %r20, [%rd6];\n"
+    "    ld.global.u16 %r21, [%rd7];\n"
+    "    ld.global.u16 %r22, [%rd8];\n"
+    "    ld.global.u16 %r23, [%rd9];\n"
+    "\n"
+    "SCALE_FILTER:\n"
+    "    cvt.rn.f32.u32 %f15, %r20;\n"
+    "    cvt.rn.f32.u32 %f16, %r21;\n"
+    "    cvt.rn.f32.u32 %f17, %r22;\n"
+    "    cvt.rn.f32.u32 %f18, %r23;\n"
+    "    sub.f32 %f19, %f16, %f15;\n"
+    "    fma.rn.f32 %f19, %f19, %f11, %f15;\n"
+    "    sub.f32 %f20, %f18, %f17;\n"
+    "    fma.rn.f32 %f20, %f20, %f11, %f17;\n"
+    "    sub.f32 %f21, %f20, %f19;\n"
+    "    fma.rn.f32 %f21, %f21, %f12, %f19;\n"
+    "\n"
+    "    ld.param.u64 %rd10, [dst];\n"
+    "    ld.param.u32 %r24, [dstPitch];\n"
+    "    ld.param.u32 %r25, [dstStride];\n"
+    "    ld.param.u32 %r26, [dstWide];\n"
+    "    mul.wide.u32 %rd11, %r5, %r24;\n"
+    "    add.u64 %rd10, %rd10, %rd11;\n"
+    "    mul.wide.u32 %rd12, %r4, %r25;\n"
+    "    add.u64 %rd10, %rd10, %rd12;\n"
+    "    setp.ne.u32 %p5, %r26, 0;\n"
+    "    @%p5 bra SCALE_STORE_WIDE;\n"
+    "    // narrow back to 8 bits, dividing by 256\n"
+    "    mul.f32 %f22, %f21, 0f3B800000;\n"
+    "    cvt.rni.u32.f32 %r27, %f22;\n"
+    "    min.u32 %r27, %r27, 255;\n"
+    "    st.global.u8 [%rd10], %r27;\n"
+    "    bra SCALE_DONE;\n"
+    "SCALE_STORE_WIDE:\n"
+    "    cvt.rni.u32.f32 %r27, %f21;\n"
+    "    min.u32 %r27, %r27, 65535;\n"
+    "    st.global.u16 [%rd10], %r27;\n"
+    "\n"
+    "SCALE_DONE:\n"
+    "    ret;\n"
+    "}\n"
+    "\n"
+    ".visible .entry nvd_scale_plane_lanczos(\n"
+    "    .param .u64 dst,\n"
+    "    .param .u32 dstPitch,\n"
+    "    .param .u32 dstStride,\n"
+    "    .param .u32 dstWide,\n"
+    "    .param .u32 dstWidth,\n"
+    "    .param .u32 dstHeight,\n"
+    "    .param .u64 src,\n"
+    "    .param .u32 srcPitch,\n"
+    "    .param .u32 srcStride,\n"
+    "    .param .u32 srcWide,\n"
+    "    .param .u32 srcWidth,\n"
+    "    .param .u32 srcHeight\n"
+    ")\n"
+    "{\n"
+    "    .reg .pred %p<8>;\n"
+    "    .reg .b32 %r<32>;\n"
+    "    .reg .f32 %f<40>;\n"
+    "    .reg .b64 %rd<16>;\n"
+    "\n"
+    "    mov.u32 %r1, %ctaid.x;\n"
+    "    mov.u32 %r2, %ntid.x;\n"
+    "    mov.u32 %r3, %tid.x;\n"
+    "    mad.lo.u32 %r4, %r1, %r2, %r3;\n"
+    "    mov.u32 %r1, %ctaid.y;\n"
+    "    mov.u32 %r2, %ntid.y;\n"
+    "    mov.u32 %r3, %tid.y;\n"
+    "    mad.lo.u32 %r5, %r1, %r2, %r3;\n"
+    "    ld.param.u32 %r6, [dstWidth];\n"
+    "    ld.param.u32 %r7, [dstHeight];\n"
+    "    setp.ge.u32 %p1, %r4, %r6;\n"
+    "    setp.ge.u32 %p2, %r5, %r7;\n"
+    "    or.pred %p1, %p1, %p2;\n"
+    "    @%p1 bra LANCZOS_DONE;\n"
+    "\n"
+    "    ld.param.u32 %r8, [srcWidth];\n"
+    "    ld.param.u32 %r9, [srcHeight];\n"
+    "\n"
+    "    // centre of the destination sample in source coordinates, less half a sample so the integer part is\n"
+    "    // the source sample up and left of it, (x + 0.5) * srcWidth / dstWidth - 0.5\n"
+    "    cvt.rn.f32.u32 %f1, %r4;\n"
+    "    cvt.rn.f32.u32 %f2, %r5;\n"
+    "    cvt.rn.f32.u32 %f3, %r6;\n"
+    "    cvt.rn.f32.u32 %f4, %r7;\n"
+    "    cvt.rn.f32.u32 %f5, %r8;\n"
+    "    cvt.rn.f32.u32 %f6, %r9;\n"
+    "    div.rn.f32 %f7, %f5, %f3;\n"
+    "    div.rn.f32 %f8, %f6, %f4;\n"
+    "    add.f32 %f1, %f1, 0f3F000000;\n"
+    "    add.f32 %f2, %f2, 0f3F000000;\n"
+    "    fma.rn.f32 %f1, %f1, %f7, 0fBF000000;\n"
+    "    fma.rn.f32 %f2, %f2, %f8, 0fBF000000;\n"
+    "    cvt.rmi.f32.f32 %f13, %f1;\n"
+    "    cvt.rmi.f32.f32 %f14, %f2;\n"
+    "    sub.f32 %f11, %f1, %f13;\n"
+    "    sub.f32 %f12, %f2, %f14;\n"
+    "    cvt.rzi.s32.f32 %r11, %f13;\n"
+    "    cvt.rzi.s32.f32 %r12, %f14;\n"
+    "    sub.s32 %r15, %r8, 1;\n"
+    "    sub.s32 %r16, %r9, 1;\n"
+    "\n"
+    "    ld.param.u64 %rd1, [src];\n"
+    "    ld.param.u32 %r17, [srcPitch];\n"
+    "    ld.param.u32 %r18, [srcStride];\n"
+    "    ld.param.u32 %r19, [srcWide];\n"
+    "    setp.ne.u32 %p7, %r19, 0;\n"
+    "    mov.f32 %f20, 0f00000000;\n"
+    "    mov.f32 %f21, 0f00000000;\n"
+    "    mov.u32 %r13, 0;\n"
+    "\n"
+    "    // 4x4 taps, the samples 1 and 2 either side of the point, each weighted by sinc(d) * sinc(d / 2)\n"
+    "    // = 2 * sin(pi * d) * sin(pi * d / 2) / (pi * d)^2 across and down, clamped to the edges of the source\n"
+    "LANCZOS_ROW:\n"
+    "    cvt.rn.f32.u32 %f22, %r13;\n"
+    "    sub.f32 %f22, %f22, 0f3F800000;\n"
+    "    sub.f32 %f22, %f22, %f12;\n"
+    "    abs.f32 %f22, %f22;\n"
+    "    mul.f32 %f23, %f22, 0f40490FDB;\n"
+    "    mul.f32 %f24, %f23, 0f3F000000;\n"
+    "    sin.approx.f32 %f25, %f23;\n"
+    "    sin.approx.f32 %f26, %f24;\n"
+    "    mul.f32 %f25, %f25, %f26;\n"
+    "    add.f32 %f25, %f25, %f25;\n"
+    "    mul.f32 %f26, %f23, %f23;\n"
+    "    div.rn.f32 %f25, %f25, %f26;\n"
+    "    setp.lt.f32 %p3, %f22, 0f3727C5AC;\n"
+    "    selp.f32 %f25, 0f3F800000, %f25, %p3;\n"
+    "    setp.ge.f32 %p4, %f22, 0f40000000;\n"
+    "    selp.f32 %f25, 0f00000000, %f25, %p4;\n"
+    "    add.s32 %r14, %r12, %r13;\n"
+    "    sub.s32 %r14, %r14, 1;\n"
+    "    max.s32 %r14, %r14, 0;\n"
+    "    min.s32 %r14, %r14, %r16;\n"
+    "    mul.wide.u32 %rd2, %r14, %r17;\n"
+    "    add.u64 %rd2, %rd1, %rd2;\n"
+    "    mov.u32 %r20, 0;\n"
+    "\n"
+    "LANCZOS_COLUMN:\n"
+    "    cvt.rn.f32.u32 %f27, %r20;\n"
+    "    sub.f32 %f27, %f27, 0f3F800000;\n"
+    "    sub.f32 %f27, %f27, %f11;\n"
+    "    abs.f32 %f27, %f27;\n"
+    "    mul.f32 %f28, %f27, 0f40490FDB;\n"
+    "    mul.f32 %f29, %f28, 0f3F000000;\n"
+    "    sin.approx.f32 %f30, %f28;\n"
+    "    sin.approx.f32 %f31, %f29;\n"
+    "    mul.f32 %f30, %f30, %f31;\n"
+    "    add.f32 %f30, %f30, %f30;\n"
+    "    mul.f32 %f31, %f28, %f28;\n"
+    "    div.rn.f32 %f30, %f30, %f31;\n"
+    "    setp.lt.f32 %p5, %f27, 0f3727C5AC;\n"
+    "    selp.f32 %f30, 0f3F800000, %f30, %p5;\n"
+    "    setp.ge.f32 %p6, %f27, 0f40000000;\n"
+    "    selp.f32 %f30, 0f00000000, %f30, %p6;\n"
+    "    mul.f32 %f30, %f30, %f25;\n"
+    "    add.s32 %r21, %r11, %r20;\n"
+    "    sub.s32 %r21, %r21, 1;\n"
+    "    max.s32 %r21, %r21, 0;\n"
+    "    min.s32 %r21, %r21, %r15;\n"
+    "    mul.wide.u32 %rd3, %r21, %r18;\n"
+    "    add.u64 %rd3, %rd2, %rd3;\n"
+    "    // widen to 16 bits with the samples in the most significant bits, like P010\n"
+    "    @%p7 ld.global.u16 %r22, [%rd3];\n"
+    "    @!%p7 ld.global.u8 %r22, [%rd3];\n"
+    "    @!%p7 shl.b32 %r22, %r22, 8;\n"
+    "    cvt.rn.f32.u32 %f32, %r22;\n"
+    "    fma.rn.f32 %f20, %f30, %f32, %f20;\n"
+    "    add.f32 %f21, %f21, %f30;\n"
+    "    add.u32 %r20, %r20, 1;\n"
+    "    setp.lt.u32 %p5, %r20, 4;\n"
+    "    @%p5 bra LANCZOS_COLUMN;\n"
+    "    add.u32 %r13, %r13, 1;\n"
+    "    setp.lt.u32 %p3, %r13, 4;\n"
+    "    @%p3 bra LANCZOS_ROW;\n"
+    "\n"
+    "    // normalise by the sum of the weights, the negative lobes can overshoot so it's clamped on the way out\n"
+    "    div.rn.f32 %f21, %f20, %f21;\n"
+    "    max.f32 %f21, %f21, 0f00000000;\n"
+    "\n"
+    "    ld.param.u64 %rd10, [dst];\n"
+    "    ld.param.u32 %r24, [dstPitch];\n"
+    "    ld.param.u32 %r25, [dstStride];\n"
+    "    ld.param.u32 %r26, [dstWide];\n"
+    "    mul.wide.u32 %rd11, %r5, %r24;\n"
+    "    add.u64 %rd10, %rd10, %rd11;\n"
+    "    mul.wide.u32 %rd12, %r4, %r25;\n"
+    "    add.u64 %rd10, %rd10, %rd12;\n"
+    "    setp.ne.u32 %p2, %r26, 0;\n"
+    "    @%p2 bra LANCZOS_STORE_WIDE;\n"
+    "    // narrow back to 8 bits, dividing by 256\n"
+    "    mul.f32 %f22, %f21, 0f3B800000;\n"
+    "    cvt.rni.u32.f32 %r27, %f22;\n"
+    "    min.u32 %r27, %r27, 255;\n"
+    "    st.global.u8 [%rd10], %r27;\n"
+    "    bra LANCZOS_DONE;\n"
+    "LANCZOS_STORE_WIDE:\n"
+    "    cvt.rni.u32.f32 %r27, %f21;\n"
+    "    min.u32 %r27, %r27, 65535;\n"
+    "    st.global.u16 [%rd10], %r27;\n"
+    "\n"
+    "LANCZOS_DONE:\n"
+    "    ret;\n"
+    "}\n"
+    "\n"
+    ".visible .entry nvd_yuv_to_rgb(\n"
+    "    .param .u64 dst,\n"
+    "    .param .u32 dstPitch,\n"
+    "    .param .u32 width,\n"
+    "    .param .u32 height,\n"
+    "    .param .u64 srcY,\n"
+    "    .param .u64 srcU,\n"
+    "    .param .u64 srcV,\n"
+    "    .param .u32 srcPitch,\n"
+    "    .param .f32 yOffset,\n"
+    "    .param .f32 yScale,\n"
+    "    .param .f32 cOffset,\n"
+    "    .param .f32 rv,\n"
+    "    .param .f32 gu,\n"
+    "    .param .f32 gv,\n"
+    "    .param .f32 bu,\n"
+    "    .param .u32 bgr\n"
+    ")\n"
+    "{\n"
+    "    .reg .pred %p<4>;\n"
+    "    .reg .b32 %r<24>;\n"
+    "    .reg .f32 %f<24>;\n"
+    "    .reg .b64 %rd<12>;\n"
+    "\n"
+    "    mov.u32 %r1, %ctaid.x;\n"
+    "    mov.u32 %r2, %ntid.x;\n"
+    "    mov.u32 %r3, %tid.x;\n"
+    "    mad.lo.u32 %r4, %r1, %r2, %r3;\n"
+    "    mov.u32 %r1, %ctaid.y;\n"
+    "    mov.u32 %r2, %ntid.y;\n"
+    "    mov.u32 %r3, %tid.y;\n"
+    "    mad.lo.u32 %r5, %r1, %r2, %r3;\n"
+    "    ld.param.u32 %r6, [width];\n"
+    "    ld.param.u32 %r7, [height];\n"
+    "    setp.ge.u32 %p1, %r4, %r6;\n"
+    "    setp.ge.u32 %p2, %r5, %r7;\n"
+    "    or.pred %p1, %p1, %p2;\n"
+    "    @%p1 bra RGB_DONE;\n"
+    "\n"
+    "    ld.param.u32 %r8, [srcPitch];\n"
+    "    mul.wide.u32 %rd1, %r5, %r8;\n"
+    "    mul.wide.u32 %rd2, %r4, 2;\n"
+    "    add.u64 %rd1, %rd1, %rd2;\n"
+    "    ld.param.u64 %rd3, [srcY];\n"
+    "    ld.param.u64 %rd4, [srcU];\n"
+    "    ld.param.u64 %rd5, [srcV];\n"
+    "    add.u64 %rd3, %rd3, %rd1;\n"
+    "    add.u64 %rd4, %rd4, %rd1;\n"
+    "    add.u64 %rd5, %rd5, %rd1;\n"
+    "    ld.global.u16 %r9, [%rd3];\n"
+    "    ld.global.u16 %r10, [%rd4];\n"
+    "    ld.global.u16 %r11, [%rd5];\n"
+    "\n"
+    "    // back to 8-bit code values, dividing by 256, and centre the chroma on 0\n"
+    "    cvt.rn.f32.u32 %f1, %r9;\n"
+    "    cvt.rn.f32.u32 %f2, %r10;\n"
+    "    cvt.rn.f32.u32 %f3, %r11;\n"
+    "    mul.f32 %f1, %f1, 0f3B800000;\n"
+    "    mul.f32 %f2, %f2, 0f3B800000;\n"
+    "    mul.f32 %f3, %f3, 0f3B800000;\n"
+    "    ld.param.f32 %f13, [cOffset];\n"
+    "    sub.f32 %f2, %f2, %f13;\n"
+    "    sub.f32 %f3, %f3, %f13;\n"
+    "    ld.param.f32 %f4, [yOffset];\n"
+    "    ld.param.f32 %f5, [yScale];\n"
+    "    ld.param.f32 %f6, [rv];\n"
+    "    ld.param.f32 %f7, [gu];\n"
+    "    ld.param.f32 %f8, [gv];\n"
+    "    ld.param.f32 %f9, [bu];\n"
+    "    sub.f32 %f1, %f1, %f4;\n"
+    "    mul.f32 %f1, %f1, %f5;\n"
+    "    fma.rn.f32 %f10, %f6, %f3, %f1;\n"
+    "    fma.rn.f32 %f11, %f7, %f2, %f1;\n"
+    "    fma.rn.f32 %f11, %f8, %f3, %f11;\n"
+    "    fma.rn.f32 %f12, %f9, %f2, %f1;\n"
+    "\n"
+    "    // the conversions clamp negative values to 0\n"
+    "    cvt.rni.u32.f32 %r12, %f10;\n"
+    "    cvt.rni.u32.f32 %r13, %f11;\n"
+    "    cvt.rni.u32.f32 %r14, %f12;\n"
+    "    min.u32 %r12, %r12, 255;\n"
+    "    min.u32 %r13, %r13, 255;\n"
+    "    min.u32 %r14, %r14, 255;\n"
+    "    ld.param.u32 %r15, [bgr];\n"
+    "    setp.ne.u32 %p3, %r15, 0;\n"
+    "    selp.b32 %r16, %r14, %r12, %p3;\n"
+    "    selp.b32 %r17, %r12, %r14, %p3;\n"
+    "    shl.b32 %r13, %r13, 8;\n"
+    "    shl.b32 %r17, %r17, 16;\n"
+    "    or.b32 %r16, %r16, %r13;\n"
+    "    or.b32 %r16, %r16, %r17;\n"
+    "    or.b32 %r16, %r16, -16777216;\n"
+    "\n"
+    "    ld.param.u64 %rd6, [dst];\n"
+    "    ld.param.u32 %r18, [dstPitch];\n"
+    "    mul.wide.u32 %rd7, %r5, %r18;\n"
+    "    mul.wide.u32 %rd8, %r4, 4;\n"
+    "    add.u64 %rd6, %rd6, %rd7;\n"
+    "    add.u64 %rd6, %rd6, %rd8;\n"
+    "    st.global.u32 [%rd6], %r16;\n"
+    "\n"
+    "RGB_DONE:\n"
+    "    ret;\n"
+    "}\n"
+    "\n"
+    ".visible .entry nvd_transform_yuv(\n"
+    "    .param .u64 planeY,\n"
+    "    .param .u64 planeU,\n"
+    "    .param .u64 planeV,\n"
+    "    .param .u32 pitch,\n"
+    "    .param .u32 width,\n"
+    "    .param .u32 height,\n"
+    "    .param .f32 m0,\n"
+    "    .param .f32 m1,\n"
+    "    .param .f32 m2,\n"
+    "    .param .f32 m3,\n"
+    "    .param .f32 m4,\n"
+    "    .param .f32 m5,\n"
+    "    .param .f32 m6,\n"
+    "    .param .f32 m7,\n"
+    "    .param .f32 m8,\n"
+    "    .param .f32 inOffset,\n"
+    "    .param .f32 outOffset\n"
+    ")\n"
+    "{\n"
+    "    .reg .pred %p<4>;\n"
+    "    .reg .b32 %r<16>;\n"
+    "    .reg .f32 %f<24>;\n"
+    "    .reg .b64 %rd<8>;\n"
+    "\n"
+    "    mov.u32 %r1, %ctaid.x;\n"
+    "    mov.u32 %r2, %ntid.x;\n"
+    "    mov.u32 %r3, %tid.x;\n"
+    "    mad.lo.u32 %r4, %r1, %r2, %r3;\n"
+    "    mov.u32 %r1, %ctaid.y;\n"
+    "    mov.u32 %r2, %ntid.y;\n"
+    "    mov.u32 %r3, %tid.y;\n"
+    "    mad.lo.u32 %r5, %r1, %r2, %r3;\n"
+    "    ld.param.u32 %r6, [width];\n"
+    "    ld.param.u32 %r7, [height];\n"
+    "    setp.ge.u32 %p1, %r4, %r6;\n"
+    "    setp.ge.u32 %p2, %r5, %r7;\n"
+    "    or.pred %p1, %p1, %p2;\n"
+    "    @%p1 bra TRANSFORM_DONE;\n"
+    "\n"
+    "    ld.param.u32 %r8, [pitch];\n"
+    "    mul.wide.u32 %rd1, %r5, %r8;\n"
+    "    mul.wide.u32 %rd2, %r4, 2;\n"
+    "    add.u64 %rd1, %rd1, %rd2;\n"
+    "    ld.param.u64 %rd3, [planeY];\n"
+    "    ld.param.u64 %rd4, [planeU];\n"
+    "    ld.param.u64 %rd5, [planeV];\n"
+    "    add.u64 %rd3, %rd3, %rd1;\n"
+    "    add.u64 %rd4, %rd4, %rd1;\n"
+    "    add.u64 %rd5, %rd5, %rd1;\n"
+    "    ld.global.u16 %r9, [%rd3];\n"
+    "    ld.global.u16 %r10, [%rd4];\n"
+    "    ld.global.u16 %r11, [%rd5];\n"
+    "\n"
+    "    // to 8-bit code values, dividing by 256, relative to black and to the centre of the chroma\n"
+    "    cvt.rn.f32.u32 %f1, %r9;\n"
+    "    cvt.rn.f32.u32 %f2, %r10;\n"
+    "    cvt.rn.f32.u32 %f3, %r11;\n"
+    "    ld.param.f32 %f13, [inOffset];\n"
+    "    neg.f32 %f13, %f13;\n"
+    "    fma.rn.f32 %f1, %f1, 0f3B800000, %f13;\n"
+    "    fma.rn.f32 %f2, %f2, 0f3B800000, 0fC3000000;\n"
+    "    fma.rn.f32 %f3, %f3, 0f3B800000, 0fC3000000;\n"
+    "    ld.param.f32 %f4, [m0];\n"
+    "    ld.param.f32 %f5, [m1];\n"
+    "    ld.param.f32 %f6, [m2];\n"
+    "    ld.param.f32 %f7, [m3];\n"
+    "    ld.param.f32 %f8, [m4];\n"
+    "    ld.param.f32 %f9, [m5];\n"
+    "    ld.param.f32 %f10, [m6];\n"
+    "    ld.param.f32 %f11, [m7];\n"
+    "    ld.param.f32 %f12, [m8];\n"
+    "    ld.param.f32 %f13, [outOffset];\n"
+    "    fma.rn.f32 %f14, %f4, %f1, %f13;\n"
+    "    fma.rn.f32 %f14, %f5, %f2, %f14;\n"
+    "    fma.rn.f32 %f14, %f6, %f3, %f14;\n"
+    "    fma.rn.f32 %f15, %f7, %f1, 0f43000000;\n"
+    "    fma.rn.f32 %f15, %f8, %f2, %f15;\n"
+    "    fma.rn.f32 %f15, %f9, %f3, %f15;\n"
+    "    fma.rn.f32 %f16, %f10, %f1, 0f43000000;\n"
+    "    fma.rn.f32 %f16, %f11, %f2, %f16;\n"
+    "    fma.rn.f32 %f16, %f12, %f3, %f16;\n"
+    "\n"
+    "    // back to 16-bit samples, the conversions clamp negative values to 0\n"
+    "    mul.f32 %f14, %f14, 0f43800000;\n"
+    "    mul.f32 %f15, %f15, 0f43800000;\n"
+    "    mul.f32 %f16, %f16, 0f43800000;\n"
+    "    cvt.rni.u32.f32 %r12, %f14;\n"
+    "    cvt.rni.u32.f32 %r13, %f15;\n"
+    "    cvt.rni.u32.f32 %r14, %f16;\n"
+    "    min.u32 %r12, %r12, 65535;\n"
+    "    min.u32 %r13, %r13, 65535;\n"
+    "    min.u32 %r14, %r14, 65535;\n"
+    "    st.global.u16 [%rd3], %r12;\n"
+    "    st.global.u16 [%rd4], %r13;\n"
+    "    st.global.u16 [%rd5], %r14;\n"
+    "\n"
+    "TRANSFORM_DONE:\n"
+    "    ret;\n"
+    "}\n"
+    "\n"
+    "// the grain of row i of a stripe of 32 luma rows at column x, blended with the block to the left where they overlap.\n"
+    "// The tables are laid out as NVFilmGrainTables, grain is the plane's template and tw it's width. ssub is 1 for chroma\n"
+    ".func (.reg .b32 %gout) nvd_grain_stripe(\n"
+    "    .reg .b64 %tab,\n"
+    "    .reg .b64 %grain,\n"
+    "    .reg .b32 %tw,\n"
+    "    .reg .b32 %ssub,\n"
+    "    .reg .b32 %stripe,\n"
+    "    .reg .b32 %row,\n"
+    "    .reg .b32 %x\n"
+    ")\n"
+    "{\n"
+    "    .reg .pred %p<4>;\n"
+    "    .reg .b32 %r<24>;\n"
+    "    .reg .b64 %rd<4>;\n"
+    "\n"
+    "    // the block the column is in and the column within it, blocks are 32 luma samples wide\n"
+    "    mov.u32 %r1, 5;\n"
+    "    sub.u32 %r1, %r1, %ssub;\n"
+    "    shr.u32 %r2, %x, %r1;\n"
+    "    shl.b32 %r3, %r2, %r1;\n"
+    "    sub.u32 %r3, %x, %r3;\n"
+    "    ld.global.u32 %r4, [%tab];\n"
+    "    mad.lo.u32 %r5, %stripe, %r4, %r2;\n"
+    "    // the random offsets index the template in steps of 2 luma samples, from 9 in, or 1 chroma sample from 6 in\n"
+    "    mul.lo.u32 %r6, %ssub, 3;\n"
+    "    mov.u32 %r7, 9;\n"
+    "    sub.u32 %r6, %r7, %r6;\n"
+    "    mov.u32 %r7, 1;\n"
+    "    sub.u32 %r7, %r7, %ssub;\n"
+    "\n"
+    "    cvt.u64.u32 %rd1, %r5;\n"
+    "    add.u64 %rd1, %tab, %rd1;\n"
+    "    ld.global.u8 %r8, [%rd1+31020];\n"
+    "    and.b32 %r9, %r8, 15;\n"
+    "    shl.b32 %r9, %r9, %r7;\n"
+    "    add.u32 %r9, %r9, %r6;\n"
+    "    add.u32 %r9, %r9, %row;\n"
+    "    shr.u32 %r8, %r8, 4;\n"
+    "    shl.b32 %r8, %r8, %r7;\n"
+    "    add.u32 %r8, %r8, %r6;\n"
+    "    add.u32 %r8, %r8, %r3;\n"
+    "    mad.lo.u32 %r9, %r9, %tw, %r8;\n"
+    "    mul.wide.u32 %rd2, %r9, 2;\n"
+    "    add.u64 %rd2, %grain, %rd2;\n"
+    "    ld.global.s16 %r10, [%rd2];\n"
+    "\n"
+    "    // the first 2 luma or 1 chroma columns of a block overlap the end of the one to the left\n"
+    "    ld.global.u32 %r11, [%tab+4];\n"
+    "    setp.eq.u32 %p1, %r11, 0;\n"
+    "    setp.eq.u32 %p2, %r2, 0;\n"
+    "    or.pred %p1, %p1, %p2;\n"
+    "    mov.u32 %r12, 2;\n"
+    "    shr.u32 %r12, %r12, %ssub;\n"
+    "    setp.ge.u32 %p2, %r3, %r12;\n"
+    "    or.pred %p1, %p1, %p2;\n"
+    "    @%p1 bra STRIPE_DONE;\n"
+    "\n"
+    "    sub.u32 %r5, %r5, 1;\n"
+    "    mov.u32 %r13, 32;\n"
+    "    shr.u32 %r13, %r13, %ssub;\n"
+    "    add.u32 %r13, %r13, %r3;\n"
+    "    cvt.u64.u32 %rd1, %r5;\n"
+    "    add.u64 %rd1, %tab, %rd1;\n"
+    "    ld.global.u8 %r8, [%rd1+31020];\n"
+    "    and.b32 %r9, %r8, 15;\n"
+    "    shl.b32 %r9, %r9, %r7;\n"
+    "    add.u32 %r9, %r9, %r6;\n"
+    "    add.u32 %r9, %r9, %row;\n"
+    "    shr.u32 %r8, %r8, 4;\n"
+    "    shl.b32 %r8, %r8, %r7;\n"
+    "    add.u32 %r8, %r8, %r6;\n"
+    "    add.u32 %r8, %r8, %r13;\n"
+    "    mad.lo.u32 %r9, %r9, %tw, %r8;\n"
+    "    mul.wide.u32 %rd2, %r9, 2;\n"
+    "    add.u64 %rd2, %grain, %rd2;\n"
+    "    ld.global.s16 %r14, [%rd2];\n"
+    "\n"
+    "    // (27, 17) then (17, 27) for luma, (23, 22) for chroma, out of 32\n"
+    "    setp.eq.u32 %p2, %r3, 0;\n"
+    "    selp.u32 %r15, 27, 17, %p2;\n"
+    "    selp.u32 %r16, 17, 27, %p2;\n"
+    "    setp.ne.u32 %p3, %ssub, 0;\n"
+    "    selp.u32 %r15, 23, %r15, %p3;\n"
+    "    selp.u32 %r16, 22, %r16, %p3;\n"
+    "    mul.lo.s32 %r17, %r14, %r15;\n"
+    "    mad.lo.s32 %r17, %r10, %r16, %r17;\n"
+    "    add.s32 %r17, %r17, 16;\n"
+    "    shr.s32 %r17, %r17, 5;\n"
+    "    ld.global.s32 %r18, [%tab+12];\n"
+    "    ld.global.s32 %r19, [%tab+16];\n"
+    "    max.s32 %r17, %r17, %r18;\n"
+    "    min.s32 %r10, %r17, %r19;\n"
+    "\n"
+    "STRIPE_DONE:\n"
+    "    mov.b32 %gout, %r10;\n"
+    "    ret;\n"
+    "}\n"
+    "\n"
+    "// the grain at x, y of a plane, blended with the stripe above where they overlap\n"
+    ".func (.reg .b32 %nout) nvd_grain_noise(\n"
+    "    .reg .b64 %tab,\n"
+    "    .reg .b64 %grain,\n"
+    "    .reg .b32 %tw,\n"
+    "    .reg .b32 %ssub,\n"
+    "    .reg .b32 %x,\n"
+    "    .reg .b32 %y\n"
+    ")\n"
+    "{\n"
+    "    .reg .pred %p<4>;\n"
+    "    .reg .b32 %r<24>;\n"
+    "\n"
+    "    mov.u32 %r1, 5;\n"
+    "    sub.u32 %r1, %r1, %ssub;\n"
+    "    shr.u32 %r2, %y, %r1;\n"
+    "    shl.b32 %r3, %r2, %r1;\n"
+    "    sub.u32 %r3, %y, %r3;\n"
+    "    call (%r4), nvd_grain_stripe, (%tab, %grain, %tw, %ssub, %r2, %r3, %x);\n"
+    "\n"
+    "    // the first 2 luma or 1 chroma rows of a stripe overlap the end of the one above\n"
+    "    ld.global.u32 %r5, [%tab+4];\n"
+    "    setp.eq.u32 %p1, %r5, 0;\n"
+    "    setp.eq.u32 %p2, %r2, 0;\n"
+    "    or.pred %p1, %p1, %p2;\n"
+    "    mov.u32 %r6, 2;\n"
+    "    shr.u32 %r6, %r6, %ssub;\n"
+    "    setp.ge.u32 %p2, %r3, %r6;\n"
+    "    or.pred %p1, %p1, %p2;\n"
+    "    @%p1 bra NOISE_DONE;\n"
+    "\n"
+    "    sub.u32 %r7, %r2, 1;\n"
+    "    mov.u32 %r8, 32;\n"
+    "    shr.u32 %r8, %r8, %ssub;\n"
+    "    add.u32 %r8, %r8, %r3;\n"
+    "    call (%r9), nvd_grain_stripe, (%tab, %grain, %tw, %ssub, %r7, %r8, %x);\n"
+    "\n"
+    "    setp.eq.u32 %p2, %r3, 0;\n"
+    "    selp.u32 %r10, 27, 17, %p2;\n"
+    "    selp.u32 %r11, 17, 27, %p2;\n"
+    "    setp.ne.u32 %p3, %ssub, 0;\n"
+    "    selp.u32 %r10, 23, %r10, %p3;\n"
+    "    selp.u32 %r11, 22, %r11, %p3;\n"
+    "    mul.lo.s32 %r12, %r9, %r10;\n"
+    "    mad.lo.s32 %r12, %r4, %r11, %r12;\n"
+    "    add.s32 %r12, %r12, 16;\n"
+    "    shr.s32 %r12, %r12, 5;\n"
+    "    ld.global.s32 %r13, [%tab+12];\n"
+    "    ld.global.s32 %r14, [%tab+16];\n"
+    "    max.s32 %r12, %r12, %r13;\n"
+    "    min.s32 %r4, %r12, %r14;\n"
+    "\n"
+    "NOISE_DONE:\n"
+    "    mov.b32 %nout, %r4;\n"
+    "    ret;\n"
+    "}\n"
+    "\n"
+    ".visible .entry nvd_film_grain_luma(\n"
+    "    .param .u64 dst,\n"
+    "    .param .u32 dstPitch,\n"
+    "    .param .u64 src,\n"
+    "    .param .u32 srcPitch,\n"
+    "    .param .u32 width,\n"
+    "    .param .u32 height,\n"
+    "    .param .u32 wide,\n"
+    "    .param .u32 sampleShift,\n"
+    "    .param .u64 tables\n"
+    ")\n"
+    "{\n"
+    "    .reg .pred %p<4>;\n"
+    "    .reg .b32 %r<24>;\n"
+    "    .reg .b64 %rd<8>;\n"
+    "\n"
+    "    mov.u32 %r1, %ctaid.x;\n"
+    "    mov.u32 %r2, %ntid.x;\n"
+    "    mov.u32 %r3, %tid.x;\n"
+    "    mad.lo.u32 %r4, %r1, %r2, %r3;\n"
+    "    mov.u32 %r1, %ctaid.y;\n"
+    "    mov.u32 %r2, %ntid.y;\n"
+    "    mov.u32 %r3, %tid.y;\n"
+    "    mad.lo.u32 %r5, %r1, %r2, %r3;\n"
+    "    ld.param.u32 %r6, [width];\n"
+    "    ld.param.u32 %r7, [height];\n"
+    "    setp.ge.u32 %p1, %r4, %r6;\n"
+    "    setp.ge.u32 %p2, %r5, %r7;\n"
+    "    or.pred %p1, %p1, %p2;\n"
+    "    @%p1 bra LUMA_DONE;\n"
+    "\n"
+    "    ld.param.u64 %rd1, [src];\n"
+    "    ld.param.u32 %r8, [srcPitch];\n"
+    "    ld.param.u64 %rd2, [dst];\n"
+    "    ld.param.u32 %r9, [dstPitch];\n"
+    "    ld.param.u32 %r10, [wide];\n"
+    "    ld.param.u32 %r11, [sampleShift];\n"
+    "    ld.param.u64 %rd3, [tables];\n"
+    "    mul.wide.u32 %rd4, %r5, %r8;\n"
+    "    add.u64 %rd1, %rd1, %rd4;\n"
+    "    mul.wide.u32 %rd4, %r5, %r9;\n"
+    "    add.u64 %rd2, %rd2, %rd4;\n"
+    "    setp.ne.u32 %p3, %r10, 0;\n"
+    "    @%p3 bra LUMA_LOAD_WIDE;\n"
+    "    cvt.u64.u32 %rd4, %r4;\n"
+    "    add.u64 %rd1, %rd1, %rd4;\n"
+    "    add.u64 %rd2, %rd2, %rd4;\n"
+    "    ld.global.u8 %r12, [%rd1];\n"
+    "    bra LUMA_GRAIN;\n"
+    "LUMA_LOAD_WIDE:\n"
+    "    mul.wide.u32 %rd4, %r4, 2;\n"
+    "    add.u64 %rd1, %rd1, %rd4;\n"
+    "    add.u64 %rd2, %rd2, %rd4;\n"
+    "    ld.global.u16 %r12, [%rd1];\n"
+    "    shr.u32 %r12, %r12, %r11;\n"
+    "\n"
+    "LUMA_GRAIN:\n"
+    "    add.u64 %rd5, %rd3, 72;\n"
+    "    mov.u32 %r13, 82;\n"
+    "    mov.u32 %r14, 0;\n"
+    "    call (%r15), nvd_grain_noise, (%rd3, %rd5, %r13, %r14, %r4, %r5);\n"
+    "\n"
+    "    // the grain is scaled by the scaling function of the sample it's added to\n"
+    "    cvt.u64.u32 %rd6, %r12;\n"
+    "    add.u64 %rd6, %rd3, %rd6;\n"
+    "    ld.global.u8 %r16, [%rd6+18732];\n"
+    "    ld.global.u32 %r17, [%rd3+8];\n"
+    "    mul.lo.s32 %r15, %r15, %r16;\n"
+    "    sub.u32 %r18, %r17, 1;\n"
+    "    mov.u32 %r19, 1;\n"
+    "    shl.b32 %r19, %r19, %r18;\n"
+    "    add.s32 %r15, %r15, %r19;\n"
+    "    shr.s32 %r15, %r15, %r17;\n"
+    "    add.s32 %r12, %r12, %r15;\n"
+    "    ld.global.s32 %r20, [%rd3+24];\n"
+    "    ld.global.s32 %r21, [%rd3+36];\n"
+    "    max.s32 %r12, %r12, %r20;\n"
+    "    min.s32 %r12, %r12, %r21;\n"
+    "\n"
+    "    @%p3 bra LUMA_STORE_WIDE;\n"
+    "    st.global.u8 [%rd2], %r12;\n"
+    "    bra LUMA_DONE;\n"
+    "LUMA_STORE_WIDE:\n"
+    "    shl.b32 %r12, %r12, %r11;\n"
+    "    st.global.u16 [%rd2], %r12;\n"
+    "\n"
+    "LUMA_DONE:\n"
+    "    ret;\n"
+    "}\n"
+    "\n"
+    "// each thread does both the Cb and the Cr sample at x, y of an interleaved chroma plane, whose luma plane is srcLuma\n"
+    ".visible .entry nvd_film_grain_chroma(\n"
+    "    .param .u64 dst,\n"
+    "    .param .u32 dstPitch,\n"
+    "    .param .u64 src,\n"
+    "    .param .u64 srcLuma,\n"
+    "    .param .u32 srcPitch,\n"
+    "    .param .u32 width,\n"
+    "    .param .u32 height,\n"
+    "    .param .u32 wide,\n"
+    "    .param .u32 sampleShift,\n"
+    "    .param .u64 tables\n"
+    ")\n"
+    "{\n"
+    "    .reg .pred %p<4>;\n"
+    "    .reg .b32 %r<40>;\n"
+    "    .reg .b64 %rd<16>;\n"
+    "\n"
+    "    mov.u32 %r1, %ctaid.x;\n"
+    "    mov.u32 %r2, %ntid.x;\n"
+    "    mov.u32 %r3, %tid.x;\n"
+    "    mad.lo.u32 %r4, %r1, %r2, %r3;\n"
+    "    mov.u32 %r1, %ctaid.y;\n"
+    "    mov.u32 %r2, %ntid.y;\n"
+    "    mov.u32 %r3, %tid.y;\n"
+    "    mad.lo.u32 %r5, %r1, %r2, %r3;\n"
+    "    ld.param.u32 %r6, [width];\n"
+    "    ld.param.u32 %r7, [height];\n"
+    "    add.u32 %r1, %r6, 1;\n"
+    "    shr.u32 %r1, %r1, 1;\n"
+    "    add.u32 %r2, %r7, 1;\n"
+    "    shr.u32 %r2, %r2, 1;\n"
+    "    setp.ge.u32 %p1, %r4, %r1;\n"
+    "    setp.ge.u32 %p2, %r5, %r2;\n"
+    "    or.pred %p1, %p1, %p2;\n"
+    "    @%p1 bra CHROMA_DONE;\n"
+    "\n"
+    "    ld.param.u64 %rd1, [src];\n"
+    "    ld.param.u64 %rd2, [srcLuma];\n"
+    "    ld.param.u32 %r8, [srcPitch];\n"
+    "    ld.param.u64 %rd3, [dst];\n"
+    "    ld.param.u32 %r9, [dstPitch];\n"
+    "    ld.param.u32 %r10, [wide];\n"
+    "    ld.param.u32 %r11, [sampleShift];\n"
+    "    ld.param.u64 %rd4, [tables];\n"
+    "    setp.ne.u32 %p3, %r10, 0;\n"
+    "    // bytes per sample\n"
+    "    selp.u32 %r10, 2, 1, %p3;\n"
+    "\n"
+    "    // the average of the two luma samples on the chroma sample's row, the second clamped to the frame\n"
+    "    shl.b32 %r12, %r4, 1;\n"
+    "    add.u32 %r13, %r12, 1;\n"
+    "    sub.u32 %r14, %r6, 1;\n"
+    "    min.u32 %r13, %r13, %r14;\n"
+    "    shl.b32 %r14, %r5, 1;\n"
+    "    mul.wide.u32 %rd5, %r14, %r8;\n"
+    "    add.u64 %rd2, %rd2, %rd5;\n"
+    "    mul.wide.u32 %rd5, %r12, %r10;\n"
+    "    add.u64 %rd5, %rd2, %rd5;\n"
+    "    mul.wide.u32 %rd6, %r13, %r10;\n"
+    "    add.u64 %rd6, %rd2, %rd6;\n"
+    "    @%p3 bra CHROMA_LUMA_WIDE;\n"
+    "    ld.global.u8 %r15, [%rd5];\n"
+    "    ld.global.u8 %r16, [%rd6];\n"
+    "    bra CHROMA_AVERAGE;\n"
+    "CHROMA_LUMA_WIDE:\n"
+    "    ld.global.u16 %r15, [%rd5];\n"
+    "    ld.global.u16 %r16, [%rd6];\n"
+    "    shr.u32 %r15, %r15, %r11;\n"
+    "    shr.u32 %r16, %r16, %r11;\n"
+    "CHROMA_AVERAGE:\n"
+    "    add.u32 %r15, %r15, %r16;\n"
+    "    add.u32 %r15, %r15, 1;\n"
+    "    shr.u32 %r15, %r15, 1;\n"
+    "\n"
+    "    // Cb then Cr, sample addresses in rd1 and rd3 step along to the next component\n"
+    "    mul.wide.u32 %rd5, %r5, %r8;\n"
+    "    add.u64 %rd1, %rd1, %rd5;\n"
+    "    mul.wide.u32 %rd5, %r5, %r9;\n"
+    "    add.u64 %rd3, %rd3, %rd5;\n"
+    "    mul.wide.u32 %rd5, %r12, %r10;\n"
+    "    add.u64 %rd1, %rd1, %rd5;\n"
+    "    add.u64 %rd3, %rd3, %rd5;\n"
+    "    ld.global.u32 %r17, [%rd4+8];\n"
+    "    ld.global.s32 %r18, [%rd4+20];\n"
+    "    mov.u32 %r19, 0;\n"
+    "\n"
+    "CHROMA_COMPONENT:\n"
+    "    @%p3 bra CHROMA_LOAD_WIDE;\n"
+    "    ld.global.u8 %r20, [%rd1];\n"
+    "    bra CHROMA_GRAIN;\n"
+    "CHROMA_LOAD_WIDE:\n"
+    "    ld.global.u16 %r20, [%rd1];\n"
+    "    shr.u32 %r20, %r20, %r11;\n"
+    "\n"
+    "CHROMA_GRAIN:\n"
+    "    // the component's lumaMult, mult, offset, clipMin and clipMax, then it's template and scaling function\n"
+    "    mul.wide.u32 %rd7, %r19, 4;\n"
+    "    add.u64 %rd7, %rd4, %rd7;\n"
+    "    ld.global.s32 %r21, [%rd7+48];\n"
+    "    ld.global.s32 %r22, [%rd7+56];\n"
+    "    ld.global.s32 %r23, [%rd7+64];\n"
+    "    ld.global.s32 %r24, [%rd7+28];\n"
+    "    ld.global.s32 %r25, [%rd7+40];\n"
+    "    mul.lo.s32 %r26, %r15, %r21;\n"
+    "    mad.lo.s32 %r26, %r20, %r22, %r26;\n"
+    "    shr.s32 %r26, %r26, 6;\n"
+    "    add.s32 %r26, %r26, %r23;\n"
+    "    max.s32 %r26, %r26, 0;\n"
+    "    min.s32 %r26, %r26, %r18;\n"
+    "\n"
+    "    mul.wide.u32 %rd8, %r19, 3344;\n"
+    "    add.u64 %rd8, %rd4, %rd8;\n"
+    "    add.u64 %rd8, %rd8, 12044;\n"
+    "    mov.u32 %r27, 44;\n"
+    "    mov.u32 %r28, 1;\n"
+    "    call (%r29), nvd_grain_noise, (%rd4, %rd8, %r27, %r28, %r4, %r5);\n"
+    "\n"
+    "    mul.wide.u32 %rd9, %r19, 4096;\n"
+    "    add.u64 %rd9, %rd4, %rd9;\n"
+    "    cvt.u64.u32 %rd10, %r26;\n"
+    "    add.u64 %rd9, %rd9, %rd10;\n"
+    "    ld.global.u8 %r30, [%rd9+22828];\n"
+    "    mul.lo.s32 %r29, %r29, %r30;\n"
+    "    sub.u32 %r31, %r17, 1;\n"
+    "    mov.u32 %r32, 1;\n"
+    "    shl.b32 %r32, %r32, %r31;\n"
+    "    add.s32 %r29, %r29, %r32;\n"
+    "    shr.s32 %r29, %r29, %r17;\n"
+    "    add.s32 %r20, %r20, %r29;\n"
+    "    max.s32 %r20, %r20, %r24;\n"
+    "    min.s32 %r20, %r20, %r25;\n"
+    "\n"
+    "    @%p3 bra CHROMA_STORE_WIDE;\n"
+    "    st.global.u8 [%rd3], %r20;\n"
+    "    bra CHROMA_NEXT;\n"
+    "CHROMA_STORE_WIDE:\n"
+    "    shl.b32 %r20, %r20, %r11;\n"
+    "    st.global.u16 [%rd3], %r20;\n"
+    "\n"
+    "CHROMA_NEXT:\n"
+    "    cvt.u64.u32 %rd5, %r10;\n"
+    "    add.u64 %rd1, %rd1, %rd5;\n"
+    "    add.u64 %rd3, %rd3, %rd5;\n"
+    "    add.u32 %r19, %r19, 1;\n"
+    "    setp.lt.u32 %p1, %r19, 2;\n"
+    "    @%p1 bra CHROMA_COMPONENT;\n"
+    "\n"
+    "CHROMA_DONE:\n"
+    "    ret;\n"
+    "}\n";
+
+//the film grain kernels read NVFilmGrainTables at these offsets
+_Static_assert(offsetof(NVFilmGrainTables, overlap) == 4 && offsetof(NVFilmGrainTables, scalingShift) == 8
+               && offsetof(NVFilmGrainTables, grainMin) == 12 && offsetof(NVFilmGrainTables, grainMax) == 16
+               && offsetof(NVFilmGrainTables, maxSample) == 20 && offsetof(NVFilmGrainTables, clipMin) == 24
+               && offsetof(NVFilmGrainTables, clipMax) == 36 && offsetof(NVFilmGrainTables, lumaMult) == 48
+               && offsetof(NVFilmGrainTables, mult) == 56 && offsetof(NVFilmGrainTables, offset) == 64
+               && offsetof(NVFilmGrainTables, lumaGrain) == 72 && offsetof(NVFilmGrainTables, cbGrain) == 12044
+               && offsetof(NVFilmGrainTables, crGrain) == 15388 && offsetof(NVFilmGrainTables, scaling) == 18732
+               && offsetof(NVFilmGrainTables, offsets) == 31020, "film grain kernels out of step with NVFilmGrainTables");
+
+#define PACK_BLOCK_WIDTH 32
+#define PACK_BLOCK_HEIGHT 8
+
+void initKernels(NVKernels *kernels) {
+    pthread_mutex_init(&kernels->mutex, NULL);
+    kernels->loaded = false;
+    kernels->module = NULL;
+    kernels->packPlane = NULL;
+    kernels->scalePlane = NULL;
+    kernels->scalePlaneLanczos = NULL;
+    kernels->yuvToRgb = NULL;
+    kernels->transformYuv = NULL;
+    kernels->filmGrainLuma = NULL;
+    kernels->filmGrainChroma = NULL;
+}
+
+bool ensureKernels(CudaFunctions *cu, NVKernels *kernels) {
+    pthread_mutex_lock(&kernels->mutex);
+    if (!kernels->loaded) {
+        if (!CHECK_CUDA_RESULT(cu->cuModuleLoadData(&kernels->module, kernelsPtx))) {
+            if (CHECK_CUDA_RESULT(cu->cuModuleGetFunction(&kernels->packPlane, kernels->module, "nvd_pack_plane"))
+                    || CHECK_CUDA_RESULT(cu->cuModuleGetFunction(&kernels->scalePlane, kernels->module, "nvd_scale_plane"))
+                    || CHECK_CUDA_RESULT(cu->cuModuleGetFunction(&kernels->scalePlaneLanczos, kernels->module, "nvd_scale_plane_lanczos"))
+                    || CHECK_CUDA_RESULT(cu->cuModuleGetFunction(&kernels->yuvToRgb, kernels->module, "nvd_yuv_to_rgb"))
+                    || CHECK_CUDA_RESULT(cu->cuModuleGetFunction(&kernels->transformYuv, kernels->module, "nvd_transform_yuv"))
+                    || CHECK_CUDA_RESULT(cu->cuModuleGetFunction(&kernels->filmGrainLuma, kernels->module, "nvd_film_grain_luma"))
+                    || CHECK_CUDA_RESULT(cu->cuModuleGetFunction(&kernels->filmGrainChroma, kernels->module, "nvd_film_grain_chroma"))) {
+                CHECK_CUDA_RESULT(cu->cuModuleUnload(kernels->module));
+                kernels->module = NULL;
+            } else {
+                kernels->loaded = true;
+            }
+        }
+    }
+    bool ret = kernels->loaded;
+    pthread_mutex_unlock(&kernels->mutex);
+    return ret;
+}
+
+void unloadKernels(CudaFunctions *cu, NVKernels *kernels) {
+    pthread_mutex_lock(&kernels->mutex);
+    if (kernels->loaded) {
+        CHECK_CUDA_RESULT(cu->cuModuleUnload(kernels->module));
+        kernels->module = NULL;
+        kernels->packPlane = NULL;
+        kernels->scalePlane = NULL;
+        kernels->scalePlaneLanczos = NULL;
+        kernels->yuvToRgb = NULL;
+        kernels->transformYuv = NULL;
+        kernels->filmGrainLuma = NULL;
+        kernels->filmGrainChroma = NULL;
+        kernels->loaded = false;
+    }
+    pthread_mutex_unlock(&kernels->mutex);
+}
+
+bool packPlane(CudaFunctions *cu, const NVKernels *kernels, CUdeviceptr dst, uint32_t dstPitch,
+               CUdeviceptr srcA, CUdeviceptr srcB, uint32_t srcPitch, uint32_t width, uint32_t height,
+               bool wide, CUstream stream) {
+    uint32_t wideParam = wide ? 1 : 0;
+    void *params[] = { &dst, &dstPitch, &srcA, &srcB, &srcPitch, &width, &height, &wideParam };
+    CHECK_CUDA_RESULT_RETURN(cu->cuLaunchKernel(kernels->packPlane,
+                                               (width + PACK_BLOCK_WIDTH - 1) / PACK_BLOCK_WIDTH,
+                                               (height + PACK_BLOCK_HEIGHT - 1) / PACK_BLOCK_HEIGHT, 1,
+                                               PACK_BLOCK_WIDTH, PACK_BLOCK_HEIGHT, 1,
+                                               0, stream, params, NULL), false);
+    return true;
+}
+
+bool scalePlane(CudaFunctions *cu, const NVKernels *kernels, const NVPlaneChannel *dst, const NVPlaneChannel *src,
+                NVScaleFilter filter, CUstream stream) {
+    if (dst->width == 0 || dst->height == 0 || src->width == 0 || src->height == 0) {
+        return true;
+    }
+    uint32_t dstWide = dst->wide ? 1 : 0, srcWide = src->wide ? 1 : 0, bilinearParam = filter == NV_SCALE_BILINEAR ? 1 : 0;
+    CUdeviceptr dstPtr = dst->ptr, srcPtr = src->ptr;
+    uint32_t dstPitch = dst->pitch, dstStride = dst->stride, dstWidth = dst->width, dstHeight = dst->height;
+    uint32_t srcPitch = src->pitch, srcStride = src->stride, srcWidth = src->width, srcHeight = src->height;
+    //the Lanczos kernel takes the same parameters, less the last
+    void *params[] = { &dstPtr, &dstPitch, &dstStride, &dstWide, &dstWidth, &dstHeight,
+                       &srcPtr, &srcPitch, &srcStride, &srcWide, &srcWidth, &srcHeight, &bilinearParam };
+    CHECK_CUDA_RESULT_RETURN(cu->cuLaunchKernel(filter == NV_SCALE_LANCZOS ? kernels->scalePlaneLanczos : kernels->scalePlane,
+                                               (dstWidth + PACK_BLOCK_WIDTH - 1) / PACK_BLOCK_WIDTH,
+                                               (dstHeight + PACK_BLOCK_HEIGHT - 1) / PACK_BLOCK_HEIGHT, 1,
+                                               PACK_BLOCK_WIDTH, PACK_BLOCK_HEIGHT, 1,
+                                               0, stream, params, NULL), false);
+    return true;
+}
+
+bool yuvToRgb(CudaFunctions *cu, const NVKernels *kernels, CUdeviceptr dst, uint32_t dstPitch, uint32_t width, uint32_t height,
+              const CUdeviceptr src[3], uint32_t srcPitch, const NVColourMatrix *matrix, bool bgr, CUstream stream) {
+    if (width == 0 || height == 0) {
+        return true;
+    }
+    CUdeviceptr srcY = src[0], srcU = src[1], srcV = src[2];
+    float yOffset = matrix->yOffset, yScale = matrix->yScale, cOffset = matrix->cOffset;
+    float rv = matrix->rv, gu = matrix->gu, gv = matrix->gv, bu = matrix->bu;
+    uint32_t bgrParam = bgr ? 1 : 0;
+    void *params[] = { &dst, &dstPitch, &width, &height, &srcY, &srcU, &srcV, &srcPitch,
+                       &yOffset, &yScale, &cOffset, &rv, &gu, &gv, &bu, &bgrParam };
+    CHECK_CUDA_RESULT_RETURN(cu->cuLaunchKernel(kernels->yuvToRgb,
+                                               (width + PACK_BLOCK_WIDTH - 1) / PACK_BLOCK_WIDTH,
+                                               (height + PACK_BLOCK_HEIGHT - 1) / PACK_BLOCK_HEIGHT, 1,
+                                               PACK_BLOCK_WIDTH, PACK_BLOCK_HEIGHT, 1,
+                                               0, stream, params, NULL), false);
+    return true;
+}
+
+bool transformYuv(CudaFunctions *cu, const NVKernels *kernels, const CUdeviceptr planes[3], uint32_t pitch, uint32_t width,
+                  uint32_t height, const NVColourTransform *transform, CUstream stream) {
+    if (width == 0 || height == 0) {
+        return true;
+    }
+    CUdeviceptr planeY = planes[0], planeU = planes[1], planeV = planes[2];
+    float m[9];
+    for (int i = 0; i < 9; i++) {
+        m[i] = transform->matrix[i];
+    }
+    float inOffset = transform->inOffset, outOffset = transform->outOffset;
+    void *params[] = { &planeY, &planeU, &planeV, &pitch, &width, &height,
+                       &m[0], &m[1], &m[2], &m[3], &m[4], &m[5], &m[6], &m[7], &m[8], &inOffset, &outOffset };
+    CHECK_CUDA_RESULT_RETURN(cu->cuLaunchKernel(kernels->transformYuv,
+                                               (width + PACK_BLOCK_WIDTH - 1) / PACK_BLOCK_WIDTH,
+                                               (height + PACK_BLOCK_HEIGHT - 1) / PACK_BLOCK_HEIGHT, 1,
+                                               PACK_BLOCK_WIDTH, PACK_BLOCK_HEIGHT, 1,
+                                               0, stream, params, NULL), false);
+    return true;
+}
+
+bool applyFilmGrain(CudaFunctions *cu, const NVKernels *kernels, CUdeviceptr dst, uint32_t dstPitch, CUdeviceptr src,
+                    uint32_t srcPitch, uint32_t planeRows, uint32_t width, uint32_t height, bool wide, uint32_t bitDepth,
+                    CUdeviceptr tables, CUstream stream) {
+    if (width == 0 || height == 0) {
+        return true;
+    }
+    uint32_t wideParam = wide ? 1 : 0, sampleShift = wide ? 16 - bitDepth : 0;
+    void *lumaParams[] = { &dst, &dstPitch, &src, &srcPitch, &width, &height, &wideParam, &sampleShift, &tables };
+    CHECK_CUDA_RESULT_RETURN(cu->cuLaunchKernel(kernels->filmGrainLuma,
+                                               (width + PACK_BLOCK_WIDTH - 1) / PACK_BLOCK_WIDTH,
+                                               (height + PACK_BLOCK_HEIGHT - 1) / PACK_BLOCK_HEIGHT, 1,
+                                               PACK_BLOCK_WIDTH, PACK_BLOCK_HEIGHT, 1,
+                                               0, stream, lumaParams, NULL), false);
+    //a thread for each pair of Cb and Cr samples
+    CUdeviceptr dstChroma = dst + (CUdeviceptr) dstPitch * planeRows;
+    CUdeviceptr srcChroma = src + (CUdeviceptr) srcPitch * planeRows;
+    uint32_t chromaWidth = (width + 1) / 2, chromaHeight = (height + 1) / 2;
+    void *chromaParams[] = { &dstChroma, &dstPitch, &srcChroma, &src, &srcPitch, &width, &height, &wideParam, &sampleShift, &tables };
+    CHECK_CUDA_RESULT_RETURN(cu->cuLaunchKernel(kernels->filmGrainChroma,
+                                               (chromaWidth + PACK_BLOCK_WIDTH - 1) / PACK_BLOCK_WIDTH,
+                                               (chromaHeight + PACK_BLOCK_HEIGHT - 1) / PACK_BLOCK_HEIGHT, 1,
+                                               PACK_BLOCK_WIDTH, PACK_BLOCK_HEIGHT, 1,
+                                               0, stream, chromaParams, NULL), false);
+    return true;
+}
@@ -0,0 +1,93 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <ffnvcodec/dynlink_loader.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+//the few CUDA kernels the driver uses for layout conversion. They're shipped as PTX and JIT compiled by the CUDA driver
+//the first time they're needed, so we don't need nvcc at build time.
+typedef struct {
+    pthread_mutex_t mutex;
+    bool            loaded;
+    CUmodule        module;
+    CUfunction      packPlane;
+    CUfunction      scalePlane;
+    CUfunction      scalePlaneLanczos;
+    CUfunction      yuvToRgb;
+    CUfunction      transformYuv;
+    CUfunction      filmGrainLuma;
+    CUfunction      filmGrainChroma;
+} NVKernels;
+
+typedef enum {
+    NV_SCALE_NEAREST,
+    NV_SCALE_BILINEAR,
+    NV_SCALE_LANCZOS,   //Lanczos-2, over the 4x4 source samples nearest the point
+} NVScaleFilter;
+
+//one channel of a pitch-linear plane, whose samples are stride bytes apart. ptr points at the top left sample
+typedef struct {
+    CUdeviceptr ptr;
+    uint32_t    pitch;
+    uint32_t    stride;
+    bool        wide;       //16-bit samples, most significant bits used, rather than 8-bit
+    uint32_t    width;
+    uint32_t    height;
+} NVPlaneChannel;
+
+//Y'CbCr to R'G'B', applied as y = (Y - yOffset) * yScale, R = y + rv * cr, G = y + gu * cb + gv * cr, B = y + bu * cb
+//where cb = Cb - cOffset and cr = Cr - cOffset. Everything is in 8-bit code values, whatever the depth of the samples
+typedef struct {
+    float yOffset;
+    float yScale;
+    float cOffset;
+    float rv;
+    float gu;
+    float gv;
+    float bu;
+} NVColourMatrix;
+
+//Y'CbCr to the Y'CbCr of another colour standard or range, applied as out = matrix * (in - inOffsets) + outOffsets, rows
+//first, in 8-bit code values. The chroma offsets are always 128, the luma ones are inOffset and outOffset
+typedef struct {
+    float matrix[9];
+    float inOffset;
+    float outOffset;
+} NVColourTransform;
+
+void initKernels(NVKernels *kernels);
+//loads the module if it hasn't been already, must be called with the CUDA context current
+bool ensureKernels(CudaFunctions *cu, NVKernels *kernels);
+void unloadKernels(CudaFunctions *cu, NVKernels *kernels);
+
+//Writes a width x height block of 8-bit samples from srcA into dst. If srcB is set the samples from both planes are
+//interleaved (A0 B0 A1 B1...), as when building the chroma plane of NV12 from I420. If wide is set each sample is
+//written as the most significant byte of a 16-bit sample, as P010/P016 and Q416 expect.
+bool packPlane(CudaFunctions *cu, const NVKernels *kernels, CUdeviceptr dst, uint32_t dstPitch,
+               CUdeviceptr srcA, CUdeviceptr srcB, uint32_t srcPitch, uint32_t width, uint32_t height,
+               bool wide, CUstream stream);
+
+//Resamples src into dst with the given filter. The sample depths can differ, 8-bit samples are shifted into the top
+//of 16 bits on the way in and rounded back down on the way out.
+bool scalePlane(CudaFunctions *cu, const NVKernels *kernels, const NVPlaneChannel *dst, const NVPlaneChannel *src,
+                NVScaleFilter filter, CUstream stream);
+
+//Converts width x height pixels of planar 16-bit Y'CbCr, each plane srcPitch wide, into packed 8-bit RGBA, or BGRA if
+//bgr is set. Alpha is always opaque.
+bool yuvToRgb(CudaFunctions *cu, const NVKernels *kernels, CUdeviceptr dst, uint32_t dstPitch, uint32_t width, uint32_t height,
+              const CUdeviceptr src[3], uint32_t srcPitch, const NVColourMatrix *matrix, bool bgr, CUstream stream);
+
+//Applies transform in place to width x height pixels of planar 16-bit Y'CbCr, each plane pitch wide.
+bool transformYuv(CudaFunctions *cu, const NVKernels *kernels, const CUdeviceptr planes[3], uint32_t pitch, uint32_t width,
+                  uint32_t height, const NVColourTransform *transform, CUstream stream);
+
+//Adds AV1 film grain to the top left width x height pixels of a 4:2:0 frame laid out like NVDEC's output, with
+//planeRows rows of luma above the chroma, writing them to dst which is laid out the same. tables points to the
+//NVFilmGrainTables generateFilmGrain made for the frame. 16-bit samples hold bitDepth bits, most significant bits used.
+bool applyFilmGrain(CudaFunctions *cu, const NVKernels *kernels, CUdeviceptr dst, uint32_t dstPitch, CUdeviceptr src,
+                    uint32_t srcPitch, uint32_t planeRows, uint32_t width, uint32_t height, bool wide, uint32_t bitDepth,
+                    CUdeviceptr tables, CUstream stream);
+
+#endif // KERNELS_H
@@ -72,3 +72,169 @@ void *get_element_at(Array *arr, uint32_t index) {
     }
     return arr->buf[index];
 }
+
+static HandleSlot *handle_table_slot(HandleTable *table, uint32_t index) {
+    HandleSlot *chunk = atomic_load_explicit(&table->chunks[index >> HANDLE_CHUNK_BITS], memory_order_acquire);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    return &chunk[index & (HANDLE_CHUNK_SIZE - 1)];
+}
+
+uint32_t handle_table_insert(HandleTable *table, void *element) {
+    uint32_t index;
+    HandleSlot *slot;
+    if (table->freeHead != 0) {
+        //reuse the most recently freed slot
+        index = table->freeHead - 1;
+        slot = handle_table_slot(table, index);
+        table->freeHead = slot->nextFree;
+    } else {
+        if (table->used >= HANDLE_MAX_SLOTS) {
+            return HANDLE_INVALID;
+        }
+        index = table->used;
+        uint32_t chunkIdx = index >> HANDLE_CHUNK_BITS;
+        if (atomic_load_explicit(&table->chunks[chunkIdx], memory_order_relaxed) == NULL) {
+            HandleSlot *chunk = calloc(HANDLE_CHUNK_SIZE, sizeof(HandleSlot));
+            if (chunk == NULL) {
+                return HANDLE_INVALID;
+            }
+            atomic_store_explicit(&table->chunks[chunkIdx], chunk, memory_order_release);
+        }
+        table->used++;
+        slot = handle_table_slot(table, index);
+    }
+
+    //generation 0 is skipped so that a handle is never 0
+    slot->generation = (slot->generation + 1) & HANDLE_GENERATION_MASK;
+    if (slot->generation == 0) {
+        slot->generation = 1;
+    }
+    uint32_t handle = (slot->generation << HANDLE_INDEX_BITS) | index;
+
+    atomic_store_explicit(&slot->element, element, memory_order_relaxed);
+    atomic_store_explicit(&slot->handle, handle, memory_order_release);
+    table->count++;
+    return handle;
+}
+
+void *handle_table_get(HandleTable *table, uint32_t handle) {
+    if (handle == HANDLE_INVALID) {
+        return NULL;
+    }
+    HandleSlot *slot = handle_table_slot(table, handle & HANDLE_INDEX_MASK);
+    if (slot == NULL || atomic_load_explicit(&slot->handle, memory_order_acquire) != handle) {
+        return NULL;
+    }
+    void *element = atomic_load_explicit(&slot->element, memory_order_acquire);
+    //make sure the slot wasn't recycled while we were reading the element
+    if (atomic_load_explicit(&slot->handle, memory_order_acquire) != handle) {
+        return NULL;
+    }
+    return element;
+}
+
+void *handle_table_remove(HandleTable *table, uint32_t handle) {
+    if (handle == HANDLE_INVALID) {
+        return NULL;
+    }
+    uint32_t index = handle & HANDLE_INDEX_MASK;
+    HandleSlot *slot = handle_table_slot(table, index);
+    if (slot == NULL || atomic_load_explicit(&slot->handle, memory_order_relaxed) != handle) {
+        return NULL;
+    }
+    void *element = atomic_load_explicit(&slot->element, memory_order_relaxed);
+    atomic_store_explicit(&slot->handle, HANDLE_INVALID, memory_order_release);
+    atomic_store_explicit(&slot->element, NULL, memory_order_release);
+
+    slot->nextFree = table->freeHead;
+    table->freeHead = index + 1;
+    table->count--;
+    return element;
+}
+
+uint32_t handle_table_size(HandleTable *table) {
+    return table->used;
+}
+
+void *handle_table_get_at(HandleTable *table, uint32_t index, uint32_t *handle) {
+    if (index >= table->used) {
+        return NULL;
+    }
+    HandleSlot *slot = handle_table_slot(table, index);
+    uint32_t h = atomic_load_explicit(&slot->handle, memory_order_acquire);
+    if (h == HANDLE_INVALID) {
+        return NULL;
+    }
+    if (handle != NULL) {
+        *handle = h;
+    }
+    return atomic_load_explicit(&slot->element, memory_order_acquire);
+}
+
+void handle_table_free(HandleTable *table) {
+    for (uint32_t i = 0; i < HANDLE_MAX_CHUNKS; i++) {
+        free(atomic_load_explicit(&table->chunks[i], memory_order_relaxed));
+        atomic_store_explicit(&table->chunks[i], NULL, memory_order_relaxed);
+    }
+    table->used = 0;
+    table->freeHead = 0;
+    table->count = 0;
+}
+
+bool spsc_queue_init(SPSCQueue *queue, uint32_t capacity) {
+    uint32_t size = 2;
+    while (size < capacity && size < (1u << 31)) {
+        size <<= 1;
+    }
+    queue->buf = calloc(size, sizeof(void*));
+    if (queue->buf == NULL) {
+        return false;
+    }
+    queue->mask = size - 1;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    return true;
+}
+
+void spsc_queue_free(SPSCQueue *queue) {
+    free(queue->buf);
+    queue->buf = NULL;
+    queue->mask = 0;
+}
+
+bool spsc_queue_push(SPSCQueue *queue, void *element) {
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    if (head - tail > queue->mask) {
+        return false;
+    }
+    queue->buf[head & queue->mask] = element;
+    //seq_cst so that a consumer checking for work after announcing it's about to sleep is guaranteed to see this
+    atomic_store_explicit(&queue->head, head + 1, memory_order_seq_cst);
+    return true;
+}
+
+void *spsc_queue_pop(SPSCQueue *queue) {
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_seq_cst);
+    if (tail == head) {
+        return NULL;
+    }
+    void *element = queue->buf[tail & queue->mask];
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_seq_cst);
+    return element;
+}
+
+bool spsc_queue_full(SPSCQueue *queue) {
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_seq_cst);
+    return head - tail > queue->mask;
+}
+
+uint32_t spsc_queue_size(SPSCQueue *queue) {
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    return head - tail;
+}
@@ -1,5 +1,7 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 
 typedef struct {
     void **buf;
@@ -26,3 +28,62 @@ void *get_element_at(Array *arr, uint32_t index);
 void remove_and_free_element_at(Array *arr, uint32_t index);
 
 void* alloc_and_add_element(Array *arr, size_t size);
+
+//A slot table handing out 32-bit handles that encode the slot index in the low bits and a generation
+//counter in the high bits. Insert/remove must be serialised by the caller, lookups are lock-free.
+#define HANDLE_INDEX_BITS 20
+#define HANDLE_INDEX_MASK ((1u << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_GENERATION_MASK ((1u << (32 - HANDLE_INDEX_BITS)) - 1)
+#define HANDLE_CHUNK_BITS 8
+#define HANDLE_CHUNK_SIZE (1u << HANDLE_CHUNK_BITS)
+#define HANDLE_MAX_CHUNKS (1u << (HANDLE_INDEX_BITS - HANDLE_CHUNK_BITS))
+//the all-ones index is never handed out, so a handle can never be 0xffffffff (VA_INVALID_ID)
+#define HANDLE_MAX_SLOTS HANDLE_INDEX_MASK
+#define HANDLE_INVALID 0
+
+typedef struct {
+    _Atomic uint32_t    handle;
+    _Atomic(void*)      element;
+    uint32_t            generation;
+    uint32_t            nextFree;
+} HandleSlot;
+
+typedef struct {
+    _Atomic(HandleSlot*)    chunks[HANDLE_MAX_CHUNKS];
+    uint32_t                used;       //slots ever handed out, the high water mark
+    uint32_t                freeHead;   //index + 1 of the first free slot, 0 if the free list is empty
+    uint32_t                count;
+} HandleTable;
+
+uint32_t handle_table_insert(HandleTable *table, void *element);
+
+void *handle_table_get(HandleTable *table, uint32_t handle);
+
+void *handle_table_remove(HandleTable *table, uint32_t handle);
+
+uint32_t handle_table_size(HandleTable *table);
+
+void *handle_table_get_at(HandleTable *table, uint32_t index, uint32_t *handle);
+
+void handle_table_free(HandleTable *table);
+
+//A bounded single-producer/single-consumer ring. push must only be called from one thread and pop from
+//one (other) thread, neither side takes a lock.
+typedef struct {
+    void                **buf;
+    uint32_t            mask;       //capacity - 1, the capacity is always a power of two
+    _Atomic uint32_t    head;       //next slot to write, only advanced by the producer
+    _Atomic uint32_t    tail;       //next slot to read, only advanced by the consumer
+} SPSCQueue;
+
+bool spsc_queue_init(SPSCQueue *queue, uint32_t capacity);
+
+void spsc_queue_free(SPSCQueue *queue);
+
+bool spsc_queue_push(SPSCQueue *queue, void *element);
+
+void *spsc_queue_pop(SPSCQueue *queue);
+
+bool spsc_queue_full(SPSCQueue *queue);
+
+uint32_t spsc_queue_size(SPSCQueue *queue);
@@ -0,0 +1,275 @@
+#define _GNU_SOURCE
+
+#include "log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef __has_include
+#define __has_include(x) 0
+#endif
+
+#if __has_include(<pthread_np.h>)
+#include <pthread_np.h>
+#define gettid pthread_getthreadid_np
+#define HAVE_GETTID 1
+#endif
+
+#ifndef HAVE_GETTID
+#include <sys/syscall.h>
+#ifdef __BIONIC__
+#define HAVE_GETTID 1
+#elif !defined(__GLIBC_PREREQ)
+#define HAVE_GETTID 0
+#elif !__GLIBC_PREREQ(2,30)
+#define HAVE_GETTID 0
+#else
+#define HAVE_GETTID 1
+#endif
+#endif
+
+/* Messages are formatted by the thread that logs them into a ring of it's own, which a writer thread empties into
+ * LOG_OUTPUT, so a thread logging on a hot path never waits on the file or on another thread. A ring that's full
+ * drops the message and counts it instead of blocking. Rings belong to their thread until it exits, after which the
+ * writer frees them once they're empty. The writer wakes up every WRITER_INTERVAL_NS, or as soon as a ring gets half
+ * full or an error is logged. If the writer can't be started, or in a forked child that doesn't have one, messages
+ * are written straight out as they always were. */
+
+#define RING_SIZE           256     //messages each thread can have waiting to be written
+#define MESSAGE_SIZE        512
+#define WRITER_INTERVAL_NS  10000000
+
+typedef struct {
+    struct timespec time;
+    const char      *filename;
+    const char      *function;
+    int             line;
+    char            message[MESSAGE_SIZE];
+} NVLogRecord;
+
+typedef struct _NVLogRing {
+    struct _NVLogRing   *next;
+    pid_t               tid;
+    _Atomic uint32_t    head;       //only written by the thread the ring belongs to
+    _Atomic uint32_t    tail;       //only written by whoever holds logMutex
+    _Atomic uint32_t    dropped;
+    _Atomic bool        orphaned;   //the thread has exited
+    NVLogRecord         records[RING_SIZE];
+} NVLogRing;
+
+int nvLogLevel = -1;
+
+static FILE *LOG_OUTPUT;
+static pthread_mutex_t logMutex = PTHREAD_MUTEX_INITIALIZER;   //guards rings and writing to LOG_OUTPUT
+static pthread_cond_t writerCond = PTHREAD_COND_INITIALIZER;
+static NVLogRing *rings;
+static pthread_once_t writerOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t ringKey;
+static pthread_t writerThread;
+static bool writerRunning;
+static bool writerExiting;
+static __thread NVLogRing *threadRing;
+
+static pid_t nv_gettid(void)
+{
+#if HAVE_GETTID
+    return gettid();
+#else
+    return syscall(__NR_gettid);
+#endif
+}
+
+void logConfigure(const char *output, const char *level) {
+    if (output == NULL) {
+        return;
+    }
+    if (strcmp(output, "1") == 0) {
+        LOG_OUTPUT = stdout;
+    } else {
+        LOG_OUTPUT = fopen(output, "a");
+        if (LOG_OUTPUT == NULL) {
+            LOG_OUTPUT = stdout;
+        }
+    }
+    static const char *levelNames[] = { "error", "warn", "info", "trace" };
+    nvLogLevel = NV_LOG_INFO;
+    if (level != NULL) {
+        for (int i = 0; i <= NV_LOG_TRACE; i++) {
+            if (strcasecmp(level, levelNames[i]) == 0 || (level[0] == '0' + i && level[1] == '\0')) {
+                nvLogLevel = i;
+            }
+        }
+    }
+}
+
+static void writeLine(const struct timespec *time, pid_t tid, const char *filename, const char *function, int line, const char *message) {
+    fprintf(LOG_OUTPUT, "%10ld.%09ld [%d-%d] %s:%4d %24s %s\n", (long) time->tv_sec, time->tv_nsec, getpid(), tid, filename, line, function, message);
+}
+
+//writes out everything that's waiting, and frees the rings of threads that have gone. Called with logMutex held
+static void drainRings(void) {
+    NVLogRing **link = &rings;
+    while (*link != NULL) {
+        NVLogRing *ring = *link;
+        //read before the messages, so the ring can't be freed with some still to be written
+        bool orphaned = atomic_load_explicit(&ring->orphaned, memory_order_acquire);
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        for (; tail != head; tail++) {
+            const NVLogRecord *record = &ring->records[tail % RING_SIZE];
+            writeLine(&record->time, ring->tid, record->filename, record->function, record->line, record->message);
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        uint32_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        if (dropped > 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            char message[64];
+            snprintf(message, sizeof(message), "%u messages dropped, the log couldn't keep up", dropped);
+            writeLine(&now, ring->tid, __FILE__, __func__, __LINE__, message);
+        }
+        if (orphaned) {
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+    fflush(LOG_OUTPUT);
+}
+
+static void *logWriter(void *arg) {
+    pthread_mutex_lock(&logMutex);
+    while (!writerExiting) {
+        drainRings();
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += WRITER_INTERVAL_NS;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&writerCond, &logMutex, &deadline);
+    }
+    drainRings();
+    pthread_mutex_unlock(&logMutex);
+    return NULL;
+}
+
+static void releaseRing(void *ring) {
+    atomic_store_explicit(&((NVLogRing*) ring)->orphaned, true, memory_order_release);
+}
+
+//the child of a fork only has the thread that forked, so it writes directly
+static void forkedChild(void) {
+    writerRunning = false;
+    rings = NULL;
+    threadRing = NULL;
+    pthread_mutex_init(&logMutex, NULL);
+}
+
+static void startWriter(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&writerCond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_key_create(&ringKey, releaseRing) != 0) {
+        return;
+    }
+    pthread_atfork(NULL, NULL, forkedChild);
+    writerRunning = pthread_create(&writerThread, NULL, logWriter, NULL) == 0;
+}
+
+//the driver is being unloaded, nothing of it's can be left running
+__attribute__ ((destructor))
+static void stopWriter(void) {
+    if (!writerRunning) {
+        return;
+    }
+    pthread_mutex_lock(&logMutex);
+    writerExiting = true;
+    pthread_cond_signal(&writerCond);
+    pthread_mutex_unlock(&logMutex);
+    pthread_join(writerThread, NULL);
+    writerRunning = false;
+    pthread_key_delete(ringKey);
+    while (rings != NULL) {
+        NVLogRing *ring = rings;
+        rings = ring->next;
+        free(ring);
+    }
+}
+
+static NVLogRing *ringForThread(void) {
+    if (threadRing != NULL) {
+        return threadRing;
+    }
+    pthread_once(&writerOnce, startWriter);
+    if (!writerRunning) {
+        return NULL;
+    }
+    NVLogRing *ring = calloc(1, sizeof(NVLogRing));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->tid = nv_gettid();
+    pthread_mutex_lock(&logMutex);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&logMutex);
+    pthread_setspecific(ringKey, ring);
+    threadRing = ring;
+    return ring;
+}
+
+void logger(NVLogLevel level, const char *filename, const char *function, int line, const char *msg, ...) {
+    if (LOG_OUTPUT == NULL || (int) level > nvLogLevel) {
+        return;
+    }
+    NVLogRing *ring = ringForThread();
+    va_list argList;
+    if (ring == NULL || !writerRunning) {
+        char formattedMessage[MESSAGE_SIZE];
+        va_start(argList, msg);
+        vsnprintf(formattedMessage, sizeof(formattedMessage), msg, argList);
+        va_end(argList);
+        struct timespec tp;
+        clock_gettime(CLOCK_MONOTONIC, &tp);
+        pthread_mutex_lock(&logMutex);
+        writeLine(&tp, nv_gettid(), filename, function, line, formattedMessage);
+        fflush(LOG_OUTPUT);
+        pthread_mutex_unlock(&logMutex);
+        return;
+    }
+
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        pthread_cond_signal(&writerCond);
+        return;
+    }
+    NVLogRecord *record = &ring->records[head % RING_SIZE];
+    clock_gettime(CLOCK_MONOTONIC, &record->time);
+    record->filename = filename;
+    record->function = function;
+    record->line = line;
+    va_start(argList, msg);
+    vsnprintf(record->message, sizeof(record->message), msg, argList);
+    va_end(argList);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    //the writer would get to it soon enough, but an error might be the last thing logged before a crash
+    if (head + 1 - tail >= RING_SIZE / 2 || level == NV_LOG_ERROR) {
+        pthread_cond_signal(&writerCond);
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdbool.h>
+
+#ifndef __has_attribute
+#define __has_attribute(x) 0
+#endif
+
+typedef enum {
+    NV_LOG_ERROR,
+    NV_LOG_WARN,
+    NV_LOG_INFO,
+    NV_LOG_TRACE,
+} NVLogLevel;
+
+//the most verbose level that's compiled in at all, set with the log_level meson option
+#ifndef NV_LOG_MAX_LEVEL
+#define NV_LOG_MAX_LEVEL NV_LOG_TRACE
+#endif
+
+//the most verbose level that's written, -1 if NVD_LOG isn't set
+extern int nvLogLevel;
+
+//reads NVD_LOG and NVD_LOG_LEVEL
+void logConfigure(const char *output, const char *level);
+#if __has_attribute(gnu_printf) || (defined(__GNUC__) && !defined(__clang__))
+__attribute((format(gnu_printf, 5, 6)))
+#endif
+void logger(NVLogLevel level, const char *filename, const char *function, int line, const char *msg, ...);
+
+//the level is checked before the arguments are evaluated, so a filtered out message costs a compare.
+//Like LOG always has, these end in a semicolon
+#define LOG_AT(level, ...) do { \
+        if ((level) <= NV_LOG_MAX_LEVEL && (int) (level) <= nvLogLevel) { \
+            logger(level, __FILE__, __func__, __LINE__, __VA_ARGS__); \
+        } \
+    } while (0);
+#define LOG_ERROR(...) LOG_AT(NV_LOG_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(NV_LOG_WARN, __VA_ARGS__)
+#define LOG(...) LOG_AT(NV_LOG_INFO, __VA_ARGS__)
+#define LOG_TRACE(...) LOG_AT(NV_LOG_TRACE, __VA_ARGS__)
+
+#endif // LOG_H
@@ -69,9 +69,15 @@ static void copyMPEG4SliceData(NVContext *ctx, NVBuffer* buf, CUVIDPICPARAMS *pi
     {
         VASliceParameterBufferMPEG4 *sliceParams = &((VASliceParameterBufferMPEG4*) ctx->lastSliceParams)[i];
         LOG("here: %d", sliceParams->macroblock_offset);
+        if (!sliceInBuffer(ctx, buf, sliceParams->slice_data_offset, sliceParams->slice_data_size)) {
+            return;
+        }
         uint32_t offset = (uint32_t) ctx->bitstreamBuffer.size;
-        appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset));
-        appendBuffer(&ctx->bitstreamBuffer, PTROFF(buf->ptr, sliceParams->slice_data_offset), sliceParams->slice_data_size);
+        if (!appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset))
+                || !appendBuffer(&ctx->bitstreamBuffer, PTROFF(buf->ptr, sliceParams->slice_data_offset), sliceParams->slice_data_size)) {
+            failPicture(ctx, VA_STATUS_ERROR_ALLOCATION_FAILED);
+            return;
+        }
         picParams->nBitstreamDataLen += sliceParams->slice_data_size;
     }
 }
@@ -1,572 +1,1152 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <dlfcn.h>
-#include <fcntl.h>
-#include <va/va.h>
-#include <va/va_drmcommon.h>
-#include <cuda.h>
-
-#include "nvenc.h"
-#include "utils.h"
-
-/* Logging macros if not already defined */
-#ifndef log_info
-#define log_info(fmt, ...) fprintf(stdout, fmt "\n", ##__VA_ARGS__)
-#endif
-#ifndef log_error
-#define log_error(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
-#endif
-
-#define MAX_ENCODE_PROFILES 10
-#define MAX_SURFACES 64
-#define CHECK_CUDA(x) \
-    do { \
-        CUresult result = (x); \
-        if (result != CUDA_SUCCESS) { \
-            const char *error_string; \
-            cuGetErrorString(result, &error_string); \
-            ERROR("CUDA error at %s:%d code=%d \"%s\"\n", __FILE__, __LINE__, result, error_string); \
-            return VA_STATUS_ERROR_OPERATION_FAILED; \
-        } \
-    } while (0)
-
-#define NVENC_CALL(x) \
-    do { \
-        NVENCSTATUS ret = (x); \
-        if (ret != NV_ENC_SUCCESS) { \
-            ERROR("NVENC call failed at %s:%d with error %d\n", __FILE__, __LINE__, ret); \
-            return VA_STATUS_ERROR_OPERATION_FAILED; \
-        } \
-    } while (0)
-
-/*
- * NVENC-specific VAAPI helper functions.
- * These functions are used to provide a minimal VAAPI interface for encoding.
- */
-
-__attribute__((visibility("default")))
-VAStatus nvenc_vaCreateConfig(VADisplay dpy, VAProfile profile, VAEntrypoint entrypoint,
-                              VAConfigAttrib *attrib_list, int num_attribs, VAConfigID *config_id)
-{
-    if (!config_id)
-        return VA_STATUS_ERROR_INVALID_PARAMETER;
-    /* For encoding, we simply return a dummy nonzero configuration ID */
-    *config_id = 1;
-    log_info("nvenc_vaCreateConfig: created dummy config id %u for profile %d, entrypoint %d", *config_id, profile, entrypoint);
-    return VA_STATUS_SUCCESS;
-}
-
-__attribute__((visibility("default")))
-VAStatus nvenc_vaGetConfigAttributes(VADisplay dpy, VAProfile profile, VAEntrypoint entrypoint,
-                                     VAConfigAttrib *attrib_list, int num_attribs)
-{
-    for (int i = 0; i < num_attribs; i++) {
-        if (attrib_list[i].type == VAConfigAttribRTFormat)
-            attrib_list[i].value = VA_RT_FORMAT_YUV420;
-        else
-            attrib_list[i].value = 0;
-    }
-    return VA_STATUS_SUCCESS;
-}
-
-__attribute__((visibility("default")))
-VAStatus nvenc_init_driver(VADisplay va_display)
-{
-    VAProfile profile = VAProfileH264Main;
-    VAEntrypoint entrypoint = VAEntrypointEncSlice;
-    VAConfigID dummy;
-    VAStatus status = nvenc_vaCreateConfig(va_display, profile, entrypoint, NULL, 0, &dummy);
-    if (status != VA_STATUS_SUCCESS) {
-         log_error("nvenc_init_driver: failed to create dummy config for profile %d, entrypoint %d", profile, entrypoint);
-         return status;
-    }
-    log_info("nvenc_init_driver: NVENC VAAPI driver (encoding) initialized successfully");
-    return VA_STATUS_SUCCESS;
-}
-
-/*
- * NVENC encoder implementation.
- */
-
-typedef struct _NVEncoder {
-    void *nvenc_lib;
-    NV_ENCODE_API_FUNCTION_LIST nvenc_funcs;
-    CUcontext cuda_ctx;
-    NV_ENC_DEVICE_TYPE device_type;
-    void *encoder;
-    GUID codec_guid;
-    GUID profile_guid;
-    GUID preset_guid;
-    
-    // Encoder parameters
-    unsigned int width;
-    unsigned int height;
-    unsigned int bitrate;
-    unsigned int max_bitrate;
-    unsigned int vbv_buffer_size;
-    unsigned int frame_rate_num;
-    unsigned int frame_rate_den;
-    unsigned int gop_length;
-    unsigned int b_frames;
-    int rc_mode; // 0=CQP, 1=VBR, 2=CBR
-
-    // Resources
-    struct nv_frame frames[MAX_SURFACES];
-    NV_ENC_OUTPUT_PTR bitstream_buffers[MAX_SURFACES];
-    int num_frames;
-    int initialized;
-} NVEncoder;
-
-static NVEncoder *g_encoder = NULL;
-
-/* Function pointer for NVENC API entry point */
-typedef NVENCSTATUS (NVENCAPI *PNVENCODEAPICREATEINSTANCE)(NV_ENCODE_API_FUNCTION_LIST *);
-
-/* Check if NVENC is available and supported */
-int nvenc_is_available(void)
-{
-    void *nvenc_lib = dlopen("libnvidia-encode.so.1", RTLD_LAZY);
-    if (!nvenc_lib) {
-        fprintf(stderr, "Failed to load NVENC library: %s\n", dlerror());
-        return 0;
-    }
-    PNVENCODEAPICREATEINSTANCE nvEncodeAPICreateInstance = dlsym(nvenc_lib, "NvEncodeAPICreateInstance");
-    if (!nvEncodeAPICreateInstance) {
-        fprintf(stderr, "Failed to get NvEncodeAPICreateInstance: %s\n", dlerror());
-        dlclose(nvenc_lib);
-        return 0;
-    }
-    NV_ENCODE_API_FUNCTION_LIST nvenc_funcs = {0};
-    nvenc_funcs.version = NV_ENCODE_API_FUNCTION_LIST_VER;
-    NVENCSTATUS status = nvEncodeAPICreateInstance(&nvenc_funcs);
-    if (status != NV_ENC_SUCCESS) {
-        fprintf(stderr, "Failed to create NVENC instance: %d\n", status);
-        dlclose(nvenc_lib);
-        return 0;
-    }
-    CUresult cuda_status = cuInit(0);
-    if (cuda_status != CUDA_SUCCESS) {
-        fprintf(stderr, "Failed to initialize CUDA: %d\n", cuda_status);
-        dlclose(nvenc_lib);
-        return 0;
-    }
-    int device_count = 0;
-    cuda_status = cuDeviceGetCount(&device_count);
-    if (cuda_status != CUDA_SUCCESS || device_count == 0) {
-        fprintf(stderr, "No CUDA devices found\n");
-        dlclose(nvenc_lib);
-        return 0;
-    }
-    dlclose(nvenc_lib);
-    return 1;
-}
-
-/* Get supported encoding profiles */
-int nvenc_get_profiles(VAProfile *profiles, int *num_profiles)
-{
-    if (!profiles || !num_profiles || *num_profiles <= 0)
-        return VA_STATUS_ERROR_INVALID_PARAMETER;
-    if (!nvenc_is_available()) {
-        *num_profiles = 0;
-        return VA_STATUS_ERROR_UNSUPPORTED_PROFILE;
-    }
-    int profile_count = 0;
-    if (profile_count < *num_profiles) {
-        profiles[profile_count++] = VAProfileH264Main;
-    }
-    if (profile_count < *num_profiles) {
-        profiles[profile_count++] = VAProfileH264High;
-    }
-    if (profile_count < *num_profiles) {
-        profiles[profile_count++] = VAProfileH264ConstrainedBaseline;
-    }
-    if (profile_count < *num_profiles) {
-        profiles[profile_count++] = VAProfileHEVCMain;
-    }
-    /* Check for AV1 support on newer NVIDIA cards */
-    void *nvenc_lib = dlopen("libnvidia-encode.so.1", RTLD_LAZY);
-    if (nvenc_lib) {
-        PNVENCODEAPICREATEINSTANCE nvEncodeAPICreateInstance = dlsym(nvenc_lib, "NvEncodeAPICreateInstance");
-        if (nvEncodeAPICreateInstance) {
-            NV_ENCODE_API_FUNCTION_LIST nvenc_funcs = {0};
-            nvenc_funcs.version = NV_ENCODE_API_FUNCTION_LIST_VER;
-            if (nvEncodeAPICreateInstance(&nvenc_funcs) == NV_ENC_SUCCESS) {
-                CUcontext cuda_ctx;
-                if (cuInit(0) == CUDA_SUCCESS) {
-                    CUdevice cuda_device;
-                    if (cuDeviceGet(&cuda_device, 0) == CUDA_SUCCESS &&
-                        cuCtxCreate(&cuda_ctx, 0, cuda_device) == CUDA_SUCCESS) {
-                        
-                        void *encoder = NULL;
-                        NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS open_params = {0};
-                        open_params.version = NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS_VER;
-                        open_params.deviceType = NV_ENC_DEVICE_TYPE_CUDA;
-                        open_params.device = cuda_ctx;
-                        open_params.apiVersion = NVENCAPI_VERSION;
-                        
-                        if (nvenc_funcs.nvEncOpenEncodeSessionEx(&open_params, &encoder) == NV_ENC_SUCCESS) {
-                            uint32_t count = 0;
-                            if (nvenc_funcs.nvEncGetEncodeGUIDCount(encoder, &count) == NV_ENC_SUCCESS && count > 0) {
-                                GUID *guids = malloc(count * sizeof(GUID));
-                                if (guids && nvenc_funcs.nvEncGetEncodeGUIDs(encoder, guids, count, &count) == NV_ENC_SUCCESS) {
-                                    for (uint32_t i = 0; i < count; i++) {
-                                        if (memcmp(&guids[i], &NV_ENC_CODEC_AV1_GUID, sizeof(GUID)) == 0 && profile_count < *num_profiles) {
-                                            profiles[profile_count++] = VAProfileAV1Main;
-                                            break;
-                                        }
-                                    }
-                                }
-                                free(guids);
-                            }
-                            nvenc_funcs.nvEncDestroyEncoder(encoder);
-                        }
-                        cuCtxDestroy(cuda_ctx);
-                    }
-                }
-            }
-        }
-        dlclose(nvenc_lib);
-    }
-    *num_profiles = profile_count;
-    return VA_STATUS_SUCCESS;
-}
-
-/* Initialize the NVENC encoder with specific parameters */
-int nvenc_init(unsigned int width, unsigned int height, unsigned int bitrate)
-{
-    if (!nvenc_is_available())
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    if (g_encoder) {
-        nvenc_terminate(); // Clean up existing encoder
-    }
-    g_encoder = calloc(1, sizeof(NVEncoder));
-    if (!g_encoder)
-        return VA_STATUS_ERROR_ALLOCATION_FAILED;
-    g_encoder->nvenc_lib = dlopen("libnvidia-encode.so.1", RTLD_LAZY);
-    if (!g_encoder->nvenc_lib) {
-        ERROR("Failed to load NVENC library: %s\n", dlerror());
-        free(g_encoder);
-        g_encoder = NULL;
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    }
-    PNVENCODEAPICREATEINSTANCE nvEncodeAPICreateInstance = dlsym(g_encoder->nvenc_lib, "NvEncodeAPICreateInstance");
-    if (!nvEncodeAPICreateInstance) {
-        ERROR("Failed to get NvEncodeAPICreateInstance: %s\n", dlerror());
-        dlclose(g_encoder->nvenc_lib);
-        free(g_encoder);
-        g_encoder = NULL;
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    }
-    memset(&g_encoder->nvenc_funcs, 0, sizeof(g_encoder->nvenc_funcs));
-    g_encoder->nvenc_funcs.version = NV_ENCODE_API_FUNCTION_LIST_VER;
-    NVENCSTATUS status = nvEncodeAPICreateInstance(&g_encoder->nvenc_funcs);
-    if (status != NV_ENC_SUCCESS) {
-        ERROR("Failed to create NVENC instance: %d\n", status);
-        dlclose(g_encoder->nvenc_lib);
-        free(g_encoder);
-        g_encoder = NULL;
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    }
-    /* Initialize CUDA */
-    CUresult cu_result = cuInit(0);
-    if (cu_result != CUDA_SUCCESS) {
-        ERROR("Failed to initialize CUDA: %d\n", cu_result);
-        dlclose(g_encoder->nvenc_lib);
-        free(g_encoder);
-        g_encoder = NULL;
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    }
-    CUdevice cu_device;
-    cu_result = cuDeviceGet(&cu_device, 0);
-    if (cu_result != CUDA_SUCCESS) {
-        ERROR("Failed to get CUDA device: %d\n", cu_result);
-        dlclose(g_encoder->nvenc_lib);
-        free(g_encoder);
-        g_encoder = NULL;
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    }
-    cu_result = cuCtxCreate(&g_encoder->cuda_ctx, 0, cu_device);
-    if (cu_result != CUDA_SUCCESS) {
-        ERROR("Failed to create CUDA context: %d\n", cu_result);
-        dlclose(g_encoder->nvenc_lib);
-        free(g_encoder);
-        g_encoder = NULL;
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    }
-    /* Initialize encoder parameters */
-    g_encoder->width = width;
-    g_encoder->height = height;
-    g_encoder->bitrate = bitrate;
-    g_encoder->frame_rate_num = 30;
-    g_encoder->frame_rate_den = 1;
-    g_encoder->gop_length = 30;
-    g_encoder->device_type = NV_ENC_DEVICE_TYPE_CUDA;
-    g_encoder->codec_guid = NV_ENC_CODEC_H264_GUID;
-    g_encoder->profile_guid = NV_ENC_H264_PROFILE_HIGH_GUID;
-    g_encoder->preset_guid = NV_ENC_PRESET_P4_GUID;
-    g_encoder->rc_mode = 2; // CBR by default
-    /* Initialize encoder session */
-    NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS open_params = {0};
-    open_params.version = NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS_VER;
-    open_params.deviceType = g_encoder->device_type;
-    open_params.device = g_encoder->cuda_ctx;
-    open_params.apiVersion = NVENCAPI_VERSION;
-    status = g_encoder->nvenc_funcs.nvEncOpenEncodeSessionEx(&open_params, &g_encoder->encoder);
-    if (status != NV_ENC_SUCCESS) {
-        ERROR("Failed to open encode session: %d\n", status);
-        cuCtxDestroy(g_encoder->cuda_ctx);
-        dlclose(g_encoder->nvenc_lib);
-        free(g_encoder);
-        g_encoder = NULL;
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    }
-    /* Create encoder configuration */
-    NV_ENC_INITIALIZE_PARAMS init_params = {0};
-    init_params.version = NV_ENC_INITIALIZE_PARAMS_VER;
-    init_params.encodeGUID = g_encoder->codec_guid;
-    init_params.presetGUID = g_encoder->preset_guid;
-    init_params.encodeWidth = g_encoder->width;
-    init_params.encodeHeight = g_encoder->height;
-    init_params.darWidth = g_encoder->width;
-    init_params.darHeight = g_encoder->height;
-    init_params.frameRateNum = g_encoder->frame_rate_num;
-    init_params.frameRateDen = g_encoder->frame_rate_den;
-    init_params.enablePTD = 1;
-    
-    NV_ENC_CONFIG enc_config = {0};
-    enc_config.version = NV_ENC_CONFIG_VER;
-    init_params.encodeConfig = &enc_config;
-    
-    status = g_encoder->nvenc_funcs.nvEncGetEncodePresetConfig(g_encoder->encoder, 
-                                                    g_encoder->codec_guid, 
-                                                    g_encoder->preset_guid, 
-                                                    &enc_config);
-    if (status != NV_ENC_SUCCESS) {
-        ERROR("Failed to get preset config: %d\n", status);
-        g_encoder->nvenc_funcs.nvEncDestroyEncoder(g_encoder->encoder);
-        cuCtxDestroy(g_encoder->cuda_ctx);
-        dlclose(g_encoder->nvenc_lib);
-        free(g_encoder);
-        g_encoder = NULL;
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    }
-    
-    /* Set rate control parameters */
-    if (g_encoder->rc_mode == 1) // VBR
-        enc_config.rcParams.rateControlMode = NV_ENC_PARAMS_RC_VBR;
-    else if (g_encoder->rc_mode == 2) // CBR
-        enc_config.rcParams.rateControlMode = NV_ENC_PARAMS_RC_CBR;
-    else // CQP
-        enc_config.rcParams.rateControlMode = NV_ENC_PARAMS_RC_CONSTQP;
-    
-    enc_config.rcParams.averageBitRate = g_encoder->bitrate;
-    enc_config.rcParams.maxBitRate = g_encoder->max_bitrate > 0 ? g_encoder->max_bitrate : g_encoder->bitrate;
-    enc_config.rcParams.vbvBufferSize = g_encoder->vbv_buffer_size > 0 ? g_encoder->vbv_buffer_size : g_encoder->bitrate / 1000;
-    
-    /* Set codec-specific parameters */
-    if (g_encoder->codec_guid == NV_ENC_CODEC_H264_GUID) {
-        enc_config.profileGUID = g_encoder->profile_guid;
-        enc_config.encodeCodecConfig.h264Config.idrPeriod = g_encoder->gop_length;
-        enc_config.encodeCodecConfig.h264Config.maxNumRefFrames = 3;
-        enc_config.encodeCodecConfig.h264Config.sliceMode = 0;
-        enc_config.encodeCodecConfig.h264Config.sliceModeData = 0;
-    } else if (g_encoder->codec_guid == NV_ENC_CODEC_HEVC_GUID) {
-        enc_config.profileGUID = NV_ENC_HEVC_PROFILE_MAIN_GUID;
-        enc_config.encodeCodecConfig.hevcConfig.idrPeriod = g_encoder->gop_length;
-        enc_config.encodeCodecConfig.hevcConfig.maxNumRefFramesInDPB = 3;
-        enc_config.encodeCodecConfig.hevcConfig.sliceMode = 0;
-        enc_config.encodeCodecConfig.hevcConfig.sliceModeData = 0;
-    } else if (g_encoder->codec_guid == NV_ENC_CODEC_AV1_GUID) {
-        enc_config.profileGUID = NV_ENC_AV1_PROFILE_MAIN_GUID;
-        enc_config.encodeCodecConfig.av1Config.idrPeriod = g_encoder->gop_length;
-    }
-    
-    /* Create bitstream buffers */
-    for (int i = 0; i < MAX_SURFACES; i++) {
-        NV_ENC_CREATE_BITSTREAM_BUFFER create_params = {0};
-        create_params.version = NV_ENC_CREATE_BITSTREAM_BUFFER_VER;
-        status = g_encoder->nvenc_funcs.nvEncCreateBitstreamBuffer(g_encoder->encoder, &create_params);
-        if (status != NV_ENC_SUCCESS) {
-            ERROR("Failed to create bitstream buffer: %d\n", status);
-            break;
-        }
-        g_encoder->bitstream_buffers[i] = create_params.bitstreamBuffer;
-    }
-    
-    /* Initialize encoder */
-    status = g_encoder->nvenc_funcs.nvEncInitializeEncoder(g_encoder->encoder, &init_params);
-    if (status != NV_ENC_SUCCESS) {
-        ERROR("Failed to initialize encoder: %d\n", status);
-        for (int i = 0; i < MAX_SURFACES; i++) {
-            if (g_encoder->bitstream_buffers[i]) {
-                g_encoder->nvenc_funcs.nvEncDestroyBitstreamBuffer(g_encoder->encoder, g_encoder->bitstream_buffers[i]);
-                g_encoder->bitstream_buffers[i] = NULL;
-            }
-        }
-        g_encoder->nvenc_funcs.nvEncDestroyEncoder(g_encoder->encoder);
-        cuCtxDestroy(g_encoder->cuda_ctx);
-        dlclose(g_encoder->nvenc_lib);
-        free(g_encoder);
-        g_encoder = NULL;
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    }
-    
-    g_encoder->initialized = 1;
-    return VA_STATUS_SUCCESS;
-}
-
-/* Helper function to map VA surface to CUDA.
-   This stub should ideally query the common backend for the actual mapping.
-*/
-static int map_va_surface_to_cuda(VASurfaceID surface, CUdeviceptr *cuda_ptr, unsigned int *pitch)
-{
-    if (!g_encoder || !cuda_ptr || !pitch)
-        return VA_STATUS_ERROR_INVALID_PARAMETER;
-    
-    VASurfaceAttrib attribs[1];
-    attribs[0].type = VASurfaceAttribExternalBufferDescriptor;
-    attribs[0].flags = VA_SURFACE_ATTRIB_SETTABLE;
-    attribs[0].value.type = VAGenericValueTypePointer;
-    
-    VASurfaceAttribExternalBuffers external_buffer;
-    memset(&external_buffer, 0, sizeof(external_buffer));
-    attribs[0].value.value.p = &external_buffer;
-    
-    *cuda_ptr = 0;
-    *pitch = g_encoder->width;
-    
-    return VA_STATUS_SUCCESS;
-}
-
-/* Prepare frame buffers for encoding */
-int nvenc_prepare_frame(struct nv_frame *frame, VASurfaceID surface)
-{
-    if (!g_encoder || !g_encoder->initialized || !frame)
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    
-    CUdeviceptr cuda_ptr = 0;
-    unsigned int pitch = 0;
-    
-    int ret = map_va_surface_to_cuda(surface, &cuda_ptr, &pitch);
-    if (ret != VA_STATUS_SUCCESS)
-        return ret;
-    
-    /* Register the CUDA resource with NVENC */
-    NV_ENC_REGISTER_RESOURCE reg_resource = {0};
-    reg_resource.version = NV_ENC_REGISTER_RESOURCE_VER;
-    reg_resource.resourceType = NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR;
-    reg_resource.width = g_encoder->width;
-    reg_resource.height = g_encoder->height;
-    reg_resource.pitch = pitch;
-    reg_resource.resourceToRegister = (void*)cuda_ptr;
-    reg_resource.bufferFormat = NV_ENC_BUFFER_FORMAT_NV12;
-    
-    NVENCSTATUS status = g_encoder->nvenc_funcs.nvEncRegisterResource(g_encoder->encoder, &reg_resource);
-    if (status != NV_ENC_SUCCESS) {
-        ERROR("Failed to register resource: %d\n", status);
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    }
-    
-    /* Map the registered resource */
-    NV_ENC_MAP_INPUT_RESOURCE map_resource = {0};
-    map_resource.version = NV_ENC_MAP_INPUT_RESOURCE_VER;
-    map_resource.registeredResource = reg_resource.registeredResource;
-    
-    status = g_encoder->nvenc_funcs.nvEncMapInputResource(g_encoder->encoder, &map_resource);
-    if (status != NV_ENC_SUCCESS) {
-        ERROR("Failed to map input resource: %d\n", status);
-        g_encoder->nvenc_funcs.nvEncUnregisterResource(g_encoder->encoder, reg_resource.registeredResource);
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    }
-    
-    frame->input_buffer = (void*)cuda_ptr;
-    frame->input_surface = map_resource.mappedResource;
-    frame->output_buffer = g_encoder->bitstream_buffers[g_encoder->num_frames % MAX_SURFACES];
-    frame->width = g_encoder->width;
-    frame->height = g_encoder->height;
-    frame->pitch = pitch;
-    frame->va_surface = surface;
-    
-    g_encoder->num_frames++;
-    return VA_STATUS_SUCCESS;
-}
-
-/* Encode a frame using NVENC */
-int nvenc_encode_frame(struct nv_frame *frame)
-{
-    if (!g_encoder || !g_encoder->initialized || !frame || !frame->input_surface)
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    
-    NV_ENC_PIC_PARAMS pic_params = {0};
-    pic_params.version = NV_ENC_PIC_PARAMS_VER;
-    pic_params.inputBuffer = frame->input_surface;
-    pic_params.bufferFmt = NV_ENC_BUFFER_FORMAT_NV12;
-    pic_params.inputWidth = frame->width;
-    pic_params.inputHeight = frame->height;
-    pic_params.outputBitstream = frame->output_buffer;
-    pic_params.completionEvent = NULL;
-    
-    NVENCSTATUS status = g_encoder->nvenc_funcs.nvEncEncodePicture(g_encoder->encoder, &pic_params);
-    if (status != NV_ENC_SUCCESS) {
-        ERROR("Failed to encode picture: %d\n", status);
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    }
-    
-    NV_ENC_LOCK_BITSTREAM lock_params = {0};
-    lock_params.version = NV_ENC_LOCK_BITSTREAM_VER;
-    lock_params.outputBitstream = frame->output_buffer;
-    lock_params.doNotWait = 0;
-    
-    status = g_encoder->nvenc_funcs.nvEncLockBitstream(g_encoder->encoder, &lock_params);
-    if (status != NV_ENC_SUCCESS) {
-        ERROR("Failed to lock bitstream: %d\n", status);
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    }
-    
-    status = g_encoder->nvenc_funcs.nvEncUnlockBitstream(g_encoder->encoder, frame->output_buffer);
-    if (status != NV_ENC_SUCCESS) {
-        ERROR("Failed to unlock bitstream: %d\n", status);
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    }
-    
-    status = g_encoder->nvenc_funcs.nvEncUnmapInputResource(g_encoder->encoder, frame->input_surface);
-    if (status != NV_ENC_SUCCESS) {
-        ERROR("Failed to unmap input resource: %d\n", status);
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    }
-    
-    return VA_STATUS_SUCCESS;
-}
-
-/* Terminate NVENC encoder and free resources */
-void nvenc_terminate(void)
-{
-    if (!g_encoder)
-        return;
-    
-    if (g_encoder->encoder) {
-        for (int i = 0; i < MAX_SURFACES; i++) {
-            if (g_encoder->bitstream_buffers[i]) {
-                g_encoder->nvenc_funcs.nvEncDestroyBitstreamBuffer(g_encoder->encoder, g_encoder->bitstream_buffers[i]);
-                g_encoder->bitstream_buffers[i] = NULL;
-            }
-        }
-        g_encoder->nvenc_funcs.nvEncDestroyEncoder(g_encoder->encoder);
-        g_encoder->encoder = NULL;
-    }
-    
-    if (g_encoder->cuda_ctx) {
-        cuCtxDestroy(g_encoder->cuda_ctx);
-        g_encoder->cuda_ctx = NULL;
-    }
-    
-    if (g_encoder->nvenc_lib) {
-        dlclose(g_encoder->nvenc_lib);
-        g_encoder->nvenc_lib = NULL;
-    }
-    
-    free(g_encoder);
-    g_encoder = NULL;
-}
+#define _GNU_SOURCE
+
+#include "nvenc.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Each encode context has it's own NVENC session, on the driver's CUDA context. NVENC is told the type of every
+ * picture rather than picking them itself, so the GOP structure is the application's, and only I and P pictures are
+ * used as we don't report any L1 references. NVENC writes the parameter sets itself, repeated at every IDR picture,
+ * as VA-API applications expect the coded buffer to hold a stream that can be decoded on it's own.
+ *
+ * vaEndPicture only submits the picture. NVENC's asynchronous mode needs Windows events, so each encoder has an
+ * output thread instead that waits for the pictures in the order they were submitted, which vaMapBuffer and
+ * vaSyncBuffer wait on one at a time. Up to MAX_IN_FLIGHT pictures can be encoding at once, each with it's own
+ * bitstream buffer and it's input kept mapped until it's been collected.
+ *
+ * The stream isn't copied into the coded buffer. It's bitstream buffer is left locked, and the coded buffer's segment
+ * points into it until vaUnmapBuffer, when it's unlocked and goes back to be used for another picture. Only if the
+ * application holds on to more than MAX_HELD_BITSTREAMS coded buffers without unmapping them is the stream copied. */
+
+#define NVENCAPI_CHECK_VERSION(major, minor) \
+    (NVENCAPI_MAJOR_VERSION > (major) || (NVENCAPI_MAJOR_VERSION == (major) && NVENCAPI_MINOR_VERSION >= (minor)))
+
+//AV1 needs both NVENC 12 and libva's AV1 encode parameters
+#define NVENC_AV1 (NVENCAPI_CHECK_VERSION(12, 0) && VA_CHECK_VERSION(1, 16, 0))
+
+//used for CQP until the application sends a QP
+#define DEFAULT_QP 26
+//inputs stay registered between pictures, registering is much more expensive than mapping. The least recently used
+//is dropped beyond this, which is more than any sensible surface pool
+#define MAX_REGISTERED_INPUTS 32
+//pictures that can be submitted before the oldest has to be collected
+#define MAX_IN_FLIGHT 8
+//collected pictures whose coded buffers can point into their locked bitstream buffer at once
+#define MAX_HELD_BITSTREAMS 16
+
+typedef struct {
+    const NVSurface         *surface;   //whose storage this is, NULL for the staging buffer
+    void                    *resource;  //the CUdeviceptr or CUarray
+    NV_ENC_INPUT_RESOURCE_TYPE type;
+    uint32_t                width;
+    uint32_t                height;
+    uint32_t                pitch;
+    NV_ENC_BUFFER_FORMAT    format;
+    NV_ENC_REGISTERED_PTR   registered;
+    uint32_t                lastUsed;   //frameIdx of the last picture read from it
+    int                     inFlight;   //pictures still mapping it, it can't be unregistered until they're collected
+} NVRegisteredInput;
+
+typedef struct {
+    NV_ENC_OUTPUT_PTR       bitstream;  //handed over to the coded buffer once collected, and replaced from spares
+    NV_ENC_REGISTERED_PTR   registered;
+    NV_ENC_INPUT_PTR        mapped;
+    NVSurface               *surface;   //whose encodesPending to drop, NULL if the input was staged
+    NVBuffer                *coded;
+} NVPendingOutput;
+
+typedef struct {
+    NVBuffer                *coded;
+    NV_ENC_OUTPUT_PTR       bitstream;  //still locked
+    void                    *data;
+    uint32_t                size;
+} NVHeldBitstream;
+
+typedef struct _NVEncoder {
+    void                *session;
+    NVEncodeCodec       codec;
+    VAProfile           profile;
+    int                 bitDepth;
+    uint32_t            rateControl;        //VA_RC_*
+    bool                lowLatency;         //VAConfigAttribNVDLowLatency
+    bool                initialised;
+    NV_ENC_CONFIG       config;
+    NV_ENC_INITIALIZE_PARAMS initParams;
+    uint32_t            frameIdx;
+    //surfaces can be destroyed from other threads while this context encodes, and the output thread unmaps inputs
+    pthread_mutex_t     inputsMutex;
+    NVRegisteredInput   inputs[MAX_REGISTERED_INPUTS];
+    int                 inputCount;
+    //a ring of the pictures being encoded, outputs[completed % MAX_IN_FLIGHT] is the next to be collected.
+    //Guarded by outputMutex, as are the encodePending and encodeStatus of the coded buffers
+    pthread_t           outputThread;
+    pthread_mutex_t     outputMutex;
+    pthread_cond_t      outputCond;
+    NVPendingOutput     outputs[MAX_IN_FLIGHT];
+    uint32_t            submitted;
+    uint32_t            completed;
+    uint32_t            lastStaged;         //submitted count after the latest picture read from the staging buffer
+    bool                outputExit;
+    //bitstream buffers the coded buffers point into, and unlocked ones ready for another picture. Guarded by outputMutex
+    NVHeldBitstream     held[MAX_HELD_BITSTREAMS];
+    int                 heldCount;
+    NV_ENC_OUTPUT_PTR   spare[MAX_IN_FLIGHT + MAX_HELD_BITSTREAMS];
+    int                 spareCount;
+    //from the sequence and misc parameters, kept between pictures
+    uint32_t            width;
+    uint32_t            height;
+    uint32_t            intraPeriod;
+    uint32_t            idrPeriod;
+    uint32_t            bitsPerSecond;
+    uint32_t            targetPercentage;
+    uint32_t            qp;
+    uint32_t            frameRateNum;
+    uint32_t            frameRateDen;
+    uint32_t            vbvBufferSize;
+    uint32_t            vbvInitialDelay;
+    uint32_t            qualityLevel;       //VAEncMiscParameterBufferQualityLevel, 0 if not given
+    uint32_t            intraRefreshSize;   //rows of macroblocks refreshed per picture, 0 for none
+    //the current picture
+    VABufferID          codedBuffer;
+    NV_ENC_PIC_TYPE     pictureType;
+} NVEncoder;
+
+static pthread_once_t nvencLoadOnce = PTHREAD_ONCE_INIT;
+static NvencFunctions *nvencLib;
+static NV_ENCODE_API_FUNCTION_LIST nvenc;
+
+//libnvidia-encode is only loaded once something wants to encode, or know whether it can
+static void loadNvencFunctions(void) {
+    if (nvenc_load_functions(&nvencLib, NULL) != 0) {
+        nvencLib = NULL;
+        LOG_ERROR("Failed to load NVENC functions");
+        return;
+    }
+    nvenc.version = NV_ENCODE_API_FUNCTION_LIST_VER;
+    NVENCSTATUS status = nvencLib->NvEncodeAPICreateInstance(&nvenc);
+    if (status != NV_ENC_SUCCESS) {
+        LOG_ERROR("NvEncodeAPICreateInstance failed: %d", status);
+        nvenc_free_functions(&nvencLib);
+        nvencLib = NULL;
+    }
+}
+
+__attribute__ ((destructor))
+static void cleanupNvenc(void) {
+    if (nvencLib != NULL) {
+        nvenc_free_functions(&nvencLib);
+    }
+}
+
+static bool checkNvencResult(void *session, NVENCSTATUS status, const char *function, int line) {
+    if (status == NV_ENC_SUCCESS) {
+        return false;
+    }
+    const char *msg = session != NULL && nvenc.nvEncGetLastErrorString != NULL ? nvenc.nvEncGetLastErrorString(session) : NULL;
+    logger(NV_LOG_ERROR, __FILE__, function, line, "NVENC error: %d (%s)", status, msg != NULL ? msg : "");
+    return true;
+}
+#define CHECK_NVENC_RESULT(session, status) checkNvencResult(session, status, __func__, __LINE__)
+
+bool nvencCodecForProfile(VAProfile profile, NVEncodeCodec *codec) {
+    switch (profile) {
+    case VAProfileH264ConstrainedBaseline:
+    case VAProfileH264Main:
+    case VAProfileH264High:
+        *codec = NV_ENCODE_H264;
+        return true;
+    case VAProfileHEVCMain:
+    case VAProfileHEVCMain10:
+        *codec = NV_ENCODE_HEVC;
+        return true;
+#if NVENC_AV1
+    case VAProfileAV1Profile0:
+        *codec = NV_ENCODE_AV1;
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+static const GUID *codecGuid(NVEncodeCodec codec) {
+    switch (codec) {
+    case NV_ENCODE_H264:
+        return &NV_ENC_CODEC_H264_GUID;
+    case NV_ENCODE_HEVC:
+        return &NV_ENC_CODEC_HEVC_GUID;
+#if NVENC_AV1
+    case NV_ENCODE_AV1:
+        return &NV_ENC_CODEC_AV1_GUID;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+static const GUID *profileGuid(VAProfile profile) {
+    switch (profile) {
+    case VAProfileH264ConstrainedBaseline:
+        return &NV_ENC_H264_PROFILE_BASELINE_GUID;
+    case VAProfileH264Main:
+        return &NV_ENC_H264_PROFILE_MAIN_GUID;
+    case VAProfileH264High:
+        return &NV_ENC_H264_PROFILE_HIGH_GUID;
+    case VAProfileHEVCMain:
+        return &NV_ENC_HEVC_PROFILE_MAIN_GUID;
+    case VAProfileHEVCMain10:
+        return &NV_ENC_HEVC_PROFILE_MAIN10_GUID;
+#if NVENC_AV1
+    case VAProfileAV1Profile0:
+        return &NV_ENC_AV1_PROFILE_MAIN_GUID;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+static void *openSession(NVDriver *drv) {
+    pthread_once(&nvencLoadOnce, loadNvencFunctions);
+    if (nvencLib == NULL) {
+        return NULL;
+    }
+    NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS params = {
+        .version = NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS_VER,
+        .deviceType = NV_ENC_DEVICE_TYPE_CUDA,
+        .device = drv->cudaContext,
+        .apiVersion = NVENCAPI_VERSION,
+    };
+    void *session = NULL;
+    if (CHECK_NVENC_RESULT(NULL, nvenc.nvEncOpenEncodeSessionEx(&params, &session))) {
+        if (session != NULL) {
+            nvenc.nvEncDestroyEncoder(session);
+        }
+        return NULL;
+    }
+    return session;
+}
+
+static int queryCap(void *session, const GUID *guid, NV_ENC_CAPS cap) {
+    NV_ENC_CAPS_PARAM param = {
+        .version = NV_ENC_CAPS_PARAM_VER,
+        .capsToQuery = cap,
+    };
+    int value = 0;
+    if (CHECK_NVENC_RESULT(session, nvenc.nvEncGetEncodeCaps(session, *guid, &param, &value))) {
+        return 0;
+    }
+    return value;
+}
+
+bool nvencQueryCaps(NVDriver *drv) {
+    void *session = openSession(drv);
+    if (session == NULL) {
+        return false;
+    }
+    GUID guids[16];
+    uint32_t count = 0;
+    if (CHECK_NVENC_RESULT(session, nvenc.nvEncGetEncodeGUIDs(session, guids, ARRAY_SIZE(guids), &count))) {
+        nvenc.nvEncDestroyEncoder(session);
+        return false;
+    }
+    for (int codec = 0; codec < ENCODE_CODECS; codec++) {
+        const GUID *guid = codecGuid((NVEncodeCodec) codec);
+        bool supported = false;
+        for (uint32_t i = 0; i < count && guid != NULL; i++) {
+            supported = supported || memcmp(&guids[i], guid, sizeof(GUID)) == 0;
+        }
+        uint32_t width = 0, height = 0;
+        bool supports10Bit = false;
+        if (supported) {
+            width = (uint32_t) queryCap(session, guid, NV_ENC_CAPS_WIDTH_MAX);
+            height = (uint32_t) queryCap(session, guid, NV_ENC_CAPS_HEIGHT_MAX);
+            supports10Bit = queryCap(session, guid, NV_ENC_CAPS_SUPPORT_10BIT_ENCODE) != 0;
+        }
+        recordEncodeCaps(drv->capsTable, codec, 8, supported, width, height);
+        recordEncodeCaps(drv->capsTable, codec, 10, supported && supports10Bit, width, height);
+    }
+    nvenc.nvEncDestroyEncoder(session);
+    return true;
+}
+
+VAStatus nvencCreateEncoder(NVContext *ctx, const NVConfig *cfg) {
+    NVEncoder *enc = calloc(1, sizeof(NVEncoder));
+    if (enc == NULL) {
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+    if (!nvencCodecForProfile(cfg->profile, &enc->codec)) {
+        free(enc);
+        return VA_STATUS_ERROR_UNSUPPORTED_PROFILE;
+    }
+    enc->session = openSession(ctx->drv);
+    if (enc->session == NULL) {
+        free(enc);
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+    enc->profile = cfg->profile;
+    enc->bitDepth = cfg->bitDepth;
+    enc->rateControl = cfg->rateControl;
+    enc->lowLatency = cfg->lowLatency;
+    enc->width = (uint32_t) ctx->width;
+    enc->height = (uint32_t) ctx->height;
+    enc->frameRateNum = 30;
+    enc->frameRateDen = 1;
+    enc->qp = DEFAULT_QP;
+    enc->targetPercentage = 100;
+    enc->codedBuffer = VA_INVALID_ID;
+    pthread_mutex_init(&enc->inputsMutex, NULL);
+    pthread_mutex_init(&enc->outputMutex, NULL);
+    pthread_cond_init(&enc->outputCond, NULL);
+    ctx->encoder = enc;
+    return VA_STATUS_SUCCESS;
+}
+
+//called with inputsMutex held
+static void unregisterInput(NVEncoder *enc, int i) {
+    CHECK_NVENC_RESULT(enc->session, nvenc.nvEncUnregisterResource(enc->session, enc->inputs[i].registered));
+    enc->inputs[i] = enc->inputs[--enc->inputCount];
+}
+
+//returns the registration of the resource, registering it if it isn't already. Called with inputsMutex held
+static NV_ENC_REGISTERED_PTR registeredInput(NVEncoder *enc, const NVRegisteredInput *input) {
+    int leastRecent = -1;
+    for (int i = enc->inputCount - 1; i >= 0; i--) {
+        NVRegisteredInput *cached = &enc->inputs[i];
+        if (cached->resource == input->resource && cached->type == input->type && cached->width == input->width
+                && cached->height == input->height && cached->pitch == input->pitch && cached->format == input->format) {
+            cached->surface = input->surface;
+            cached->lastUsed = enc->frameIdx;
+            return cached->registered;
+        }
+        if (cached->inFlight > 0) {
+            continue;
+        }
+        //the resource has been reused with a different layout, or the surface's storage has moved
+        if (cached->resource == input->resource || (input->surface != NULL && cached->surface == input->surface)) {
+            unregisterInput(enc, i);
+            continue;
+        }
+        if (leastRecent == -1 || enc->frameIdx - cached->lastUsed > enc->frameIdx - enc->inputs[leastRecent].lastUsed) {
+            leastRecent = i;
+        }
+    }
+    if (enc->inputCount == MAX_REGISTERED_INPUTS) {
+        if (leastRecent == -1) {
+            LOG("Every registered input is in flight");
+            return NULL;
+        }
+        unregisterInput(enc, leastRecent);
+    }
+
+    NV_ENC_REGISTER_RESOURCE reg = {
+        .version = NV_ENC_REGISTER_RESOURCE_VER,
+        .resourceType = input->type,
+        .width = input->width,
+        .height = input->height,
+        .pitch = input->pitch,
+        .resourceToRegister = input->resource,
+        .bufferFormat = input->format,
+        .bufferUsage = NV_ENC_INPUT_IMAGE,
+    };
+    if (CHECK_NVENC_RESULT(enc->session, nvenc.nvEncRegisterResource(enc->session, &reg))) {
+        return NULL;
+    }
+    NVRegisteredInput *cached = &enc->inputs[enc->inputCount++];
+    *cached = *input;
+    cached->registered = reg.registeredResource;
+    cached->lastUsed = enc->frameIdx;
+    return cached->registered;
+}
+
+static NVRegisteredInput *findInput(NVEncoder *enc, NV_ENC_REGISTERED_PTR registered) {
+    for (int i = 0; i < enc->inputCount; i++) {
+        if (enc->inputs[i].registered == registered) {
+            return &enc->inputs[i];
+        }
+    }
+    return NULL;
+}
+
+//waits for the output thread to have collected the first count pictures submitted
+static void waitForOutputs(NVEncoder *enc, uint32_t count) {
+    pthread_mutex_lock(&enc->outputMutex);
+    while ((int32_t) (enc->completed - count) < 0) {
+        pthread_cond_wait(&enc->outputCond, &enc->outputMutex);
+    }
+    pthread_mutex_unlock(&enc->outputMutex);
+}
+
+static void waitForAllOutputs(NVEncoder *enc) {
+    pthread_mutex_lock(&enc->outputMutex);
+    uint32_t submitted = enc->submitted;
+    pthread_mutex_unlock(&enc->outputMutex);
+    waitForOutputs(enc, submitted);
+}
+
+void nvencForgetSurface(NVContext *ctx, const NVSurface *surface) {
+    NVEncoder *enc = ctx->encoder;
+    //a picture still reading from it has it mapped
+    waitForAllOutputs(enc);
+    pthread_mutex_lock(&enc->inputsMutex);
+    for (int i = enc->inputCount - 1; i >= 0; i--) {
+        if (enc->inputs[i].surface == surface) {
+            unregisterInput(enc, i);
+        }
+    }
+    pthread_mutex_unlock(&enc->inputsMutex);
+}
+
+void nvencForgetFrame(NVContext *ctx, CUdeviceptr frame) {
+    NVEncoder *enc = ctx->encoder;
+    waitForAllOutputs(enc);
+    pthread_mutex_lock(&enc->inputsMutex);
+    for (int i = enc->inputCount - 1; i >= 0; i--) {
+        if (enc->inputs[i].resource == (void*) frame) {
+            unregisterInput(enc, i);
+        }
+    }
+    pthread_mutex_unlock(&enc->inputsMutex);
+}
+
+//the coded buffer holds a single segment, followed by it's data
+static bool writeCodedBuffer(NVBuffer *coded, const void *data, uint32_t size) {
+    size_t needed = sizeof(VACodedBufferSegment) + size;
+    if (coded->capacity < needed) {
+        void *storage = memalign(16, needed);
+        if (storage == NULL) {
+            return false;
+        }
+        free(coded->storage);
+        coded->storage = coded->ptr = storage;
+        coded->capacity = needed;
+    }
+    VACodedBufferSegment *segment = (VACodedBufferSegment*) coded->ptr;
+    *segment = (VACodedBufferSegment) {
+        .size = size,
+        .buf = PTROFF(segment, sizeof(VACodedBufferSegment)),
+    };
+    memcpy(segment->buf, data, size);
+    coded->size = (int) needed;
+    return true;
+}
+
+//empties the coded buffer's segment, called with outputMutex held
+static void clearCodedBuffer(NVBuffer *coded) {
+    VACodedBufferSegment *segment = (VACodedBufferSegment*) coded->ptr;
+    *segment = (VACodedBufferSegment) {0};
+}
+
+//unlocks the bitstream buffer the coded buffer points into, if it does. Called with outputMutex held
+static void releaseHeldBitstream(NVEncoder *enc, NVBuffer *coded) {
+    for (int i = 0; i < enc->heldCount; i++) {
+        NVHeldBitstream *held = &enc->held[i];
+        if (held->coded != coded) {
+            continue;
+        }
+        CHECK_NVENC_RESULT(enc->session, nvenc.nvEncUnlockBitstream(enc->session, held->bitstream));
+        enc->spare[enc->spareCount++] = held->bitstream;
+        clearCodedBuffer(coded);
+        enc->held[i] = enc->held[--enc->heldCount];
+        return;
+    }
+}
+
+//a bitstream buffer for the next picture, called with outputMutex held
+static NV_ENC_OUTPUT_PTR takeBitstream(NVEncoder *enc) {
+    if (enc->spareCount > 0) {
+        return enc->spare[--enc->spareCount];
+    }
+    NV_ENC_CREATE_BITSTREAM_BUFFER bitstream = {
+        .version = NV_ENC_CREATE_BITSTREAM_BUFFER_VER,
+    };
+    if (CHECK_NVENC_RESULT(enc->session, nvenc.nvEncCreateBitstreamBuffer(enc->session, &bitstream))) {
+        return NULL;
+    }
+    return bitstream.bitstreamBuffer;
+}
+
+void nvencUnmapCodedBuffer(NVContext *ctx, NVBuffer *coded) {
+    NVEncoder *enc = ctx->encoder;
+    pthread_mutex_lock(&enc->outputMutex);
+    releaseHeldBitstream(enc, coded);
+    pthread_mutex_unlock(&enc->outputMutex);
+}
+
+void nvencWaitForStagedInput(NVContext *ctx) {
+    NVEncoder *enc = ctx->encoder;
+    pthread_mutex_lock(&enc->outputMutex);
+    uint32_t lastStaged = enc->lastStaged;
+    pthread_mutex_unlock(&enc->outputMutex);
+    waitForOutputs(enc, lastStaged);
+}
+
+VAStatus nvencWaitForCodedBuffer(NVContext *ctx, NVBuffer *coded, uint64_t timeout_ns) {
+    NVEncoder *enc = ctx->encoder;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    if (timeout_ns != VA_TIMEOUT_INFINITE) {
+        deadline.tv_sec += (time_t) (timeout_ns / 1000000000ull);
+        deadline.tv_nsec += (long) (timeout_ns % 1000000000ull);
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+    VAStatus status = VA_STATUS_SUCCESS;
+    pthread_mutex_lock(&enc->outputMutex);
+    while (coded->encodePending && status == VA_STATUS_SUCCESS) {
+        if (timeout_ns == VA_TIMEOUT_INFINITE) {
+            pthread_cond_wait(&enc->outputCond, &enc->outputMutex);
+        } else if (pthread_cond_timedwait(&enc->outputCond, &enc->outputMutex, &deadline) == ETIMEDOUT) {
+            status = VA_STATUS_ERROR_TIMEDOUT;
+        }
+    }
+    if (!coded->encodePending) {
+        status = coded->encodeStatus;
+    }
+    pthread_mutex_unlock(&enc->outputMutex);
+    return status;
+}
+
+static void destroyOutputBitstreams(NVEncoder *enc) {
+    for (int i = 0; i < MAX_IN_FLIGHT; i++) {
+        if (enc->outputs[i].bitstream != NULL) {
+            CHECK_NVENC_RESULT(enc->session, nvenc.nvEncDestroyBitstreamBuffer(enc->session, enc->outputs[i].bitstream));
+            enc->outputs[i].bitstream = NULL;
+        }
+    }
+}
+
+void nvencDestroyEncoder(NVContext *ctx) {
+    NVEncoder *enc = ctx->encoder;
+    if (enc == NULL) {
+        return;
+    }
+    if (enc->initialised) {
+        //the output thread collects everything still in flight before exiting
+        pthread_mutex_lock(&enc->outputMutex);
+        enc->outputExit = true;
+        pthread_cond_broadcast(&enc->outputCond);
+        pthread_mutex_unlock(&enc->outputMutex);
+        pthread_join(enc->outputThread, NULL);
+    }
+    while (enc->inputCount > 0) {
+        unregisterInput(enc, enc->inputCount - 1);
+    }
+    //coded buffers outlive their context, so the ones still pointing into a bitstream buffer get a copy of their own
+    for (int i = 0; i < enc->heldCount; i++) {
+        NVHeldBitstream *held = &enc->held[i];
+        if (!writeCodedBuffer(held->coded, held->data, held->size)) {
+            clearCodedBuffer(held->coded);
+        }
+        CHECK_NVENC_RESULT(enc->session, nvenc.nvEncUnlockBitstream(enc->session, held->bitstream));
+        CHECK_NVENC_RESULT(enc->session, nvenc.nvEncDestroyBitstreamBuffer(enc->session, held->bitstream));
+    }
+    for (int i = 0; i < enc->spareCount; i++) {
+        CHECK_NVENC_RESULT(enc->session, nvenc.nvEncDestroyBitstreamBuffer(enc->session, enc->spare[i]));
+    }
+    destroyOutputBitstreams(enc);
+    pthread_mutex_destroy(&enc->inputsMutex);
+    pthread_mutex_destroy(&enc->outputMutex);
+    pthread_cond_destroy(&enc->outputCond);
+    CHECK_NVENC_RESULT(NULL, nvenc.nvEncDestroyEncoder(enc->session));
+    free(enc);
+    ctx->encoder = NULL;
+}
+
+void nvencBeginPicture(NVContext *ctx) {
+    NVEncoder *enc = ctx->encoder;
+    enc->codedBuffer = VA_INVALID_ID;
+    enc->pictureType = NV_ENC_PIC_TYPE_P;
+}
+
+static void copySequenceParams(NVEncoder *enc, const void *params) {
+    switch (enc->codec) {
+    case NV_ENCODE_H264: {
+        const VAEncSequenceParameterBufferH264 *seq = params;
+        //the frame is cropped in units of two luma samples for 4:2:0
+        uint32_t cropX = seq->frame_cropping_flag ? (seq->frame_crop_left_offset + seq->frame_crop_right_offset) * 2 : 0;
+        uint32_t cropY = seq->frame_cropping_flag ? (seq->frame_crop_top_offset + seq->frame_crop_bottom_offset) * 2 : 0;
+        enc->width = seq->picture_width_in_mbs * 16 - cropX;
+        enc->height = seq->picture_height_in_mbs * 16 - cropY;
+        enc->intraPeriod = seq->intra_period;
+        enc->idrPeriod = seq->intra_idr_period;
+        enc->bitsPerSecond = seq->bits_per_second;
+        if (seq->vui_parameters_present_flag && seq->vui_fields.bits.timing_info_present_flag && seq->num_units_in_tick > 0) {
+            //a tick is a field
+            enc->frameRateNum = seq->time_scale;
+            enc->frameRateDen = seq->num_units_in_tick * 2;
+        }
+        break;
+    }
+    case NV_ENCODE_HEVC: {
+        const VAEncSequenceParameterBufferHEVC *seq = params;
+        enc->width = seq->pic_width_in_luma_samples;
+        enc->height = seq->pic_height_in_luma_samples;
+        enc->intraPeriod = seq->intra_period;
+        enc->idrPeriod = seq->intra_idr_period;
+        enc->bitsPerSecond = seq->bits_per_second;
+        break;
+    }
+#if NVENC_AV1
+    case NV_ENCODE_AV1: {
+        const VAEncSequenceParameterBufferAV1 *seq = params;
+        //every key frame is an IDR picture
+        enc->intraPeriod = seq->intra_period;
+        enc->idrPeriod = seq->intra_period;
+        enc->bitsPerSecond = seq->bits_per_second;
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+}
+
+static void copyPictureParams(NVEncoder *enc, const void *params) {
+    switch (enc->codec) {
+    case NV_ENCODE_H264: {
+        const VAEncPictureParameterBufferH264 *pic = params;
+        enc->codedBuffer = pic->coded_buf;
+        enc->qp = pic->pic_init_qp;
+        if (pic->pic_fields.bits.idr_pic_flag) {
+            enc->pictureType = NV_ENC_PIC_TYPE_IDR;
+        }
+        break;
+    }
+    case NV_ENCODE_HEVC: {
+        const VAEncPictureParameterBufferHEVC *pic = params;
+        enc->codedBuffer = pic->coded_buf;
+        enc->qp = pic->pic_init_qp;
+        if (pic->pic_fields.bits.idr_pic_flag) {
+            enc->pictureType = NV_ENC_PIC_TYPE_IDR;
+        } else if (pic->pic_fields.bits.coding_type == 1) {
+            enc->pictureType = NV_ENC_PIC_TYPE_I;
+        }
+        break;
+    }
+#if NVENC_AV1
+    case NV_ENCODE_AV1: {
+        const VAEncPictureParameterBufferAV1 *pic = params;
+        enc->codedBuffer = pic->coded_buf;
+        enc->width = pic->frame_width_minus_1 + 1u;
+        enc->height = pic->frame_height_minus_1 + 1u;
+        //key and intra only frames
+        if (pic->picture_flags.bits.frame_type == 0) {
+            enc->pictureType = NV_ENC_PIC_TYPE_IDR;
+        } else if (pic->picture_flags.bits.frame_type == 2) {
+            enc->pictureType = NV_ENC_PIC_TYPE_I;
+        }
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+}
+
+static void copySliceParams(NVEncoder *enc, const void *params) {
+    //IDR pictures are already known from the picture parameters, and B slices are encoded as P as there are no L1
+    //references. AV1 has no slices
+    if (enc->pictureType == NV_ENC_PIC_TYPE_IDR) {
+        return;
+    }
+    if (enc->codec == NV_ENCODE_H264) {
+        const VAEncSliceParameterBufferH264 *slice = params;
+        if (slice->slice_type % 5 == 2) {
+            enc->pictureType = NV_ENC_PIC_TYPE_I;
+        }
+    } else if (enc->codec == NV_ENCODE_HEVC) {
+        const VAEncSliceParameterBufferHEVC *slice = params;
+        if (slice->slice_type == 2) {
+            enc->pictureType = NV_ENC_PIC_TYPE_I;
+        }
+    }
+}
+
+static void copyMiscParams(NVEncoder *enc, const VAEncMiscParameterBuffer *misc) {
+    switch (misc->type) {
+    case VAEncMiscParameterTypeRateControl: {
+        const VAEncMiscParameterRateControl *rc = (const VAEncMiscParameterRateControl*) misc->data;
+        enc->bitsPerSecond = rc->bits_per_second;
+        enc->targetPercentage = rc->target_percentage > 0 && rc->target_percentage <= 100 ? rc->target_percentage : 100;
+        if (rc->initial_qp > 0) {
+            enc->qp = rc->initial_qp;
+        }
+        break;
+    }
+    case VAEncMiscParameterTypeFrameRate: {
+        const VAEncMiscParameterFrameRate *frameRate = (const VAEncMiscParameterFrameRate*) misc->data;
+        //the denominator is in the top half if it isn't 1
+        uint32_t den = frameRate->framerate >> 16;
+        enc->frameRateNum = den != 0 ? frameRate->framerate & 0xffff : frameRate->framerate;
+        enc->frameRateDen = den != 0 ? den : 1;
+        break;
+    }
+    case VAEncMiscParameterTypeHRD: {
+        const VAEncMiscParameterHRD *hrd = (const VAEncMiscParameterHRD*) misc->data;
+        enc->vbvBufferSize = hrd->buffer_size;
+        enc->vbvInitialDelay = hrd->initial_buffer_fullness;
+        break;
+    }
+    //these two are only applied when the encoder is created, NVENC can't change them afterwards
+    case VAEncMiscParameterTypeQualityLevel: {
+        const VAEncMiscParameterBufferQualityLevel *quality = (const VAEncMiscParameterBufferQualityLevel*) misc->data;
+        enc->qualityLevel = quality->quality_level <= 7 ? quality->quality_level : 7;
+        break;
+    }
+    case VAEncMiscParameterTypeRIR: {
+        const VAEncMiscParameterRIR *rir = (const VAEncMiscParameterRIR*) misc->data;
+        enc->intraRefreshSize = rir->rir_flags.value != 0 ? rir->intra_insert_size : 0;
+        break;
+    }
+    default:
+        LOG("Ignoring encode misc parameter: %d", misc->type);
+        break;
+    }
+}
+
+void nvencRenderBuffer(NVContext *ctx, NVBuffer *buf) {
+    NVEncoder *enc = ctx->encoder;
+    switch (buf->bufferType) {
+    case VAEncSequenceParameterBufferType:
+        copySequenceParams(enc, buf->ptr);
+        break;
+    case VAEncPictureParameterBufferType:
+        copyPictureParams(enc, buf->ptr);
+        break;
+    case VAEncSliceParameterBufferType:
+        copySliceParams(enc, buf->ptr);
+        break;
+    case VAEncMiscParameterBufferType:
+        copyMiscParams(enc, (const VAEncMiscParameterBuffer*) buf->ptr);
+        break;
+    default:
+        LOG("Unhandled encode buffer type: %d", buf->bufferType);
+        break;
+    }
+}
+
+static void setRateControl(const NVEncoder *enc, NV_ENC_RC_PARAMS *rc) {
+    if (enc->rateControl == VA_RC_CQP || enc->bitsPerSecond == 0) {
+        rc->rateControlMode = NV_ENC_PARAMS_RC_CONSTQP;
+        rc->constQP = (NV_ENC_QP) { enc->qp, enc->qp, enc->qp };
+        return;
+    }
+    if (enc->rateControl == VA_RC_VBR) {
+        //VA-API's bitrate is the peak, with the target a percentage of it
+        rc->rateControlMode = NV_ENC_PARAMS_RC_VBR;
+        rc->averageBitRate = (uint32_t) ((uint64_t) enc->bitsPerSecond * enc->targetPercentage / 100);
+    } else {
+        rc->rateControlMode = NV_ENC_PARAMS_RC_CBR;
+        rc->averageBitRate = enc->bitsPerSecond;
+    }
+    rc->maxBitRate = enc->bitsPerSecond;
+    rc->vbvBufferSize = enc->vbvBufferSize;
+    rc->vbvInitialDelay = enc->vbvInitialDelay;
+}
+
+//VA-API's quality levels go from 1 as the best, NVENC's presets from P7
+static GUID presetGuid(uint32_t qualityLevel) {
+    switch (qualityLevel) {
+    case 1: return NV_ENC_PRESET_P7_GUID;
+    case 2: return NV_ENC_PRESET_P6_GUID;
+    case 3: return NV_ENC_PRESET_P5_GUID;
+    case 5: return NV_ENC_PRESET_P3_GUID;
+    case 6: return NV_ENC_PRESET_P2_GUID;
+    case 7: return NV_ENC_PRESET_P1_GUID;
+    default: return NV_ENC_PRESET_P4_GUID;
+    }
+}
+
+//spreads a refresh of the whole picture over as many pictures as it takes at intraRefreshSize rows each, repeated
+//every intra period, or straight away again if there isn't one. Fills in the codec's count and period and returns
+//what enableIntraRefresh should be, which being a bitfield can't be passed in
+static bool setIntraRefresh(const NVEncoder *enc, uint32_t *intraRefreshCnt, uint32_t *intraRefreshPeriod) {
+    if (enc->intraRefreshSize == 0) {
+        return false;
+    }
+    uint32_t count = ((enc->height + 15) / 16 + enc->intraRefreshSize - 1) / enc->intraRefreshSize;
+    *intraRefreshCnt = count;
+    *intraRefreshPeriod = enc->intraPeriod > count ? enc->intraPeriod : count;
+    return true;
+}
+
+static void *outputThread(void *arg);
+
+static bool initialiseEncoder(NVEncoder *enc) {
+    const GUID *guid = codecGuid(enc->codec);
+    GUID preset = presetGuid(enc->qualityLevel);
+    NV_ENC_TUNING_INFO tuning = enc->lowLatency ? NV_ENC_TUNING_INFO_ULTRA_LOW_LATENCY : NV_ENC_TUNING_INFO_HIGH_QUALITY;
+    NV_ENC_PRESET_CONFIG presetConfig = {
+        .version = NV_ENC_PRESET_CONFIG_VER,
+        .presetCfg = { .version = NV_ENC_CONFIG_VER },
+    };
+    if (CHECK_NVENC_RESULT(enc->session, nvenc.nvEncGetEncodePresetConfigEx(enc->session, *guid, preset, tuning, &presetConfig))) {
+        return false;
+    }
+    enc->config = presetConfig.presetCfg;
+    NV_ENC_CONFIG *config = &enc->config;
+    config->profileGUID = *profileGuid(enc->profile);
+    config->gopLength = enc->intraPeriod > 0 ? enc->intraPeriod : NVENC_INFINITE_GOPLENGTH;
+    config->frameIntervalP = 1;
+    setRateControl(enc, &config->rcParams);
+    if (enc->lowLatency) {
+        //nothing is held back for reordering, and key frames aren't allowed to burst over the VBV
+        config->rcParams.zeroReorderDelay = 1;
+        config->rcParams.lowDelayKeyFrameScale = 1;
+    }
+    uint32_t idrPeriod = enc->idrPeriod > 0 ? enc->idrPeriod : config->gopLength;
+    switch (enc->codec) {
+    case NV_ENCODE_H264:
+        config->encodeCodecConfig.h264Config.idrPeriod = idrPeriod;
+        config->encodeCodecConfig.h264Config.repeatSPSPPS = 1;
+        if (enc->lowLatency) {
+            config->encodeCodecConfig.h264Config.maxNumRefFrames = 1;
+        }
+        config->encodeCodecConfig.h264Config.enableIntraRefresh =
+                setIntraRefresh(enc, &config->encodeCodecConfig.h264Config.intraRefreshCnt,
+                                &config->encodeCodecConfig.h264Config.intraRefreshPeriod);
+        break;
+    case NV_ENCODE_HEVC:
+        config->encodeCodecConfig.hevcConfig.idrPeriod = idrPeriod;
+        config->encodeCodecConfig.hevcConfig.repeatSPSPPS = 1;
+        if (enc->lowLatency) {
+            config->encodeCodecConfig.hevcConfig.maxNumRefFramesInDPB = 1;
+        }
+        config->encodeCodecConfig.hevcConfig.enableIntraRefresh =
+                setIntraRefresh(enc, &config->encodeCodecConfig.hevcConfig.intraRefreshCnt,
+                                &config->encodeCodecConfig.hevcConfig.intraRefreshPeriod);
+        if (enc->bitDepth > 8) {
+#if NVENCAPI_CHECK_VERSION(12, 2)
+            config->encodeCodecConfig.hevcConfig.inputBitDepth = NV_ENC_BIT_DEPTH_10;
+            config->encodeCodecConfig.hevcConfig.outputBitDepth = NV_ENC_BIT_DEPTH_10;
+#else
+            config->encodeCodecConfig.hevcConfig.pixelBitDepthMinus8 = 2;
+#endif
+        }
+        break;
+#if NVENC_AV1
+    case NV_ENCODE_AV1:
+        config->encodeCodecConfig.av1Config.idrPeriod = idrPeriod;
+        config->encodeCodecConfig.av1Config.repeatSeqHdr = 1;
+        if (enc->lowLatency) {
+            config->encodeCodecConfig.av1Config.maxNumRefFramesInDPB = 1;
+        }
+        config->encodeCodecConfig.av1Config.enableIntraRefresh =
+                setIntraRefresh(enc, &config->encodeCodecConfig.av1Config.intraRefreshCnt,
+                                &config->encodeCodecConfig.av1Config.intraRefreshPeriod);
+        if (enc->bitDepth > 8) {
+#if NVENCAPI_CHECK_VERSION(12, 2)
+            config->encodeCodecConfig.av1Config.inputBitDepth = NV_ENC_BIT_DEPTH_10;
+            config->encodeCodecConfig.av1Config.outputBitDepth = NV_ENC_BIT_DEPTH_10;
+#else
+            config->encodeCodecConfig.av1Config.inputPixelBitDepthMinus8 = 2;
+            config->encodeCodecConfig.av1Config.pixelBitDepthMinus8 = 2;
+#endif
+        }
+        break;
+#endif
+    default:
+        break;
+    }
+
+    enc->initParams = (NV_ENC_INITIALIZE_PARAMS) {
+        .version = NV_ENC_INITIALIZE_PARAMS_VER,
+        .encodeGUID = *guid,
+        .presetGUID = preset,
+        .encodeWidth = enc->width,
+        .encodeHeight = enc->height,
+        .darWidth = enc->width,
+        .darHeight = enc->height,
+        .frameRateNum = enc->frameRateNum,
+        .frameRateDen = enc->frameRateDen,
+        //the application decides the picture types
+        .enablePTD = 0,
+        .encodeConfig = config,
+        .maxEncodeWidth = enc->width,
+        .maxEncodeHeight = enc->height,
+        .tuningInfo = tuning,
+    };
+    if (CHECK_NVENC_RESULT(enc->session, nvenc.nvEncInitializeEncoder(enc->session, &enc->initParams))) {
+        return false;
+    }
+    for (int i = 0; i < MAX_IN_FLIGHT; i++) {
+        NV_ENC_CREATE_BITSTREAM_BUFFER bitstream = {
+            .version = NV_ENC_CREATE_BITSTREAM_BUFFER_VER,
+        };
+        if (CHECK_NVENC_RESULT(enc->session, nvenc.nvEncCreateBitstreamBuffer(enc->session, &bitstream))) {
+            //the next picture tries again from scratch, so it mustn't find the ones made so far
+            destroyOutputBitstreams(enc);
+            return false;
+        }
+        enc->outputs[i].bitstream = bitstream.bitstreamBuffer;
+    }
+    if (pthread_create(&enc->outputThread, NULL, outputThread, enc) != 0) {
+        LOG("Unable to start encoder output thread");
+        destroyOutputBitstreams(enc);
+        return false;
+    }
+    enc->initialised = true;
+    LOG("Initialised encoder at %ux%u, %u/%u fps, rate control %u, tuning %u", enc->width, enc->height,
+        enc->frameRateNum, enc->frameRateDen, (uint32_t) config->rcParams.rateControlMode, (uint32_t) tuning);
+    return true;
+}
+
+//applies changes to the rate control, frame rate or picture size made since the encoder was created, without
+//re-creating it. A new size starts a new IDR picture, and can't be larger than the encoder was created at
+static bool reconfigureEncoder(NVEncoder *enc) {
+    NV_ENC_RC_PARAMS rc = enc->config.rcParams;
+    setRateControl(enc, &rc);
+    bool resize = enc->width != enc->initParams.encodeWidth || enc->height != enc->initParams.encodeHeight;
+    if (!resize && memcmp(&rc, &enc->config.rcParams, sizeof(rc)) == 0
+            && enc->frameRateNum == enc->initParams.frameRateNum && enc->frameRateDen == enc->initParams.frameRateDen) {
+        return true;
+    }
+    if (enc->width > enc->initParams.maxEncodeWidth || enc->height > enc->initParams.maxEncodeHeight) {
+        LOG("Unable to grow the encoder from %ux%u to %ux%u", enc->initParams.maxEncodeWidth,
+            enc->initParams.maxEncodeHeight, enc->width, enc->height);
+        return false;
+    }
+    if (resize) {
+        //resetting drops whatever NVENC still holds
+        waitForAllOutputs(enc);
+    }
+    NV_ENC_CONFIG config = enc->config;
+    config.rcParams = rc;
+    NV_ENC_RECONFIGURE_PARAMS reconfigure = {
+        .version = NV_ENC_RECONFIGURE_PARAMS_VER,
+        .reInitEncodeParams = enc->initParams,
+        .resetEncoder = resize,
+        .forceIDR = resize,
+    };
+    NV_ENC_INITIALIZE_PARAMS *params = &reconfigure.reInitEncodeParams;
+    params->encodeConfig = &config;
+    params->encodeWidth = params->darWidth = enc->width;
+    params->encodeHeight = params->darHeight = enc->height;
+    params->frameRateNum = enc->frameRateNum;
+    params->frameRateDen = enc->frameRateDen;
+    if (CHECK_NVENC_RESULT(enc->session, nvenc.nvEncReconfigureEncoder(enc->session, &reconfigure))) {
+        return false;
+    }
+    enc->config = config;
+    enc->initParams = *params;
+    enc->initParams.encodeConfig = &enc->config;
+    LOG("Reconfigured encoder to %ux%u, %u/%u fps, %u bps", enc->width, enc->height, enc->frameRateNum,
+        enc->frameRateDen, rc.averageBitRate);
+    return true;
+}
+
+static NV_ENC_BUFFER_FORMAT inputFormat(const NVEncoder *enc, const NVSurface *input) {
+    switch (nvSurfaceFormat(input)) {
+    case NV_FORMAT_NV12:
+        return enc->bitDepth == 8 ? NV_ENC_BUFFER_FORMAT_NV12 : NV_ENC_BUFFER_FORMAT_UNDEFINED;
+    case NV_FORMAT_P010:
+    case NV_FORMAT_P016:
+        return enc->bitDepth == 10 ? NV_ENC_BUFFER_FORMAT_YUV420_10BIT : NV_ENC_BUFFER_FORMAT_UNDEFINED;
+    //NVENC names packed formats after the order of the channels in a little endian word
+    case NV_FORMAT_BGRA:
+        return enc->bitDepth == 8 ? NV_ENC_BUFFER_FORMAT_ARGB : NV_ENC_BUFFER_FORMAT_UNDEFINED;
+    case NV_FORMAT_RGBA:
+        return enc->bitDepth == 8 ? NV_ENC_BUFFER_FORMAT_ABGR : NV_ENC_BUFFER_FORMAT_UNDEFINED;
+    default:
+        return NV_ENC_BUFFER_FORMAT_UNDEFINED;
+    }
+}
+
+static VAStatus submitPicture(NVEncoder *enc, NV_ENC_INPUT_PTR input, NV_ENC_BUFFER_FORMAT format,
+                              const NVSurface *surface, uint32_t pitch, NV_ENC_OUTPUT_PTR bitstream) {
+    NV_ENC_PIC_PARAMS pic = {
+        .version = NV_ENC_PIC_PARAMS_VER,
+        .inputWidth = surface->width,
+        .inputHeight = surface->height,
+        .inputPitch = pitch,
+        .frameIdx = enc->frameIdx,
+        .inputTimeStamp = enc->frameIdx,
+        .inputBuffer = input,
+        .outputBitstream = bitstream,
+        .bufferFmt = format,
+        .pictureStruct = NV_ENC_PIC_STRUCT_FRAME,
+        .pictureType = enc->pictureType,
+    };
+    if (enc->pictureType == NV_ENC_PIC_TYPE_IDR) {
+        pic.encodePicFlags = NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS;
+    }
+    enc->frameIdx++;
+    if (CHECK_NVENC_RESULT(enc->session, nvenc.nvEncEncodePicture(enc->session, &pic))) {
+        return VA_STATUS_ERROR_ENCODING_ERROR;
+    }
+    return VA_STATUS_SUCCESS;
+}
+
+//releases the input of a picture, once NVENC has finished with it or it couldn't be submitted
+static void releaseInput(NVEncoder *enc, const NVPendingOutput *out) {
+    pthread_mutex_lock(&enc->inputsMutex);
+    CHECK_NVENC_RESULT(enc->session, nvenc.nvEncUnmapInputResource(enc->session, out->mapped));
+    NVRegisteredInput *input = findInput(enc, out->registered);
+    if (input != NULL) {
+        input->inFlight--;
+    }
+    pthread_mutex_unlock(&enc->inputsMutex);
+}
+
+//waits for the picture to be encoded, and points it's coded buffer at the locked bitstream buffer. If too many are
+//held already the stream is copied and the bitstream buffer unlocked straight away
+static VAStatus collectOutput(NVEncoder *enc, NVPendingOutput *out) {
+    NVTX_RANGE("Collect encoded picture from surface %u", out->surface != NULL ? out->surface->id : VA_INVALID_ID);
+    NV_ENC_LOCK_BITSTREAM lock = {
+        .version = NV_ENC_LOCK_BITSTREAM_VER,
+        .outputBitstream = out->bitstream,
+    };
+    VAStatus status = VA_STATUS_ERROR_ENCODING_ERROR;
+    if (!CHECK_NVENC_RESULT(enc->session, nvenc.nvEncLockBitstream(enc->session, &lock))) {
+        status = VA_STATUS_SUCCESS;
+        NVBuffer *coded = out->coded;
+        pthread_mutex_lock(&enc->outputMutex);
+        //the segment is written to the front of the coded buffer's storage, which is always large enough for it
+        bool hold = enc->heldCount < MAX_HELD_BITSTREAMS && coded->capacity >= sizeof(VACodedBufferSegment);
+        if (hold) {
+            enc->held[enc->heldCount++] = (NVHeldBitstream) {
+                .coded = coded,
+                .bitstream = out->bitstream,
+                .data = lock.bitstreamBufferPtr,
+                .size = lock.bitstreamSizeInBytes,
+            };
+            VACodedBufferSegment *segment = (VACodedBufferSegment*) coded->ptr;
+            *segment = (VACodedBufferSegment) {
+                .size = lock.bitstreamSizeInBytes,
+                .buf = lock.bitstreamBufferPtr,
+            };
+            out->bitstream = NULL;
+        }
+        pthread_mutex_unlock(&enc->outputMutex);
+        if (!hold) {
+            if (!writeCodedBuffer(coded, lock.bitstreamBufferPtr, lock.bitstreamSizeInBytes)) {
+                LOG("Unable to grow coded buffer to %u bytes", lock.bitstreamSizeInBytes);
+                status = VA_STATUS_ERROR_ALLOCATION_FAILED;
+            }
+            CHECK_NVENC_RESULT(enc->session, nvenc.nvEncUnlockBitstream(enc->session, out->bitstream));
+        }
+    }
+    releaseInput(enc, out);
+    if (out->surface != NULL) {
+        pthread_mutex_lock(&out->surface->mutex);
+        out->surface->encodesPending--;
+        pthread_cond_broadcast(&out->surface->cond);
+        pthread_mutex_unlock(&out->surface->mutex);
+    }
+    return status;
+}
+
+static void *outputThread(void *arg) {
+    NVEncoder *enc = (NVEncoder*) arg;
+    pthread_mutex_lock(&enc->outputMutex);
+    while (true) {
+        while (enc->completed == enc->submitted && !enc->outputExit) {
+            pthread_cond_wait(&enc->outputCond, &enc->outputMutex);
+        }
+        if (enc->completed == enc->submitted) {
+            break;
+        }
+        //the slot isn't touched by the submitting thread until it's been collected
+        NVPendingOutput *out = &enc->outputs[enc->completed % MAX_IN_FLIGHT];
+        pthread_mutex_unlock(&enc->outputMutex);
+        VAStatus status = collectOutput(enc, out);
+        pthread_mutex_lock(&enc->outputMutex);
+        out->coded->encodeStatus = status;
+        out->coded->encodePending = false;
+        enc->completed++;
+        pthread_cond_broadcast(&enc->outputCond);
+    }
+    pthread_mutex_unlock(&enc->outputMutex);
+    return NULL;
+}
+
+VAStatus nvencEncodePicture(NVContext *ctx, NVSurface *input, const NVEncodeFrame *frame) {
+    NVTX_RANGE("nvEncEncodePicture context %u surface %u", ctx->id, input->id);
+    NVEncoder *enc = ctx->encoder;
+    NVBuffer *coded = nvBufferFromBufferId(ctx->drv, enc->codedBuffer);
+    if (coded == NULL || coded->bufferType != VAEncCodedBufferType) {
+        LOG("No coded buffer for the picture");
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+    }
+    NV_ENC_BUFFER_FORMAT format = inputFormat(enc, input);
+    if (format == NV_ENC_BUFFER_FORMAT_UNDEFINED) {
+        LOG("Unable to encode from surfaces of format %d", nvSurfaceFormat(input));
+        return VA_STATUS_ERROR_UNSUPPORTED_RT_FORMAT;
+    }
+    if (input->width < enc->width || input->height < enc->height) {
+        LOG("Input surface is smaller than the picture, %ux%u < %ux%u", input->width, input->height, enc->width, enc->height);
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+    }
+    if (enc->initialised ? !reconfigureEncoder(enc) : !initialiseEncoder(enc)) {
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+
+    //an array has no pitch of it's own, NVENC wants the width in bytes
+    NVRegisteredInput resource = {
+        .surface = frame->staged ? NULL : input,
+        .resource = frame->array != NULL ? (void*) frame->array : (void*) frame->ptr,
+        .type = frame->array != NULL ? NV_ENC_INPUT_RESOURCE_TYPE_CUDAARRAY : NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR,
+        .width = input->width,
+        .height = input->height,
+        .pitch = frame->array != NULL ? input->width * formatsInfo[nvSurfaceFormat(input)].bppc * 4 : (uint32_t) frame->pitch,
+        .format = format,
+    };
+    //only this thread submits, so once a slot is free it stays free
+    pthread_mutex_lock(&enc->outputMutex);
+    while (enc->submitted - enc->completed == MAX_IN_FLIGHT) {
+        pthread_cond_wait(&enc->outputCond, &enc->outputMutex);
+    }
+    NVPendingOutput *out = &enc->outputs[enc->submitted % MAX_IN_FLIGHT];
+    //the coded buffer is being reused, whatever it held last time has been read
+    releaseHeldBitstream(enc, coded);
+    if (out->bitstream == NULL) {
+        out->bitstream = takeBitstream(enc);
+    }
+    pthread_mutex_unlock(&enc->outputMutex);
+    if (out->bitstream == NULL) {
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+
+    pthread_mutex_lock(&enc->inputsMutex);
+    NV_ENC_MAP_INPUT_RESOURCE map = {
+        .version = NV_ENC_MAP_INPUT_RESOURCE_VER,
+        .registeredResource = registeredInput(enc, &resource),
+    };
+    if (map.registeredResource == NULL || CHECK_NVENC_RESULT(enc->session, nvenc.nvEncMapInputResource(enc->session, &map))) {
+        pthread_mutex_unlock(&enc->inputsMutex);
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+    findInput(enc, map.registeredResource)->inFlight++;
+    pthread_mutex_unlock(&enc->inputsMutex);
+    out->registered = map.registeredResource;
+    out->mapped = map.mappedResource;
+    out->surface = frame->staged ? NULL : input;
+    out->coded = coded;
+
+    VAStatus status = submitPicture(enc, map.mappedResource, map.mappedBufferFmt, input, resource.pitch, out->bitstream);
+    if (status != VA_STATUS_SUCCESS) {
+        releaseInput(enc, out);
+        return status;
+    }
+    if (out->surface != NULL) {
+        pthread_mutex_lock(&input->mutex);
+        input->encodesPending++;
+        pthread_mutex_unlock(&input->mutex);
+    }
+    pthread_mutex_lock(&enc->outputMutex);
+    coded->encodePending = true;
+    enc->submitted++;
+    if (frame->staged) {
+        enc->lastStaged = enc->submitted;
+    }
+    pthread_cond_broadcast(&enc->outputCond);
+    pthread_mutex_unlock(&enc->outputMutex);
+    return VA_STATUS_SUCCESS;
+}
@@ -1,36 +1,50 @@
 #ifndef NVENC_H
 #define NVENC_H
 
-#include <nvEncodeAPI.h>
-#include <va/va.h>
-
-/* Structure to hold NVENC frame data */
-struct nv_frame {
-    void* input_buffer;
-    NV_ENC_INPUT_PTR input_surface;
-    NV_ENC_OUTPUT_PTR output_buffer;
-    unsigned int width;
-    unsigned int height;
-    unsigned int pitch;
-    VASurfaceID va_surface;
-};
-
-/* Check if NVENC is available and supported */
-int nvenc_is_available(void);
-
-/* Get supported encoding profiles */
-int nvenc_get_profiles(VAProfile *profiles, int *num_profiles);
-
-/* Initialize the NVENC encoder with specific parameters */
-int nvenc_init(unsigned int width, unsigned int height, unsigned int bitrate);
-
-/* Prepare frame buffers for encoding */
-int nvenc_prepare_frame(struct nv_frame *frame, VASurfaceID surface);
-
-/* Encode a frame using NVENC */
-int nvenc_encode_frame(struct nv_frame *frame);
-
-/* Terminate NVENC encoder and free resources */
-void nvenc_terminate(void);
+#include "vabackend.h"
+
+//the codecs NVENC can encode to, also the index into the caps table's encodeCaps
+typedef enum {
+    NV_ENCODE_H264,
+    NV_ENCODE_HEVC,
+    NV_ENCODE_AV1,
+} NVEncodeCodec;
+
+//where NVENC reads a picture from, either a pitch-linear frame laid out like NVDEC's output, or if array is set the
+//CUDA array of a single plane surface that's been exported
+typedef struct {
+    CUdeviceptr ptr;
+    size_t      pitch;
+    CUarray     array;
+    bool        staged;     //ptr is a copy in the context's procInput rather than the surface's own storage
+} NVEncodeFrame;
+
+//returns false if the profile can't be encoded to
+bool nvencCodecForProfile(VAProfile profile, NVEncodeCodec *codec);
+//reads NVENC's limits for every codec into the caps table. Must be called with the CUDA context current
+bool nvencQueryCaps(NVDriver *drv);
+//opens the context's NVENC session. The encoder itself is set up at the first picture, once the sequence parameters
+//are known. Must be called with the CUDA context current
+VAStatus nvencCreateEncoder(NVContext *ctx, const NVConfig *cfg);
+void nvencDestroyEncoder(NVContext *ctx);
+//unregisters the surface's storage, before it's freed or the surface's backing image is detached
+void nvencForgetSurface(NVContext *ctx, const NVSurface *surface);
+//unregisters a frame that isn't a surface's, before it's freed
+void nvencForgetFrame(NVContext *ctx, CUdeviceptr frame);
+//waits for NVENC to have read the staging buffer, before the next input is copied into it
+void nvencWaitForStagedInput(NVContext *ctx);
+//waits up to timeout_ns for the picture being encoded into the coded buffer, returning how the encode went
+VAStatus nvencWaitForCodedBuffer(NVContext *ctx, NVBuffer *coded, uint64_t timeout_ns);
+//unlocks the NVENC bitstream buffer the coded buffer's segment points into, once the application is done with it.
+//The segment is left empty
+void nvencUnmapCodedBuffer(NVContext *ctx, NVBuffer *coded);
+//forgets the parameters of the previous picture
+void nvencBeginPicture(NVContext *ctx);
+//records what a sequence, picture, slice or misc parameter buffer asks of the current picture
+void nvencRenderBuffer(NVContext *ctx, NVBuffer *buf);
+//submits the input surface's frame to be encoded into the picture's coded buffer, waiting only if the encoder
+//already has as many pictures in flight as it can take. NVENC reads it in place, so this must be called with the CUDA context current and
+//nothing left to complete on the frame
+VAStatus nvencEncodePicture(NVContext *ctx, NVSurface *input, const NVEncodeFrame *frame);
 
 #endif // NVENC_H
@@ -0,0 +1,64 @@
+#define _GNU_SOURCE
+
+#include "nvtx.h"
+#include "vabackend.h"
+
+#include <dlfcn.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* NVTX ranges are pushed through libnvToolsExt, which hands them to whatever profiler has injected itself through
+ * NVTX_INJECTION64_PATH. It's only loaded if NVD_NVTX asks for it or a profiler is attached, so normally nothing is
+ * loaded and every range is a single branch on nvtxEnabled. */
+
+#define NVTX_NAME_SIZE 128
+
+bool nvtxEnabled;
+
+static void *nvtxLib;
+static int (*nvtxRangePushA)(const char *message);
+static int (*nvtxRangePop)(void);
+
+void nvtxConfigure(const char *nvdNvtx) {
+    bool wanted = nvdNvtx != NULL ? strcmp(nvdNvtx, "0") != 0 : getenv("NVTX_INJECTION64_PATH") != NULL;
+    if (!wanted) {
+        return;
+    }
+    nvtxLib = dlopen("libnvToolsExt.so.1", RTLD_LAZY | RTLD_LOCAL);
+    if (nvtxLib == NULL) {
+        LOG("Unable to load libnvToolsExt, NVTX ranges are disabled");
+        return;
+    }
+    nvtxRangePushA = dlsym(nvtxLib, "nvtxRangePushA");
+    nvtxRangePop = dlsym(nvtxLib, "nvtxRangePop");
+    if (nvtxRangePushA == NULL || nvtxRangePop == NULL) {
+        LOG("libnvToolsExt is missing nvtxRangePushA or nvtxRangePop, NVTX ranges are disabled");
+        dlclose(nvtxLib);
+        nvtxLib = NULL;
+        return;
+    }
+    nvtxEnabled = true;
+    LOG("Emitting NVTX ranges");
+}
+
+bool nvtxPush(const char *format, ...) {
+    char name[NVTX_NAME_SIZE];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(name, sizeof(name), format, args);
+    va_end(args);
+    nvtxRangePushA(name);
+    return true;
+}
+
+void nvtxPop(void) {
+    nvtxRangePop();
+}
+
+void nvtxEndRange(const bool *pushed) {
+    if (*pushed) {
+        nvtxRangePop();
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef NVTX_H
+#define NVTX_H
+
+#include <stdbool.h>
+
+#ifndef __has_attribute
+#define __has_attribute(x) 0
+#endif
+
+//set once libnvToolsExt has been loaded, see NVD_NVTX
+extern bool nvtxEnabled;
+
+//loads libnvToolsExt if NVD_NVTX is set, or if a profiler such as Nsight Systems is collecting NVTX ranges
+void nvtxConfigure(const char *nvdNvtx);
+//pushes a range named by the format, returning true so NVTX_RANGE knows to pop it
+#if __has_attribute(gnu_printf) || (defined(__GNUC__) && !defined(__clang__))
+__attribute((format(gnu_printf, 1, 2)))
+#endif
+bool nvtxPush(const char *format, ...);
+void nvtxPop(void);
+void nvtxEndRange(const bool *pushed);
+
+//the name is only formatted if NVTX is loaded, otherwise a range costs a load and a branch at each end
+#define NVTX_PUSH(...) do { if (nvtxEnabled) { nvtxPush(__VA_ARGS__); } } while (0)
+#define NVTX_POP() do { if (nvtxEnabled) { nvtxPop(); } } while (0)
+//a range that covers the rest of the enclosing scope, however it's left
+#define NVTX_CONCAT_(a, b) a##b
+#define NVTX_CONCAT(a, b) NVTX_CONCAT_(a, b)
+#define NVTX_RANGE(...) __attribute__((cleanup(nvtxEndRange))) const bool NVTX_CONCAT(nvtxRange, __LINE__) = nvtxEnabled && nvtxPush(__VA_ARGS__)
+
+#endif // NVTX_H
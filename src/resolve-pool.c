@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+
+#include "resolve-pool.h"
+#include "vabackend.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+/* Decoded pictures are resolved by a few workers per GPU rather than a thread per context. Each context is a job with
+ * it's own queue of surfaces, a job is queued on the pool when a picture is submitted and runs on one worker at a time,
+ * so the context's mapped frames still only have one thread touching them. A turn resolves a handful of surfaces and
+ * then goes to the back of the run queue if there's more, so a busy context can't starve the others. */
+
+#define MAX_RESOLVE_POOLS   16
+#define MAX_RESOLVE_THREADS 32
+#define DEFAULT_RESOLVE_THREADS 4
+
+struct _NVResolvePool {
+    int                 gpu;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      work;       //signalled when a job is queued
+    pthread_cond_t      turnDone;   //broadcast when a job's turn ends
+    NVResolveJob        *head;
+    NVResolveJob        *tail;
+    bool                exiting;
+    int                 threadCount;
+    pthread_t           threads[MAX_RESOLVE_THREADS];
+};
+
+static int threadsPerPool = DEFAULT_RESOLVE_THREADS;
+static bool numaPinning = false;
+
+static pthread_mutex_t poolsMutex = PTHREAD_MUTEX_INITIALIZER;
+static NVResolvePool *pools[MAX_RESOLVE_POOLS];
+static int poolCount = 0;
+
+void resolvePoolConfigure(const char *threads, const char *numa) {
+    if (threads != NULL) {
+        threadsPerPool = MIN(MAX(atoi(threads), 1), MAX_RESOLVE_THREADS);
+    } else {
+        //no point having more workers than CPUs to run them
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threadsPerPool = cpus > 0 ? (int) MIN(cpus, DEFAULT_RESOLVE_THREADS) : DEFAULT_RESOLVE_THREADS;
+    }
+    if (numa != NULL) {
+        numaPinning = strcmp(numa, "0") != 0;
+    }
+}
+
+//must be called with the pool's mutex held
+static void enqueueJob(NVResolvePool *pool, NVResolveJob *job) {
+    job->state = NV_JOB_QUEUED;
+    job->next = NULL;
+    if (pool->tail != NULL) {
+        pool->tail->next = job;
+    } else {
+        pool->head = job;
+    }
+    pool->tail = job;
+    pthread_cond_signal(&pool->work);
+}
+
+static void *resolveWorker(void *param) {
+    NVResolvePool *pool = (NVResolvePool*) param;
+    pthread_mutex_lock(&pool->mutex);
+    while (true) {
+        while (pool->head == NULL && !pool->exiting) {
+            pthread_cond_wait(&pool->work, &pool->mutex);
+        }
+        if (pool->exiting) {
+            break;
+        }
+        NVResolveJob *job = pool->head;
+        pool->head = job->next;
+        if (pool->head == NULL) {
+            pool->tail = NULL;
+        }
+        job->state = NV_JOB_RUNNING;
+        job->rescheduled = false;
+        pthread_mutex_unlock(&pool->mutex);
+
+        bool more = job->run(job);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (more || job->rescheduled) {
+            enqueueJob(pool, job);
+        } else {
+            job->state = NV_JOB_IDLE;
+        }
+        pthread_cond_broadcast(&pool->turnDone);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+//parses a sysfs cpu list, such as 0-7,16-23
+static bool parseCpuList(const char *list, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    const char *p = list;
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p) {
+            return false;
+        }
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) {
+                return false;
+            }
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET((int) cpu, cpus);
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+    return CPU_COUNT(cpus) > 0;
+}
+
+//the CPUs local to the GPU the DRM fd is for
+static bool gpuLocalCpus(int drmFd, cpu_set_t *cpus) {
+    struct stat st;
+    if (drmFd < 0 || fstat(drmFd, &st) != 0 || !S_ISCHR(st.st_mode)) {
+        return false;
+    }
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device/local_cpulist", major(st.st_rdev), minor(st.st_rdev));
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return false;
+    }
+    char list[1024];
+    bool ret = fgets(list, sizeof(list), f) != NULL && parseCpuList(list, cpus);
+    fclose(f);
+    return ret;
+}
+
+static NVResolvePool *createPool(int gpu, int drmFd) {
+    NVResolvePool *pool = calloc(1, sizeof(NVResolvePool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->gpu = gpu;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->turnDone, NULL);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    cpu_set_t cpus;
+    bool pinned = numaPinning && gpuLocalCpus(drmFd, &cpus) && pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus) == 0;
+    if (numaPinning && !pinned) {
+        LOG("Unable to find the CPUs local to GPU %d, resolve workers aren't pinned", gpu);
+    }
+    for (int i = 0; i < threadsPerPool; i++) {
+        int err = pthread_create(&pool->threads[pool->threadCount], &attr, &resolveWorker, pool);
+        if (err != 0) {
+            LOG("Unable to create resolve worker: %d", err);
+            break;
+        }
+        pool->threadCount++;
+    }
+    pthread_attr_destroy(&attr);
+    if (pool->threadCount == 0) {
+        pthread_cond_destroy(&pool->turnDone);
+        pthread_cond_destroy(&pool->work);
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool);
+        return NULL;
+    }
+    LOG("Started %d resolve worker(s) for GPU %d%s", pool->threadCount, gpu, pinned ? ", pinned to it's NUMA node" : "");
+    return pool;
+}
+
+NVResolvePool *resolvePoolGet(int gpu, int drmFd) {
+    NVResolvePool *pool = NULL;
+    pthread_mutex_lock(&poolsMutex);
+    for (int i = 0; i < poolCount; i++) {
+        if (pools[i]->gpu == gpu) {
+            pool = pools[i];
+            break;
+        }
+    }
+    if (pool == NULL && poolCount < MAX_RESOLVE_POOLS) {
+        pool = createPool(gpu, drmFd);
+        if (pool != NULL) {
+            pools[poolCount++] = pool;
+        }
+    }
+    pthread_mutex_unlock(&poolsMutex);
+    return pool;
+}
+
+void resolvePoolShutdown(void) {
+    pthread_mutex_lock(&poolsMutex);
+    for (int i = 0; i < poolCount; i++) {
+        NVResolvePool *pool = pools[i];
+        pthread_mutex_lock(&pool->mutex);
+        pool->exiting = true;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->mutex);
+        for (int j = 0; j < pool->threadCount; j++) {
+            pthread_join(pool->threads[j], NULL);
+        }
+        pthread_cond_destroy(&pool->turnDone);
+        pthread_cond_destroy(&pool->work);
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool);
+        pools[i] = NULL;
+    }
+    poolCount = 0;
+    pthread_mutex_unlock(&poolsMutex);
+}
+
+void resolveJobInit(NVResolveJob *job, NVResolvePool *pool, ResolveJobFunc run, void *data) {
+    *job = (NVResolveJob) {
+        .run = run,
+        .data = data,
+        .pool = pool,
+        .state = NV_JOB_IDLE,
+    };
+}
+
+void resolveJobSchedule(NVResolveJob *job) {
+    NVResolvePool *pool = job->pool;
+    pthread_mutex_lock(&pool->mutex);
+    if (job->state == NV_JOB_IDLE) {
+        enqueueJob(pool, job);
+    } else if (job->state == NV_JOB_RUNNING) {
+        //the worker might have already looked at the queue, so it has to take another turn
+        job->rescheduled = true;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void resolveJobRemove(NVResolveJob *job) {
+    NVResolvePool *pool = job->pool;
+    pthread_mutex_lock(&pool->mutex);
+    while (true) {
+        if (job->state == NV_JOB_QUEUED) {
+            NVResolveJob **link = &pool->head;
+            NVResolveJob *prev = NULL;
+            while (*link != job) {
+                prev = *link;
+                link = &(*link)->next;
+            }
+            *link = job->next;
+            if (pool->tail == job) {
+                pool->tail = prev;
+            }
+            job->state = NV_JOB_IDLE;
+        }
+        if (job->state == NV_JOB_IDLE) {
+            break;
+        }
+        //stop the turn in progress from queueing it again
+        job->rescheduled = false;
+        pthread_cond_wait(&pool->turnDone, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,42 @@
+#ifndef RESOLVE_POOL_H
+#define RESOLVE_POOL_H
+
+#include <stdbool.h>
+
+typedef struct _NVResolveJob NVResolveJob;
+typedef struct _NVResolvePool NVResolvePool;
+
+//runs a turn of the job on one of the pool's workers, returns true if it stopped with work left
+typedef bool (*ResolveJobFunc)(NVResolveJob *job);
+
+typedef enum {
+    NV_JOB_IDLE,
+    NV_JOB_QUEUED,
+    NV_JOB_RUNNING,
+} NVJobState;
+
+//a decode context's share of a pool, the pool only ever runs a job on one worker at a time
+struct _NVResolveJob {
+    ResolveJobFunc      run;
+    void                *data;
+    NVResolvePool       *pool;
+    //the rest are guarded by the pool's mutex
+    NVResolveJob        *next;          //in the pool's run queue
+    NVJobState          state;
+    bool                rescheduled;    //scheduled again while it was running
+};
+
+//reads NVD_RESOLVE_THREADS and NVD_RESOLVE_NUMA
+void resolvePoolConfigure(const char *threads, const char *numa);
+//the pool of the GPU, started on first use. drmFd is used to find the GPU's NUMA node, and can be -1
+NVResolvePool *resolvePoolGet(int gpu, int drmFd);
+//stops and joins every pool's workers, once no contexts are left
+void resolvePoolShutdown(void);
+
+void resolveJobInit(NVResolveJob *job, NVResolvePool *pool, ResolveJobFunc run, void *data);
+//has the job run soon, cheap if it's already queued or running
+void resolveJobSchedule(NVResolveJob *job);
+//takes the job out of the pool, waiting for a turn in progress to finish. Once it returns no worker has the job
+void resolveJobRemove(NVResolveJob *job);
+
+#endif // RESOLVE_POOL_H
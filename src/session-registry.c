@@ -0,0 +1,178 @@
+#define _GNU_SOURCE
+
+#include "session-registry.h"
+#include "vabackend.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* The registry is a small file in /dev/shm mapped by every process of the user, with a slot per decode session.
+ * Processes that die without releasing their sessions are found by their pid no longer existing, so a crashed
+ * worker doesn't hold on to its share of the GPU. The file is locked with flock, which also covers processes
+ * that die while holding it, and a mutex as flock doesn't exclude other threads using the same descriptor. */
+
+#define REGISTRY_MAGIC      0x5353564e  //"NVSS"
+#define REGISTRY_VERSION    1
+#define REGISTRY_SESSIONS   1024
+
+typedef struct {
+    uint8_t     uuid[16];
+    int32_t     pid;            //0 if the slot is free
+    uint32_t    reserved;
+    uint64_t    pixels;
+} NVRegistrySession;
+
+typedef struct {
+    uint32_t            magic;
+    uint32_t            version;
+    NVRegistrySession   sessions[REGISTRY_SESSIONS];
+} NVRegistry;
+
+static pthread_once_t registryOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t registryMutex = PTHREAD_MUTEX_INITIALIZER;
+static NVRegistry *registry;
+static int registryFd = -1;
+
+static void openRegistry(void) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/dev/shm/nvidia-vaapi-driver-sessions-%u", (unsigned int) getuid());
+    int fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+    if (fd == -1) {
+        LOG("Unable to open session registry %s: %d", path, errno);
+        return;
+    }
+    //a new file is all zeros, which is an empty registry once the header is written
+    if (flock(fd, LOCK_EX) != 0 || ftruncate(fd, sizeof(NVRegistry)) != 0) {
+        LOG("Unable to initialise session registry %s: %d", path, errno);
+        close(fd);
+        return;
+    }
+    NVRegistry *map = mmap(NULL, sizeof(NVRegistry), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        LOG("Unable to map session registry %s: %d", path, errno);
+        flock(fd, LOCK_UN);
+        close(fd);
+        return;
+    }
+    if (map->magic != REGISTRY_MAGIC || map->version != REGISTRY_VERSION) {
+        memset(map, 0, sizeof(NVRegistry));
+        map->magic = REGISTRY_MAGIC;
+        map->version = REGISTRY_VERSION;
+    }
+    flock(fd, LOCK_UN);
+    registry = map;
+    registryFd = fd;
+}
+
+static bool lockRegistry(void) {
+    pthread_once(&registryOnce, openRegistry);
+    if (registry == NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&registryMutex);
+    if (flock(registryFd, LOCK_EX) != 0) {
+        pthread_mutex_unlock(&registryMutex);
+        return false;
+    }
+    return true;
+}
+
+static void unlockRegistry(void) {
+    flock(registryFd, LOCK_UN);
+    pthread_mutex_unlock(&registryMutex);
+}
+
+//frees the slots of processes that have gone away. Called with the registry locked
+static void reapSessions(void) {
+    for (int i = 0; i < REGISTRY_SESSIONS; i++) {
+        NVRegistrySession *session = &registry->sessions[i];
+        if (session->pid != 0 && kill(session->pid, 0) != 0 && errno == ESRCH) {
+            LOG("Releasing session of exited process %d", session->pid);
+            memset(session, 0, sizeof(NVRegistrySession));
+        }
+    }
+}
+
+//what the GPU is already running. Called with the registry locked
+static void gpuUsage(const uint8_t uuid[16], uint32_t *decoders, uint64_t *pixels) {
+    *decoders = 0;
+    *pixels = 0;
+    for (int i = 0; i < REGISTRY_SESSIONS; i++) {
+        const NVRegistrySession *session = &registry->sessions[i];
+        if (session->pid != 0 && memcmp(session->uuid, uuid, 16) == 0) {
+            (*decoders)++;
+            *pixels += session->pixels;
+        }
+    }
+}
+
+static bool limited(const NVSessionLimits *limits) {
+    return limits->maxDecoders > 0 || limits->maxPixels > 0;
+}
+
+bool gpuHasSessionCapacity(const uint8_t uuid[16], const NVSessionLimits *limits) {
+    if (!limited(limits) || !lockRegistry()) {
+        return true;
+    }
+    reapSessions();
+    uint32_t decoders;
+    uint64_t pixels;
+    gpuUsage(uuid, &decoders, &pixels);
+    unlockRegistry();
+    return (limits->maxDecoders == 0 || decoders < limits->maxDecoders)
+        && (limits->maxPixels == 0 || pixels < limits->maxPixels);
+}
+
+int acquireGpuSession(const uint8_t uuid[16], const NVSessionLimits *limits, uint64_t pixels) {
+    if (!limited(limits) || !lockRegistry()) {
+        return 0;
+    }
+    reapSessions();
+    uint32_t usedDecoders;
+    uint64_t usedPixels;
+    gpuUsage(uuid, &usedDecoders, &usedPixels);
+    if ((limits->maxDecoders > 0 && usedDecoders >= limits->maxDecoders)
+            || (limits->maxPixels > 0 && usedPixels + pixels > limits->maxPixels)) {
+        LOG("GPU is at its session limits, %u decoders with %" PRIu64 " pixels of surfaces", usedDecoders, usedPixels);
+        unlockRegistry();
+        return -1;
+    }
+    int id = 0;
+    for (int i = 0; i < REGISTRY_SESSIONS; i++) {
+        NVRegistrySession *session = &registry->sessions[i];
+        if (session->pid == 0) {
+            memcpy(session->uuid, uuid, 16);
+            session->pid = getpid();
+            session->pixels = pixels;
+            id = i + 1;
+            break;
+        }
+    }
+    if (id == 0) {
+        //not worth failing over, the session just won't count towards the limits
+        LOG("Session registry is full");
+    }
+    unlockRegistry();
+    return id;
+}
+
+void releaseGpuSession(int session) {
+    if (session <= 0 || !lockRegistry()) {
+        return;
+    }
+    NVRegistrySession *slot = &registry->sessions[session - 1];
+    //a forked child inherits the id but not the session
+    if (slot->pid == getpid()) {
+        memset(slot, 0, sizeof(NVRegistrySession));
+    }
+    unlockRegistry();
+}
@@ -0,0 +1,21 @@
+#ifndef SESSION_REGISTRY_H
+#define SESSION_REGISTRY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//limits on the decode sessions of a GPU, shared by every process using the driver. 0 means unlimited
+typedef struct {
+    uint32_t    maxDecoders;
+    uint64_t    maxPixels;
+} NVSessionLimits;
+
+//returns false if the GPU is already at its limits, so a display opened on it couldn't decode anything
+bool gpuHasSessionCapacity(const uint8_t uuid[16], const NVSessionLimits *limits);
+//records a decoder with surfaces totalling the number of pixels. Returns -1 if that would go over the limits,
+//otherwise an id to release the session with, which is 0 if the session isn't being tracked (there are no limits,
+//or the registry can't be used)
+int acquireGpuSession(const uint8_t uuid[16], const NVSessionLimits *limits, uint64_t pixels);
+void releaseGpuSession(int session);
+
+#endif // SESSION_REGISTRY_H
@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+
+#include "stats.h"
+#include "vabackend.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <time.h>
+#include <unistd.h>
+
+/* With NVD_STATS_SHM the counters live in a file in /dev/shm named after the process, with a slot per context, so
+ * they can be read while the process runs. The slots are claimed by compare and swap on their pid, and the file is
+ * removed when the driver is unloaded. Without it, or if the file can't be used, each NVStats is just allocated. */
+
+#define STATS_MAGIC     0x5453564e  //"NVST"
+#define STATS_VERSION   2
+#define STATS_SLOTS     64
+
+typedef struct {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    slotCount;
+    uint32_t    stageCount;
+    uint32_t    bucketCount;
+    uint32_t    gaugeCount;
+    NVStats     slots[STATS_SLOTS];
+} NVStatsSegment;
+
+static const struct {
+    const char  *name;
+    bool        time;
+} stageInfo[NV_STAT_COUNT] = {
+    [NV_STAT_DECODE]        = { "decode", true },
+    [NV_STAT_QUEUE_WAIT]    = { "queue wait", true },
+    [NV_STAT_QUEUE_DEPTH]   = { "queue depth", false },
+    [NV_STAT_MAP]           = { "map", true },
+    [NV_STAT_COPY]          = { "copy", true },
+    [NV_STAT_REALISE]       = { "realise", true },
+    [NV_STAT_SYNC]          = { "sync", true },
+    [NV_STAT_ENCODE]        = { "encode", true },
+};
+
+static const char *gaugeNames[NV_GAUGE_COUNT] = {
+    [NV_GAUGE_VRAM_DECODERS]    = "vram decoder",
+    [NV_GAUGE_VRAM_FRAMES]      = "vram frames",
+    [NV_GAUGE_VRAM_IMAGES]      = "vram images",
+    [NV_GAUGE_VRAM_POOLED]      = "vram pooled",
+    [NV_GAUGE_VRAM_EVICTED]     = "vram evicted",
+};
+
+static bool enabled;
+static uint64_t dumpIntervalNs;   //0 to only dump when the counters are destroyed
+static bool useSegment;
+static pthread_once_t segmentOnce = PTHREAD_ONCE_INIT;
+static NVStatsSegment *segment;
+static char segmentPath[PATH_MAX];
+static pid_t segmentPid;
+
+static uint64_t statsNow(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
+
+void statsConfigure(const char *stats, const char *shm) {
+    if (stats != NULL) {
+        long interval = strtol(stats, NULL, 10);
+        enabled = interval > 0;
+        //1 is just "on", anything more is how often to dump in seconds
+        dumpIntervalNs = interval > 1 ? (uint64_t) interval * 1000000000ull : 0;
+    }
+    useSegment = enabled && shm != NULL && strcmp(shm, "0") != 0;
+}
+
+static void openSegment(void) {
+    snprintf(segmentPath, sizeof(segmentPath), "/dev/shm/nvidia-vaapi-driver-stats-%d", (int) getpid());
+    int fd = open(segmentPath, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+    if (fd == -1) {
+        LOG("Unable to open stats segment %s: %d", segmentPath, errno);
+        return;
+    }
+    if (ftruncate(fd, sizeof(NVStatsSegment)) != 0) {
+        LOG("Unable to size stats segment %s: %d", segmentPath, errno);
+        close(fd);
+        unlink(segmentPath);
+        return;
+    }
+    //a new file is all zeros, so every slot starts out free
+    NVStatsSegment *map = mmap(NULL, sizeof(NVStatsSegment), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOG("Unable to map stats segment %s: %d", segmentPath, errno);
+        unlink(segmentPath);
+        return;
+    }
+    map->slotCount = STATS_SLOTS;
+    map->stageCount = NV_STAT_COUNT;
+    map->bucketCount = NV_STAT_BUCKETS;
+    map->gaugeCount = NV_GAUGE_COUNT;
+    map->version = STATS_VERSION;
+    map->magic = STATS_MAGIC;
+    segment = map;
+    segmentPid = getpid();
+    LOG("Publishing stats to %s", segmentPath);
+}
+
+__attribute__ ((destructor))
+static void closeSegment(void) {
+    //a forked child shares the mapping, but the file is named after the parent
+    if (segment != NULL && getpid() == segmentPid) {
+        unlink(segmentPath);
+    }
+}
+
+static NVStats *claimSlot(void) {
+    pthread_once(&segmentOnce, openSegment);
+    if (segment == NULL) {
+        return NULL;
+    }
+    int32_t pid = (int32_t) getpid();
+    for (int i = 0; i < STATS_SLOTS; i++) {
+        NVStats *slot = &segment->slots[i];
+        int32_t expected = 0;
+        if (atomic_compare_exchange_strong(&slot->pid, &expected, pid)) {
+            return slot;
+        }
+    }
+    LOG("Stats segment is full");
+    return NULL;
+}
+
+NVStats *statsCreate(const char *name, uint32_t id) {
+    if (!enabled) {
+        return NULL;
+    }
+    NVStats *stats = useSegment ? claimSlot() : NULL;
+    if (stats != NULL) {
+        //the pid is already set, clear everything after it
+        memset((char*) stats + sizeof(stats->pid), 0, sizeof(NVStats) - sizeof(stats->pid));
+    } else {
+        stats = calloc(1, sizeof(NVStats));
+        if (stats == NULL) {
+            return NULL;
+        }
+    }
+    stats->id = id;
+    snprintf(stats->name, sizeof(stats->name), "%s", name);
+    atomic_store_explicit(&stats->lastDump, statsNow(), memory_order_relaxed);
+    return stats;
+}
+
+static bool inSegment(const NVStats *stats) {
+    return segment != NULL && stats >= segment->slots && stats < segment->slots + STATS_SLOTS;
+}
+
+void statsDestroy(NVStats *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    statsDump(stats);
+    if (inSegment(stats)) {
+        atomic_store(&stats->pid, 0);
+    } else {
+        free(stats);
+    }
+}
+
+//upper end of the bucket the percentile falls in
+static uint64_t percentile(const uint64_t buckets[NV_STAT_BUCKETS], uint64_t count, unsigned int percent) {
+    uint64_t target = (count * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < NV_STAT_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= target) {
+            return i == NV_STAT_BUCKETS - 1 ? UINT64_MAX : (2ull << i) - 1;
+        }
+    }
+    return UINT64_MAX;
+}
+
+void statsDump(NVStats *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    LOG("Stats for %s %u", stats->name, stats->id);
+    for (int s = 0; s < NV_STAT_COUNT; s++) {
+        NVStatHistogram *h = &stats->stages[s];
+        uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+        if (count == 0) {
+            continue;
+        }
+        uint64_t buckets[NV_STAT_BUCKETS];
+        for (int i = 0; i < NV_STAT_BUCKETS; i++) {
+            buckets[i] = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        }
+        uint64_t avg = atomic_load_explicit(&h->total, memory_order_relaxed) / count;
+        uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+        uint64_t p50 = MIN(percentile(buckets, count, 50), max);
+        uint64_t p99 = MIN(percentile(buckets, count, 99), max);
+        if (stageInfo[s].time) {
+            LOG("  %-12s %10" PRIu64 " samples, avg %" PRIu64 "us, p50 <%" PRIu64 "us, p99 <%" PRIu64 "us, max %" PRIu64 "us",
+                stageInfo[s].name, count, avg / 1000, (p50 + 999) / 1000, (p99 + 999) / 1000, max / 1000);
+        } else {
+            LOG("  %-12s %10" PRIu64 " samples, avg %" PRIu64 ", p50 <=%" PRIu64 ", p99 <=%" PRIu64 ", max %" PRIu64,
+                stageInfo[s].name, count, avg, p50, p99, max);
+        }
+    }
+    for (int g = 0; g < NV_GAUGE_COUNT; g++) {
+        int64_t value = atomic_load_explicit(&stats->gauges[g], memory_order_relaxed);
+        if (value != 0) {
+            LOG("  %-12s %10" PRId64 " KiB", gaugeNames[g], value / 1024);
+        }
+    }
+}
+
+uint64_t statsStart(const NVStats *stats) {
+    return stats != NULL ? statsNow() : 0;
+}
+
+void statsRecordValue(NVStats *stats, NVStatStage stage, uint64_t value) {
+    if (stats == NULL) {
+        return;
+    }
+    NVStatHistogram *h = &stats->stages[stage];
+    int bucket = value == 0 ? 0 : MIN(63 - __builtin_clzll(value), NV_STAT_BUCKETS - 1);
+    atomic_fetch_add_explicit(&h->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->total, value, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (value > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, value, memory_order_relaxed, memory_order_relaxed));
+    //counted last, so a dump never sees more samples than the buckets hold
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+}
+
+void statsRecord(NVStats *stats, NVStatStage stage, uint64_t start) {
+    if (stats == NULL) {
+        return;
+    }
+    uint64_t now = statsNow();
+    statsRecordValue(stats, stage, now - start);
+    if (dumpIntervalNs == 0) {
+        return;
+    }
+    //whichever thread moves lastDump on does the dump
+    uint64_t last = atomic_load_explicit(&stats->lastDump, memory_order_relaxed);
+    if (now - last >= dumpIntervalNs
+            && atomic_compare_exchange_strong_explicit(&stats->lastDump, &last, now, memory_order_relaxed, memory_order_relaxed)) {
+        statsDump(stats);
+    }
+}
+
+void statsAddGauge(NVStats *stats, NVStatGauge gauge, int64_t delta) {
+    if (stats == NULL) {
+        return;
+    }
+    atomic_fetch_add_explicit(&stats->gauges[gauge], delta, memory_order_relaxed);
+}
@@ -0,0 +1,67 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+//what's measured, in the order the stages appear in a dump and in the shared memory segment
+typedef enum {
+    NV_STAT_DECODE,         //cuvidDecodePicture in nvEndPicture
+    NV_STAT_QUEUE_WAIT,     //nvEndPicture blocked on a full surface queue
+    NV_STAT_QUEUE_DEPTH,    //pictures already queued for the resolve thread when one is added, not a time
+    NV_STAT_MAP,            //cuvidMapVideoFrame in the resolve thread, which includes waiting for the decode
+    NV_STAT_COPY,           //queueing the copy of a mapped frame to it's surface, including any allocation
+    NV_STAT_REALISE,        //allocating a surface's storage ahead of time, or it's backing image on export
+    NV_STAT_SYNC,           //vaSyncSurface blocked on a surface
+    NV_STAT_ENCODE,         //submitting a picture to NVENC, including waiting for room in the pipeline
+    NV_STAT_COUNT
+} NVStatStage;
+
+//levels rather than samples, in the order they appear in a dump. Only the driver's counters have any
+typedef enum {
+    NV_GAUGE_VRAM_DECODERS,     //bytes held by NVDEC's surfaces, see NVVramKind
+    NV_GAUGE_VRAM_FRAMES,       //bytes held by the frames of surfaces that haven't been exported
+    NV_GAUGE_VRAM_IMAGES,       //bytes held by backing images
+    NV_GAUGE_VRAM_POOLED,       //bytes held by backing images that aren't attached to a surface
+    NV_GAUGE_VRAM_EVICTED,      //bytes of pooled backing images destroyed to keep under NVD_VRAM_BUDGET, only ever goes up
+    NV_GAUGE_COUNT
+} NVStatGauge;
+
+//bucket i counts the samples whose value has it's highest set bit at i, the last bucket takes everything above
+#define NV_STAT_BUCKETS 40
+
+typedef struct {
+    _Atomic uint64_t    count;
+    _Atomic uint64_t    total;
+    _Atomic uint64_t    max;
+    _Atomic uint64_t    buckets[NV_STAT_BUCKETS];
+} NVStatHistogram;
+
+//the counters of a context, or of the driver for work that doesn't belong to one. Samples are added with relaxed
+//atomics so any thread can record without locking, and a scraper reading the shared memory segment sees every
+//histogram as it was at some point, if not all of them at the same point
+typedef struct {
+    _Atomic int32_t     pid;            //0 if the slot is free
+    uint32_t            id;             //the VAContextID, or 0 for the driver
+    char                name[16];
+    _Atomic uint64_t    lastDump;
+    NVStatHistogram     stages[NV_STAT_COUNT];
+    _Atomic int64_t     gauges[NV_GAUGE_COUNT];
+} NVStats;
+
+//reads NVD_STATS and NVD_STATS_SHM
+void statsConfigure(const char *stats, const char *shm);
+//returns NULL if stats are disabled, which every other function accepts and ignores
+NVStats *statsCreate(const char *name, uint32_t id);
+//logs the counters and frees them
+void statsDestroy(NVStats *stats);
+void statsDump(NVStats *stats);
+//the time to pass to statsRecord, or 0 without reading the clock if stats is NULL
+uint64_t statsStart(const NVStats *stats);
+void statsRecordValue(NVStats *stats, NVStatStage stage, uint64_t value);
+//records the time since start, which came from statsStart
+void statsRecord(NVStats *stats, NVStatStage stage, uint64_t start);
+void statsAddGauge(NVStats *stats, NVStatGauge gauge, int64_t delta);
+
+#endif // STATS_H
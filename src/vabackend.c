@@ -13,10 +13,15 @@
 
 #include "vabackend.h"
 #include "backend-common.h"
+#include "cuda-extra.h"
+#include "gpu-placement.h"
+#include "nvenc.h"
+#include "session-registry.h"
 
 #include <assert.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <malloc.h>
@@ -24,65 +29,92 @@
 #include <sys/param.h>
 #include <va/va_backend.h>
 #include <va/va_drmcommon.h>
+#include <va/va_vpp.h>
 #include <drm_fourcc.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <stdarg.h>
 #include <time.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 
 #ifndef __has_builtin
 #define __has_builtin(x) 0
 #endif
 
-#ifndef __has_include
-#define __has_include(x) 0
-#endif
-
-#if __has_include(<pthread_np.h>)
-#include <pthread_np.h>
-#define gettid pthread_getthreadid_np
-#define HAVE_GETTID 1
-#endif
-
-#ifndef HAVE_GETTID
-#include <sys/syscall.h>
-#ifdef __BIONIC__
-#define HAVE_GETTID 1
-#elif !defined(__GLIBC_PREREQ)
-#define HAVE_GETTID 0
-#elif !__GLIBC_PREREQ(2,30)
-#define HAVE_GETTID 0
-#else
-#define HAVE_GETTID 1
-#endif
-#endif
-
-static pid_t nv_gettid(void)
-{
-#if HAVE_GETTID
-    return gettid();
-#else
-    return syscall(__NR_gettid);
-#endif
-}
-
 static pthread_mutex_t concurrency_mutex = PTHREAD_MUTEX_INITIALIZER;
 static uint32_t instances;
 static uint32_t max_instances;
 
 static CudaFunctions *cu;
 static CuvidFunctions *cv;
+static CudaExtraFunctions *cux;
 
 extern const NVCodec __start_nvd_codecs[];
 extern const NVCodec __stop_nvd_codecs[];
 
-static FILE *LOG_OUTPUT;
-
 static int gpu = -1;
+//how displays pick a GPU when NVD_GPU isn't set
+static NVGpuPlacement gpuPlacement = NV_PLACEMENT_NONE;
+//decode sessions allowed on each GPU, counted across every process with a limit set
+static NVSessionLimits sessionLimits;
 static enum {
     EGL, DIRECT
 } backend = DIRECT;
 
+static uint32_t surfaceQueueDepth = SURFACE_QUEUE_SIZE;
+//0 picks a number based on the number of surfaces in the context
+static int outputSurfaces = 0;
+static int imagePoolSize = 8;
+//the client promises not to use an exported dma-buf once it's surface is gone, so it's image can be pooled
+static bool poolExportedImages = false;
+//what nvEndPicture does when the resolve thread has fallen behind, block or fail with VA_STATUS_ERROR_HW_BUSY
+static bool surfaceQueueBlock = true;
+//realise the backing images of a context's render targets up front on a worker thread, rather than on first decode
+static bool preallocateSurfaces = false;
+//idle decoders kept for reuse by new contexts with the same parameters, and how long they're kept for
+static uint32_t decoderPoolSize = 2;
+static uint64_t decoderPoolTimeoutNs = 30 * 1000000000ull;
+//keep decoded frames in plain CUDA memory until the surface is first exported
+static bool lazyExport = true;
+//persist the decoder caps cache between processes
+static bool diskCapsCache = true;
+//set if the constructor decided CUDA must not be loaded in this process
+static bool cudaBlocked = false;
+static pthread_once_t cudaLoadOnce = PTHREAD_ONCE_INIT;
+//use the device's primary context, shared by every display on the GPU, rather than a context per display
+static bool sharedContext = false;
+//largest picture a resizable decoder (JPEG) is created to take, clamped to what the GPU supports
+static uint32_t resizableMaxWidth = 4096;
+static uint32_t resizableMaxHeight = 4096;
+//largest picture a video decoder whose stream can change size is created to take, 0 for no headroom
+static uint32_t adaptiveMaxWidth = 0;
+static uint32_t adaptiveMaxHeight = 0;
+//create every decoder intra only, as if the config had VAConfigAttribNVDIntraOnly set
+static bool intraOnlyDefault = false;
+//how decoders deinterlace when the config doesn't say, see VAConfigAttribNVDDeinterlace
+static cudaVideoDeinterlaceMode deinterlaceDefault = cudaVideoDeinterlaceMode_Weave;
+static bool doubleRateDefault = false;
+//tune every encoder for low latency, as if the config had VAConfigAttribNVDLowLatency set
+static bool lowLatencyDefault = false;
+
+//not defined by older ffnvcodec headers
+#ifndef CUDA_ERROR_PRIMARY_CONTEXT_ACTIVE
+#define CUDA_ERROR_PRIMARY_CONTEXT_ACTIVE 708
+#endif
+
+#define MAX_SHARED_CONTEXTS 16
+typedef struct {
+    CUdevice    device;
+    CUcontext   context;
+    int         refs;
+} NVSharedContext;
+static pthread_mutex_t sharedContextsMutex = PTHREAD_MUTEX_INITIALIZER;
+static NVSharedContext sharedContexts[MAX_SHARED_CONTEXTS];
+static int sharedContextCount = 0;
+
 const NVFormatInfo formatsInfo[] =
 {
     [NV_FORMAT_NONE] = {0},
@@ -94,6 +126,12 @@ const NVFormatInfo formatsInfo[] =
 #if VA_CHECK_VERSION(1, 20, 0)
     [NV_FORMAT_Q416] = {2, 3, DRM_FORMAT_INVALID,  true,  true,  {{1, DRM_FORMAT_R16,      {0,0}}, {1, DRM_FORMAT_R16,    {0,0}}, {1, DRM_FORMAT_R16,{0,0}}}, {VA_FOURCC_Q416, VA_LSB_FIRST,   48, 0,0,0,0,0}},
 #endif
+    //image only, converted to NV12 or P01x by vaPutImage and back by vaGetImage
+    [NV_FORMAT_I420] = {1, 3, DRM_FORMAT_YUV420,   false, false, {{1, DRM_FORMAT_R8,       {0,0}}, {1, DRM_FORMAT_R8,     {1,1}}, {1, DRM_FORMAT_R8, {1,1}}}, {VA_FOURCC_I420, VA_LSB_FIRST,   12, 0,0,0,0,0}, true},
+    [NV_FORMAT_YV12] = {1, 3, DRM_FORMAT_YVU420,   false, false, {{1, DRM_FORMAT_R8,       {0,0}}, {1, DRM_FORMAT_R8,     {1,1}}, {1, DRM_FORMAT_R8, {1,1}}}, {VA_FOURCC_YV12, VA_LSB_FIRST,   12, 0,0,0,0,0}, true},
+    //only produced by video processing
+    [NV_FORMAT_BGRA] = {1, 1, DRM_FORMAT_ARGB8888, false, false, {{4, DRM_FORMAT_ARGB8888, {0,0}}},                                                    {VA_FOURCC_BGRA, VA_LSB_FIRST,   32, 32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000}, false, true},
+    [NV_FORMAT_RGBA] = {1, 1, DRM_FORMAT_ABGR8888, false, false, {{4, DRM_FORMAT_ABGR8888, {0,0}}},                                                    {VA_FOURCC_RGBA, VA_LSB_FIRST,   32, 32, 0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000}, false, true},
 };
 
 static NVFormat nvFormatFromVaFormat(uint32_t fourcc) {
@@ -140,25 +178,48 @@ VAStatus vaTerminate(VADisplay dpy)
    (The remaining functions implement the VAAPI backend interface.)
    ====================================================================== */
 
+//read for each display when it's initialised rather than once for the process, so an application can choose per
+//VADisplay by setting NVD_AV1_FILM_GRAIN before vaInitialize
+static NVFilmGrainMode filmGrainModeFromEnv(void) {
+    char *nvdFilmGrain = getenv("NVD_AV1_FILM_GRAIN");
+    if (nvdFilmGrain == NULL || strcmp(nvdFilmGrain, "decoder") == 0) {
+        return NV_FILM_GRAIN_DECODER;
+    }
+    if (strcmp(nvdFilmGrain, "driver") == 0) {
+        return NV_FILM_GRAIN_DRIVER;
+    }
+    if (strcmp(nvdFilmGrain, "off") == 0) {
+        return NV_FILM_GRAIN_OFF;
+    }
+    LOG("Ignoring unknown NVD_AV1_FILM_GRAIN value: %s", nvdFilmGrain);
+    return NV_FILM_GRAIN_DECODER;
+}
+
 __attribute__ ((constructor))
 static void init() {
-    char *nvdLog = getenv("NVD_LOG");
-    if (nvdLog != NULL) {
-        if (strcmp(nvdLog, "1") == 0) {
-            LOG_OUTPUT = stdout;
-        } else {
-            LOG_OUTPUT = fopen(nvdLog, "a");
-            if (LOG_OUTPUT == NULL) {
-                LOG_OUTPUT = stdout;
-            }
-        }
-    }
+    logConfigure(getenv("NVD_LOG"), getenv("NVD_LOG_LEVEL"));
+    nvtxConfigure(getenv("NVD_NVTX"));
 
     char *nvdGpu = getenv("NVD_GPU");
     if (nvdGpu != NULL) {
         gpu = atoi(nvdGpu);
     }
 
+    char *nvdGpuPlacement = getenv("NVD_GPU_PLACEMENT");
+    if (nvdGpuPlacement != NULL && !parseGpuPlacement(nvdGpuPlacement, &gpuPlacement)) {
+        LOG("Unknown GPU placement policy: %s", nvdGpuPlacement);
+    }
+
+    char *nvdGpuMaxDecoders = getenv("NVD_GPU_MAX_DECODERS");
+    if (nvdGpuMaxDecoders != NULL) {
+        sessionLimits.maxDecoders = (uint32_t) MAX(atoi(nvdGpuMaxDecoders), 0);
+    }
+
+    char *nvdGpuMaxPixels = getenv("NVD_GPU_MAX_PIXELS");
+    if (nvdGpuMaxPixels != NULL) {
+        sessionLimits.maxPixels = strtoull(nvdGpuMaxPixels, NULL, 10);
+    }
+
     char *nvdMaxInstances = getenv("NVD_MAX_INSTANCES");
     if (nvdMaxInstances != NULL) {
         max_instances = atoi(nvdMaxInstances);
@@ -173,37 +234,163 @@ static void init() {
         }
     }
 
+    char *nvdOutputSurfaces = getenv("NVD_OUTPUT_SURFACES");
+    if (nvdOutputSurfaces != NULL) {
+        outputSurfaces = MIN(MAX(atoi(nvdOutputSurfaces), 0), MAX_OUTPUT_SURFACES);
+    }
+
+    char *nvdImagePoolSize = getenv("NVD_IMAGE_POOL_SIZE");
+    if (nvdImagePoolSize != NULL) {
+        imagePoolSize = MAX(atoi(nvdImagePoolSize), 0);
+    }
+
+    char *nvdPoolExportedImages = getenv("NVD_POOL_EXPORTED_IMAGES");
+    if (nvdPoolExportedImages != NULL) {
+        poolExportedImages = strcmp(nvdPoolExportedImages, "1") == 0;
+    }
+
+    char *nvdQueueDepth = getenv("NVD_SURFACE_QUEUE_DEPTH");
+    if (nvdQueueDepth != NULL && atoi(nvdQueueDepth) > 0) {
+        surfaceQueueDepth = atoi(nvdQueueDepth);
+    }
+
+    char *nvdQueuePolicy = getenv("NVD_SURFACE_QUEUE_POLICY");
+    if (nvdQueuePolicy != NULL) {
+        if (strcmp(nvdQueuePolicy, "block") == 0) {
+            surfaceQueueBlock = true;
+        } else if (strcmp(nvdQueuePolicy, "busy") == 0) {
+            surfaceQueueBlock = false;
+        }
+    }
+
+    char *nvdPreallocate = getenv("NVD_PREALLOCATE_SURFACES");
+    if (nvdPreallocate != NULL) {
+        preallocateSurfaces = strcmp(nvdPreallocate, "1") == 0;
+    }
+
+    char *nvdSharedContext = getenv("NVD_SHARED_CONTEXT");
+    if (nvdSharedContext != NULL) {
+        sharedContext = strcmp(nvdSharedContext, "1") == 0;
+    }
+
+    char *nvdIntraOnly = getenv("NVD_INTRA_ONLY");
+    if (nvdIntraOnly != NULL) {
+        intraOnlyDefault = strcmp(nvdIntraOnly, "1") == 0;
+    }
+
+    char *nvdLowLatency = getenv("NVD_ENCODE_LOW_LATENCY");
+    if (nvdLowLatency != NULL) {
+        lowLatencyDefault = strcmp(nvdLowLatency, "1") == 0;
+    }
+
+    char *nvdDeinterlace = getenv("NVD_DEINTERLACE");
+    if (nvdDeinterlace != NULL) {
+        //bob-2x and adaptive-2x also output a frame for the second field
+        doubleRateDefault = strstr(nvdDeinterlace, "-2x") != NULL;
+        if (strncmp(nvdDeinterlace, "bob", 3) == 0) {
+            deinterlaceDefault = cudaVideoDeinterlaceMode_Bob;
+        } else if (strncmp(nvdDeinterlace, "adaptive", 8) == 0) {
+            deinterlaceDefault = cudaVideoDeinterlaceMode_Adaptive;
+        } else {
+            deinterlaceDefault = cudaVideoDeinterlaceMode_Weave;
+            doubleRateDefault = false;
+        }
+    }
+
+    char *nvdJpegMaxSize = getenv("NVD_JPEG_MAX_SIZE");
+    if (nvdJpegMaxSize != NULL) {
+        uint32_t width, height;
+        if (sscanf(nvdJpegMaxSize, "%ux%u", &width, &height) == 2) {
+            resizableMaxWidth = width;
+            resizableMaxHeight = height;
+        }
+    }
+
+    char *nvdDecoderMaxSize = getenv("NVD_DECODER_MAX_SIZE");
+    if (nvdDecoderMaxSize != NULL) {
+        uint32_t width, height;
+        if (sscanf(nvdDecoderMaxSize, "%ux%u", &width, &height) == 2) {
+            adaptiveMaxWidth = width;
+            adaptiveMaxHeight = height;
+        }
+    }
+
+    char *nvdCapsCache = getenv("NVD_CAPS_CACHE");
+    if (nvdCapsCache != NULL) {
+        //anything that isn't a number leaves the disk cache on, rather than atoi turning it into 0
+        char *end;
+        long value = strtol(nvdCapsCache, &end, 10);
+        if (end == nvdCapsCache || *end != '\0') {
+            LOG("Ignoring NVD_CAPS_CACHE=%s, expected 0 or 1", nvdCapsCache);
+        } else {
+            diskCapsCache = value != 0;
+        }
+    }
+
+    char *nvdLazyExport = getenv("NVD_LAZY_EXPORT");
+    if (nvdLazyExport != NULL) {
+        lazyExport = strcmp(nvdLazyExport, "0") != 0;
+    }
+
+    char *nvdDecoderPoolSize = getenv("NVD_DECODER_POOL_SIZE");
+    if (nvdDecoderPoolSize != NULL) {
+        decoderPoolSize = (uint32_t) MAX(atoi(nvdDecoderPoolSize), 0);
+    }
+
+    char *nvdDecoderPoolTimeout = getenv("NVD_DECODER_POOL_TIMEOUT");
+    if (nvdDecoderPoolTimeout != NULL) {
+        decoderPoolTimeoutNs = (uint64_t) MAX(atoi(nvdDecoderPoolTimeout), 0) * 1000000000ull;
+    }
+
+    statsConfigure(getenv("NVD_STATS"), getenv("NVD_STATS_SHM"));
+    vramConfigure(getenv("NVD_VRAM_BUDGET"));
+    resolvePoolConfigure(getenv("NVD_RESOLVE_THREADS"), getenv("NVD_RESOLVE_NUMA"));
+
     // Try to detect the Firefox sandbox and skip loading CUDA if detected.
     int fd = open("/proc/version", O_RDONLY);
     if (fd < 0) {
-        LOG("ERROR: Potential Firefox sandbox detected, failing to init!");
+        LOG_ERROR("ERROR: Potential Firefox sandbox detected, failing to init!");
         LOG("If running in Firefox, set env var MOZ_DISABLE_RDD_SANDBOX=1 to disable sandbox.");
         if (getenv("NVD_FORCE_INIT") == NULL) {
-            return;
+            cudaBlocked = true;
         }
     } else {
         close(fd);
     }
+}
 
-    // Initialize the CUDA and NVDEC functions.
+//loads the CUDA and NVDEC functions, this is deferred until something actually needs them since libva loads
+//drivers in plenty of processes that never decode anything
+static void loadCudaFunctions(void) {
     int ret = cuda_load_functions(&cu, NULL);
     if (ret != 0) {
         cu = NULL;
-        LOG("Failed to load CUDA functions");
+        LOG_ERROR("Failed to load CUDA functions");
         return;
     }
     ret = cuvid_load_functions(&cv, NULL);
     if (ret != 0) {
         cv = NULL;
-        LOG("Failed to load NVDEC functions");
+        cuda_free_functions(&cu);
+        LOG_ERROR("Failed to load NVDEC functions");
         return;
     }
+    if (!loadCudaExtraFunctions(&cux)) {
+        //not fatal, we just lose the optional features that depend on them
+        cux = NULL;
+        LOG_ERROR("Failed to load extra CUDA functions");
+    }
 
     CHECK_CUDA_RESULT(cu->cuInit(0));
 }
 
 __attribute__ ((destructor))
 static void cleanup() {
+    //the workers are idle by now, but they need the CUDA functions to finish
+    resolvePoolShutdown();
+    if (cux != NULL) {
+        freeCudaExtraFunctions(&cux);
+    }
     if (cv != NULL) {
         cuvid_free_functions(&cv);
     }
@@ -212,95 +399,146 @@ static void cleanup() {
     }
 }
 
-#ifndef __has_attribute
-#define __has_attribute(x) 0
-#endif
-
-#if __has_attribute(gnu_printf) || (defined(__GNUC__) && !defined(__clang__))
-__attribute((format(gnu_printf, 4, 5)))
-#endif
-void logger(const char *filename, const char *function, int line, const char *msg, ...) {
-    if (LOG_OUTPUT == 0) {
-        return;
-    }
-
-    va_list argList;
-    char formattedMessage[1024];
-
-    va_start(argList, msg);
-    vsnprintf(formattedMessage, 1024, msg, argList);
-    va_end(argList);
-
-    struct timespec tp;
-    clock_gettime(CLOCK_MONOTONIC, &tp);
-
-    fprintf(LOG_OUTPUT, "%10ld.%09ld [%d-%d] %s:%4d %24s %s\n", (long)tp.tv_sec, tp.tv_nsec, getpid(), nv_gettid(), filename, line, function, formattedMessage);
-    fflush(LOG_OUTPUT);
-}
-
 bool checkCudaErrors(CUresult err, const char *file, const char *function, const int line) {
     if (CUDA_SUCCESS != err) {
         const char *errStr = NULL;
         cu->cuGetErrorString(err, &errStr);
-        logger(file, function, line, "CUDA ERROR '%s' (%d)\n", errStr, err);
+        logger(NV_LOG_ERROR, file, function, line, "CUDA ERROR '%s' (%d)", errStr, err);
         return true;
     }
     return false;
 }
 
-void appendBuffer(AppendableBuffer *ab, const void *buf, uint64_t size) {
+static void *allocBufferStorage(AppendableBuffer *ab, uint64_t size, bool *pinned) {
+    *pinned = false;
+    if (ab->hostContext != NULL && cux != NULL && cux->cuMemAllocHost != NULL && cux->cuMemFreeHost != NULL) {
+        //page-locked memory lets NVDEC read the bitstream without staging it through a pageable copy first
+        void *ptr = NULL;
+        if (!CHECK_CUDA_RESULT(cu->cuCtxPushCurrent(ab->hostContext))) {
+            CUresult result = cux->cuMemAllocHost(&ptr, size);
+            CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+            if (result == CUDA_SUCCESS) {
+                *pinned = true;
+                return ptr;
+            }
+            LOG_WARN("cuMemAllocHost failed for %" PRIu64 " bytes, falling back to pageable memory", size);
+        }
+    }
+    return memalign(16, size);
+}
+
+static void freeBufferStorage(AppendableBuffer *ab, void *ptr, bool pinned) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (pinned) {
+        if (!CHECK_CUDA_RESULT(cu->cuCtxPushCurrent(ab->hostContext))) {
+            CHECK_CUDA_RESULT(cux->cuMemFreeHost(ptr));
+            CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+        }
+    } else {
+        free(ptr);
+    }
+}
+
+//grows the buffer so it can hold at least allocated bytes, keeping the current contents
+static bool reserveBuffer(AppendableBuffer *ab, uint64_t allocated) {
+    if (allocated <= ab->allocated) {
+        return true;
+    }
+    bool pinned;
+    void *nb = allocBufferStorage(ab, allocated, &pinned);
+    if (nb == NULL) {
+        return false;
+    }
+    if (ab->buf != NULL) {
+        memcpy(nb, ab->buf, ab->size);
+        freeBufferStorage(ab, ab->buf, ab->pinned);
+    }
+    ab->buf = nb;
+    ab->pinned = pinned;
+    ab->allocated = allocated;
+    return true;
+}
+
+//makes room for size more bytes, returning where they go or NULL if the buffer couldn't be grown
+static void *growBuffer(AppendableBuffer *ab, uint64_t size) {
     if (ab->buf == NULL) {
-        ab->allocated = size * 2;
-        ab->buf = memalign(16, ab->allocated);
         ab->size = 0;
+        if (!reserveBuffer(ab, MAX(size * 2, 64))) {
+            return NULL;
+        }
     } else if (ab->size + size > ab->allocated) {
-        while (ab->size + size > ab->allocated) {
-            ab->allocated += ab->allocated >> 1;
+        uint64_t allocated = ab->allocated;
+        while (ab->size + size > allocated) {
+            allocated += allocated >> 1;
         }
-        void *nb = memalign(16, ab->allocated);
-        memcpy(nb, ab->buf, ab->size);
-        free(ab->buf);
-        ab->buf = nb;
+        if (!reserveBuffer(ab, allocated)) {
+            return NULL;
+        }
+    }
+    return (char*)ab->buf + ab->size;
+}
+
+bool appendBuffer(AppendableBuffer *ab, const void *buf, uint64_t size) {
+    void *dst = growBuffer(ab, size);
+    if (dst == NULL) {
+        LOG_ERROR("Unable to grow buffer by %" PRIu64 " bytes", size);
+        return false;
     }
-    memcpy((char*)ab->buf + ab->size, buf, size);
+    memcpy(dst, buf, size);
     ab->size += size;
+    return true;
+}
+
+void failPicture(NVContext *ctx, VAStatus status) {
+    if (ctx->pictureStatus == VA_STATUS_SUCCESS) {
+        ctx->pictureStatus = status;
+    }
 }
 
 static void freeBuffer(AppendableBuffer *ab) {
     if (ab->buf != NULL) {
-        free(ab->buf);
+        freeBufferStorage(ab, ab->buf, ab->pinned);
         ab->buf = NULL;
         ab->size = 0;
         ab->allocated = 0;
+        ab->pinned = false;
+    }
+}
+
+static bool registerObject(NVDriver *drv, Object obj) {
+    pthread_mutex_lock(&drv->objectCreationMutex);
+    //the id encodes the slot in the object table, so it needs to be assigned before anyone can look it up
+    obj->id = handle_table_insert(&drv->objects, obj);
+    pthread_mutex_unlock(&drv->objectCreationMutex);
+    if (obj->id == HANDLE_INVALID) {
+        LOG("Unable to allocate object, the object table is full");
+        return false;
     }
+    return true;
 }
 
 static Object allocateObject(NVDriver *drv, ObjectType type, int allocatePtrSize) {
     Object newObj = (Object) calloc(1, sizeof(struct Object_t));
     newObj->type = type;
-    newObj->id = (++drv->nextObjId);
     if (allocatePtrSize > 0) {
         newObj->obj = calloc(1, allocatePtrSize);
     }
-    pthread_mutex_lock(&drv->objectCreationMutex);
-    add_element(&drv->objects, newObj);
-    pthread_mutex_unlock(&drv->objectCreationMutex);
+    if (!registerObject(drv, newObj)) {
+        free(newObj->obj);
+        free(newObj);
+        return NULL;
+    }
     return newObj;
 }
 
 static Object getObject(NVDriver *drv, VAGenericID id) {
-    Object ret = NULL;
+    //lookups don't take the mutex, the table detects stale or reused ids by the generation in the id
     if (id != VA_INVALID_ID) {
-        pthread_mutex_lock(&drv->objectCreationMutex);
-        ARRAY_FOR_EACH(Object, o, &drv->objects)
-            if (o->id == id) {
-                ret = o;
-                break;
-            }
-        END_FOR_EACH
-        pthread_mutex_unlock(&drv->objectCreationMutex);
+        return (Object) handle_table_get(&drv->objects, id);
     }
-    return ret;
+    return NULL;
 }
 
 static void* getObjectPtr(NVDriver *drv, VAGenericID id) {
@@ -313,425 +551,1885 @@ static void* getObjectPtr(NVDriver *drv, VAGenericID id) {
     return NULL;
 }
 
-static Object getObjectByPtr(NVDriver *drv, void *ptr) {
-    Object ret = NULL;
-    if (ptr != NULL) {
-        pthread_mutex_lock(&drv->objectCreationMutex);
-        ARRAY_FOR_EACH(Object, o, &drv->objects)
-            if (o->obj == ptr) {
-                ret = o;
-                break;
-            }
-        END_FOR_EACH
-        pthread_mutex_unlock(&drv->objectCreationMutex);
+//removes the object from the object table without freeing it
+static Object detachObject(NVDriver *drv, VAGenericID id) {
+    if (id == VA_INVALID_ID) {
+        return NULL;
     }
-    return ret;
+    pthread_mutex_lock(&drv->objectCreationMutex);
+    Object o = (Object) handle_table_remove(&drv->objects, id);
+    pthread_mutex_unlock(&drv->objectCreationMutex);
+    return o;
 }
 
 static void deleteObject(NVDriver *drv, VAGenericID id) {
-    if (id == VA_INVALID_ID) {
-        return;
+    Object o = detachObject(drv, id);
+    if (o != NULL) {
+        free(o->obj);
+        free(o);
     }
-    pthread_mutex_lock(&drv->objectCreationMutex);
-    ARRAY_FOR_EACH(Object, o, &drv->objects)
-        if (o->id == id) {
-            remove_element_at(&drv->objects, o_idx);
-            free(o->obj);
-            free(o);
+}
+
+static NVBufferPoolClass bufferPoolClass(VABufferType type) {
+    switch (type) {
+        case VAPictureParameterBufferType:
+            return BUFFER_POOL_PIC_PARAMS;
+        case VASliceParameterBufferType:
+            return BUFFER_POOL_SLICE_PARAMS;
+        case VASliceDataBufferType:
+            return BUFFER_POOL_SLICE_DATA;
+        default:
+            return BUFFER_POOL_OTHER;
+    }
+}
+
+static void initBufferPool(NVBufferPool *pool) {
+    pthread_mutex_init(&pool->mutex, NULL);
+}
+
+static void freePooledBuffer(Object o) {
+    NVBuffer *buf = (NVBuffer*) o->obj;
+    free(buf->storage);
+    free(buf);
+    free(o);
+}
+
+//takes a buffer object out of the pool, preferring the most recently released one that is large enough.
+//returns NULL if the pool has nothing of this class, otherwise the storage may still need growing
+static Object takePooledBuffer(NVBufferPool *pool, NVBufferPoolClass cls, size_t size) {
+    Array *freeList = &pool->freeList[cls];
+    pthread_mutex_lock(&pool->mutex);
+    Object ret = NULL;
+    ARRAY_FOR_EACH_REV(Object, o, freeList)
+        if (((NVBuffer*) o->obj)->capacity >= size) {
+            ret = o;
+            remove_element_at(freeList, o_idx);
             break;
         }
     END_FOR_EACH
-    pthread_mutex_unlock(&drv->objectCreationMutex);
+    if (ret == NULL && freeList->size > 0) {
+        //nothing big enough, recycle the newest entry and let the caller grow it
+        ret = (Object) get_element_at(freeList, freeList->size - 1);
+        remove_element_at(freeList, freeList->size - 1);
+    }
+    if (ret != NULL) {
+        pool->hits++;
+    } else {
+        pool->misses++;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return ret;
 }
 
-static bool destroyContext(NVDriver *drv, NVContext *nvCtx) {
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), false);
-    LOG("Signaling resolve thread to exit");
-    struct timespec timeout;
-    clock_gettime(CLOCK_REALTIME, &timeout);
-    timeout.tv_sec += 5;
-    nvCtx->exiting = true;
-    pthread_cond_signal(&nvCtx->resolveCondition);
-    LOG("Waiting for resolve thread to exit");
-    int ret = pthread_timedjoin_np(nvCtx->resolveThread, NULL, &timeout);
-    LOG("pthread_timedjoin_np finished with %d", ret);
-    freeBuffer(&nvCtx->sliceOffsets);
-    freeBuffer(&nvCtx->bitstreamBuffer);
-    bool successful = true;
-    if (nvCtx->decoder != NULL) {
-        CUresult result = cv->cuvidDestroyDecoder(nvCtx->decoder);
-        if (result != CUDA_SUCCESS) {
-            LOG("cuvidDestroyDecoder failed: %d", result);
-            successful = false;
-        }
+static void releasePooledBuffer(NVBufferPool *pool, Object o) {
+    NVBuffer *buf = (NVBuffer*) o->obj;
+    Array *freeList = &pool->freeList[bufferPoolClass(buf->bufferType)];
+    pthread_mutex_lock(&pool->mutex);
+    if (freeList->size < BUFFER_POOL_MAX_FREE) {
+        add_element(freeList, o);
+        o = NULL;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    if (o != NULL) {
+        freePooledBuffer(o);
     }
-    nvCtx->decoder = NULL;
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), false);
-    return successful;
 }
 
-static void deleteAllObjects(NVDriver *drv) {
-    pthread_mutex_lock(&drv->objectCreationMutex);
-    ARRAY_FOR_EACH(Object, o, &drv->objects)
-        LOG("Found object %d or type %d", o->id, o->type);
-        if (o->type == OBJECT_TYPE_CONTEXT) {
-            destroyContext(drv, (NVContext*) o->obj);
-            deleteObject(drv, o->id);
-        }
-    END_FOR_EACH
-    pthread_mutex_unlock(&drv->objectCreationMutex);
+static uint64_t sliceArenaPrefix(NVContext *ctx) {
+    return ctx->codec->sliceDataStartCode ? 3 : 0;
 }
 
-NVSurface* nvSurfaceFromSurfaceId(NVDriver *drv, VASurfaceID surf) {
-    Object obj = getObject(drv, surf);
-    if (obj != NULL && obj->type == OBJECT_TYPE_SURFACE) {
-        NVSurface *suf = (NVSurface*) obj->obj;
-        return suf;
+//makes room for size more bytes in the slice arena, fixing up the buffers that point into it if it moves.
+//must be called with bufferPool.mutex held
+static bool reserveSliceArena(NVContext *ctx, uint64_t size) {
+    AppendableBuffer *ab = &ctx->sliceArena;
+    if (ab->size + size <= ab->allocated) {
+        return true;
     }
-    return NULL;
+    if (ctx->sliceArenaMapped > 0) {
+        //the client holds a pointer into the arena, so it can't be moved
+        return false;
+    }
+    uint64_t allocated = ab->allocated > 0 ? ab->allocated : size * 2;
+    while (ab->size + size > allocated) {
+        allocated += allocated >> 1;
+    }
+    if (!reserveBuffer(ab, allocated)) {
+        return false;
+    }
+    uint64_t prefix = sliceArenaPrefix(ctx);
+    ARRAY_FOR_EACH(NVBuffer*, b, &ctx->sliceArenaBuffers)
+        b->ptr = PTROFF(ab->buf, b->arenaOffset + prefix);
+    END_FOR_EACH
+    return true;
 }
 
-int pictureIdxFromSurfaceId(NVDriver *drv, VASurfaceID surfId) {
-    NVSurface *surf = nvSurfaceFromSurfaceId(drv, surfId);
-    if (surf != NULL) {
-        return surf->pictureIdx;
+static bool placeSliceDataInArena(NVContext *ctx, NVBuffer *buf, size_t size) {
+    static const uint8_t header[] = { 0, 0, 1 }; //1 as a 24-bit Big Endian
+    uint64_t prefix = sliceArenaPrefix(ctx);
+    bool placed = false;
+    pthread_mutex_lock(&ctx->bufferPool.mutex);
+    if (ctx->sliceArenaBuffers.size == 0 && !ctx->sliceArenaClaimed) {
+        //nothing references the arena any more, start again from the beginning
+        ctx->sliceArena.size = 0;
     }
-    return -1;
+    if (reserveSliceArena(ctx, prefix + size)) {
+        buf->arenaOffset = ctx->sliceArena.size;
+        memcpy(PTROFF(ctx->sliceArena.buf, buf->arenaOffset), header, prefix);
+        buf->ptr = PTROFF(ctx->sliceArena.buf, buf->arenaOffset + prefix);
+        buf->inArena = true;
+        ctx->sliceArena.size += prefix + size;
+        add_element(&ctx->sliceArenaBuffers, buf);
+        placed = true;
+    }
+    pthread_mutex_unlock(&ctx->bufferPool.mutex);
+    return placed;
 }
 
-static cudaVideoCodec vaToCuCodec(VAProfile profile) {
-    for (const NVCodec *c = __start_nvd_codecs; c < __stop_nvd_codecs; c++) {
-        cudaVideoCodec cvc = c->computeCudaCodec(profile);
-        if (cvc != cudaVideoCodec_NONE) {
-            return cvc;
+static void removeSliceDataFromArena(NVContext *ctx, NVBuffer *buf) {
+    pthread_mutex_lock(&ctx->bufferPool.mutex);
+    ARRAY_FOR_EACH(NVBuffer*, b, &ctx->sliceArenaBuffers)
+        if (b == buf) {
+            remove_element_at(&ctx->sliceArenaBuffers, b_idx);
+            break;
         }
+    END_FOR_EACH
+    if (buf->mapped) {
+        ctx->sliceArenaMapped--;
     }
-    return cudaVideoCodec_NONE;
+    pthread_mutex_unlock(&ctx->bufferPool.mutex);
+    buf->inArena = false;
+    buf->mapped = false;
+    buf->ptr = buf->storage;
 }
 
-static bool doesGPUSupportCodec(cudaVideoCodec codec, int bitDepth, cudaVideoChromaFormat chromaFormat, uint32_t *width, uint32_t *height)
-{
-    CUVIDDECODECAPS videoDecodeCaps = {
-        .eCodecType      = codec,
-        .eChromaFormat   = chromaFormat,
-        .nBitDepthMinus8 = bitDepth - 8
-    };
-    CHECK_CUDA_RESULT_RETURN(cv->cuvidGetDecoderCaps(&videoDecodeCaps), false);
-    if (width != NULL) {
-        *width = videoDecodeCaps.nMaxWidth;
-    }
-    if (height != NULL) {
-        *height = videoDecodeCaps.nMaxHeight;
+bool sliceInBuffer(NVContext *ctx, const NVBuffer *buf, uint64_t offset, uint64_t size) {
+    //both are 32-bit in the slice parameters, so the sum can't overflow
+    if (buf->size < 0 || offset + size > (uint64_t) buf->size) {
+        LOG_ERROR("Slice data at %" PRIu64 "+%" PRIu64 " is outside the %d byte buffer", offset, size, buf->size);
+        failPicture(ctx, VA_STATUS_ERROR_INVALID_PARAMETER);
+        return false;
     }
-    return (videoDecodeCaps.bIsSupported == 1);
+    return true;
 }
 
-static void* resolveSurfaces(void *param) {
-    NVContext *ctx = (NVContext*) param;
-    NVDriver *drv = ctx->drv;
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), NULL);
-    LOG("[RT] Resolve thread for %p started", ctx);
-    while (!ctx->exiting) {
-        pthread_mutex_lock(&ctx->resolveMutex);
-        while (ctx->surfaceQueueReadIdx == ctx->surfaceQueueWriteIdx) {
-            pthread_cond_wait(&ctx->resolveCondition, &ctx->resolveMutex);
-            if (ctx->exiting) {
-                pthread_mutex_unlock(&ctx->resolveMutex);
-                goto out;
-            }
-        }
-        pthread_mutex_unlock(&ctx->resolveMutex);
-        NVSurface *surface = ctx->surfaceQueue[ctx->surfaceQueueReadIdx++];
-        if (ctx->surfaceQueueReadIdx >= SURFACE_QUEUE_SIZE) {
-            ctx->surfaceQueueReadIdx = 0;
-        }
-        if (surface->decodeFailed) {
-            pthread_mutex_lock(&surface->mutex);
-            surface->resolving = 0;
-            pthread_cond_signal(&surface->cond);
-            pthread_mutex_unlock(&surface->mutex);
-            continue;
+bool claimSliceData(NVContext *ctx, NVBuffer *buf, uint32_t *offset) {
+    if (buf->inArena && ctx->bitstreamBuffer.size == 0) {
+        if (!ctx->sliceArenaClaimed) {
+            ctx->sliceArenaClaimed = true;
+            ctx->sliceArenaStart = ctx->sliceArenaCursor = buf->arenaOffset;
         }
-        CUdeviceptr deviceMemory = (CUdeviceptr) NULL;
-        unsigned int pitch = 0;
-        CUVIDPROCPARAMS procParams = {
-            .progressive_frame = surface->progressiveFrame,
-            .top_field_first = surface->topFieldFirst,
-            .second_field = surface->secondField
-        };
-        if (CHECK_CUDA_RESULT(cv->cuvidMapVideoFrame(ctx->decoder, surface->pictureIdx, &deviceMemory, &pitch, &procParams))) {
-            pthread_mutex_lock(&surface->mutex);
-            surface->resolving = 0;
-            pthread_cond_signal(&surface->cond);
-            pthread_mutex_unlock(&surface->mutex);
-            continue;
+        //only a buffer directly following the previously claimed one continues the bitstream
+        if (buf->arenaOffset == ctx->sliceArenaCursor) {
+            *offset = (uint32_t) (buf->arenaOffset - ctx->sliceArenaStart);
+            ctx->sliceArenaCursor += sliceArenaPrefix(ctx) + buf->size;
+            return true;
         }
-        drv->backend->exportCudaPtr(drv, deviceMemory, surface, pitch);
-        CHECK_CUDA_RESULT(cv->cuvidUnmapVideoFrame(ctx->decoder, deviceMemory));
     }
-out:
-    LOG("[RT] Resolve thread for %p exiting", ctx);
-    return NULL;
+    return false;
 }
 
-#define MAX_PROFILES 32
-static VAStatus nvQueryConfigProfiles(
-        VADriverContextP ctx,
-        VAProfile *profile_list,	/* out */
-        int *num_profiles			/* out */
-    )
-{
-    NVDriver *drv = (NVDriver*) ctx->pDriverData;
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
-    int profiles = 0;
-    if (doesGPUSupportCodec(cudaVideoCodec_MPEG2, 8, cudaVideoChromaFormat_420, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileMPEG2Simple;
-        profile_list[profiles++] = VAProfileMPEG2Main;
-    }
-    if (doesGPUSupportCodec(cudaVideoCodec_MPEG4, 8, cudaVideoChromaFormat_420, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileMPEG4Simple;
-        profile_list[profiles++] = VAProfileMPEG4AdvancedSimple;
-        profile_list[profiles++] = VAProfileMPEG4Main;
-    }
-    if (doesGPUSupportCodec(cudaVideoCodec_VC1, 8, cudaVideoChromaFormat_420, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileVC1Simple;
-        profile_list[profiles++] = VAProfileVC1Main;
-        profile_list[profiles++] = VAProfileVC1Advanced;
+bool spillSliceData(NVContext *ctx) {
+    //the caller is about to copy slice data, so move anything claimed so far into the bitstream buffer, the
+    //offsets already recorded stay valid as they're relative to the start of the picture's bitstream
+    if (ctx->sliceArenaClaimed) {
+        ctx->sliceArenaClaimed = false;
+        if (!appendBuffer(&ctx->bitstreamBuffer, PTROFF(ctx->sliceArena.buf, ctx->sliceArenaStart), ctx->sliceArenaCursor - ctx->sliceArenaStart)) {
+            failPicture(ctx, VA_STATUS_ERROR_ALLOCATION_FAILED);
+            return false;
+        }
     }
-    if (doesGPUSupportCodec(cudaVideoCodec_H264, 8, cudaVideoChromaFormat_420, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileH264Main;
-        profile_list[profiles++] = VAProfileH264High;
-        profile_list[profiles++] = VAProfileH264ConstrainedBaseline;
+    return true;
+}
+
+uint64_t gatherSliceData(NVContext *ctx, NVBuffer *buf, bool startCode) {
+    static const uint8_t header[] = { 0, 0, 1 }; //1 as a 24-bit Big Endian
+    const uint64_t prefix = startCode ? sizeof(header) : 0;
+    const uint32_t count = ctx->lastSliceParamsCount;
+    const size_t stride = ctx->lastSliceParamsSize;
+
+    if (!spillSliceData(ctx) || count == 0) {
+        return 0;
     }
-    if (doesGPUSupportCodec(cudaVideoCodec_JPEG, 8, cudaVideoChromaFormat_420, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileJPEGBaseline;
+
+    //size everything up front so each buffer grows at most once, however many slices there are
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const VASliceParameterBufferBase *slice = PTROFF(ctx->lastSliceParams, i * stride);
+        if (!sliceInBuffer(ctx, buf, slice->slice_data_offset, slice->slice_data_size)) {
+            return 0;
+        }
+        total += prefix + slice->slice_data_size;
     }
-    if (doesGPUSupportCodec(cudaVideoCodec_H264_SVC, 8, cudaVideoChromaFormat_420, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileH264StereoHigh;
+    uint8_t *dst = growBuffer(&ctx->bitstreamBuffer, total);
+    uint32_t *offsets = growBuffer(&ctx->sliceOffsets, count * sizeof(uint32_t));
+    if (dst == NULL || offsets == NULL) {
+        failPicture(ctx, VA_STATUS_ERROR_ALLOCATION_FAILED);
+        return 0;
     }
-    if (doesGPUSupportCodec(cudaVideoCodec_H264_MVC, 8, cudaVideoChromaFormat_420, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileH264MultiviewHigh;
+
+    uint32_t offset = (uint32_t) ctx->bitstreamBuffer.size;
+    for (uint32_t i = 0; i < count; i++) {
+        const VASliceParameterBufferBase *slice = PTROFF(ctx->lastSliceParams, i * stride);
+        offsets[i] = offset;
+        if (startCode) {
+            memcpy(dst, header, sizeof(header));
+        }
+        memcpy(dst + prefix, PTROFF(buf->ptr, slice->slice_data_offset), slice->slice_data_size);
+        dst += prefix + slice->slice_data_size;
+        offset += (uint32_t) (prefix + slice->slice_data_size);
     }
-    if (doesGPUSupportCodec(cudaVideoCodec_HEVC, 8, cudaVideoChromaFormat_420, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileHEVCMain;
+    ctx->bitstreamBuffer.size += total;
+    ctx->sliceOffsets.size += count * sizeof(uint32_t);
+    return total;
+}
+
+uint64_t bitstreamLength(NVContext *ctx) {
+    if (ctx->sliceArenaClaimed) {
+        return ctx->sliceArenaCursor - ctx->sliceArenaStart;
     }
-    if (doesGPUSupportCodec(cudaVideoCodec_VP8, 8, cudaVideoChromaFormat_420, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileVP8Version0_3;
+    return ctx->bitstreamBuffer.size;
+}
+
+static void drainBufferPool(NVBufferPool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    uint64_t total = pool->hits + pool->misses;
+    LOG("Buffer pool: %" PRIu64 " hits, %" PRIu64 " misses (%" PRIu64 "%% hit rate)",
+        pool->hits, pool->misses, total > 0 ? (pool->hits * 100) / total : 0);
+    for (int i = 0; i < BUFFER_POOL_CLASS_COUNT; i++) {
+        ARRAY_FOR_EACH(Object, o, &pool->freeList[i])
+            freePooledBuffer(o);
+        END_FOR_EACH
+        free(pool->freeList[i].buf);
+        pool->freeList[i] = (Array) {0};
     }
-    if (doesGPUSupportCodec(cudaVideoCodec_VP9, 8, cudaVideoChromaFormat_420, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileVP9Profile0;
+    pthread_mutex_unlock(&pool->mutex);
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+static bool initWakeup(NVWakeup *wakeup) {
+    atomic_init(&wakeup->waiting, false);
+    wakeup->fd = eventfd(0, EFD_CLOEXEC);
+    return wakeup->fd >= 0;
+}
+
+static void closeWakeup(NVWakeup *wakeup) {
+    if (wakeup->fd >= 0) {
+        close(wakeup->fd);
+        wakeup->fd = -1;
     }
-    if (doesGPUSupportCodec(cudaVideoCodec_AV1, 8, cudaVideoChromaFormat_420, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileAV1Profile0;
+}
+
+static void forceWakeup(NVWakeup *wakeup) {
+    uint64_t one = 1;
+    while (write(wakeup->fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+//cheap unless the other side is asleep, in which case it costs a single write
+static void signalWakeup(NVWakeup *wakeup) {
+    if (atomic_load(&wakeup->waiting)) {
+        forceWakeup(wakeup);
     }
-    if (drv->supports16BitSurface) {
-        if (doesGPUSupportCodec(cudaVideoCodec_HEVC, 10, cudaVideoChromaFormat_420, NULL, NULL)) {
-            profile_list[profiles++] = VAProfileHEVCMain10;
-        }
-        if (doesGPUSupportCodec(cudaVideoCodec_HEVC, 12, cudaVideoChromaFormat_420, NULL, NULL)) {
-            profile_list[profiles++] = VAProfileHEVCMain12;
-        }
-        if (doesGPUSupportCodec(cudaVideoCodec_VP9, 10, cudaVideoChromaFormat_420, NULL, NULL)) {
-            profile_list[profiles++] = VAProfileVP9Profile2;
-        }
+}
+
+static void waitWakeup(NVWakeup *wakeup) {
+    uint64_t value;
+    while (read(wakeup->fd, &value, sizeof(value)) < 0 && errno == EINTR);
+}
+
+static bool sameDecoderConfig(const CUVIDDECODECREATEINFO *a, const CUVIDDECODECREATEINFO *b) {
+    return a->CodecType == b->CodecType && a->ChromaFormat == b->ChromaFormat && a->OutputFormat == b->OutputFormat
+        && a->bitDepthMinus8 == b->bitDepthMinus8 && a->ulCreationFlags == b->ulCreationFlags
+        && a->ulWidth == b->ulWidth && a->ulHeight == b->ulHeight
+        && a->ulMaxWidth == b->ulMaxWidth && a->ulMaxHeight == b->ulMaxHeight
+        && a->ulTargetWidth == b->ulTargetWidth && a->ulTargetHeight == b->ulTargetHeight
+        && a->display_area.left == b->display_area.left && a->display_area.top == b->display_area.top
+        && a->display_area.right == b->display_area.right && a->display_area.bottom == b->display_area.bottom
+        && a->ulNumDecodeSurfaces == b->ulNumDecodeSurfaces && a->ulNumOutputSurfaces == b->ulNumOutputSurfaces
+        && a->DeinterlaceMode == b->DeinterlaceMode && a->ulIntraDecodeOnly == b->ulIntraDecodeOnly;
+}
+
+//whether a pooled decoder can be reconfigured into the one asked for, it has to be at least as large
+static bool decoderFits(const CUVIDDECODECREATEINFO *pooled, const CUVIDDECODECREATEINFO *want) {
+    return pooled->CodecType == want->CodecType && pooled->ChromaFormat == want->ChromaFormat && pooled->OutputFormat == want->OutputFormat
+        && pooled->bitDepthMinus8 == want->bitDepthMinus8 && pooled->ulCreationFlags == want->ulCreationFlags
+        && pooled->ulMaxWidth >= want->ulMaxWidth && pooled->ulMaxHeight >= want->ulMaxHeight
+        && pooled->ulNumDecodeSurfaces == want->ulNumDecodeSurfaces && pooled->ulNumOutputSurfaces == want->ulNumOutputSurfaces
+        && pooled->DeinterlaceMode == want->DeinterlaceMode && pooled->ulIntraDecodeOnly == want->ulIntraDecodeOnly;
+}
+
+//changes a pooled decoder's picture and output sizes to the ones asked for, recording them in pooled
+static bool reconfigurePooledDecoder(NVDriver *drv, CUvideodecoder decoder, CUVIDDECODECREATEINFO *pooled, const CUVIDDECODECREATEINFO *want) {
+    CUVIDRECONFIGUREDECODERINFO reconfigure = {
+        .ulWidth = (unsigned int) want->ulWidth,
+        .ulHeight = (unsigned int) want->ulHeight,
+        .ulTargetWidth = (unsigned int) want->ulTargetWidth,
+        .ulTargetHeight = (unsigned int) want->ulTargetHeight,
+        .ulNumDecodeSurfaces = (unsigned int) want->ulNumDecodeSurfaces,
+        .display_area.left = want->display_area.left,
+        .display_area.top = want->display_area.top,
+        .display_area.right = want->display_area.right,
+        .display_area.bottom = want->display_area.bottom,
+        .target_rect.left = want->target_rect.left,
+        .target_rect.top = want->target_rect.top,
+        .target_rect.right = want->target_rect.right,
+        .target_rect.bottom = want->target_rect.bottom
+    };
+    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), false);
+    CUresult result = cv->cuvidReconfigureDecoder(decoder, &reconfigure);
+    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), false);
+    if (CHECK_CUDA_RESULT(result)) {
+        return false;
     }
-    if (drv->supports444Surface) {
-        if (doesGPUSupportCodec(cudaVideoCodec_HEVC, 8, cudaVideoChromaFormat_444, NULL, NULL)) {
-            profile_list[profiles++] = VAProfileHEVCMain444;
-        }
-        if (doesGPUSupportCodec(cudaVideoCodec_VP9, 8, cudaVideoChromaFormat_444, NULL, NULL)) {
-            profile_list[profiles++] = VAProfileVP9Profile1;
+    pooled->ulWidth = want->ulWidth;
+    pooled->ulHeight = want->ulHeight;
+    pooled->ulTargetWidth = want->ulTargetWidth;
+    pooled->ulTargetHeight = want->ulTargetHeight;
+    pooled->display_area = want->display_area;
+    pooled->target_rect = want->target_rect;
+    return true;
+}
+
+static uint64_t decoderPoolClock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
+
+//NVDEC doesn't say what a decoder allocates, so this counts it's decode and output surfaces at the largest size
+static uint64_t decoderVramSize(const CUVIDDECODECREATEINFO *vdci) {
+    uint64_t pixels = (uint64_t) vdci->ulMaxWidth * vdci->ulMaxHeight;
+    //in half bytes per pixel
+    uint64_t halves = vdci->ChromaFormat == cudaVideoChromaFormat_444 ? 6 : vdci->ChromaFormat == cudaVideoChromaFormat_422 ? 4
+                    : vdci->ChromaFormat == cudaVideoChromaFormat_Monochrome ? 2 : 3;
+    if (vdci->bitDepthMinus8 > 0) {
+        halves *= 2;
+    }
+    return (uint64_t) (vdci->ulNumDecodeSurfaces + vdci->ulNumOutputSurfaces) * pixels * halves / 2;
+}
+
+static void destroyDecoder(NVDriver *drv, const CUVIDDECODECREATEINFO *vdci, CUvideodecoder decoder) {
+    if (decoder != NULL) {
+        CHECK_CUDA_RESULT(cv->cuvidDestroyDecoder(decoder));
+        vramAccount(drv, NV_VRAM_DECODERS, -(int64_t) decoderVramSize(vdci));
+    }
+    if (vdci->vidLock != NULL) {
+        CHECK_CUDA_RESULT(cv->cuvidCtxLockDestroy(vdci->vidLock));
+    }
+}
+
+static void initDecoderPool(NVDecoderPool *pool) {
+    pthread_mutex_init(&pool->mutex, NULL);
+}
+
+//destroys the idle decoders that have timed out, then the oldest ones until at most maxIdle are left.
+//must be called with the pool's mutex held
+static void trimDecoderPool(NVDriver *drv, uint32_t maxIdle) {
+    NVDecoderPool *pool = &drv->decoderPool;
+    uint64_t now = decoderPoolClock();
+    ARRAY_FOR_EACH_REV(NVPooledDecoder*, d, &pool->idle)
+        if (now - d->releasedAt > decoderPoolTimeoutNs) {
+            LOG("Destroying decoder %p, idle for too long", d->decoder);
+            destroyDecoder(drv, &d->info, d->decoder);
+            remove_and_free_element_at(&pool->idle, d_idx);
         }
-        if (doesGPUSupportCodec(cudaVideoCodec_AV1, 8, cudaVideoChromaFormat_444, NULL, NULL)) {
-            profile_list[profiles++] = VAProfileAV1Profile1;
+    END_FOR_EACH
+    //the array is kept in release order, so the oldest are at the front
+    while (pool->idle.size > maxIdle) {
+        NVPooledDecoder *d = (NVPooledDecoder*) get_element_at(&pool->idle, 0);
+        destroyDecoder(drv, &d->info, d->decoder);
+        remove_and_free_element_at(&pool->idle, 0);
+    }
+}
+
+//creates a decoder for want, reusing an idle one created with the same parameters if there is one, or reconfiguring
+//a larger one. created is filled in with what the decoder really is, including it's lock and maximum size
+static CUresult createDecoder(NVDriver *drv, const CUVIDDECODECREATEINFO *want, CUVIDDECODECREATEINFO *created, CUvideodecoder *decoder) {
+    NVDecoderPool *pool = &drv->decoderPool;
+    NVPooledDecoder *found = NULL;
+    pthread_mutex_lock(&pool->mutex);
+    trimDecoderPool(drv, decoderPoolSize);
+    //prefer an exact match, then the most recently released that's large enough, it's the least likely to have been paged out
+    ARRAY_FOR_EACH_REV(NVPooledDecoder*, d, &pool->idle)
+        if (sameDecoderConfig(&d->info, want)) {
+            found = d;
+            remove_element_at(&pool->idle, d_idx);
+            break;
         }
-#if VA_CHECK_VERSION(1, 20, 0)
-        if (drv->supports16BitSurface) {
-            if (doesGPUSupportCodec(cudaVideoCodec_HEVC, 10, cudaVideoChromaFormat_444, NULL, NULL)) {
-                profile_list[profiles++] = VAProfileHEVCMain444_10;
-            }
-            if (doesGPUSupportCodec(cudaVideoCodec_HEVC, 12, cudaVideoChromaFormat_444, NULL, NULL)) {
-                profile_list[profiles++] = VAProfileHEVCMain444_12;
-            }
-            if (doesGPUSupportCodec(cudaVideoCodec_VP9, 10, cudaVideoChromaFormat_444, NULL, NULL)) {
-                profile_list[profiles++] = VAProfileVP9Profile3;
+    END_FOR_EACH
+    if (found == NULL && cv->cuvidReconfigureDecoder != NULL) {
+        ARRAY_FOR_EACH_REV(NVPooledDecoder*, d, &pool->idle)
+            if (decoderFits(&d->info, want)) {
+                found = d;
+                remove_element_at(&pool->idle, d_idx);
+                break;
             }
-        }
-#endif
+        END_FOR_EACH
     }
-    for (int i = 0; i < profiles; i++) {
-        if (vaToCuCodec(profile_list[i]) == cudaVideoCodec_NONE) {
-            for (int x = i; x < profiles-1; x++) {
-                profile_list[x] = profile_list[x+1];
-            }
-            profiles--;
-            i--;
+    if (found != NULL) {
+        pool->hits++;
+    } else {
+        pool->misses++;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (found != NULL) {
+        if (sameDecoderConfig(&found->info, want) || reconfigurePooledDecoder(drv, found->decoder, &found->info, want)) {
+            *decoder = found->decoder;
+            *created = found->info;
+            free(found);
+            LOG_TRACE("Reusing idle decoder %p", *decoder);
+            return CUDA_SUCCESS;
         }
+        LOG("Unable to reconfigure idle decoder %p, creating a new one", found->decoder);
+        destroyDecoder(drv, &found->info, found->decoder);
+        free(found);
     }
-    *num_profiles = profiles;
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), VA_STATUS_ERROR_OPERATION_FAILED);
-    return VA_STATUS_SUCCESS;
+
+    CUVIDDECODECREATEINFO info = *want;
+    vramMakeRoom(drv, decoderVramSize(&info));
+    CUresult result = cv->cuvidCtxLockCreate(&info.vidLock, drv->cudaContext);
+    if (result != CUDA_SUCCESS) {
+        return result;
+    }
+    result = cv->cuvidCreateDecoder(decoder, &info);
+    if (result != CUDA_SUCCESS) {
+        CHECK_CUDA_RESULT(cv->cuvidCtxLockDestroy(info.vidLock));
+        return result;
+    }
+    vramAccount(drv, NV_VRAM_DECODERS, decoderVramSize(&info));
+    *created = info;
+    return CUDA_SUCCESS;
 }
 
-static VAStatus nvQueryConfigEntrypoints(
-        VADriverContextP ctx,
-        VAProfile profile,
-        VAEntrypoint  *entrypoint_list,	/* out */
-        int *num_entrypoints			/* out */
-    )
-{
-    entrypoint_list[0] = VAEntrypointVLD;
-    *num_entrypoints = 1;
-    return VA_STATUS_SUCCESS;
+//hands a decoder that's no longer used back to the pool, or destroys it if pooling is disabled
+static void releaseDecoder(NVDriver *drv, const CUVIDDECODECREATEINFO *vdci, CUvideodecoder decoder) {
+    NVDecoderPool *pool = &drv->decoderPool;
+    NVPooledDecoder *d = decoderPoolSize > 0 ? calloc(1, sizeof(NVPooledDecoder)) : NULL;
+    if (d == NULL) {
+        destroyDecoder(drv, vdci, decoder);
+        return;
+    }
+    d->info = *vdci;
+    d->decoder = decoder;
+    d->releasedAt = decoderPoolClock();
+    pthread_mutex_lock(&pool->mutex);
+    add_element(&pool->idle, d);
+    trimDecoderPool(drv, decoderPoolSize);
+    pthread_mutex_unlock(&pool->mutex);
 }
 
-static VAStatus nvGetConfigAttributes(
-        VADriverContextP ctx,
-        VAProfile profile,
-        VAEntrypoint entrypoint,
-        VAConfigAttrib *attrib_list,	/* in/out */
-        int num_attribs
-    )
-{
-    NVDriver *drv = (NVDriver*) ctx->pDriverData;
-    if (vaToCuCodec(profile) == cudaVideoCodec_NONE) {
-        return VA_STATUS_ERROR_UNSUPPORTED_PROFILE;
+static void drainDecoderPool(NVDriver *drv) {
+    NVDecoderPool *pool = &drv->decoderPool;
+    pthread_mutex_lock(&pool->mutex);
+    uint64_t total = pool->hits + pool->misses;
+    LOG("Decoder pool: %" PRIu64 " hits, %" PRIu64 " misses (%" PRIu64 "%% hit rate)",
+        pool->hits, pool->misses, total > 0 ? (pool->hits * 100) / total : 0);
+    trimDecoderPool(drv, 0);
+    free(pool->idle.buf);
+    pool->idle = (Array) {0};
+    pthread_mutex_unlock(&pool->mutex);
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+static void deinitCodecContext(NVContext *nvCtx) {
+    if (nvCtx->codec->deinitContext != NULL) {
+        nvCtx->codec->deinitContext(nvCtx);
     }
-    LOG("Got here with profile: %d == %d", profile, vaToCuCodec(profile));
-    for (int i = 0; i < num_attribs; i++) {
-        if (attrib_list[i].type == VAConfigAttribRTFormat) {
-            attrib_list[i].value = VA_RT_FORMAT_YUV420;
-            switch (profile) {
-            case VAProfileHEVCMain12:
-            case VAProfileVP9Profile2:
-                attrib_list[i].value |= VA_RT_FORMAT_YUV420_12;
-            case VAProfileHEVCMain10:
-            case VAProfileAV1Profile0:
-                attrib_list[i].value |= VA_RT_FORMAT_YUV420_10;
-                break;
-            case VAProfileHEVCMain444_12:
-            case VAProfileVP9Profile3:
-                attrib_list[i].value |= VA_RT_FORMAT_YUV444_12 | VA_RT_FORMAT_YUV420_12;
-            case VAProfileHEVCMain444_10:
-            case VAProfileAV1Profile1:
-                attrib_list[i].value |= VA_RT_FORMAT_YUV444_10 | VA_RT_FORMAT_YUV420_10;
-            case VAProfileHEVCMain444:
-            case VAProfileVP9Profile1:
-                attrib_list[i].value |= VA_RT_FORMAT_YUV444;
-                break;
-            default:
-                break;
-            }
-            if (!drv->supports16BitSurface) {
-                attrib_list[i].value &= ~(VA_RT_FORMAT_YUV420_10 | VA_RT_FORMAT_YUV420_12 | VA_RT_FORMAT_YUV444_10 | VA_RT_FORMAT_YUV444_12);
-            }
-            if (!drv->supports444Surface) {
-                attrib_list[i].value &= ~(VA_RT_FORMAT_YUV444 | VA_RT_FORMAT_YUV444_10 | VA_RT_FORMAT_YUV444_12);
-            }
-        } else if (attrib_list[i].type == VAConfigAttribMaxPictureWidth) {
-            doesGPUSupportCodec(vaToCuCodec(profile), 8, cudaVideoChromaFormat_420, &attrib_list[i].value, NULL);
-        } else if (attrib_list[i].type == VAConfigAttribMaxPictureHeight) {
-            doesGPUSupportCodec(vaToCuCodec(profile), 8, cudaVideoChromaFormat_420, NULL, &attrib_list[i].value);
-        } else {
-            LOG("unhandled config attribute: %d", attrib_list[i].type);
-        }
+    nvCtx->codecData = NULL;
+}
+
+static void freeScratchBuffer(NVScratchBuffer *scratch) {
+    if (scratch->ptr != (CUdeviceptr) NULL) {
+        CHECK_CUDA_RESULT(cu->cuMemFree(scratch->ptr));
     }
-    return VA_STATUS_SUCCESS;
+    *scratch = (NVScratchBuffer) {0};
 }
 
-static VAStatus nvCreateConfig(
-        VADriverContextP ctx,
-        VAProfile profile,
-        VAEntrypoint entrypoint,
-        VAConfigAttrib *attrib_list,
-        int num_attribs,
-        VAConfigID *config_id		/* out */
-    )
-{
-    NVDriver *drv = (NVDriver*) ctx->pDriverData;
-    LOG("got profile: %d with %d attributes", profile, num_attribs);
-    cudaVideoCodec cudaCodec = vaToCuCodec(profile);
-    if (cudaCodec == cudaVideoCodec_NONE) {
-        LOG("Profile not supported: %d", profile);
-        return VA_STATUS_ERROR_UNSUPPORTED_PROFILE;
+//must be called with the CUDA context current
+static bool destroyVideoProcContext(NVContext *nvCtx) {
+    //the kernels of the last picture may still be using the scratch buffers
+    bool successful = !CHECK_CUDA_RESULT(cu->cuStreamSynchronize(nvCtx->stream));
+    freeScratchBuffer(&nvCtx->procInput);
+    freeScratchBuffer(&nvCtx->procOutput);
+    freeScratchBuffer(&nvCtx->procTemp);
+    if (nvCtx->procBackground != (CUdeviceptr) NULL) {
+        CHECK_CUDA_RESULT(cu->cuMemFree(nvCtx->procBackground));
+        nvCtx->procBackground = (CUdeviceptr) NULL;
     }
-    if (entrypoint != VAEntrypointVLD) {
-        LOG("Entrypoint not supported: %d", entrypoint);
-        return VA_STATUS_ERROR_UNSUPPORTED_ENTRYPOINT;
+    drainBufferPool(&nvCtx->bufferPool);
+    CHECK_CUDA_RESULT(cu->cuStreamDestroy(nvCtx->stream));
+    nvCtx->stream = NULL;
+    return successful;
+}
+
+//must be called with the CUDA context current
+static bool destroyEncodeContext(NVContext *nvCtx) {
+    //the staging copy of the last input may still be in flight
+    bool successful = !CHECK_CUDA_RESULT(cu->cuStreamSynchronize(nvCtx->stream));
+    nvencDestroyEncoder(nvCtx);
+    freeScratchBuffer(&nvCtx->procInput);
+    drainBufferPool(&nvCtx->bufferPool);
+    CHECK_CUDA_RESULT(cu->cuStreamDestroy(nvCtx->stream));
+    nvCtx->stream = NULL;
+    return successful;
+}
+
+//unmaps the oldest mapped frame, waiting for it's copies to complete first if wait is set.
+//returns false if it's copies are still in flight
+static bool unmapOldestFrame(NVContext *ctx, bool wait) {
+    NVMappedFrame *frame = &ctx->mappedFrames[ctx->mappedFrameHead];
+    if (wait) {
+        CHECK_CUDA_RESULT(cu->cuEventSynchronize(frame->copied));
+    } else if (cu->cuEventQuery(frame->copied) == CUDA_ERROR_NOT_READY) {
+        return false;
     }
-    Object obj = allocateObject(drv, OBJECT_TYPE_CONFIG, sizeof(NVConfig));
-    NVConfig *cfg = (NVConfig*) obj->obj;
-    cfg->profile = profile;
-    cfg->entrypoint = entrypoint;
-    for (int i = 0; i < num_attribs; i++) {
-      LOG("got config attrib: %d %d %d", i, attrib_list[i].type, attrib_list[i].value);
+    CHECK_CUDA_RESULT(cv->cuvidUnmapVideoFrame(ctx->decoder, frame->deviceMemory));
+    ctx->mappedFrameHead = (ctx->mappedFrameHead + 1) % ctx->numOutputSurfaces;
+    ctx->mappedFrameCount--;
+    return true;
+}
+
+static void markSurfaceResolved(NVSurface *surface, CUstream stream, bool eventRecorded);
+
+static bool destroyContext(NVDriver *drv, NVContext *nvCtx) {
+    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), false);
+    if (nvCtx->videoProc || nvCtx->encoder != NULL) {
+        bool successful = nvCtx->videoProc ? destroyVideoProcContext(nvCtx) : destroyEncodeContext(nvCtx);
+        statsDestroy(nvCtx->stats);
+        nvCtx->stats = NULL;
+        CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), false);
+        return successful;
     }
-    cfg->cudaCodec = cudaCodec;
-    cfg->chromaFormat = cudaVideoChromaFormat_420;
-    cfg->surfaceFormat = cudaVideoSurfaceFormat_NV12;
-    cfg->bitDepth = 8;
-    if (drv->supports16BitSurface) {
-        switch(cfg->profile) {
-        case VAProfileHEVCMain10:
-            cfg->surfaceFormat = cudaVideoSurfaceFormat_P016;
-            cfg->bitDepth = 10;
-            break;
-        case VAProfileHEVCMain12:
-            cfg->surfaceFormat = cudaVideoSurfaceFormat_P016;
-            cfg->bitDepth = 12;
-            break;
-        case VAProfileVP9Profile2:
-        case VAProfileAV1Profile0:
-            if (num_attribs > 0 && attrib_list[0].type == VAConfigAttribRTFormat) {
-                switch(attrib_list[0].value) {
-                case VA_RT_FORMAT_YUV420_12:
-                    cfg->surfaceFormat = cudaVideoSurfaceFormat_P016;
-                    cfg->bitDepth = 12;
-                    break;
-                case VA_RT_FORMAT_YUV420_10:
-                    cfg->surfaceFormat = cudaVideoSurfaceFormat_P016;
-                    cfg->bitDepth = 10;
-                    break;
+    LOG("Signaling resolve worker to stop");
+    nvCtx->exiting = true;
+    if (nvCtx->realiseThreadStarted) {
+        //checks exiting between each surface, so this only waits for the allocation in progress
+        pthread_join(nvCtx->realiseThread, NULL);
+        nvCtx->realiseThreadStarted = false;
+    }
+    free(nvCtx->realiseTargets);
+    nvCtx->realiseTargets = NULL;
+    //a turn checks exiting between surfaces, so this only waits for the surface it's resolving. There's no timeout,
+    //as everything below, the context included, is freed under a worker that's still going otherwise
+    LOG("Waiting for resolve worker to finish with the context");
+    resolveJobRemove(&nvCtx->resolveJob);
+    //pictures the worker never got to are failed, so nothing waiting on them hangs
+    NVSurface *pending;
+    while ((pending = (NVSurface*) spsc_queue_pop(&nvCtx->surfaceQueue)) != NULL) {
+        pending->decodeFailed = true;
+        markSurfaceResolved(pending, nvCtx->stream, false);
+    }
+    //the next turn would have unmapped what's left
+    while (nvCtx->mappedFrameCount > 0) {
+        unmapOldestFrame(nvCtx, true);
+    }
+    for (int i = 0; i < nvCtx->numOutputSurfaces; i++) {
+        CHECK_CUDA_RESULT(cu->cuEventDestroy(nvCtx->mappedFrames[i].copied));
+    }
+    //nothing's queued on the stream anymore, it was all waited for by unmapping the frames
+    freeScratchBuffer(&nvCtx->filmGrainFrame);
+    if (nvCtx->filmGrainTablesDevice != (CUdeviceptr) NULL) {
+        CHECK_CUDA_RESULT(cu->cuMemFree(nvCtx->filmGrainTablesDevice));
+        nvCtx->filmGrainTablesDevice = (CUdeviceptr) NULL;
+    }
+    free(nvCtx->filmGrainTables);
+    nvCtx->filmGrainTables = NULL;
+    closeWakeup(&nvCtx->queueSpaceWakeup);
+    spsc_queue_free(&nvCtx->surfaceQueue);
+    deinitCodecContext(nvCtx);
+    drainBufferPool(&nvCtx->bufferPool);
+    freeBuffer(&nvCtx->sliceOffsets);
+    freeBuffer(&nvCtx->bitstreamBuffer);
+    freeBuffer(&nvCtx->sliceArena);
+    free(nvCtx->sliceArenaBuffers.buf);
+    if (nvCtx->decoder != NULL) {
+        releaseDecoder(drv, &nvCtx->decoderInfo, nvCtx->decoder);
+    }
+    nvCtx->decoder = NULL;
+    releaseGpuSession(nvCtx->gpuSession);
+    nvCtx->gpuSession = 0;
+    statsDestroy(nvCtx->stats);
+    nvCtx->stats = NULL;
+    if (nvCtx->stream != NULL) {
+        CHECK_CUDA_RESULT(cu->cuStreamDestroy(nvCtx->stream));
+        nvCtx->stream = NULL;
+    }
+    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), false);
+    return true;
+}
+
+static void deleteAllObjects(NVDriver *drv) {
+    pthread_mutex_lock(&drv->objectCreationMutex);
+    //removing an object only clears its slot, so walking the table by index is safe while deleting
+    for (uint32_t i = 0; i < handle_table_size(&drv->objects); i++) {
+        Object o = (Object) handle_table_get_at(&drv->objects, i, NULL);
+        if (o == NULL) {
+            continue;
+        }
+        LOG_TRACE("Found object %d or type %d", o->id, o->type);
+        if (o->type == OBJECT_TYPE_CONTEXT) {
+            destroyContext(drv, (NVContext*) o->obj);
+            deleteObject(drv, o->id);
+        } else if (o->type == OBJECT_TYPE_MF_CONTEXT) {
+            freeScratchBuffer(&((NVMFContext*) o->obj)->staging);
+            deleteObject(drv, o->id);
+        }
+    }
+    pthread_mutex_unlock(&drv->objectCreationMutex);
+}
+
+//the format of the image backing a surface of the given decoder output format and bit depth
+NVFormat nvSurfaceFormat(const NVSurface *surface) {
+    if (surface->rgbFormat != NV_FORMAT_NONE) {
+        return surface->rgbFormat;
+    }
+    switch (surface->format) {
+        case cudaVideoSurfaceFormat_P016:
+            switch (surface->bitDepth) {
+                case 10:
+                    return NV_FORMAT_P010;
+                case 12:
+                    return NV_FORMAT_P012;
                 default:
-                    break;
-                }
-            } else {
-                if (cfg->profile == VAProfileVP9Profile2) {
-                    cfg->surfaceFormat = cudaVideoSurfaceFormat_P016;
-                    cfg->bitDepth = 10;
-                } else {
-                    LOG("Unable to determine surface type for VP9/AV1 codec due to no RTFormat specified.");
-                }
+                    return NV_FORMAT_P016;
             }
+        case cudaVideoSurfaceFormat_YUV444_16Bit:
+            return NV_FORMAT_Q416;
+        case cudaVideoSurfaceFormat_YUV444:
+            return NV_FORMAT_444P;
         default:
-            break;
+            return NV_FORMAT_NV12;
+    }
+}
+
+//Until a surface is exported it's frames are kept in a single pitch-linear allocation, laid out like NVDEC's own
+//output with the planes stacked one after the other. This avoids allocating exportable memory for clients that only
+//ever read the frames back.
+static void cudaFrameSize(const NVSurface *surface, uint32_t *widthInBytes, uint32_t *rows) {
+    const NVFormatInfo *fmtInfo = &formatsInfo[nvSurfaceFormat(surface)];
+    *widthInBytes = 0;
+    *rows = 0;
+    for (uint32_t i = 0; i < fmtInfo->numPlanes; i++) {
+        const NVFormatPlane *p = &fmtInfo->plane[i];
+        *widthInBytes = MAX(*widthInBytes, (surface->width >> p->ss.x) * fmtInfo->bppc * p->channelCount);
+        *rows += surface->height >> p->ss.y;
+    }
+}
+
+//what a frame allocated with pitch takes up, for the VRAM accounting
+static int64_t cudaFrameBytes(const NVSurface *surface, size_t pitch) {
+    uint32_t widthInBytes, rows;
+    cudaFrameSize(surface, &widthInBytes, &rows);
+    return (int64_t) pitch * rows;
+}
+
+//must be called with the surface's mutex held and the CUDA context current
+static bool allocCudaFrame(NVDriver *drv, NVSurface *surface) {
+    if (surface->cudaFrame != (CUdeviceptr) NULL) {
+        return true;
+    }
+    uint32_t widthInBytes, rows;
+    cudaFrameSize(surface, &widthInBytes, &rows);
+    vramMakeRoom(drv, (uint64_t) widthInBytes * rows);
+    CHECK_CUDA_RESULT_RETURN(cu->cuMemAllocPitch(&surface->cudaFrame, &surface->cudaFramePitch, widthInBytes, rows, 16), false);
+    vramAccount(drv, NV_VRAM_FRAMES, cudaFrameBytes(surface, surface->cudaFramePitch));
+    return true;
+}
+
+//drops the NVENC registrations of the surface's storage, which must happen before it's freed or handed to another
+//surface with the backing image
+static void forgetEncoderInputs(NVDriver *drv, NVSurface *surface) {
+    if (!surface->encodeRegistered || CHECK_CUDA_RESULT(cu->cuCtxPushCurrent(drv->cudaContext))) {
+        return;
+    }
+    pthread_mutex_lock(&drv->objectCreationMutex);
+    for (uint32_t i = 0; i < handle_table_size(&drv->objects); i++) {
+        Object o = (Object) handle_table_get_at(&drv->objects, i, NULL);
+        if (o != NULL && o->type == OBJECT_TYPE_CONTEXT && ((NVContext*) o->obj)->encoder != NULL) {
+            nvencForgetSurface((NVContext*) o->obj, surface);
         }
     }
-    if (drv->supports444Surface) {
-        switch(cfg->profile) {
-        case VAProfileHEVCMain444:
-        case VAProfileVP9Profile1:
-        case VAProfileAV1Profile1:
-            cfg->surfaceFormat = cudaVideoSurfaceFormat_YUV444;
-            cfg->chromaFormat = cudaVideoChromaFormat_444;
-            cfg->bitDepth = 8;
-            break;
-        default:
-            break;
+    pthread_mutex_unlock(&drv->objectCreationMutex);
+    CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+    surface->encodeRegistered = false;
+}
+
+static void freeCudaFrame(NVDriver *drv, NVSurface *surface) {
+    pthread_mutex_lock(&surface->mutex);
+    CUdeviceptr frame = surface->cudaFrame;
+    CUdeviceptr doubledFrame = surface->doubledFrame;
+    int64_t bytes = (frame != (CUdeviceptr) NULL ? cudaFrameBytes(surface, surface->cudaFramePitch) : 0)
+                  + (doubledFrame != (CUdeviceptr) NULL ? cudaFrameBytes(surface, surface->doubledFramePitch) : 0);
+    surface->cudaFrame = (CUdeviceptr) NULL;
+    surface->doubledFrame = (CUdeviceptr) NULL;
+    surface->hasDoubledFrame = false;
+    pthread_mutex_unlock(&surface->mutex);
+    if ((frame != (CUdeviceptr) NULL || doubledFrame != (CUdeviceptr) NULL) && !CHECK_CUDA_RESULT(cu->cuCtxPushCurrent(drv->cudaContext))) {
+        if (frame != (CUdeviceptr) NULL) {
+            CHECK_CUDA_RESULT(cu->cuMemFree(frame));
+        }
+        if (doubledFrame != (CUdeviceptr) NULL) {
+            CHECK_CUDA_RESULT(cu->cuMemFree(doubledFrame));
         }
+        CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+        vramAccount(drv, NV_VRAM_FRAMES, -bytes);
     }
-    if (drv->supports444Surface && drv->supports16BitSurface) {
-        switch(cfg->profile) {
-        case VAProfileHEVCMain444_10:
-            cfg->surfaceFormat = cudaVideoSurfaceFormat_YUV444_16Bit;
-            cfg->chromaFormat = cudaVideoChromaFormat_444;
-            cfg->bitDepth = 10;
-            break;
-        case VAProfileHEVCMain444_12:
-            cfg->surfaceFormat = cudaVideoSurfaceFormat_YUV444_16Bit;
-            cfg->chromaFormat = cudaVideoChromaFormat_444;
-            cfg->bitDepth = 12;
-            break;
+}
+
+//copies the frame NVDEC made from the second field of the surface's picture into doubledFrame
+static bool resolveDoubledFrame(NVDriver *drv, NVSurface *surface, CUdeviceptr ptr, uint32_t pitch, CUstream stream) {
+    uint32_t widthInBytes, rows;
+    cudaFrameSize(surface, &widthInBytes, &rows);
+    pthread_mutex_lock(&surface->mutex);
+    bool ret = surface->doubledFrame != (CUdeviceptr) NULL;
+    if (!ret) {
+        vramMakeRoom(drv, (uint64_t) widthInBytes * rows);
+        ret = !CHECK_CUDA_RESULT(cu->cuMemAllocPitch(&surface->doubledFrame, &surface->doubledFramePitch, widthInBytes, rows, 16));
+        if (ret) {
+            vramAccount(drv, NV_VRAM_FRAMES, cudaFrameBytes(surface, surface->doubledFramePitch));
+        }
+    }
+    if (ret) {
+        CUDA_MEMCPY2D cpy = {
+            .srcMemoryType = CU_MEMORYTYPE_DEVICE,
+            .srcDevice = ptr,
+            .srcPitch = pitch,
+            .dstMemoryType = CU_MEMORYTYPE_DEVICE,
+            .dstDevice = surface->doubledFrame,
+            .dstPitch = surface->doubledFramePitch,
+            .WidthInBytes = widthInBytes,
+            .Height = rows
+        };
+        ret = !CHECK_CUDA_RESULT(cu->cuMemcpy2DAsync(&cpy, stream));
+    }
+    surface->hasDoubledFrame = ret;
+    pthread_mutex_unlock(&surface->mutex);
+    return ret;
+}
+
+//copies a mapped frame to wherever the surface currently keeps it's contents
+static bool resolveFrame(NVDriver *drv, NVSurface *surface, CUdeviceptr ptr, uint32_t pitch, CUstream stream) {
+    pthread_mutex_lock(&surface->mutex);
+    bool cudaOnly = lazyExport && !surface->exported;
+    bool ret = true;
+    if (cudaOnly) {
+        uint32_t widthInBytes, rows;
+        cudaFrameSize(surface, &widthInBytes, &rows);
+        CUDA_MEMCPY2D cpy = {
+            .srcMemoryType = CU_MEMORYTYPE_DEVICE,
+            .srcDevice = ptr,
+            .srcPitch = pitch,
+            .dstMemoryType = CU_MEMORYTYPE_DEVICE,
+            .dstPitch = surface->cudaFramePitch,
+            .WidthInBytes = widthInBytes,
+            .Height = rows
+        };
+        ret = allocCudaFrame(drv, surface);
+        cpy.dstDevice = surface->cudaFrame;
+        ret = ret && !CHECK_CUDA_RESULT(cu->cuMemcpy2DAsync(&cpy, stream));
+    }
+    pthread_mutex_unlock(&surface->mutex);
+    if (!cudaOnly) {
+        ret = drv->backend->exportCudaPtr(drv, ptr, surface, pitch, stream);
+    }
+    return ret;
+}
+
+//gives the surface somewhere to be decoded into ahead of time, must be called with the CUDA context current
+static bool realiseSurfaceStorage(NVDriver *drv, NVSurface *surface) {
+    pthread_mutex_lock(&surface->mutex);
+    bool cudaOnly = lazyExport && !surface->exported;
+    bool ret = cudaOnly && allocCudaFrame(drv, surface);
+    pthread_mutex_unlock(&surface->mutex);
+    if (!cudaOnly) {
+        ret = drv->backend->realiseSurface(drv, surface);
+    }
+    return ret;
+}
+
+//layout of the planes of an image's buffer, they're packed one after the other with no padding
+static uint32_t imagePlanePitch(const NVFormatInfo *fmtInfo, uint32_t width, uint32_t plane) {
+    const NVFormatPlane *p = &fmtInfo->plane[plane];
+    return (width >> p->ss.x) * fmtInfo->bppc * p->channelCount;
+}
+
+static uint32_t imagePlaneOffset(const NVFormatInfo *fmtInfo, uint32_t width, uint32_t height, uint32_t plane) {
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < plane; i++) {
+        const NVFormatPlane *p = &fmtInfo->plane[i];
+        offset += ((width * height) >> (p->ss.x + p->ss.y)) * fmtInfo->bppc * p->channelCount;
+    }
+    return offset;
+}
+
+static uint32_t imageSize(const NVFormatInfo *fmtInfo, uint32_t width, uint32_t height) {
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < fmtInfo->numPlanes; i++) {
+        const NVFormatPlane *p = &fmtInfo->plane[i];
+        size += ((width * height) >> (p->ss.x + p->ss.y)) * fmtInfo->bppc * p->channelCount;
+    }
+    return size;
+}
+
+//splits a semi-planar 4:2:0 frame read back from a surface into planar I420 or YV12, keeping the top 8 bits of 16-bit
+//samples. There's only a copy to host memory for the whole frame already, so it's not worth a kernel
+static void splitToPlanar(const NVFormatInfo *srcFmt, const uint8_t *src, const NVFormatInfo *dstFmt, bool yv12, uint32_t width,
+                          uint32_t height, uint32_t dstWidth, uint32_t dstHeight, uint8_t *dst) {
+    uint32_t bpp = srcFmt->bppc;
+    //little endian, the most significant byte is the last one
+    uint32_t msb = bpp - 1;
+    uint32_t srcPitch = imagePlanePitch(srcFmt, width, 0);
+    uint8_t *luma = dst + imagePlaneOffset(dstFmt, dstWidth, dstHeight, 0);
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *row = src + y * srcPitch;
+        uint8_t *out = luma + y * imagePlanePitch(dstFmt, dstWidth, 0);
+        for (uint32_t x = 0; x < width; x++) {
+            out[x] = row[x * bpp + msb];
+        }
+    }
+    const uint8_t *chroma = src + imagePlaneOffset(srcFmt, width, height, 1);
+    uint32_t chromaPitch = imagePlanePitch(srcFmt, width, 1);
+    uint8_t *u = dst + imagePlaneOffset(dstFmt, dstWidth, dstHeight, yv12 ? 2 : 1);
+    uint8_t *v = dst + imagePlaneOffset(dstFmt, dstWidth, dstHeight, yv12 ? 1 : 2);
+    uint32_t outPitch = imagePlanePitch(dstFmt, dstWidth, 1);
+    for (uint32_t y = 0; y < height / 2; y++) {
+        const uint8_t *row = chroma + y * chromaPitch;
+        for (uint32_t x = 0; x < width / 2; x++) {
+            u[y * outPitch + x] = row[2 * x * bpp + msb];
+            v[y * outPitch + x] = row[(2 * x + 1) * bpp + msb];
+        }
+    }
+}
+
+//queues copies of a region of a surface's frame into host memory, laid out as nvCreateImage would lay out an image of
+//dstWidth x dstHeight with the region at it's origin. The frame is read from ptr if it's set, otherwise from wherever the
+//surface currently keeps it. Must be called with the CUDA context current
+static bool copySurfaceToHost(const NVSurface *surface, const NVFormatInfo *fmtInfo, CUdeviceptr ptr, size_t pitch,
+                              const VARectangle *src, uint32_t dstWidth, uint32_t dstHeight, void *dst, CUstream stream) {
+    uint32_t planeY = 0;
+    if (ptr == (CUdeviceptr) NULL && surface->backingImage == NULL) {
+        ptr = surface->cudaFrame;
+        pitch = surface->cudaFramePitch;
+    }
+    for (uint32_t i = 0; i < fmtInfo->numPlanes; i++) {
+        const NVFormatPlane *p = &fmtInfo->plane[i];
+        uint32_t bytesPerPixel = fmtInfo->bppc * p->channelCount;
+        CUDA_MEMCPY2D memcpy2d = {
+            .srcXInBytes = (src->x >> p->ss.x) * bytesPerPixel,
+            .srcY = src->y >> p->ss.y,
+            .dstXInBytes = 0, .dstY = 0,
+            .dstMemoryType = CU_MEMORYTYPE_HOST,
+            .dstHost = (char *) dst + imagePlaneOffset(fmtInfo, dstWidth, dstHeight, i),
+            .dstPitch = imagePlanePitch(fmtInfo, dstWidth, i),
+            .WidthInBytes = (src->width >> p->ss.x) * bytesPerPixel,
+            .Height = src->height >> p->ss.y
+        };
+        if (ptr != (CUdeviceptr) NULL) {
+            memcpy2d.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+            memcpy2d.srcDevice = ptr;
+            memcpy2d.srcPitch = pitch;
+            memcpy2d.srcY += planeY;
+        } else if (surface->backingImage != NULL) {
+            memcpy2d.srcMemoryType = CU_MEMORYTYPE_ARRAY;
+            memcpy2d.srcArray = surface->backingImage->arrays[i];
+        } else {
+            LOG("Surface %p has never been decoded into", surface);
+            return false;
+        }
+        planeY += surface->height >> p->ss.y;
+        CHECK_CUDA_RESULT_RETURN(cu->cuMemcpy2DAsync(&memcpy2d, stream), false);
+    }
+    return true;
+}
+
+//tries to allocate page-locked host memory, returning false if it couldn't
+static bool allocHostMemory(NVDriver *drv, void **ptr, size_t size) {
+    //images created before anything initialised CUDA just use ordinary memory
+    if (!atomic_load(&drv->cudaInitialised) || cux == NULL || cux->cuMemAllocHost == NULL || CHECK_CUDA_RESULT(cu->cuCtxPushCurrent(drv->cudaContext))) {
+        return false;
+    }
+    bool ret = !CHECK_CUDA_RESULT(cux->cuMemAllocHost(ptr, size));
+    CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+    return ret;
+}
+
+static void freeHostMemory(NVDriver *drv, void *ptr) {
+    if (!CHECK_CUDA_RESULT(cu->cuCtxPushCurrent(drv->cudaContext))) {
+        CHECK_CUDA_RESULT(cux->cuMemFreeHost(ptr));
+        CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+    }
+}
+
+static void releaseHostFrame(NVDriver *drv, NVHostFrame *frame) {
+    if (frame == NULL || atomic_fetch_sub(&frame->refs, 1) != 1) {
+        return;
+    }
+    if (frame->pinned) {
+        freeHostMemory(drv, frame->ptr);
+    } else {
+        free(frame->ptr);
+    }
+    free(frame);
+}
+
+//the surface's reference to it's host copy, images derived from it keep theirs
+static void freeHostFrame(NVDriver *drv, NVSurface *surface) {
+    pthread_mutex_lock(&surface->mutex);
+    NVHostFrame *frame = surface->hostFrame;
+    surface->hostFrame = NULL;
+    pthread_mutex_unlock(&surface->mutex);
+    releaseHostFrame(drv, frame);
+}
+
+//the host copy the next frame should be written to, must be called with the surface's mutex held. A copy a client
+//has mapped can't be written under it, so the surface lets go of it and the next nvDeriveImage makes a new one
+static NVHostFrame *refreshableHostFrame(NVSurface *surface, NVHostFrame **detached) {
+    *detached = NULL;
+    if (surface->hostFrame != NULL && atomic_load(&surface->hostFrame->mapped) > 0) {
+        *detached = surface->hostFrame;
+        surface->hostFrame = NULL;
+    }
+    return surface->hostFrame;
+}
+
+NVSurface* nvSurfaceFromSurfaceId(NVDriver *drv, VASurfaceID surf) {
+    Object obj = getObject(drv, surf);
+    if (obj != NULL && obj->type == OBJECT_TYPE_SURFACE) {
+        NVSurface *suf = (NVSurface*) obj->obj;
+        return suf;
+    }
+    return NULL;
+}
+
+NVBuffer* nvBufferFromBufferId(NVDriver *drv, VABufferID buf) {
+    Object obj = getObject(drv, buf);
+    if (obj != NULL && obj->type == OBJECT_TYPE_BUFFER) {
+        return (NVBuffer*) obj->obj;
+    }
+    return NULL;
+}
+
+int pictureIdxFromSurfaceId(NVDriver *drv, VASurfaceID surfId) {
+    NVSurface *surf = nvSurfaceFromSurfaceId(drv, surfId);
+    if (surf != NULL) {
+        return surf->pictureIdx;
+    }
+    return -1;
+}
+
+//the order profiles are reported in, along with the caps the GPU needs for them to be listed
+static const NVProfileCaps profileCaps[] = {
+    {VAProfileMPEG2Simple,              cudaVideoCodec_MPEG2,       8,  cudaVideoChromaFormat_420},
+    {VAProfileMPEG2Main,                cudaVideoCodec_MPEG2,       8,  cudaVideoChromaFormat_420},
+    {VAProfileMPEG4Simple,              cudaVideoCodec_MPEG4,       8,  cudaVideoChromaFormat_420},
+    {VAProfileMPEG4AdvancedSimple,      cudaVideoCodec_MPEG4,       8,  cudaVideoChromaFormat_420},
+    {VAProfileMPEG4Main,                cudaVideoCodec_MPEG4,       8,  cudaVideoChromaFormat_420},
+    {VAProfileVC1Simple,                cudaVideoCodec_VC1,         8,  cudaVideoChromaFormat_420},
+    {VAProfileVC1Main,                  cudaVideoCodec_VC1,         8,  cudaVideoChromaFormat_420},
+    {VAProfileVC1Advanced,              cudaVideoCodec_VC1,         8,  cudaVideoChromaFormat_420},
+    {VAProfileH264Main,                 cudaVideoCodec_H264,        8,  cudaVideoChromaFormat_420},
+    {VAProfileH264High,                 cudaVideoCodec_H264,        8,  cudaVideoChromaFormat_420},
+    {VAProfileH264ConstrainedBaseline,  cudaVideoCodec_H264,        8,  cudaVideoChromaFormat_420},
+    {VAProfileJPEGBaseline,             cudaVideoCodec_JPEG,        8,  cudaVideoChromaFormat_420},
+    {VAProfileH264StereoHigh,           cudaVideoCodec_H264_SVC,    8,  cudaVideoChromaFormat_420},
+    {VAProfileH264MultiviewHigh,        cudaVideoCodec_H264_MVC,    8,  cudaVideoChromaFormat_420},
+    {VAProfileHEVCMain,                 cudaVideoCodec_HEVC,        8,  cudaVideoChromaFormat_420},
+    {VAProfileVP8Version0_3,            cudaVideoCodec_VP8,         8,  cudaVideoChromaFormat_420},
+    {VAProfileVP9Profile0,              cudaVideoCodec_VP9,         8,  cudaVideoChromaFormat_420},
+    {VAProfileAV1Profile0,              cudaVideoCodec_AV1,         8,  cudaVideoChromaFormat_420},
+    {VAProfileHEVCMain10,               cudaVideoCodec_HEVC,        10, cudaVideoChromaFormat_420},
+    {VAProfileHEVCMain12,               cudaVideoCodec_HEVC,        12, cudaVideoChromaFormat_420},
+    {VAProfileVP9Profile2,              cudaVideoCodec_VP9,         10, cudaVideoChromaFormat_420},
+    {VAProfileHEVCMain444,              cudaVideoCodec_HEVC,        8,  cudaVideoChromaFormat_444},
+    {VAProfileVP9Profile1,              cudaVideoCodec_VP9,         8,  cudaVideoChromaFormat_444},
+    {VAProfileAV1Profile1,              cudaVideoCodec_AV1,         8,  cudaVideoChromaFormat_444},
+#if VA_CHECK_VERSION(1, 20, 0)
+    {VAProfileHEVCMain444_10,           cudaVideoCodec_HEVC,        10, cudaVideoChromaFormat_444},
+    {VAProfileHEVCMain444_12,           cudaVideoCodec_HEVC,        12, cudaVideoChromaFormat_444},
+    {VAProfileVP9Profile3,              cudaVideoCodec_VP9,         10, cudaVideoChromaFormat_444},
+#endif
+};
+
+//indexed by VAProfile, filled in once from the nvd_codecs section by buildProfileTable
+static NVProfileInfo profileTable[MAX_VA_PROFILE];
+static pthread_once_t profileTableOnce = PTHREAD_ONCE_INIT;
+
+static void buildProfileTable(void) {
+    for (int p = 0; p < MAX_VA_PROFILE; p++) {
+        NVProfileInfo *info = &profileTable[p];
+        info->cudaCodec = cudaVideoCodec_NONE;
+        info->capsCodec = cudaVideoCodec_NONE;
+        for (const NVCodec *c = __start_nvd_codecs; c < __stop_nvd_codecs && info->cudaCodec == cudaVideoCodec_NONE; c++) {
+            info->cudaCodec = c->computeCudaCodec(p);
+        }
+        for (const NVCodec *c = __start_nvd_codecs; c < __stop_nvd_codecs && info->codec == NULL; c++) {
+            for (int i = 0; i < c->supportedProfileCount; i++) {
+                if (c->supportedProfiles[i] == (VAProfile) p) {
+                    info->codec = c;
+                    break;
+                }
+            }
+        }
+    }
+    for (uint32_t i = 0; i < ARRAY_SIZE(profileCaps); i++) {
+        if (profileCaps[i].profile >= 0 && profileCaps[i].profile < MAX_VA_PROFILE) {
+            NVProfileInfo *info = &profileTable[profileCaps[i].profile];
+            info->capsCodec = profileCaps[i].capsCodec;
+            info->bitDepth = profileCaps[i].bitDepth;
+            info->chromaFormat = profileCaps[i].chromaFormat;
+        }
+    }
+}
+
+static const NVProfileInfo *getProfileInfo(VAProfile profile) {
+    static const NVProfileInfo unknownProfile = { .cudaCodec = cudaVideoCodec_NONE, .capsCodec = cudaVideoCodec_NONE };
+    if (profile < 0 || profile >= MAX_VA_PROFILE) {
+        return &unknownProfile;
+    }
+    return &profileTable[profile];
+}
+
+static cudaVideoCodec vaToCuCodec(VAProfile profile) {
+    return getProfileInfo(profile)->cudaCodec;
+}
+
+//retains the primary context of the device, the first display on a device sets it's flags
+static bool acquireSharedContext(CUdevice device, CUcontext *context) {
+    pthread_mutex_lock(&sharedContextsMutex);
+    for (int i = 0; i < sharedContextCount; i++) {
+        if (sharedContexts[i].device == device) {
+            sharedContexts[i].refs++;
+            *context = sharedContexts[i].context;
+            pthread_mutex_unlock(&sharedContextsMutex);
+            return true;
+        }
+    }
+    if (sharedContextCount == MAX_SHARED_CONTEXTS) {
+        pthread_mutex_unlock(&sharedContextsMutex);
+        return false;
+    }
+    //if something else in the process is already using the primary context we have to take it's flags as they are
+    CUresult result = cu->cuDevicePrimaryCtxSetFlags(device, CU_CTX_SCHED_BLOCKING_SYNC);
+    if (result == CUDA_ERROR_PRIMARY_CONTEXT_ACTIVE) {
+        LOG("Primary context for device %d is already active, using it's existing flags", device);
+    } else {
+        CHECK_CUDA_RESULT(result);
+    }
+    if (CHECK_CUDA_RESULT(cu->cuDevicePrimaryCtxRetain(context, device))) {
+        pthread_mutex_unlock(&sharedContextsMutex);
+        return false;
+    }
+    sharedContexts[sharedContextCount++] = (NVSharedContext) {
+        .device = device,
+        .context = *context,
+        .refs = 1
+    };
+    LOG("Retained primary context %p for device %d", *context, device);
+    pthread_mutex_unlock(&sharedContextsMutex);
+    return true;
+}
+
+static void releaseSharedContext(CUdevice device) {
+    pthread_mutex_lock(&sharedContextsMutex);
+    for (int i = 0; i < sharedContextCount; i++) {
+        if (sharedContexts[i].device == device) {
+            if (--sharedContexts[i].refs == 0) {
+                CHECK_CUDA_RESULT(cu->cuDevicePrimaryCtxRelease(device));
+                sharedContexts[i] = sharedContexts[--sharedContextCount];
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sharedContextsMutex);
+}
+
+static bool createCudaContext(NVDriver *drv) {
+    if (drv->sharedContext) {
+        if (acquireSharedContext(drv->cudaGpuId, &drv->cudaContext)) {
+            return true;
+        }
+        LOG_WARN("Unable to use the primary context, falling back to a private one");
+        drv->sharedContext = false;
+    }
+    return !CHECK_CUDA_RESULT(cu->cuCtxCreate(&drv->cudaContext, CU_CTX_SCHED_BLOCKING_SYNC, drv->cudaGpuId));
+}
+
+static void destroyCudaContext(NVDriver *drv) {
+    if (drv->sharedContext) {
+        releaseSharedContext(drv->cudaGpuId);
+    } else {
+        CHECK_CUDA_RESULT(cu->cuCtxDestroy(drv->cudaContext));
+    }
+    drv->cudaContext = NULL;
+}
+
+//creates the exporter and CUDA context the first time they're needed. Until then the driver can only answer queries
+//that the caps cache has the answers to
+static bool initialiseCuda(NVDriver *drv) {
+    //everything a thread needs from the initialisation was written before the flag was set
+    if (atomic_load(&drv->cudaInitialised)) {
+        return true;
+    }
+    pthread_mutex_lock(&drv->initMutex);
+    if (atomic_load(&drv->cudaInitialised)) {
+        pthread_mutex_unlock(&drv->initMutex);
+        return true;
+    }
+    pthread_once(&cudaLoadOnce, loadCudaFunctions);
+    if (cu == NULL || cv == NULL) {
+        pthread_mutex_unlock(&drv->initMutex);
+        return false;
+    }
+    LOG("Initialising CUDA for %p", drv);
+    drv->cu = cu;
+    drv->cv = cv;
+    if (!drv->backend->initExporter(drv)) {
+        LOG("Exporter failed");
+        pthread_mutex_unlock(&drv->initMutex);
+        return false;
+    }
+    if (!createCudaContext(drv)) {
+        drv->backend->releaseExporter(drv);
+        pthread_mutex_unlock(&drv->initMutex);
+        return false;
+    }
+    CUuuid uuid = {0};
+    if (!CHECK_CUDA_RESULT(cu->cuDeviceGetUuid(&uuid, drv->cudaGpuId))) {
+        setCapsTableDevice(drv->capsTable, (const uint8_t*) uuid.bytes, drv->supports16BitSurface, drv->supports444Surface);
+    }
+    atomic_store(&drv->surfaceSupportKnown, true);
+    atomic_store(&drv->cudaInitialised, true);
+    pthread_mutex_unlock(&drv->initMutex);
+    return true;
+}
+
+//the surface formats depend on the backend, so they either need to come from the cache or the exporter
+static void ensureSurfaceSupport(NVDriver *drv) {
+    if (!atomic_load(&drv->surfaceSupportKnown) && !initialiseCuda(drv)) {
+        LOG("Unable to determine supported surface formats");
+    }
+}
+
+static bool doesGPUSupportCodec(NVDriver *drv, cudaVideoCodec codec, int bitDepth, cudaVideoChromaFormat chromaFormat, uint32_t *width, uint32_t *height)
+{
+    bool supported;
+    if (lookupCodecCaps(drv->capsTable, codec, bitDepth, chromaFormat, &supported, width, height)) {
+        return supported;
+    }
+    if (!initialiseCuda(drv)) {
+        return false;
+    }
+    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), false);
+    supported = queryCodecCaps(cv, drv->capsTable, codec, bitDepth, chromaFormat, width, height);
+    CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+    return supported;
+}
+
+static bool doesGPUSupportEncode(NVDriver *drv, NVEncodeCodec codec, int bitDepth, uint32_t *width, uint32_t *height)
+{
+    bool supported;
+    if (lookupEncodeCaps(drv->capsTable, codec, bitDepth, &supported, width, height)) {
+        return supported;
+    }
+    if (!initialiseCuda(drv)) {
+        return false;
+    }
+    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), false);
+    bool queried = nvencQueryCaps(drv);
+    CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+    return queried && lookupEncodeCaps(drv->capsTable, codec, bitDepth, &supported, width, height) && supported;
+}
+
+//the profiles that can be encoded to, in the order they're listed
+static const VAProfile encodeProfiles[] = {
+    VAProfileH264ConstrainedBaseline,
+    VAProfileH264Main,
+    VAProfileH264High,
+    VAProfileHEVCMain,
+    VAProfileHEVCMain10,
+    VAProfileAV1Profile0,
+};
+
+//the smallest bit depth the profile can be encoded at
+static int encodeBitDepth(VAProfile profile) {
+    return profile == VAProfileHEVCMain10 ? 10 : 8;
+}
+
+static bool profileEncodable(NVDriver *drv, VAProfile profile, uint32_t *width, uint32_t *height) {
+    NVEncodeCodec codec;
+    return nvencCodecForProfile(profile, &codec) && doesGPUSupportEncode(drv, codec, encodeBitDepth(profile), width, height);
+}
+
+//a surface's timeline syncobj. Signals still queued on a stream hold a reference, so a surface destroyed mid resolve
+//doesn't leave a callback signalling a handle that's since been reused
+typedef struct _NVSurfaceFence {
+    int             drmFd;
+    uint32_t        handle;
+    _Atomic int     refs;
+} NVSurfaceFence;
+
+typedef struct {
+    NVSurfaceFence  *fence;
+    uint64_t        point;
+} NVFenceSignal;
+
+static void releaseSurfaceFence(NVSurfaceFence *fence) {
+    if (atomic_fetch_sub(&fence->refs, 1) == 1) {
+        destroySyncobj(fence->drmFd, fence->handle);
+        free(fence);
+    }
+}
+
+//runs on CUDA's callback thread once the copies queued before it have completed, so it can't make any CUDA calls
+static void CUDAAPI signalSurfaceFence(CUstream stream, CUresult status, void *userData) {
+    NVFenceSignal *signal = (NVFenceSignal*) userData;
+    //signalled even if the copy failed, a consumer is better off with a bad frame than waiting forever
+    if (!signalSyncobjPoint(signal->fence->drmFd, signal->fence->handle, signal->point)) {
+        LOG("Unable to signal point %" PRIu64 " of a surface's syncobj", signal->point);
+    }
+    releaseSurfaceFence(signal->fence);
+    free(signal);
+}
+
+//signals the point once the work queued on the stream so far is done, or straight away if onStream is false
+static void queueFenceSignal(NVSurfaceFence *fence, uint64_t point, CUstream stream, bool onStream) {
+    NVFenceSignal *signal = malloc(sizeof(NVFenceSignal));
+    if (signal == NULL) {
+        signalSyncobjPoint(fence->drmFd, fence->handle, point);
+        return;
+    }
+    atomic_fetch_add(&fence->refs, 1);
+    *signal = (NVFenceSignal) { .fence = fence, .point = point };
+    if (!onStream || CHECK_CUDA_RESULT(cu->cuStreamAddCallback(stream, &signalSurfaceFence, signal, 0))) {
+        signalSurfaceFence(stream, CUDA_SUCCESS, signal);
+    }
+}
+
+//if eventRecorded, the copies were queued on stream and the CUDA context is still current
+static void markSurfaceResolved(NVSurface *surface, CUstream stream, bool eventRecorded) {
+    //notify anyone waiting for the copy to be queued, they'll wait on the event for it to complete
+    pthread_mutex_lock(&surface->mutex);
+    surface->resolving = 0;
+    surface->resolveEventPending = eventRecorded;
+    surface->fencePoint++;
+    if (surface->fence != NULL) {
+        queueFenceSignal(surface->fence, surface->fencePoint, stream, eventRecorded);
+    }
+    pthread_cond_signal(&surface->cond);
+    pthread_mutex_unlock(&surface->mutex);
+}
+
+//keeps a mapped frame until the copies queued on the stream so far are done with it
+static void trackMappedFrame(NVContext *ctx, CUdeviceptr deviceMemory) {
+    NVMappedFrame *frame = &ctx->mappedFrames[(ctx->mappedFrameHead + ctx->mappedFrameCount) % ctx->numOutputSurfaces];
+    frame->deviceMemory = deviceMemory;
+    if (CHECK_CUDA_RESULT(cu->cuEventRecord(frame->copied, ctx->stream))) {
+        CHECK_CUDA_RESULT(cu->cuStreamSynchronize(ctx->stream));
+        CHECK_CUDA_RESULT(cv->cuvidUnmapVideoFrame(ctx->decoder, deviceMemory));
+        return;
+    }
+    ctx->mappedFrameCount++;
+}
+
+static bool ensureScratchBuffer(NVScratchBuffer *scratch, size_t widthInBytes, size_t rows, CUstream stream);
+
+//NVD_AV1_FILM_GRAIN=driver, adds the picture's grain to a copy of the mapped frame which is then resolved in it's
+//place. Gives back the mapped frame if the grain couldn't be added, the picture is still usable without it
+static CUdeviceptr applySurfaceFilmGrain(NVContext *ctx, NVSurface *surface, CUdeviceptr frame, unsigned int *pitch) {
+    NVDriver *drv = ctx->drv;
+    if (!ensureKernels(cu, &drv->kernels)) {
+        LOG("Unable to load the film grain kernels");
+        return frame;
+    }
+    if (ctx->filmGrainTables == NULL) {
+        ctx->filmGrainTables = (NVFilmGrainTables*) malloc(sizeof(NVFilmGrainTables));
+        if (ctx->filmGrainTables == NULL) {
+            return frame;
+        }
+    }
+    if (ctx->filmGrainTablesDevice == (CUdeviceptr) NULL
+            && CHECK_CUDA_RESULT(cu->cuMemAlloc(&ctx->filmGrainTablesDevice, sizeof(NVFilmGrainTables)))) {
+        ctx->filmGrainTablesDevice = (CUdeviceptr) NULL;
+        return frame;
+    }
+    size_t tablesSize = generateFilmGrain(&surface->filmGrain, ctx->filmGrainTables);
+    uint32_t widthInBytes, rows;
+    cudaFrameSize(surface, &widthInBytes, &rows);
+    if (tablesSize == 0 || !ensureScratchBuffer(&ctx->filmGrainFrame, widthInBytes, rows, ctx->stream)) {
+        return frame;
+    }
+    //pageable memory is staged before this returns, so the next picture can regenerate the tables straight away
+    if (CHECK_CUDA_RESULT(cu->cuMemcpyHtoDAsync(ctx->filmGrainTablesDevice, ctx->filmGrainTables, tablesSize, ctx->stream))) {
+        return frame;
+    }
+    //the kernels only write the picture, anything of the surface beyond it is copied across as it is
+    uint32_t width = MIN(surface->filmGrain.width, surface->width);
+    uint32_t height = MIN(surface->filmGrain.height, surface->height);
+    if (width < surface->width || height < surface->height) {
+        CUDA_MEMCPY2D cpy = {
+            .srcMemoryType = CU_MEMORYTYPE_DEVICE,
+            .srcDevice = frame,
+            .srcPitch = *pitch,
+            .dstMemoryType = CU_MEMORYTYPE_DEVICE,
+            .dstDevice = ctx->filmGrainFrame.ptr,
+            .dstPitch = ctx->filmGrainFrame.pitch,
+            .WidthInBytes = widthInBytes,
+            .Height = rows
+        };
+        if (CHECK_CUDA_RESULT(cu->cuMemcpy2DAsync(&cpy, ctx->stream))) {
+            return frame;
+        }
+    }
+    if (!applyFilmGrain(cu, &drv->kernels, ctx->filmGrainFrame.ptr, (uint32_t) ctx->filmGrainFrame.pitch, frame, *pitch,
+                        surface->height, width, height, surface->format == cudaVideoSurfaceFormat_P016,
+                        surface->filmGrain.bitDepth, ctx->filmGrainTablesDevice, ctx->stream)) {
+        return frame;
+    }
+    *pitch = (unsigned int) ctx->filmGrainFrame.pitch;
+    return ctx->filmGrainFrame.ptr;
+}
+
+//how many surfaces a context resolves in a turn on the pool before the other contexts get a go
+#define RESOLVE_TURN_SURFACES 4
+
+//a turn of the context on it's GPU's resolve pool, returns true if it stopped with surfaces still queued
+static bool resolveSurfaces(NVResolveJob *job) {
+    NVContext *ctx = (NVContext*) job->data;
+    NVDriver *drv = ctx->drv;
+    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), false);
+    atomic_store(&ctx->resolveIdle, false);
+    bool more = false;
+    for (int resolved = 0; !ctx->exiting; resolved++) {
+        //unmap whatever has finished copying, so the decoder gets it's output surfaces back as soon as possible
+        while (ctx->mappedFrameCount > 0 && unmapOldestFrame(ctx, false));
+
+        if (resolved == RESOLVE_TURN_SURFACES) {
+            more = spsc_queue_size(&ctx->surfaceQueue) > 0;
+            if (more) {
+                break;
+            }
+        }
+        NVSurface *surface = (NVSurface*) spsc_queue_pop(&ctx->surfaceQueue);
+        if (surface == NULL) {
+            //nothing else to do, so don't hold on to mapped frames until the next turn. A surface pushed after this
+            //reschedules the job, so it can't be missed
+            while (ctx->mappedFrameCount > 0) {
+                unmapOldestFrame(ctx, true);
+            }
+            atomic_store(&ctx->resolveIdle, true);
+            break;
+        }
+        //there's room in the queue again
+        signalWakeup(&ctx->queueSpaceWakeup);
+        if (surface->decodeFailed) {
+            markSurfaceResolved(surface, ctx->stream, false);
+            continue;
+        }
+        //all the decoder's output surfaces are mapped, wait for the oldest one's copies to finish
+        if (ctx->mappedFrameCount == ctx->numOutputSurfaces) {
+            unmapOldestFrame(ctx, true);
+        }
+        CUdeviceptr deviceMemory = (CUdeviceptr) NULL;
+        unsigned int pitch = 0;
+        //when deinterlacing the surface always shows the first field, and the second goes to doubledFrame.
+        //The first of a pair of field pictures only has one field to make a frame from
+        bool deinterlacing = ctx->deinterlaceMode != cudaVideoDeinterlaceMode_Weave && !surface->progressiveFrame;
+        bool doubling = deinterlacing && ctx->doubleRate && (!surface->fieldPicture || surface->secondField);
+        CUVIDPROCPARAMS procParams = {
+            .progressive_frame = surface->progressiveFrame,
+            .top_field_first = surface->topFieldFirst,
+            .second_field = deinterlacing ? 0 : surface->secondField,
+            .output_stream = ctx->stream
+        };
+        uint64_t start = statsStart(ctx->stats);
+        NVTX_PUSH("Map context %u surface %u idx %d", ctx->id, surface->id, surface->pictureIdx);
+        CUresult mapResult = cv->cuvidMapVideoFrame(ctx->decoder, surface->pictureIdx, &deviceMemory, &pitch, &procParams);
+        NVTX_POP();
+        if (CHECK_CUDA_RESULT(mapResult)) {
+            //nothing was written to the surface, so it has to read as failed rather than ready
+            pthread_mutex_lock(&surface->mutex);
+            surface->decodeFailed = true;
+            pthread_mutex_unlock(&surface->mutex);
+            markSurfaceResolved(surface, ctx->stream, false);
+            continue;
+        }
+        statsRecord(ctx->stats, NV_STAT_MAP, start);
+        //mapping waits for the decode to finish, so the status is final by now
+        CUVIDGETDECODESTATUS decodeStatus = {0};
+        surface->decodeConcealed = cv->cuvidGetDecodeStatus != NULL
+                && cv->cuvidGetDecodeStatus(ctx->decoder, surface->pictureIdx, &decodeStatus) == CUDA_SUCCESS
+                && (decodeStatus.decodeStatus == cuvidDecodeStatus_Error || decodeStatus.decodeStatus == cuvidDecodeStatus_Error_Concealed);
+        //the copies are queued on the context's stream, the frame stays mapped until they've completed
+        //which lets us map the next frame while this one is still being copied
+        start = statsStart(ctx->stats);
+        NVTX_PUSH("Copy context %u surface %u idx %d", ctx->id, surface->id, surface->pictureIdx);
+        //the grain frame is only read by the copies queued below, deviceMemory stays the mapped frame so it's unmapped
+        CUdeviceptr frame = deviceMemory;
+        unsigned int framePitch = pitch;
+        if (surface->applyFilmGrain) {
+            frame = applySurfaceFilmGrain(ctx, surface, deviceMemory, &framePitch);
+        }
+        bool exported = resolveFrame(drv, surface, frame, framePitch, ctx->stream);
+        NVTX_POP();
+        statsRecord(ctx->stats, NV_STAT_COPY, start);
+        //keep the host copy of a derived surface up to date, so mapping the image is just a pointer hand-off
+        pthread_mutex_lock(&surface->mutex);
+        NVHostFrame *detached;
+        NVHostFrame *hostFrame = refreshableHostFrame(surface, &detached);
+        if (exported && hostFrame != NULL) {
+            VARectangle rect = { .width = surface->width, .height = surface->height };
+            exported = copySurfaceToHost(surface, &formatsInfo[nvSurfaceFormat(surface)], frame, framePitch, &rect,
+                                         surface->width, surface->height, hostFrame->ptr, ctx->stream);
+        }
+        surface->deinterlaced = deinterlacing;
+        surface->hasDoubledFrame = false;
+        pthread_mutex_unlock(&surface->mutex);
+        releaseHostFrame(drv, detached);
+        if (exported && doubling) {
+            //the first field's frame has to be given up before mapping the second if it took the last output surface
+            trackMappedFrame(ctx, deviceMemory);
+            if (ctx->mappedFrameCount == ctx->numOutputSurfaces) {
+                unmapOldestFrame(ctx, true);
+            }
+            procParams.second_field = 1;
+            if (CHECK_CUDA_RESULT(cv->cuvidMapVideoFrame(ctx->decoder, surface->pictureIdx, &deviceMemory, &pitch, &procParams))) {
+                //not fatal, video processing falls back to the first field's frame
+                deviceMemory = (CUdeviceptr) NULL;
+            } else {
+                resolveDoubledFrame(drv, surface, deviceMemory, pitch, ctx->stream);
+            }
+        }
+        bool recorded = exported && !CHECK_CUDA_RESULT(cu->cuEventRecord(surface->resolveEvent, ctx->stream));
+        if (!recorded) {
+            //the copy didn't make it, or there's nothing to wait on for it to finish
+            pthread_mutex_lock(&surface->mutex);
+            surface->decodeFailed = true;
+            pthread_mutex_unlock(&surface->mutex);
+        }
+        markSurfaceResolved(surface, ctx->stream, recorded);
+        if (deviceMemory != (CUdeviceptr) NULL) {
+            trackMappedFrame(ctx, deviceMemory);
+        }
+    }
+    CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+    return more;
+}
+
+//codecs that can carry interlaced pictures, the only ones NVDEC's deinterlacer is used for
+static bool interlacedCodec(cudaVideoCodec codec) {
+    switch (codec) {
+    case cudaVideoCodec_MPEG2:
+    case cudaVideoCodec_MPEG4:
+    case cudaVideoCodec_VC1:
+    case cudaVideoCodec_H264:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static VAStatus nvQueryConfigProfiles(
+        VADriverContextP ctx,
+        VAProfile *profile_list,	/* out */
+        int *num_profiles			/* out */
+    )
+{
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    //the list only changes if the GPU's caps do, so it's built once and the same list returned every time
+    if (drv->profileCount >= 0) {
+        memcpy(profile_list, drv->profiles, drv->profileCount * sizeof(VAProfile));
+        *num_profiles = drv->profileCount;
+        return VA_STATUS_SUCCESS;
+    }
+    ensureSurfaceSupport(drv);
+    int profiles = 0;
+    for (uint32_t i = 0; i < ARRAY_SIZE(profileCaps) && profiles < MAX_PROFILES; i++) {
+        const NVProfileCaps *caps = &profileCaps[i];
+        if (vaToCuCodec(caps->profile) == cudaVideoCodec_NONE) {
+            continue;
+        }
+        if ((caps->bitDepth > 8 && !drv->supports16BitSurface) || (caps->chromaFormat == cudaVideoChromaFormat_444 && !drv->supports444Surface)) {
+            continue;
+        }
+        if (doesGPUSupportCodec(drv, caps->capsCodec, caps->bitDepth, caps->chromaFormat, NULL, NULL)) {
+            profile_list[profiles++] = caps->profile;
+        }
+    }
+    //profiles that can only be encoded to
+    for (uint32_t i = 0; i < ARRAY_SIZE(encodeProfiles) && profiles < MAX_PROFILES; i++) {
+        bool listed = false;
+        for (int j = 0; j < profiles; j++) {
+            listed = listed || profile_list[j] == encodeProfiles[i];
+        }
+        if (!listed && profileEncodable(drv, encodeProfiles[i], NULL, NULL)) {
+            profile_list[profiles++] = encodeProfiles[i];
+        }
+    }
+    //video processing only needs CUDA, so it's always available
+    if (profiles < MAX_PROFILES) {
+        profile_list[profiles++] = VAProfileNone;
+    }
+    //if we couldn't find out which surfaces are supported the list is incomplete, so try again next time
+    if (atomic_load(&drv->surfaceSupportKnown)) {
+        memcpy(drv->profiles, profile_list, profiles * sizeof(VAProfile));
+        drv->profileCount = profiles;
+    }
+    *num_profiles = profiles;
+    //profile enumeration touches nearly every entry, so this is the best point to persist them
+    saveCapsTable(drv->capsTable);
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus nvQueryConfigEntrypoints(
+        VADriverContextP ctx,
+        VAProfile profile,
+        VAEntrypoint  *entrypoint_list,	/* out */
+        int *num_entrypoints			/* out */
+    )
+{
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    if (profile == VAProfileNone) {
+        entrypoint_list[0] = VAEntrypointVideoProc;
+        *num_entrypoints = 1;
+        return VA_STATUS_SUCCESS;
+    }
+    int entrypoints = 0;
+    if (vaToCuCodec(profile) != cudaVideoCodec_NONE) {
+        entrypoint_list[entrypoints++] = VAEntrypointVLD;
+    }
+    if (profileEncodable(drv, profile, NULL, NULL)) {
+        entrypoint_list[entrypoints++] = VAEntrypointEncSlice;
+    }
+    *num_entrypoints = entrypoints;
+    return entrypoints > 0 ? VA_STATUS_SUCCESS : VA_STATUS_ERROR_UNSUPPORTED_PROFILE;
+}
+
+//the smallest a 4:2:0 surface can be, and the largest CUDA is happy to allocate
+#define VIDEO_PROC_MIN_SIZE 2
+#define VIDEO_PROC_MAX_SIZE 16384
+
+//the surface formats video processing can read and write
+static uint32_t videoProcRTFormats(NVDriver *drv) {
+    uint32_t formats = VA_RT_FORMAT_YUV420;
+    if (drv->supports16BitSurface) {
+        formats |= VA_RT_FORMAT_YUV420_10 | VA_RT_FORMAT_YUV420_12;
+    }
+    if (drv->supports444Surface) {
+        formats |= VA_RT_FORMAT_YUV444;
+    }
+    if (drv->supports444Surface && drv->supports16BitSurface) {
+        formats |= VA_RT_FORMAT_YUV444_10 | VA_RT_FORMAT_YUV444_12;
+    }
+    //see nvCreateSurfaces2
+    if (backend != EGL) {
+        formats |= VA_RT_FORMAT_RGB32;
+    }
+    return formats;
+}
+
+static uint32_t encodeRTFormats(NVDriver *drv, VAProfile profile) {
+    switch (profile) {
+    case VAProfileHEVCMain10:
+        return VA_RT_FORMAT_YUV420_10;
+    case VAProfileAV1Profile0:
+        return VA_RT_FORMAT_YUV420 | (doesGPUSupportEncode(drv, NV_ENCODE_AV1, 10, NULL, NULL) ? VA_RT_FORMAT_YUV420_10 : 0);
+    default:
+        return VA_RT_FORMAT_YUV420;
+    }
+}
+
+static VAStatus getEncodeConfigAttributes(NVDriver *drv, VAProfile profile, VAConfigAttrib *attrib_list, int num_attribs) {
+    uint32_t width = 0, height = 0;
+    if (!profileEncodable(drv, profile, &width, &height)) {
+        return VA_STATUS_ERROR_UNSUPPORTED_ENTRYPOINT;
+    }
+    for (int i = 0; i < num_attribs; i++) {
+        switch (attrib_list[i].type) {
+        case VAConfigAttribRTFormat:
+            attrib_list[i].value = encodeRTFormats(drv, profile);
+            break;
+        case VAConfigAttribRateControl:
+            attrib_list[i].value = VA_RC_CQP | VA_RC_CBR | VA_RC_VBR;
+            break;
+        case VAConfigAttribEncPackedHeaders:
+            //NVENC writes the headers itself
+            attrib_list[i].value = VA_ENC_PACKED_HEADER_NONE;
+            break;
+        case VAConfigAttribEncMaxRefFrames:
+            //a single L0 reference and no L1, so there are no B pictures
+            attrib_list[i].value = 1;
+            break;
+        case VAConfigAttribMaxPictureWidth:
+            attrib_list[i].value = width;
+            break;
+        case VAConfigAttribMaxPictureHeight:
+            attrib_list[i].value = height;
+            break;
+        case VAConfigAttribEncQualityRange:
+            //quality levels 1 to 7 pick NVENC's presets P7 to P1
+            attrib_list[i].value = 7;
+            break;
+        case VAConfigAttribEncIntraRefresh:
+            //NVENC has it's own refresh pattern, VAEncMiscParameterRIR only sets how wide the refreshed area is
+            attrib_list[i].value = VA_ENC_INTRA_REFRESH_ROLLING_ROW;
+            break;
+        default:
+            attrib_list[i].value = attrib_list[i].type == VAConfigAttribNVDLowLatency ? 1 : VA_ATTRIB_NOT_SUPPORTED;
+            break;
+        }
+    }
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus nvGetConfigAttributes(
+        VADriverContextP ctx,
+        VAProfile profile,
+        VAEntrypoint entrypoint,
+        VAConfigAttrib *attrib_list,	/* in/out */
+        int num_attribs
+    )
+{
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    if (profile == VAProfileNone) {
+        if (entrypoint != VAEntrypointVideoProc) {
+            return VA_STATUS_ERROR_UNSUPPORTED_ENTRYPOINT;
+        }
+        ensureSurfaceSupport(drv);
+        for (int i = 0; i < num_attribs; i++) {
+            attrib_list[i].value = attrib_list[i].type == VAConfigAttribRTFormat ? videoProcRTFormats(drv) : VA_ATTRIB_NOT_SUPPORTED;
+        }
+        return VA_STATUS_SUCCESS;
+    }
+    if (entrypoint == VAEntrypointEncSlice) {
+        return getEncodeConfigAttributes(drv, profile, attrib_list, num_attribs);
+    }
+    if (vaToCuCodec(profile) == cudaVideoCodec_NONE) {
+        return VA_STATUS_ERROR_UNSUPPORTED_PROFILE;
+    }
+    LOG_TRACE("Got here with profile: %d == %d", profile, vaToCuCodec(profile));
+    ensureSurfaceSupport(drv);
+    for (int i = 0; i < num_attribs; i++) {
+        if (attrib_list[i].type == VAConfigAttribRTFormat) {
+            attrib_list[i].value = VA_RT_FORMAT_YUV420;
+            switch (profile) {
+            case VAProfileHEVCMain12:
+            case VAProfileVP9Profile2:
+                attrib_list[i].value |= VA_RT_FORMAT_YUV420_12;
+            case VAProfileHEVCMain10:
+            case VAProfileAV1Profile0:
+                attrib_list[i].value |= VA_RT_FORMAT_YUV420_10;
+                break;
+            case VAProfileHEVCMain444_12:
+            case VAProfileVP9Profile3:
+                attrib_list[i].value |= VA_RT_FORMAT_YUV444_12 | VA_RT_FORMAT_YUV420_12;
+            case VAProfileHEVCMain444_10:
+            case VAProfileAV1Profile1:
+                attrib_list[i].value |= VA_RT_FORMAT_YUV444_10 | VA_RT_FORMAT_YUV420_10;
+            case VAProfileHEVCMain444:
+            case VAProfileVP9Profile1:
+                attrib_list[i].value |= VA_RT_FORMAT_YUV444;
+                break;
+            default:
+                break;
+            }
+            if (!drv->supports16BitSurface) {
+                attrib_list[i].value &= ~(VA_RT_FORMAT_YUV420_10 | VA_RT_FORMAT_YUV420_12 | VA_RT_FORMAT_YUV444_10 | VA_RT_FORMAT_YUV444_12);
+            }
+            if (!drv->supports444Surface) {
+                attrib_list[i].value &= ~(VA_RT_FORMAT_YUV444 | VA_RT_FORMAT_YUV444_10 | VA_RT_FORMAT_YUV444_12);
+            }
+        } else if (attrib_list[i].type == VAConfigAttribMaxPictureWidth) {
+            doesGPUSupportCodec(drv, vaToCuCodec(profile), 8, cudaVideoChromaFormat_420, &attrib_list[i].value, NULL);
+        } else if (attrib_list[i].type == VAConfigAttribMaxPictureHeight) {
+            doesGPUSupportCodec(drv, vaToCuCodec(profile), 8, cudaVideoChromaFormat_420, NULL, &attrib_list[i].value);
+        } else if (attrib_list[i].type == VAConfigAttribNVDIntraOnly) {
+            attrib_list[i].value = 1;
+        } else if (attrib_list[i].type == VAConfigAttribNVDDeinterlace) {
+            //the most that can be asked for, every mode up to it is available
+            attrib_list[i].value = interlacedCodec(vaToCuCodec(profile))
+                    ? (uint32_t) cudaVideoDeinterlaceMode_Adaptive | NVD_DEINTERLACE_DOUBLE_RATE : (uint32_t) cudaVideoDeinterlaceMode_Weave;
+        } else if (attrib_list[i].type == VAConfigAttribDecProcessing) {
+            attrib_list[i].value = VA_DEC_PROCESSING;
+        } else {
+            LOG("unhandled config attribute: %d", attrib_list[i].type);
+        }
+    }
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus createEncodeConfig(NVDriver *drv, VAProfile profile, VAConfigAttrib *attrib_list, int num_attribs, VAConfigID *config_id) {
+    NVEncodeCodec codec;
+    if (!nvencCodecForProfile(profile, &codec)) {
+        LOG("Unable to encode to profile: %d", profile);
+        return VA_STATUS_ERROR_UNSUPPORTED_PROFILE;
+    }
+    int bitDepth = encodeBitDepth(profile);
+    uint32_t rateControl = 0;
+    bool lowLatency = lowLatencyDefault;
+    for (int i = 0; i < num_attribs; i++) {
+        if (attrib_list[i].type == VAConfigAttribRTFormat) {
+            if ((attrib_list[i].value & encodeRTFormats(drv, profile)) == 0) {
+                return VA_STATUS_ERROR_UNSUPPORTED_RT_FORMAT;
+            }
+            //AV1 profile 0 can be either
+            if ((attrib_list[i].value & VA_RT_FORMAT_YUV420) == 0) {
+                bitDepth = 10;
+            }
+        } else if (attrib_list[i].type == VAConfigAttribRateControl) {
+            if (attrib_list[i].value != VA_RC_CQP && attrib_list[i].value != VA_RC_CBR && attrib_list[i].value != VA_RC_VBR) {
+                LOG("Unsupported rate control mode: %u", attrib_list[i].value);
+                return VA_STATUS_ERROR_ATTR_NOT_SUPPORTED;
+            }
+            rateControl = attrib_list[i].value;
+        } else if (attrib_list[i].type == VAConfigAttribNVDLowLatency) {
+            lowLatency = attrib_list[i].value != 0;
+        }
+    }
+    if (!doesGPUSupportEncode(drv, codec, bitDepth, NULL, NULL)) {
+        LOG("GPU can't encode to profile: %d", profile);
+        return VA_STATUS_ERROR_UNSUPPORTED_ENTRYPOINT;
+    }
+    if (!initialiseCuda(drv)) {
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+    Object obj = allocateObject(drv, OBJECT_TYPE_CONFIG, sizeof(NVConfig));
+    if (obj == NULL) {
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+    NVConfig *cfg = (NVConfig*) obj->obj;
+    cfg->profile = profile;
+    cfg->entrypoint = VAEntrypointEncSlice;
+    cfg->cudaCodec = cudaVideoCodec_NONE;
+    cfg->chromaFormat = cudaVideoChromaFormat_420;
+    cfg->surfaceFormat = bitDepth > 8 ? cudaVideoSurfaceFormat_P016 : cudaVideoSurfaceFormat_NV12;
+    cfg->bitDepth = bitDepth;
+    cfg->rateControl = rateControl;
+    cfg->lowLatency = lowLatency;
+    *config_id = obj->id;
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus nvCreateConfig(
+        VADriverContextP ctx,
+        VAProfile profile,
+        VAEntrypoint entrypoint,
+        VAConfigAttrib *attrib_list,
+        int num_attribs,
+        VAConfigID *config_id		/* out */
+    )
+{
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    LOG_TRACE("got profile: %d with %d attributes", profile, num_attribs);
+    if (entrypoint == VAEntrypointEncSlice) {
+        return createEncodeConfig(drv, profile, attrib_list, num_attribs, config_id);
+    }
+    bool videoProc = profile == VAProfileNone && entrypoint == VAEntrypointVideoProc;
+    cudaVideoCodec cudaCodec = vaToCuCodec(profile);
+    if (cudaCodec == cudaVideoCodec_NONE && !videoProc) {
+        LOG("Profile not supported: %d", profile);
+        return VA_STATUS_ERROR_UNSUPPORTED_PROFILE;
+    }
+    if (entrypoint != VAEntrypointVLD && !videoProc) {
+        LOG("Entrypoint not supported: %d", entrypoint);
+        return VA_STATUS_ERROR_UNSUPPORTED_ENTRYPOINT;
+    }
+    if (!initialiseCuda(drv)) {
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+    Object obj = allocateObject(drv, OBJECT_TYPE_CONFIG, sizeof(NVConfig));
+    if (obj == NULL) {
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+    NVConfig *cfg = (NVConfig*) obj->obj;
+    cfg->profile = profile;
+    cfg->entrypoint = entrypoint;
+    cfg->intraOnly = intraOnlyDefault;
+    cfg->deinterlaceMode = deinterlaceDefault;
+    cfg->doubleRate = doubleRateDefault;
+    for (int i = 0; i < num_attribs; i++) {
+      LOG_TRACE("got config attrib: %d %d %d", i, attrib_list[i].type, attrib_list[i].value);
+      if (attrib_list[i].type == VAConfigAttribNVDIntraOnly) {
+          cfg->intraOnly = attrib_list[i].value != 0;
+      } else if (attrib_list[i].type == VAConfigAttribNVDDeinterlace) {
+          uint32_t mode = attrib_list[i].value & ~NVD_DEINTERLACE_DOUBLE_RATE;
+          if (mode > cudaVideoDeinterlaceMode_Adaptive) {
+              LOG("Unknown deinterlace mode: %u", mode);
+              deleteObject(drv, obj->id);
+              return VA_STATUS_ERROR_INVALID_VALUE;
+          }
+          cfg->deinterlaceMode = (cudaVideoDeinterlaceMode) mode;
+          cfg->doubleRate = mode != cudaVideoDeinterlaceMode_Weave && (attrib_list[i].value & NVD_DEINTERLACE_DOUBLE_RATE) != 0;
+      } else if (attrib_list[i].type == VAConfigAttribDecProcessing) {
+          cfg->decProcessing = attrib_list[i].value == VA_DEC_PROCESSING;
+      }
+    }
+    cfg->cudaCodec = cudaCodec;
+    cfg->chromaFormat = cudaVideoChromaFormat_420;
+    cfg->surfaceFormat = cudaVideoSurfaceFormat_NV12;
+    cfg->bitDepth = 8;
+    if (drv->supports16BitSurface) {
+        switch(cfg->profile) {
+        case VAProfileHEVCMain10:
+            cfg->surfaceFormat = cudaVideoSurfaceFormat_P016;
+            cfg->bitDepth = 10;
+            break;
+        case VAProfileHEVCMain12:
+            cfg->surfaceFormat = cudaVideoSurfaceFormat_P016;
+            cfg->bitDepth = 12;
+            break;
+        case VAProfileVP9Profile2:
+        case VAProfileAV1Profile0:
+            if (num_attribs > 0 && attrib_list[0].type == VAConfigAttribRTFormat) {
+                switch(attrib_list[0].value) {
+                case VA_RT_FORMAT_YUV420_12:
+                    cfg->surfaceFormat = cudaVideoSurfaceFormat_P016;
+                    cfg->bitDepth = 12;
+                    break;
+                case VA_RT_FORMAT_YUV420_10:
+                    cfg->surfaceFormat = cudaVideoSurfaceFormat_P016;
+                    cfg->bitDepth = 10;
+                    break;
+                default:
+                    break;
+                }
+            } else {
+                if (cfg->profile == VAProfileVP9Profile2) {
+                    cfg->surfaceFormat = cudaVideoSurfaceFormat_P016;
+                    cfg->bitDepth = 10;
+                } else {
+                    LOG("Unable to determine surface type for VP9/AV1 codec due to no RTFormat specified.");
+                }
+            }
+        default:
+            break;
+        }
+    }
+    if (drv->supports444Surface) {
+        switch(cfg->profile) {
+        case VAProfileHEVCMain444:
+        case VAProfileVP9Profile1:
+        case VAProfileAV1Profile1:
+            cfg->surfaceFormat = cudaVideoSurfaceFormat_YUV444;
+            cfg->chromaFormat = cudaVideoChromaFormat_444;
+            cfg->bitDepth = 8;
+            break;
+        default:
+            break;
+        }
+    }
+    if (drv->supports444Surface && drv->supports16BitSurface) {
+        switch(cfg->profile) {
+        case VAProfileHEVCMain444_10:
+            cfg->surfaceFormat = cudaVideoSurfaceFormat_YUV444_16Bit;
+            cfg->chromaFormat = cudaVideoChromaFormat_444;
+            cfg->bitDepth = 10;
+            break;
+        case VAProfileHEVCMain444_12:
+            cfg->surfaceFormat = cudaVideoSurfaceFormat_YUV444_16Bit;
+            cfg->chromaFormat = cudaVideoChromaFormat_444;
+            cfg->bitDepth = 12;
+            break;
         case VAProfileVP9Profile3:
         case VAProfileAV1Profile1:
             if (num_attribs > 0 && attrib_list[0].type == VAConfigAttribRTFormat) {
@@ -765,452 +2463,1805 @@ static VAStatus nvCreateConfig(
             break;
         }
     }
-    *config_id = obj->id;
+    *config_id = obj->id;
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus nvDestroyConfig(
+        VADriverContextP ctx,
+        VAConfigID config_id
+    )
+{
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    deleteObject(drv, config_id);
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus nvQueryConfigAttributes(
+        VADriverContextP ctx,
+        VAConfigID config_id,
+        VAProfile *profile,		/* out */
+        VAEntrypoint *entrypoint, 	/* out */
+        VAConfigAttrib *attrib_list,	/* out */
+        int *num_attribs		/* out */
+    )
+{
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    NVConfig *cfg = (NVConfig*) getObjectPtr(drv, config_id);
+    if (cfg == NULL) {
+        return VA_STATUS_ERROR_INVALID_CONFIG;
+    }
+    *profile = cfg->profile;
+    *entrypoint = cfg->entrypoint;
+    if (cfg->entrypoint == VAEntrypointVideoProc) {
+        attrib_list[0].type = VAConfigAttribRTFormat;
+        attrib_list[0].value = videoProcRTFormats(drv);
+        *num_attribs = 1;
+        return VA_STATUS_SUCCESS;
+    }
+    if (cfg->entrypoint == VAEntrypointEncSlice) {
+        attrib_list[0].type = VAConfigAttribRTFormat;
+        attrib_list[0].value = cfg->bitDepth > 8 ? VA_RT_FORMAT_YUV420_10 : VA_RT_FORMAT_YUV420;
+        *num_attribs = 1;
+        if (cfg->rateControl != 0) {
+            attrib_list[*num_attribs].type = VAConfigAttribRateControl;
+            attrib_list[*num_attribs].value = cfg->rateControl;
+            (*num_attribs)++;
+        }
+        if (cfg->lowLatency) {
+            attrib_list[*num_attribs].type = VAConfigAttribNVDLowLatency;
+            attrib_list[*num_attribs].value = 1;
+            (*num_attribs)++;
+        }
+        return VA_STATUS_SUCCESS;
+    }
+    int i = 0;
+    attrib_list[i].value = VA_RT_FORMAT_YUV420;
+    attrib_list[i].type = VAConfigAttribRTFormat;
+    switch (cfg->profile) {
+    case VAProfileHEVCMain12:
+    case VAProfileVP9Profile2:
+        attrib_list[i].value |= VA_RT_FORMAT_YUV420_12;
+    case VAProfileHEVCMain10:
+    case VAProfileAV1Profile0:
+        attrib_list[i].value |= VA_RT_FORMAT_YUV420_10;
+        break;
+    case VAProfileHEVCMain444_12:
+    case VAProfileVP9Profile3:
+        attrib_list[i].value |= VA_RT_FORMAT_YUV444_12 | VA_RT_FORMAT_YUV420_12;
+    case VAProfileHEVCMain444_10:
+    case VAProfileAV1Profile1:
+        attrib_list[i].value |= VA_RT_FORMAT_YUV444_10 | VA_RT_FORMAT_YUV420_10;
+    case VAProfileHEVCMain444:
+    case VAProfileVP9Profile1:
+        attrib_list[i].value |= VA_RT_FORMAT_YUV444;
+        break;
+    default:
+        break;
+    }
+    if (!drv->supports16BitSurface) {
+        attrib_list[i].value &= ~(VA_RT_FORMAT_YUV420_10 | VA_RT_FORMAT_YUV420_12 | VA_RT_FORMAT_YUV444_10 | VA_RT_FORMAT_YUV444_12);
+    }
+    if (!drv->supports444Surface) {
+        attrib_list[i].value &= ~(VA_RT_FORMAT_YUV444 | VA_RT_FORMAT_YUV444_10 | VA_RT_FORMAT_YUV444_12);
+    }
+    i++;
+    if (cfg->intraOnly) {
+        attrib_list[i].type = VAConfigAttribNVDIntraOnly;
+        attrib_list[i].value = 1;
+        i++;
+    }
+    if (cfg->deinterlaceMode != cudaVideoDeinterlaceMode_Weave) {
+        attrib_list[i].type = VAConfigAttribNVDDeinterlace;
+        attrib_list[i].value = (uint32_t) cfg->deinterlaceMode | (cfg->doubleRate ? NVD_DEINTERLACE_DOUBLE_RATE : 0);
+        i++;
+    }
+    if (cfg->decProcessing) {
+        attrib_list[i].type = VAConfigAttribDecProcessing;
+        attrib_list[i].value = VA_DEC_PROCESSING;
+        i++;
+    }
+    *num_attribs = i;
+    return VA_STATUS_SUCCESS;
+}
+
+//Surfaces can only take the layout CUDA picks for their size when it imports the backing image, which is always
+//block-linear, so a client's modifier list can't steer it, only be checked against it
+static bool surfaceModifierAllowed(NVDriver *drv, const VADRMFormatModifierList *list, uint32_t height, uint32_t chromaHeight) {
+    if (backend != DIRECT) {
+        //the egl backend only finds out the modifier once a frame has been through the stream
+        LOG("Ignoring modifier list, only the direct backend can check it");
+        return true;
+    }
+    //each plane's block height comes from it's own height, so the chroma planes can need a different modifier
+    const uint32_t heights[] = { height, chromaHeight };
+    for (uint32_t p = 0; p < 2; p++) {
+        uint64_t modifier = get_image_modifier(&drv->driverContext, heights[p]);
+        bool found = false;
+        for (uint32_t i = 0; !found && i < list->num_modifiers; i++) {
+            found = list->modifiers[i] == modifier;
+        }
+        if (!found) {
+            LOG("None of the %u modifiers offered match the surface's layout, %" PRIx64, list->num_modifiers, modifier);
+            return false;
+        }
+    }
+    return true;
+}
+
+static VAStatus nvCreateSurfaces2(
+            VADriverContextP    ctx,
+            unsigned int        format,
+            unsigned int        width,
+            unsigned int        height,
+            VASurfaceID        *surfaces,
+            unsigned int        num_surfaces,
+            VASurfaceAttrib    *attrib_list,
+            unsigned int        num_attribs
+        )
+{
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    if (!initialiseCuda(drv)) {
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+    cudaVideoSurfaceFormat nvFormat;
+    cudaVideoChromaFormat chromaFormat;
+    int bitdepth;
+    switch (format)
+    {
+    case VA_RT_FORMAT_YUV420:
+        nvFormat = cudaVideoSurfaceFormat_NV12;
+        chromaFormat = cudaVideoChromaFormat_420;
+        bitdepth = 8;
+        break;
+    case VA_RT_FORMAT_YUV420_10:
+        nvFormat = cudaVideoSurfaceFormat_P016;
+        chromaFormat = cudaVideoChromaFormat_420;
+        bitdepth = 10;
+        break;
+    case VA_RT_FORMAT_YUV420_12:
+        nvFormat = cudaVideoSurfaceFormat_P016;
+        chromaFormat = cudaVideoChromaFormat_420;
+        bitdepth = 12;
+        break;
+    case VA_RT_FORMAT_YUV444:
+        nvFormat = cudaVideoSurfaceFormat_YUV444;
+        chromaFormat = cudaVideoChromaFormat_444;
+        bitdepth = 8;
+        break;
+    case VA_RT_FORMAT_YUV444_10:
+        nvFormat = cudaVideoSurfaceFormat_YUV444_16Bit;
+        chromaFormat = cudaVideoChromaFormat_444;
+        bitdepth = 10;
+        break;
+    case VA_RT_FORMAT_YUV444_12:
+        nvFormat = cudaVideoSurfaceFormat_YUV444_16Bit;
+        chromaFormat = cudaVideoChromaFormat_444;
+        bitdepth = 12;
+        break;
+    case VA_RT_FORMAT_RGB32:
+        //never decoded into, the decoder format just has to be one that no chroma rounding applies to
+        nvFormat = cudaVideoSurfaceFormat_YUV444;
+        chromaFormat = cudaVideoChromaFormat_444;
+        bitdepth = 8;
+        break;
+    default:
+        LOG("Unknown format: %X", format);
+        return VA_STATUS_ERROR_UNSUPPORTED_RT_FORMAT;
+    }
+    NVFormat rgbFormat = NV_FORMAT_NONE;
+    if (format == VA_RT_FORMAT_RGB32) {
+        //the egl backend only knows how to export YUV surfaces
+        if (backend == EGL) {
+            LOG("RGB surfaces need the direct backend");
+            return VA_STATUS_ERROR_UNSUPPORTED_RT_FORMAT;
+        }
+        rgbFormat = NV_FORMAT_BGRA;
+        for (unsigned int i = 0; i < num_attribs; i++) {
+            if (attrib_list[i].type == VASurfaceAttribPixelFormat) {
+                rgbFormat = nvFormatFromVaFormat((uint32_t) attrib_list[i].value.value.i);
+            }
+        }
+        if (!formatsInfo[rgbFormat].isRgb) {
+            LOG("Unsupported RGB pixel format");
+            return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
+        }
+    }
+    switch(chromaFormat) {
+        case cudaVideoChromaFormat_422:
+            width = ROUND_UP(width, 2);
+            break;
+        case cudaVideoChromaFormat_420:
+            width = ROUND_UP(width, 2);
+            height = ROUND_UP(height, 2);
+            break;
+        default:
+            break;
+    }
+    uint32_t memoryType = VA_SURFACE_ATTRIB_MEM_TYPE_VA;
+    const VADRMPRIMESurfaceDescriptor *importDesc = NULL;
+    for (unsigned int i = 0; i < num_attribs; i++) {
+        if (attrib_list[i].type == VASurfaceAttribDRMFormatModifiers && attrib_list[i].value.value.p != NULL
+                && !surfaceModifierAllowed(drv, (const VADRMFormatModifierList*) attrib_list[i].value.value.p, height,
+                                        chromaFormat == cudaVideoChromaFormat_420 ? height / 2 : height)) {
+            return VA_STATUS_ERROR_ATTR_NOT_SUPPORTED;
+        } else if (attrib_list[i].type == VASurfaceAttribMemoryType) {
+            memoryType = (uint32_t) attrib_list[i].value.value.i;
+        } else if (attrib_list[i].type == VASurfaceAttribExternalBufferDescriptor) {
+            importDesc = (const VADRMPRIMESurfaceDescriptor*) attrib_list[i].value.value.p;
+        }
+    }
+    if (memoryType != VA_SURFACE_ATTRIB_MEM_TYPE_VA && memoryType != VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2) {
+        LOG("Unsupported surface memory type: %X", memoryType);
+        return VA_STATUS_ERROR_UNSUPPORTED_MEMORY_TYPE;
+    }
+    if (memoryType == VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2) {
+        if (drv->backend->importBackingImage == NULL) {
+            LOG("Importing dma-bufs needs the direct backend");
+            return VA_STATUS_ERROR_UNSUPPORTED_MEMORY_TYPE;
+        }
+        //a descriptor only describes the one buffer
+        if (importDesc == NULL || num_surfaces != 1) {
+            return VA_STATUS_ERROR_INVALID_PARAMETER;
+        }
+    } else {
+        importDesc = NULL;
+    }
+    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
+    for (uint32_t i = 0; i < num_surfaces; i++) {
+        Object surfaceObject = allocateObject(drv, OBJECT_TYPE_SURFACE, sizeof(NVSurface));
+        if (surfaceObject == NULL) {
+            for (uint32_t j = 0; j < i; j++) {
+                deleteObject(drv, surfaces[j]);
+            }
+            CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), VA_STATUS_ERROR_OPERATION_FAILED);
+            return VA_STATUS_ERROR_ALLOCATION_FAILED;
+        }
+        surfaces[i] = surfaceObject->id;
+        NVSurface *suf = (NVSurface*) surfaceObject->obj;
+        suf->id = surfaceObject->id;
+        suf->width = width;
+        suf->height = height;
+        suf->format = nvFormat;
+        suf->pictureIdx = -1;
+        suf->bitDepth = bitdepth;
+        suf->context = NULL;
+        suf->chromaFormat = chromaFormat;
+        suf->rgbFormat = rgbFormat;
+        pthread_mutex_init(&suf->mutex, NULL);
+        pthread_cond_init(&suf->cond, NULL);
+        CHECK_CUDA_RESULT(cu->cuEventCreate(&suf->resolveEvent, CU_EVENT_DISABLE_TIMING | CU_EVENT_BLOCKING_SYNC));
+        if (importDesc != NULL) {
+            if (!drv->backend->importBackingImage(drv, suf, importDesc)) {
+                if (suf->resolveEvent != NULL) {
+                    CHECK_CUDA_RESULT(cu->cuEventDestroy(suf->resolveEvent));
+                }
+                deleteObject(drv, surfaces[i]);
+                CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), VA_STATUS_ERROR_OPERATION_FAILED);
+                return VA_STATUS_ERROR_ATTR_NOT_SUPPORTED;
+            }
+            //frames are resolved straight into the client's buffer rather than waiting for an export
+            suf->exported = true;
+        }
+        LOG_TRACE("Creating surface %dx%d, format %X (%p)", width, height, format, suf);
+    }
+    drv->surfaceCount += num_surfaces;
+    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), VA_STATUS_ERROR_OPERATION_FAILED);
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus nvCreateSurfaces(
+        VADriverContextP ctx,
+        int width,
+        int height,
+        int format,
+        int num_surfaces,
+        VASurfaceID *surfaces		/* out */
+    )
+{
+    return nvCreateSurfaces2(ctx, format, width, height, surfaces, num_surfaces, NULL, 0);
+}
+
+static VAStatus nvDestroySurfaces(
+        VADriverContextP ctx,
+        VASurfaceID *surface_list,
+        int num_surfaces
+    )
+{
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    VAStatus status = VA_STATUS_SUCCESS;
+    int destroyed = 0;
+    for (int i = 0; i < num_surfaces; i++) {
+        NVSurface *surface = (NVSurface*) getObjectPtr(drv, surface_list[i]);
+        if (surface == NULL) {
+            //already destroyed or never created, the rest of the list is still destroyed
+            LOG("Unable to destroy unknown surface: %d", surface_list[i]);
+            status = VA_STATUS_ERROR_INVALID_SURFACE;
+            continue;
+        }
+        LOG_TRACE("Destroying surface %d (%p)", surface->pictureIdx, surface);
+        forgetEncoderInputs(drv, surface);
+        drv->backend->detachBackingImageFromSurface(drv, surface);
+        freeCudaFrame(drv, surface);
+        freeHostFrame(drv, surface);
+        if (surface->resolveEvent != NULL && !CHECK_CUDA_RESULT(cu->cuCtxPushCurrent(drv->cudaContext))) {
+            CHECK_CUDA_RESULT(cu->cuEventDestroy(surface->resolveEvent));
+            CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+        }
+        if (surface->fence != NULL) {
+            releaseSurfaceFence(surface->fence);
+        }
+        deleteObject(drv, surface_list[i]);
+        destroyed++;
+    }
+    drv->surfaceCount = MAX(drv->surfaceCount - destroyed, 0);
+    return status;
+}
+
+static void *realiseRenderTargets(void *param) {
+    NVContext *ctx = (NVContext*) param;
+    NVDriver *drv = ctx->drv;
+    if (CHECK_CUDA_RESULT(cu->cuCtxPushCurrent(drv->cudaContext))) {
+        return NULL;
+    }
+    int realised = 0;
+    for (int i = 0; i < ctx->realiseTargetCount && !ctx->exiting; i++) {
+        NVSurface *surface = (NVSurface*) getObjectPtr(drv, ctx->realiseTargets[i]);
+        //the application may have destroyed it already, that's not our problem
+        uint64_t start = statsStart(ctx->stats);
+        if (surface != NULL && realiseSurfaceStorage(drv, surface)) {
+            statsRecord(ctx->stats, NV_STAT_REALISE, start);
+            realised++;
+        }
+    }
+    LOG("Realised %d of %d render targets", realised, ctx->realiseTargetCount);
+    CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+    return NULL;
+}
+
+//the display area has to cover whole chroma samples
+static void alignToChroma(cudaVideoChromaFormat chromaFormat, int *width, int *height) {
+    switch(chromaFormat) {
+        case cudaVideoChromaFormat_422:
+            *width = ROUND_UP(*width, 2);
+            break;
+        case cudaVideoChromaFormat_420:
+            *width = ROUND_UP(*width, 2);
+            *height = ROUND_UP(*height, 2);
+            break;
+        default:
+            break;
+    }
+}
+
+//video processing contexts don't decode anything, they only need this for nvCreateBuffer and deinitCodecContext.
+//The pipeline buffer is picked up directly by nvRenderPicture
+static const NVCodec videoProcCodec = { .computeCudaCodec = NULL };
+static const NVCodec encodeCodec = { .computeCudaCodec = NULL };
+
+static VAStatus createVideoProcContext(NVDriver *drv, NVConfig *cfg, int width, int height, VAContextID *context) {
+    CUstream stream = NULL;
+    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
+    bool loaded = ensureKernels(cu, &drv->kernels);
+    CUresult streamResult = loaded ? cu->cuStreamCreate(&stream, CU_STREAM_NON_BLOCKING) : CUDA_SUCCESS;
+    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), VA_STATUS_ERROR_OPERATION_FAILED);
+    if (!loaded) {
+        LOG("Unable to load video processing kernels");
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+    CHECK_CUDA_RESULT_RETURN(streamResult, VA_STATUS_ERROR_ALLOCATION_FAILED);
+    Object contextObj = allocateObject(drv, OBJECT_TYPE_CONTEXT, sizeof(NVContext));
+    if (contextObj == NULL) {
+        cu->cuStreamDestroy(stream);
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+    NVContext *nvCtx = (NVContext*) contextObj->obj;
+    nvCtx->drv = drv;
+    nvCtx->id = contextObj->id;
+    nvCtx->profile = cfg->profile;
+    nvCtx->entrypoint = cfg->entrypoint;
+    nvCtx->width = width;
+    nvCtx->height = height;
+    nvCtx->codec = &videoProcCodec;
+    nvCtx->stream = stream;
+    nvCtx->videoProc = true;
+    initBufferPool(&nvCtx->bufferPool);
+    nvCtx->stats = statsCreate("vpp", contextObj->id);
+    LOG("Created video processing context %d", contextObj->id);
+    *context = contextObj->id;
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus createEncodeContext(NVDriver *drv, NVConfig *cfg, int width, int height, VAContextID *context) {
+    CUstream stream = NULL;
+    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
+    CUresult streamResult = cu->cuStreamCreate(&stream, CU_STREAM_NON_BLOCKING);
+    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), VA_STATUS_ERROR_OPERATION_FAILED);
+    CHECK_CUDA_RESULT_RETURN(streamResult, VA_STATUS_ERROR_ALLOCATION_FAILED);
+    Object contextObj = allocateObject(drv, OBJECT_TYPE_CONTEXT, sizeof(NVContext));
+    if (contextObj == NULL) {
+        cu->cuStreamDestroy(stream);
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+    NVContext *nvCtx = (NVContext*) contextObj->obj;
+    nvCtx->drv = drv;
+    nvCtx->id = contextObj->id;
+    nvCtx->profile = cfg->profile;
+    nvCtx->entrypoint = cfg->entrypoint;
+    nvCtx->width = width;
+    nvCtx->height = height;
+    nvCtx->codec = &encodeCodec;
+    nvCtx->stream = stream;
+    initBufferPool(&nvCtx->bufferPool);
+    VAStatus status = VA_STATUS_ERROR_OPERATION_FAILED;
+    if (!CHECK_CUDA_RESULT(cu->cuCtxPushCurrent(drv->cudaContext))) {
+        status = nvencCreateEncoder(nvCtx, cfg);
+        CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+    }
+    if (status != VA_STATUS_SUCCESS) {
+        LOG("Unable to create encoder");
+        cu->cuStreamDestroy(stream);
+        deleteObject(drv, contextObj->id);
+        return status;
+    }
+    nvCtx->stats = statsCreate("encode", contextObj->id);
+    LOG("Created encode context %d", contextObj->id);
+    *context = contextObj->id;
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus nvCreateContext(
+        VADriverContextP ctx,
+        VAConfigID config_id,
+        int picture_width,
+        int picture_height,
+        int flag,
+        VASurfaceID *render_targets,
+        int num_render_targets,
+        VAContextID *context		/* out */
+    )
+{
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    NVConfig *cfg = (NVConfig*) getObjectPtr(drv, config_id);
+    if (cfg == NULL) {
+        return VA_STATUS_ERROR_INVALID_CONFIG;
+    }
+    LOG("creating context with %d render targets, %d surfaces, at %dx%d", num_render_targets, drv->surfaceCount, picture_width, picture_height);
+    if (cfg->entrypoint == VAEntrypointVideoProc) {
+        return createVideoProcContext(drv, cfg, picture_width, picture_height, context);
+    }
+    if (cfg->entrypoint == VAEntrypointEncSlice) {
+        return createEncodeContext(drv, cfg, picture_width, picture_height, context);
+    }
+    const NVCodec *selectedCodec = getProfileInfo(cfg->profile)->codec;
+    if (selectedCodec == NULL) {
+        LOG("Unable to find codec for profile: %d", cfg->profile);
+        return VA_STATUS_ERROR_UNSUPPORTED_PROFILE;
+    }
+    int targetWidth = picture_width;
+    int targetHeight = picture_height;
+    if (num_render_targets) {
+        NVSurface *surface = (NVSurface *) getObjectPtr(drv, render_targets[0]);
+        if (!surface) {
+            return VA_STATUS_ERROR_INVALID_PARAMETER;
+        }
+        if (surface->rgbFormat != NV_FORMAT_NONE) {
+            LOG("Unable to decode into RGB surfaces");
+            return VA_STATUS_ERROR_UNSUPPORTED_RT_FORMAT;
+        }
+        cfg->surfaceFormat = surface->format;
+        cfg->chromaFormat = surface->chromaFormat;
+        cfg->bitDepth = surface->bitDepth;
+        if (cfg->decProcessing) {
+            //the render targets are the size of the output, NVDEC scales to them as the frame leaves the decoder
+            targetWidth = (int) surface->width;
+            targetHeight = (int) surface->height;
+        }
+    }
+    int surfaceCount = num_render_targets > 0 ? num_render_targets : 32;
+    if (surfaceCount > 32) {
+        LOG_WARN("Application requested %d surface(s), limiting to 32. This may cause issues.", surfaceCount);
+        surfaceCount = 32;
+    }
+    //having more than one output surface lets the resolve thread map a frame while the previous one is still being copied
+    int numOutputSurfaces = outputSurfaces > 0 ? outputSurfaces : MIN(MAX(surfaceCount / 4, 2), 4);
+    LOG("Using %d output surfaces", numOutputSurfaces);
+    if (cfg->intraOnly) {
+        //nothing is kept for reference, so only the pictures in flight need a decode surface,
+        //see surfaceQueueFull for how many that's allowed to be
+        surfaceCount = numOutputSurfaces + INTRA_SPARE_DECODE_SURFACES;
+        LOG("Creating intra only decoder with %d decode surfaces", surfaceCount);
+    }
+    cudaVideoDeinterlaceMode deinterlaceMode = cfg->deinterlaceMode;
+    if (deinterlaceMode != cudaVideoDeinterlaceMode_Weave && !interlacedCodec(cfg->cudaCodec)) {
+        //nothing to deinterlace, and NVDEC rejects it for some of the progressive only codecs
+        deinterlaceMode = cudaVideoDeinterlaceMode_Weave;
+    }
+    int display_area_width = picture_width;
+    int display_area_height = picture_height;
+    alignToChroma(cfg->chromaFormat, &display_area_width, &display_area_height);
+    CUVIDDECODECREATEINFO vdci = {
+        .ulWidth             = vdci.ulMaxWidth  = picture_width,
+        .ulHeight            = vdci.ulMaxHeight = picture_height,
+        .ulTargetWidth       = targetWidth,
+        .ulTargetHeight      = targetHeight,
+        .CodecType           = cfg->cudaCodec,
+        .ulCreationFlags     = cudaVideoCreate_PreferCUVID,
+        .ulIntraDecodeOnly   = cfg->intraOnly,
+        .display_area.right  = display_area_width,
+        .display_area.bottom = display_area_height,
+        .ChromaFormat        = cfg->chromaFormat,
+        .OutputFormat        = cfg->surfaceFormat,
+        .bitDepthMinus8      = cfg->bitDepth - 8,
+        .DeinterlaceMode     = deinterlaceMode,
+        .ulNumOutputSurfaces = numOutputSurfaces,
+        .ulNumDecodeSurfaces = surfaceCount,
+    };
+    uint32_t headroomWidth = 0, headroomHeight = 0;
+    if (selectedCodec->resizableDecoder) {
+        headroomWidth = resizableMaxWidth;
+        headroomHeight = resizableMaxHeight;
+    } else if (selectedCodec->adaptiveDecoder) {
+        headroomWidth = adaptiveMaxWidth;
+        headroomHeight = adaptiveMaxHeight;
+    }
+    if (headroomWidth > (uint32_t) picture_width || headroomHeight > (uint32_t) picture_height) {
+        //leave room for pictures to grow, so a change of size is a reconfigure rather than a new context
+        uint32_t maxWidth = 0, maxHeight = 0;
+        doesGPUSupportCodec(drv, cfg->cudaCodec, cfg->bitDepth, cfg->chromaFormat, &maxWidth, &maxHeight);
+        vdci.ulMaxWidth = MAX((uint32_t) picture_width, MIN(maxWidth, headroomWidth));
+        vdci.ulMaxHeight = MAX((uint32_t) picture_height, MIN(maxHeight, headroomHeight));
+        LOG("Creating resizable decoder, up to %lux%lu", (unsigned long) vdci.ulMaxWidth, (unsigned long) vdci.ulMaxHeight);
+    }
+    //claimed before the decoder is created, so a busy GPU is reported before anything is allocated on it
+    int gpuSession = 0;
+    uint8_t uuid[16];
+    if (getCachedDeviceUuid(drv->capsTable, uuid)) {
+        uint64_t pixels = (uint64_t) (vdci.ulNumDecodeSurfaces + vdci.ulNumOutputSurfaces) * vdci.ulMaxWidth * vdci.ulMaxHeight;
+        gpuSession = acquireGpuSession(uuid, &sessionLimits, pixels);
+        if (gpuSession == -1) {
+            return VA_STATUS_ERROR_HW_BUSY;
+        }
+    }
+    drv->surfaceCount = 0;
+    CUvideodecoder decoder;
+    CUVIDDECODECREATEINFO wanted = vdci;
+    if (CHECK_CUDA_RESULT(createDecoder(drv, &wanted, &vdci, &decoder))) {
+        releaseGpuSession(gpuSession);
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+    //from here on a failure goes to fail, which undoes whatever has been set up so far in reverse
+    VAStatus status = VA_STATUS_ERROR_ALLOCATION_FAILED;
+    Object contextObj = NULL;
+    NVContext *nvCtx = NULL;
+    bool codecInitialised = false;
+    //each context gets it's own stream so the copies of separate decode sessions don't serialise on stream 0
+    CUstream stream = NULL;
+    if (CHECK_CUDA_RESULT(cu->cuCtxPushCurrent(drv->cudaContext))) {
+        status = VA_STATUS_ERROR_OPERATION_FAILED;
+        goto fail;
+    }
+    CUresult streamResult = cu->cuStreamCreate(&stream, CU_STREAM_NON_BLOCKING);
+    if (CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL))) {
+        status = VA_STATUS_ERROR_OPERATION_FAILED;
+        goto fail;
+    }
+    if (CHECK_CUDA_RESULT(streamResult)) {
+        stream = NULL;
+        goto fail;
+    }
+    contextObj = allocateObject(drv, OBJECT_TYPE_CONTEXT, sizeof(NVContext));
+    if (contextObj == NULL) {
+        goto fail;
+    }
+    nvCtx = (NVContext*) contextObj->obj;
+    nvCtx->queueSpaceWakeup.fd = -1;
+    initBufferPool(&nvCtx->bufferPool);
+    pthread_mutexattr_t attrib;
+    pthread_mutexattr_init(&attrib);
+    pthread_mutexattr_settype(&attrib, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&nvCtx->surfaceCreationMutex, &attrib);
+    pthread_mutexattr_destroy(&attrib);
+    nvCtx->drv = drv;
+    nvCtx->id = contextObj->id;
+    nvCtx->gpuSession = gpuSession;
+    nvCtx->decoder = decoder;
+    nvCtx->decoderInfo = vdci;
+    nvCtx->stream = stream;
+    nvCtx->numOutputSurfaces = numOutputSurfaces;
+    nvCtx->profile = cfg->profile;
+    nvCtx->entrypoint = cfg->entrypoint;
+    nvCtx->width = picture_width;
+    nvCtx->height = picture_height;
+    nvCtx->codec = selectedCodec;
+    if (selectedCodec->initContext != NULL && !selectedCodec->initContext(nvCtx)) {
+        LOG("Unable to initialise codec state");
+        goto fail;
+    }
+    codecInitialised = true;
+    nvCtx->surfaceCount = surfaceCount;
+    nvCtx->intraOnly = cfg->intraOnly;
+    nvCtx->deinterlaceMode = deinterlaceMode;
+    nvCtx->doubleRate = deinterlaceMode != cudaVideoDeinterlaceMode_Weave && cfg->doubleRate;
+    nvCtx->decProcessing = cfg->decProcessing;
+    nvCtx->bitstreamBuffer.hostContext = drv->cudaContext;
+    nvCtx->sliceOffsets.hostContext = drv->cudaContext;
+    nvCtx->sliceArena.hostContext = drv->cudaContext;
+    if (!spsc_queue_init(&nvCtx->surfaceQueue, surfaceQueueDepth) || !initWakeup(&nvCtx->queueSpaceWakeup)) {
+        LOG("Unable to create surface queue");
+        goto fail;
+    }
+    NVResolvePool *resolvePool = resolvePoolGet(drv->cudaGpuId, drv->drmFd);
+    if (resolvePool == NULL) {
+        LOG("Unable to start the resolve workers");
+        status = VA_STATUS_ERROR_OPERATION_FAILED;
+        goto fail;
+    }
+    if (CHECK_CUDA_RESULT(cu->cuCtxPushCurrent(drv->cudaContext))) {
+        status = VA_STATUS_ERROR_OPERATION_FAILED;
+        goto fail;
+    }
+    for (int i = 0; i < nvCtx->numOutputSurfaces; i++) {
+        CHECK_CUDA_RESULT(cu->cuEventCreate(&nvCtx->mappedFrames[i].copied, CU_EVENT_DISABLE_TIMING | CU_EVENT_BLOCKING_SYNC));
+    }
+    if (CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL))) {
+        status = VA_STATUS_ERROR_OPERATION_FAILED;
+        goto fail;
+    }
+    atomic_init(&nvCtx->resolveIdle, true);
+    resolveJobInit(&nvCtx->resolveJob, resolvePool, &resolveSurfaces, nvCtx);
+    nvCtx->stats = statsCreate("decode", contextObj->id);
+    int err;
+    if (preallocateSurfaces && num_render_targets > 0) {
+        //take a copy of the ids, the worker looks each one up again so it never touches a destroyed surface
+        nvCtx->realiseTargets = malloc(num_render_targets * sizeof(VASurfaceID));
+        if (nvCtx->realiseTargets != NULL) {
+            memcpy(nvCtx->realiseTargets, render_targets, num_render_targets * sizeof(VASurfaceID));
+            nvCtx->realiseTargetCount = num_render_targets;
+            err = pthread_create(&nvCtx->realiseThread, NULL, &realiseRenderTargets, nvCtx);
+            if (err == 0) {
+                nvCtx->realiseThreadStarted = true;
+            } else {
+                //not fatal, the surfaces will just be realised on first use
+                LOG("Unable to create realise thread: %d", err);
+            }
+        }
+    }
+    *context = contextObj->id;
+    return VA_STATUS_SUCCESS;
+
+fail:
+    if (stream != NULL && !CHECK_CUDA_RESULT(cu->cuCtxPushCurrent(drv->cudaContext))) {
+        for (int i = 0; nvCtx != NULL && i < nvCtx->numOutputSurfaces; i++) {
+            if (nvCtx->mappedFrames[i].copied != NULL) {
+                CHECK_CUDA_RESULT(cu->cuEventDestroy(nvCtx->mappedFrames[i].copied));
+            }
+        }
+        CHECK_CUDA_RESULT(cu->cuStreamDestroy(stream));
+        CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+    }
+    if (nvCtx != NULL) {
+        if (codecInitialised) {
+            deinitCodecContext(nvCtx);
+        }
+        closeWakeup(&nvCtx->queueSpaceWakeup);
+        spsc_queue_free(&nvCtx->surfaceQueue);
+        pthread_mutex_destroy(&nvCtx->surfaceCreationMutex);
+        pthread_mutex_destroy(&nvCtx->bufferPool.mutex);
+        deleteObject(drv, contextObj->id);
+    }
+    releaseDecoder(drv, &vdci, decoder);
+    releaseGpuSession(gpuSession);
+    return status;
+}
+
+static VAStatus destroyMFContext(NVDriver *drv, VAMFContextID mf_context);
+
+static VAStatus nvDestroyContext(
+        VADriverContextP ctx,
+        VAContextID context)
+{
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    LOG("Destroying context: %d", context);
+    //MF contexts are destroyed through here as well
+    Object o = getObject(drv, context);
+    if (o != NULL && o->type == OBJECT_TYPE_MF_CONTEXT) {
+        return destroyMFContext(drv, context);
+    }
+    NVContext *nvCtx = (NVContext*) getObjectPtr(drv, context);
+    if (nvCtx == NULL) {
+        return VA_STATUS_ERROR_INVALID_CONTEXT;
+    }
+    //buffers destroyed from now on are freed rather than returned to the pool that's about to be drained
+    pthread_mutex_lock(&drv->objectCreationMutex);
+    nvCtx->bufferPool.draining = true;
+    pthread_mutex_unlock(&drv->objectCreationMutex);
+    VAStatus ret = VA_STATUS_SUCCESS;
+    if (!destroyContext(drv, nvCtx)) {
+        ret = VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+    deleteObject(drv, context);
+    return ret;
+}
+
+static VAStatus nvCreateBuffer(
+        VADriverContextP ctx,
+        VAContextID context,		/* in */
+        VABufferType type,		/* in */
+        unsigned int size,		/* in */
+        unsigned int num_elements,	/* in */
+        void *data,			/* in */
+        VABufferID *buf_id
+    )
+{
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    NVContext *nvCtx = (NVContext*) getObjectPtr(drv, context);
+    if (nvCtx == NULL) {
+        return VA_STATUS_ERROR_INVALID_CONTEXT;
+    }
+    int offset = 0;
+    if (nvCtx->profile == VAProfileVP8Version0_3 && type == VASliceDataBufferType) {
+        offset = (int)(((uintptr_t)data) & 0xf);
+        data = ((char *)data) - offset;
+        size += offset;
+    }
+    size_t totalSize = (size_t) num_elements * size;
+    //buffers created on a context have their Object, NVBuffer and storage recycled through the context's pool
+    Object bufferObject = takePooledBuffer(&nvCtx->bufferPool, bufferPoolClass(type), totalSize);
+    if (bufferObject == NULL) {
+        bufferObject = (Object) calloc(1, sizeof(struct Object_t));
+        if (bufferObject == NULL) {
+            return VA_STATUS_ERROR_ALLOCATION_FAILED;
+        }
+        bufferObject->type = OBJECT_TYPE_BUFFER;
+        bufferObject->obj = calloc(1, sizeof(NVBuffer));
+        if (bufferObject->obj == NULL) {
+            free(bufferObject);
+            return VA_STATUS_ERROR_ALLOCATION_FAILED;
+        }
+    }
+    NVBuffer *buf = (NVBuffer*) bufferObject->obj;
+    buf->ptr = buf->storage;
+    //slice data gets written directly into the picture's bitstream, if that's not possible it goes into it's own storage
+    bool inArena = type == VASliceDataBufferType && nvCtx->codec->inPlaceSliceData && offset == 0
+                   && placeSliceDataInArena(nvCtx, buf, totalSize);
+    if (!inArena && buf->capacity < totalSize) {
+        free(buf->storage);
+        buf->storage = buf->ptr = memalign(16, totalSize);
+        buf->capacity = buf->storage != NULL ? totalSize : 0;
+    }
+    if (buf->ptr == NULL) {
+        LOG("Unable to allocate buffer of %zu bytes", totalSize);
+        freePooledBuffer(bufferObject);
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+    buf->bufferType = type;
+    buf->elements = num_elements;
+    buf->size = totalSize;
+    buf->offset = offset;
+    buf->context = context;
+    buf->encodePending = false;
+    buf->encodeStatus = VA_STATUS_SUCCESS;
+    if (data != NULL) {
+        memcpy(buf->ptr, data, buf->size);
+    }
+    if (!registerObject(drv, bufferObject)) {
+        if (inArena) {
+            removeSliceDataFromArena(nvCtx, buf);
+        }
+        freePooledBuffer(bufferObject);
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+    *buf_id = bufferObject->id;
     return VA_STATUS_SUCCESS;
 }
 
-static VAStatus nvDestroyConfig(
+static VAStatus nvBufferSetNumElements(
         VADriverContextP ctx,
-        VAConfigID config_id
+        VABufferID buf_id,	/* in */
+        unsigned int num_elements	/* in */
     )
 {
-    NVDriver *drv = (NVDriver*) ctx->pDriverData;
-    deleteObject(drv, config_id);
-    return VA_STATUS_SUCCESS;
+    return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
-static VAStatus nvQueryConfigAttributes(
+static VAStatus nvSyncSurface(VADriverContextP ctx, VASurfaceID render_target);
+
+//the encoder of the context a coded buffer was created on, NULL for every other buffer
+static NVContext *codedBufferEncoder(NVDriver *drv, const NVBuffer *buf) {
+    if (buf->bufferType != VAEncCodedBufferType) {
+        return NULL;
+    }
+    NVContext *nvCtx = (NVContext*) getObjectPtr(drv, buf->context);
+    return nvCtx != NULL && nvCtx->encoder != NULL ? nvCtx : NULL;
+}
+
+static VAStatus nvMapBuffer(
         VADriverContextP ctx,
-        VAConfigID config_id,
-        VAProfile *profile,		/* out */
-        VAEntrypoint *entrypoint, 	/* out */
-        VAConfigAttrib *attrib_list,	/* out */
-        int *num_attribs		/* out */
+        VABufferID buf_id,	/* in */
+        void **pbuf         /* out */
     )
 {
     NVDriver *drv = (NVDriver*) ctx->pDriverData;
-    NVConfig *cfg = (NVConfig*) getObjectPtr(drv, config_id);
-    if (cfg == NULL) {
-        return VA_STATUS_ERROR_INVALID_CONFIG;
+    NVBuffer *buf = getObjectPtr(drv, buf_id);
+    if (buf == NULL) {
+        return VA_STATUS_ERROR_INVALID_BUFFER;
     }
-    *profile = cfg->profile;
-    *entrypoint = cfg->entrypoint;
-    int i = 0;
-    attrib_list[i].value = VA_RT_FORMAT_YUV420;
-    attrib_list[i].type = VAConfigAttribRTFormat;
-    switch (cfg->profile) {
-    case VAProfileHEVCMain12:
-    case VAProfileVP9Profile2:
-        attrib_list[i].value |= VA_RT_FORMAT_YUV420_12;
-    case VAProfileHEVCMain10:
-    case VAProfileAV1Profile0:
-        attrib_list[i].value |= VA_RT_FORMAT_YUV420_10;
-        break;
-    case VAProfileHEVCMain444_12:
-    case VAProfileVP9Profile3:
-        attrib_list[i].value |= VA_RT_FORMAT_YUV444_12 | VA_RT_FORMAT_YUV420_12;
-    case VAProfileHEVCMain444_10:
-    case VAProfileAV1Profile1:
-        attrib_list[i].value |= VA_RT_FORMAT_YUV444_10 | VA_RT_FORMAT_YUV420_10;
-    case VAProfileHEVCMain444:
-    case VAProfileVP9Profile1:
-        attrib_list[i].value |= VA_RT_FORMAT_YUV444;
-        break;
-    default:
-        break;
+    if (buf->hostFrame != NULL) {
+        //stops the resolve thread writing the next frame under the client, then waits for the latest one to land
+        atomic_fetch_add(&buf->hostFrame->mapped, 1);
+        VAStatus status = nvSyncSurface(ctx, buf->derivedSurface);
+        if (status != VA_STATUS_SUCCESS) {
+            //the frame never landed, so the client doesn't get a pointer to it and the copy can be written again
+            atomic_fetch_sub(&buf->hostFrame->mapped, 1);
+            return status;
+        }
     }
-    if (!drv->supports16BitSurface) {
-        attrib_list[i].value &= ~(VA_RT_FORMAT_YUV420_10 | VA_RT_FORMAT_YUV420_12 | VA_RT_FORMAT_YUV444_10 | VA_RT_FORMAT_YUV444_12);
+    NVContext *encodeCtx = codedBufferEncoder(drv, buf);
+    if (encodeCtx != NULL) {
+        //only waits for the picture being encoded into this buffer, later ones carry on
+        VAStatus status = nvencWaitForCodedBuffer(encodeCtx, buf, VA_TIMEOUT_INFINITE);
+        if (status != VA_STATUS_SUCCESS) {
+            return status;
+        }
     }
-    if (!drv->supports444Surface) {
-        attrib_list[i].value &= ~(VA_RT_FORMAT_YUV444 | VA_RT_FORMAT_YUV444_10 | VA_RT_FORMAT_YUV444_12);
+    NVContext *nvCtx = buf->inArena ? (NVContext*) getObjectPtr(drv, buf->context) : NULL;
+    if (nvCtx != NULL) {
+        //stop the arena from moving while the client has a pointer into it
+        pthread_mutex_lock(&nvCtx->bufferPool.mutex);
+        if (!buf->mapped) {
+            buf->mapped = true;
+            nvCtx->sliceArenaMapped++;
+        }
+        pthread_mutex_unlock(&nvCtx->bufferPool.mutex);
     }
-    i++;
-    *num_attribs = i;
+    *pbuf = buf->ptr;
     return VA_STATUS_SUCCESS;
 }
 
-static VAStatus nvCreateSurfaces2(
-            VADriverContextP    ctx,
-            unsigned int        format,
-            unsigned int        width,
-            unsigned int        height,
-            VASurfaceID        *surfaces,
-            unsigned int        num_surfaces,
-            VASurfaceAttrib    *attrib_list,
-            unsigned int        num_attribs
-        )
+static VAStatus nvUnmapBuffer(
+        VADriverContextP ctx,
+        VABufferID buf_id	/* in */
+    )
 {
     NVDriver *drv = (NVDriver*) ctx->pDriverData;
-    cudaVideoSurfaceFormat nvFormat;
-    cudaVideoChromaFormat chromaFormat;
-    int bitdepth;
-    switch (format)
-    {
-    case VA_RT_FORMAT_YUV420:
-        nvFormat = cudaVideoSurfaceFormat_NV12;
-        chromaFormat = cudaVideoChromaFormat_420;
-        bitdepth = 8;
-        break;
-    case VA_RT_FORMAT_YUV420_10:
-        nvFormat = cudaVideoSurfaceFormat_P016;
-        chromaFormat = cudaVideoChromaFormat_420;
-        bitdepth = 10;
-        break;
-    case VA_RT_FORMAT_YUV420_12:
-        nvFormat = cudaVideoSurfaceFormat_P016;
-        chromaFormat = cudaVideoChromaFormat_420;
-        bitdepth = 12;
-        break;
-    case VA_RT_FORMAT_YUV444:
-        nvFormat = cudaVideoSurfaceFormat_YUV444;
-        chromaFormat = cudaVideoChromaFormat_444;
-        bitdepth = 8;
-        break;
-    case VA_RT_FORMAT_YUV444_10:
-        nvFormat = cudaVideoSurfaceFormat_YUV444_16Bit;
-        chromaFormat = cudaVideoChromaFormat_444;
-        bitdepth = 10;
-        break;
-    case VA_RT_FORMAT_YUV444_12:
-        nvFormat = cudaVideoSurfaceFormat_YUV444_16Bit;
-        chromaFormat = cudaVideoChromaFormat_444;
-        bitdepth = 12;
-        break;
-    default:
-        LOG("Unknown format: %X", format);
-        return VA_STATUS_ERROR_UNSUPPORTED_RT_FORMAT;
+    NVBuffer *buf = getObjectPtr(drv, buf_id);
+    if (buf == NULL) {
+        return VA_STATUS_ERROR_INVALID_BUFFER;
     }
-    switch(chromaFormat) {
-        case cudaVideoChromaFormat_422:
-            width = ROUND_UP(width, 2);
-            break;
-        case cudaVideoChromaFormat_420:
-            width = ROUND_UP(width, 2);
-            height = ROUND_UP(height, 2);
-            break;
-        default:
-            break;
+    NVContext *encodeCtx = codedBufferEncoder(drv, buf);
+    if (encodeCtx != NULL) {
+        //the segment points into NVENC's bitstream buffer, which goes back to be encoded into again
+        nvencUnmapCodedBuffer(encodeCtx, buf);
     }
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
-    for (uint32_t i = 0; i < num_surfaces; i++) {
-        Object surfaceObject = allocateObject(drv, OBJECT_TYPE_SURFACE, sizeof(NVSurface));
-        surfaces[i] = surfaceObject->id;
-        NVSurface *suf = (NVSurface*) surfaceObject->obj;
-        suf->width = width;
-        suf->height = height;
-        suf->format = nvFormat;
-        suf->pictureIdx = -1;
-        suf->bitDepth = bitdepth;
-        suf->context = NULL;
-        suf->chromaFormat = chromaFormat;
-        pthread_mutex_init(&suf->mutex, NULL);
-        pthread_cond_init(&suf->cond, NULL);
-        LOG("Creating surface %dx%d, format %X (%p)", width, height, format, suf);
+    if (buf->hostFrame != NULL && atomic_load(&buf->hostFrame->mapped) > 0) {
+        atomic_fetch_sub(&buf->hostFrame->mapped, 1);
+    }
+    NVContext *nvCtx = buf->inArena ? (NVContext*) getObjectPtr(drv, buf->context) : NULL;
+    if (nvCtx != NULL) {
+        pthread_mutex_lock(&nvCtx->bufferPool.mutex);
+        if (buf->mapped) {
+            buf->mapped = false;
+            nvCtx->sliceArenaMapped--;
+        }
+        pthread_mutex_unlock(&nvCtx->bufferPool.mutex);
     }
-    drv->surfaceCount += num_surfaces;
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), VA_STATUS_ERROR_OPERATION_FAILED);
     return VA_STATUS_SUCCESS;
 }
 
-static VAStatus nvCreateSurfaces(
+static VAStatus nvDestroyBuffer(
         VADriverContextP ctx,
-        int width,
-        int height,
-        int format,
-        int num_surfaces,
-        VASurfaceID *surfaces		/* out */
+        VABufferID buffer_id
     )
 {
-    return nvCreateSurfaces2(ctx, format, width, height, surfaces, num_surfaces, NULL, 0);
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    NVBuffer *buf = getObjectPtr(drv, buffer_id);
+    if (buf == NULL) {
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+    }
+    NVContext *encodeCtx = codedBufferEncoder(drv, buf);
+    if (encodeCtx != NULL) {
+        //the output thread would otherwise write into the freed buffer
+        nvencWaitForCodedBuffer(encodeCtx, buf, VA_TIMEOUT_INFINITE);
+        nvencUnmapCodedBuffer(encodeCtx, buf);
+    }
+    Object bufferObject = detachObject(drv, buffer_id);
+    if (bufferObject == NULL) {
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+    }
+    //if the owning context is gone the stale id won't resolve, and the storage is just freed. The object table stays
+    //locked until the buffer is back in the pool, so nvDestroyContext can't drain and free it in between
+    pthread_mutex_lock(&drv->objectCreationMutex);
+    NVContext *nvCtx = buf->context != VA_INVALID_ID ? (NVContext*) getObjectPtr(drv, buf->context) : NULL;
+    if (nvCtx != NULL && !nvCtx->bufferPool.draining) {
+        if (buf->inArena) {
+            removeSliceDataFromArena(nvCtx, buf);
+        }
+        releasePooledBuffer(&nvCtx->bufferPool, bufferObject);
+    } else {
+        freePooledBuffer(bufferObject);
+    }
+    pthread_mutex_unlock(&drv->objectCreationMutex);
+    return VA_STATUS_SUCCESS;
 }
 
-static VAStatus nvDestroySurfaces(
+//waits for the resolve thread to have queued the copy of the surface's latest decode
+static void waitForSurfaceQueued(NVSurface *surface) {
+    pthread_mutex_lock(&surface->mutex);
+    while (surface->resolving) {
+        pthread_cond_wait(&surface->cond, &surface->mutex);
+    }
+    pthread_mutex_unlock(&surface->mutex);
+}
+
+//waits for NVENC to have read every picture submitted from the surface
+static void waitForSurfaceEncoded(NVSurface *surface) {
+    pthread_mutex_lock(&surface->mutex);
+    while (surface->encodesPending > 0) {
+        pthread_cond_wait(&surface->cond, &surface->mutex);
+    }
+    pthread_mutex_unlock(&surface->mutex);
+}
+
+static VAStatus nvBeginPicture(
         VADriverContextP ctx,
-        VASurfaceID *surface_list,
-        int num_surfaces
+        VAContextID context,
+        VASurfaceID render_target
     )
 {
+    NVTX_RANGE("vaBeginPicture context %u surface %u", context, render_target);
     NVDriver *drv = (NVDriver*) ctx->pDriverData;
-    for (int i = 0; i < num_surfaces; i++) {
-        NVSurface *surface = (NVSurface*) getObjectPtr(drv, surface_list[i]);
-        LOG("Destroying surface %d (%p)", surface->pictureIdx, surface);
-        drv->backend->detachBackingImageFromSurface(drv, surface);
-        deleteObject(drv, surface_list[i]);
+    NVContext *nvCtx = (NVContext*) getObjectPtr(drv, context);
+    if (nvCtx == NULL) {
+        return VA_STATUS_ERROR_INVALID_CONTEXT;
+    }
+    NVSurface *surface = (NVSurface*) getObjectPtr(drv, render_target);
+    if (surface == NULL) {
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+    }
+    if (nvCtx->encoder != NULL) {
+        //the surface is only read, so it keeps the frame whoever wrote it left there
+        nvCtx->renderTarget = surface;
+        nvencBeginPicture(nvCtx);
+        return VA_STATUS_SUCCESS;
+    }
+    //encodes may still be reading the frame that's about to be replaced
+    waitForSurfaceEncoded(surface);
+    if (surface->context != NULL && surface->context != nvCtx) {
+        forgetEncoderInputs(drv, surface);
+        //an imported image is the surface's for good, the new context has to decode in it's format
+        if (surface->backingImage != NULL && !surface->backingImage->imported) {
+            drv->backend->detachBackingImageFromSurface(drv, surface);
+        }
+        //the new context may decode in a different format
+        freeCudaFrame(drv, surface);
+        freeHostFrame(drv, surface);
+        surface->pictureIdx = -1;
+    }
+    if (nvCtx->videoProc) {
+        //the previous picture converted into the surface has to be queued before it's written again
+        waitForSurfaceQueued(surface);
+        pthread_mutex_lock(&surface->mutex);
+        surface->resolving = 1;
+        pthread_mutex_unlock(&surface->mutex);
+        nvCtx->renderTarget = surface;
+        nvCtx->procPipelineSet = false;
+        return VA_STATUS_SUCCESS;
+    }
+    if (nvCtx->intraOnly) {
+        //the surface's last picture has to have been mapped before it's given a different decode surface
+        waitForSurfaceQueued(surface);
+        surface->pictureIdx = nvCtx->currentPictureId;
+        nvCtx->currentPictureId = (nvCtx->currentPictureId + 1) % nvCtx->surfaceCount;
+    } else if (surface->pictureIdx == -1) {
+        if (nvCtx->currentPictureId == nvCtx->surfaceCount) {
+            return VA_STATUS_ERROR_MAX_NUM_EXCEEDED;
+        }
+        surface->pictureIdx = nvCtx->currentPictureId++;
+    }
+    pthread_mutex_lock(&surface->mutex);
+    surface->resolving = 1;
+    pthread_mutex_unlock(&surface->mutex);
+    memset(&nvCtx->pPicParams, 0, sizeof(CUVIDPICPARAMS));
+    nvCtx->pictureStatus = VA_STATUS_SUCCESS;
+    //a picture without a VAProcPipelineParameterBuffer is decoded whole into the whole render target
+    nvCtx->decodeCrop = (VARectangle) {0};
+    nvCtx->decodeOutputRegion = (VARectangle) {0};
+    nvCtx->sliceArenaClaimed = false;
+    nvCtx->renderTarget = surface;
+    nvCtx->renderTarget->progressiveFrame = true;
+    nvCtx->renderTarget->applyFilmGrain = false;
+    nvCtx->pPicParams.CurrPicIdx = nvCtx->renderTarget->pictureIdx;
+    return VA_STATUS_SUCCESS;
+}
+
+static void copyDecodeProcessingParams(NVContext *ctx, NVBuffer *buf) {
+    VAProcPipelineParameterBuffer *params = (VAProcPipelineParameterBuffer*) buf->ptr;
+    //the regions point into the application's memory, so they have to be copied now
+    ctx->decodeCrop = params->surface_region != NULL ? *params->surface_region : (VARectangle) {0};
+    ctx->decodeOutputRegion = params->output_region != NULL ? *params->output_region : (VARectangle) {0};
+}
+
+static VAStatus copyVideoProcPipeline(NVContext *ctx, NVBuffer *buf) {
+    const VAProcPipelineParameterBuffer *params = (const VAProcPipelineParameterBuffer*) buf->ptr;
+    NVProcPipeline *pipeline = &ctx->procPipeline;
+    pipeline->surface = params->surface;
+    pipeline->surfaceRegion = params->surface_region != NULL ? *params->surface_region : (VARectangle) {0};
+    pipeline->outputRegion = params->output_region != NULL ? *params->output_region : (VARectangle) {0};
+    pipeline->backgroundColour = params->output_background_color;
+    pipeline->inputStandard = params->surface_color_standard;
+    pipeline->filterFlags = params->filter_flags;
+#if VA_CHECK_VERSION(1, 3, 0)
+    pipeline->inputFullRange = params->input_color_properties.color_range == VA_SOURCE_RANGE_FULL;
+    pipeline->outputRangeGiven = params->output_color_properties.color_range == VA_SOURCE_RANGE_FULL
+            || params->output_color_properties.color_range == VA_SOURCE_RANGE_REDUCED;
+    pipeline->outputFullRange = params->output_color_properties.color_range == VA_SOURCE_RANGE_FULL;
+#else
+    pipeline->inputFullRange = false;
+    pipeline->outputRangeGiven = false;
+    pipeline->outputFullRange = false;
+#endif
+    pipeline->outputStandard = params->output_color_standard;
+    pipeline->deinterlace = false;
+    for (uint32_t i = 0; i < params->num_filters; i++) {
+        NVBuffer *filter = (NVBuffer*) getObjectPtr(ctx->drv, params->filters[i]);
+        const VAProcFilterParameterBufferBase *base = filter != NULL ? (const VAProcFilterParameterBufferBase*) filter->ptr : NULL;
+        if (base == NULL) {
+            ctx->procPipelineSet = false;
+            return VA_STATUS_ERROR_INVALID_BUFFER;
+        }
+        //the only filter is deinterlacing, an application relying on any other has to be told
+        if (base->type != VAProcFilterDeinterlacing) {
+            LOG("Unsupported video processing filter: %d", base->type);
+            ctx->procPipelineSet = false;
+            return VA_STATUS_ERROR_UNSUPPORTED_FILTER;
+        }
+        const VAProcFilterParameterBufferDeinterlacing *deinterlacing = (const VAProcFilterParameterBufferDeinterlacing*) base;
+        bool bottomFirst = (deinterlacing->flags & VA_DEINTERLACING_BOTTOM_FIELD_FIRST) != 0;
+        pipeline->deinterlace = true;
+        pipeline->bottomField = (deinterlacing->flags & VA_DEINTERLACING_BOTTOM_FIELD) != 0;
+        //with ONE_FIELD only a frame per picture is wanted, so it's always made from the first field
+        if (deinterlacing->flags & VA_DEINTERLACING_ONE_FIELD) {
+            pipeline->bottomField = bottomFirst;
+        }
+        pipeline->secondField = pipeline->bottomField != bottomFirst;
     }
-    drv->surfaceCount = MAX(drv->surfaceCount - num_surfaces, 0);
+    ctx->procPipelineSet = true;
     return VA_STATUS_SUCCESS;
 }
 
-static VAStatus nvCreateContext(
+static VAStatus nvRenderPicture(
         VADriverContextP ctx,
-        VAConfigID config_id,
-        int picture_width,
-        int picture_height,
-        int flag,
-        VASurfaceID *render_targets,
-        int num_render_targets,
-        VAContextID *context		/* out */
+        VAContextID context,
+        VABufferID *buffers,
+        int num_buffers
     )
 {
+    NVTX_RANGE("vaRenderPicture context %u, %d buffers", context, num_buffers);
     NVDriver *drv = (NVDriver*) ctx->pDriverData;
-    NVConfig *cfg = (NVConfig*) getObjectPtr(drv, config_id);
-    if (cfg == NULL) {
-        return VA_STATUS_ERROR_INVALID_CONFIG;
+    NVContext *nvCtx = (NVContext*) getObjectPtr(drv, context);
+    if (nvCtx == NULL) {
+        return VA_STATUS_ERROR_INVALID_CONTEXT;
     }
-    LOG("creating context with %d render targets, %d surfaces, at %dx%d", num_render_targets, drv->surfaceCount, picture_width, picture_height);
-    const NVCodec *selectedCodec = NULL;
-    for (const NVCodec *c = __start_nvd_codecs; c < __stop_nvd_codecs; c++) {
-        for (int i = 0; i < c->supportedProfileCount; i++) {
-            if (c->supportedProfiles[i] == cfg->profile) {
-                selectedCodec = c;
-                break;
+    CUVIDPICPARAMS *picParams = &nvCtx->pPicParams;
+    for (int i = 0; i < num_buffers; i++) {
+        NVBuffer *buf = nvBufferFromBufferId(drv, buffers[i]);
+        if (buf == NULL || buf->ptr == NULL) {
+            LOG("Invalid buffer detected, skipping: %d", buffers[i]);
+            continue;
+        }
+        HandlerFunc func = nvCtx->codec->handlers[buf->bufferType];
+        if (nvCtx->encoder != NULL) {
+            nvencRenderBuffer(nvCtx, buf);
+        } else if (buf->bufferType == VAProcPipelineParameterBufferType && nvCtx->videoProc) {
+            VAStatus status = copyVideoProcPipeline(nvCtx, buf);
+            if (status != VA_STATUS_SUCCESS) {
+                return status;
             }
+        } else if (buf->bufferType == VAProcPipelineParameterBufferType && nvCtx->decProcessing) {
+            copyDecodeProcessingParams(nvCtx, buf);
+        } else if (func != NULL) {
+            func(nvCtx, buf, picParams);
+        } else {
+            LOG("Unhandled buffer type: %d", buf->bufferType);
         }
     }
-    if (selectedCodec == NULL) {
-        LOG("Unable to find codec for profile: %d", cfg->profile);
-        return VA_STATUS_ERROR_UNSUPPORTED_PROFILE;
+    return nvCtx->pictureStatus;
+}
+
+//how long SyncSurface2 sleeps between polls of the surface's event, CUDA has no timed wait on an event.
+//Also used while draining the resolve thread
+#define SURFACE_POLL_INTERVAL_NS 100000
+
+//waits for the resolve thread to have taken every queued picture and unmapped all of the decoder's output surfaces.
+//Only called from the thread submitting pictures, so nothing new can be queued while waiting
+static bool drainResolveThread(NVContext *ctx) {
+    while (spsc_queue_size(&ctx->surfaceQueue) > 0 || !atomic_load(&ctx->resolveIdle)) {
+        if (ctx->exiting) {
+            return false;
+        }
+        struct timespec interval = { .tv_nsec = SURFACE_POLL_INTERVAL_NS };
+        nanosleep(&interval, NULL);
     }
-    if (num_render_targets) {
-        NVSurface *surface = (NVSurface *) getObjectPtr(drv, render_targets[0]);
-        if (!surface) {
-            return VA_STATUS_ERROR_INVALID_PARAMETER;
+    return true;
+}
+
+static bool sameRect(short left, short top, short right, short bottom, const VARectangle *rect) {
+    return left == rect->x && top == rect->y && right == rect->x + rect->width && bottom == rect->y + rect->height;
+}
+
+static bool reconfigureDecoder(NVContext *ctx, CUVIDRECONFIGUREDECODERINFO *reconfigure) {
+    CUVIDDECODECREATEINFO *info = &ctx->decoderInfo;
+    if (reconfigure->ulWidth > info->ulMaxWidth || reconfigure->ulHeight > info->ulMaxHeight || cv->cuvidReconfigureDecoder == NULL) {
+        LOG("Unable to reconfigure decoder from %lux%lu to %ux%u", (unsigned long) info->ulWidth, (unsigned long) info->ulHeight,
+            reconfigure->ulWidth, reconfigure->ulHeight);
+        return false;
+    }
+    //the decoder can only be reconfigured once none of it's output surfaces are mapped
+    if (!drainResolveThread(ctx)) {
+        return false;
+    }
+    reconfigure->ulNumDecodeSurfaces = info->ulNumDecodeSurfaces;
+    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(ctx->drv->cudaContext), false);
+    CUresult result = cv->cuvidReconfigureDecoder(ctx->decoder, reconfigure);
+    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), false);
+    if (CHECK_CUDA_RESULT(result)) {
+        return false;
+    }
+    LOG("Reconfigured decoder to %ux%u, output %ux%u", reconfigure->ulWidth, reconfigure->ulHeight,
+        reconfigure->ulTargetWidth, reconfigure->ulTargetHeight);
+    //keep the record accurate, so the decoder is only handed to contexts wanting this configuration when it's pooled
+    info->ulWidth = reconfigure->ulWidth;
+    info->ulHeight = reconfigure->ulHeight;
+    info->ulTargetWidth = reconfigure->ulTargetWidth;
+    info->ulTargetHeight = reconfigure->ulTargetHeight;
+    info->display_area.left = reconfigure->display_area.left;
+    info->display_area.top = reconfigure->display_area.top;
+    info->display_area.right = reconfigure->display_area.right;
+    info->display_area.bottom = reconfigure->display_area.bottom;
+    info->target_rect.left = reconfigure->target_rect.left;
+    info->target_rect.top = reconfigure->target_rect.top;
+    info->target_rect.right = reconfigure->target_rect.right;
+    info->target_rect.bottom = reconfigure->target_rect.bottom;
+    ctx->width = (int) reconfigure->ulWidth;
+    ctx->height = (int) reconfigure->ulHeight;
+    return true;
+}
+
+bool resizeDecoder(NVContext *ctx, uint32_t width, uint32_t height, uint32_t targetWidth, uint32_t targetHeight) {
+    CUVIDDECODECREATEINFO *info = &ctx->decoderInfo;
+    if (width == info->ulWidth && height == info->ulHeight && targetWidth == info->ulTargetWidth && targetHeight == info->ulTargetHeight) {
+        return true;
+    }
+    int displayWidth = (int) width, displayHeight = (int) height;
+    alignToChroma(info->ChromaFormat, &displayWidth, &displayHeight);
+    CUVIDRECONFIGUREDECODERINFO reconfigure = {
+        .ulWidth             = width,
+        .ulHeight            = height,
+        .ulTargetWidth       = targetWidth,
+        .ulTargetHeight      = targetHeight,
+        .display_area.right  = displayWidth,
+        .display_area.bottom = displayHeight,
+    };
+    return reconfigureDecoder(ctx, &reconfigure);
+}
+
+bool resizeForPicture(NVContext *ctx, uint32_t width, uint32_t height, uint32_t alignment) {
+    CUVIDDECODECREATEINFO *info = &ctx->decoderInfo;
+    if (ROUND_UP(width, alignment) == ROUND_UP(info->ulWidth, alignment) && ROUND_UP(height, alignment) == ROUND_UP(info->ulHeight, alignment)) {
+        return true;
+    }
+    //the part of the picture that's shown is taken to be the render target, where that's smaller, as the coded size
+    //can include the padding out to a whole macroblock
+    NVSurface *target = ctx->renderTarget;
+    int displayWidth = (int) MIN(width, target->width), displayHeight = (int) MIN(height, target->height);
+    alignToChroma(info->ChromaFormat, &displayWidth, &displayHeight);
+    CUVIDRECONFIGUREDECODERINFO reconfigure = {
+        .ulWidth             = width,
+        .ulHeight            = height,
+        .ulTargetWidth       = ctx->decProcessing ? target->width : (unsigned int) displayWidth,
+        .ulTargetHeight      = ctx->decProcessing ? target->height : (unsigned int) displayHeight,
+        .display_area.right  = (short) displayWidth,
+        .display_area.bottom = (short) displayHeight,
+    };
+    LOG("Picture size changed from %lux%lu to %ux%u", (unsigned long) info->ulWidth, (unsigned long) info->ulHeight, width, height);
+    return reconfigureDecoder(ctx, &reconfigure);
+}
+
+//whether a position lands on a sample of every plane, chroma can't be split so odd offsets into 4:2:0 aren't
+static bool onChromaSamples(const NVFormatInfo *fmtInfo, uint32_t x, uint32_t y) {
+    for (uint32_t i = 0; i < fmtInfo->numPlanes; i++) {
+        const NVFormatPlane *p = &fmtInfo->plane[i];
+        if ((x & ((1u << p->ss.x) - 1)) != 0 || (y & ((1u << p->ss.y) - 1)) != 0) {
+            return false;
         }
-        cfg->surfaceFormat = surface->format;
-        cfg->chromaFormat = surface->chromaFormat;
-        cfg->bitDepth = surface->bitDepth;
     }
-    int surfaceCount = num_render_targets > 0 ? num_render_targets : 32;
-    if (surfaceCount > 32) {
-        LOG("Application requested %d surface(s), limiting to 32. This may cause issues.", surfaceCount);
-        surfaceCount = 32;
+    return true;
+}
+
+//whether a non-empty region lies within a width x height picture, starting on a sample of every plane
+static bool regionFits(const NVFormatInfo *fmtInfo, const VARectangle *region, uint32_t width, uint32_t height) {
+    return region->x >= 0 && region->y >= 0 && (uint32_t) region->x + region->width <= width
+        && (uint32_t) region->y + region->height <= height && onChromaSamples(fmtInfo, (uint32_t) region->x, (uint32_t) region->y);
+}
+
+//the region of the surface, all of it if the region is empty. Returns false if it doesn't fit the surface
+static bool surfaceRegion(const NVSurface *surface, const VARectangle *region, VARectangle *rect) {
+    if (region->width == 0 || region->height == 0) {
+        *rect = (VARectangle) { .width = surface->width, .height = surface->height };
+        return true;
     }
-    int display_area_width = picture_width;
-    int display_area_height = picture_height;
-    switch(cfg->chromaFormat) {
-        case cudaVideoChromaFormat_422:
-            display_area_width = ROUND_UP(display_area_width, 2);
-            break;
-        case cudaVideoChromaFormat_420:
-            display_area_width = ROUND_UP(display_area_width, 2);
-            display_area_height = ROUND_UP(display_area_height, 2);
-            break;
-        default:
-            break;
+    if (!regionFits(&formatsInfo[nvSurfaceFormat(surface)], region, surface->width, surface->height)) {
+        LOG("Region %dx%d at %d,%d doesn't fit the %ux%u surface", region->width, region->height, region->x, region->y,
+            surface->width, surface->height);
+        return false;
     }
-    CUVIDDECODECREATEINFO vdci = {
-        .ulWidth             = vdci.ulMaxWidth  = vdci.ulTargetWidth  = picture_width,
-        .ulHeight            = vdci.ulMaxHeight = vdci.ulTargetHeight = picture_height,
-        .CodecType           = cfg->cudaCodec,
-        .ulCreationFlags     = cudaVideoCreate_PreferCUVID,
-        .ulIntraDecodeOnly   = 0,
-        .display_area.right  = display_area_width,
-        .display_area.bottom = display_area_height,
-        .ChromaFormat        = cfg->chromaFormat,
-        .OutputFormat        = cfg->surfaceFormat,
-        .bitDepthMinus8      = cfg->bitDepth - 8,
-        .DeinterlaceMode     = cudaVideoDeinterlaceMode_Weave,
-        .ulNumOutputSurfaces = 1,
-        .ulNumDecodeSurfaces = surfaceCount,
+    *rect = *region;
+    return true;
+}
+
+//crops and scales the picture into the render target as part of decoding, reconfiguring the decoder if the
+//crop, output region or render target size differ from the last picture
+static VAStatus applyDecodeProcessing(NVContext *ctx) {
+    CUVIDDECODECREATEINFO *info = &ctx->decoderInfo;
+    NVSurface *target = ctx->renderTarget;
+    const NVFormatInfo *fmtInfo = &formatsInfo[nvSurfaceFormat(target)];
+    VARectangle crop = ctx->decodeCrop;
+    if (crop.width == 0 || crop.height == 0) {
+        int width = (int) info->ulWidth, height = (int) info->ulHeight;
+        alignToChroma(info->ChromaFormat, &width, &height);
+        crop = (VARectangle) { .width = (uint16_t) width, .height = (uint16_t) height };
+    } else if (!regionFits(fmtInfo, &crop, (uint32_t) info->ulWidth, (uint32_t) info->ulHeight)) {
+        LOG("Crop %dx%d at %d,%d is outside the %lux%lu picture", crop.width, crop.height, crop.x, crop.y,
+            (unsigned long) info->ulWidth, (unsigned long) info->ulHeight);
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    //NVDEC takes an empty target rectangle as the whole of the target
+    VARectangle output = ctx->decodeOutputRegion;
+    if (output.width == 0 || output.height == 0
+            || (output.x == 0 && output.y == 0 && output.width == target->width && output.height == target->height)) {
+        output = (VARectangle) {0};
+    } else if (!regionFits(fmtInfo, &output, target->width, target->height)) {
+        LOG("Output region %dx%d at %d,%d is outside the %ux%u render target", output.width, output.height, output.x, output.y,
+            target->width, target->height);
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    if (target->width == info->ulTargetWidth && target->height == info->ulTargetHeight
+            && sameRect(info->display_area.left, info->display_area.top, info->display_area.right, info->display_area.bottom, &crop)
+            && sameRect(info->target_rect.left, info->target_rect.top, info->target_rect.right, info->target_rect.bottom, &output)) {
+        return VA_STATUS_SUCCESS;
+    }
+    CUVIDRECONFIGUREDECODERINFO reconfigure = {
+        .ulWidth             = (unsigned int) info->ulWidth,
+        .ulHeight            = (unsigned int) info->ulHeight,
+        .ulTargetWidth       = target->width,
+        .ulTargetHeight      = target->height,
+        .display_area.left   = crop.x,
+        .display_area.top    = crop.y,
+        .display_area.right  = (short) (crop.x + crop.width),
+        .display_area.bottom = (short) (crop.y + crop.height),
+        .target_rect.left    = output.x,
+        .target_rect.top     = output.y,
+        .target_rect.right   = (short) (output.x + output.width),
+        .target_rect.bottom  = (short) (output.y + output.height),
     };
-    drv->surfaceCount = 0;
-    CHECK_CUDA_RESULT_RETURN(cv->cuvidCtxLockCreate(&vdci.vidLock, drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
-    CUvideodecoder decoder;
-    CHECK_CUDA_RESULT_RETURN(cv->cuvidCreateDecoder(&decoder, &vdci), VA_STATUS_ERROR_ALLOCATION_FAILED);
-    Object contextObj = allocateObject(drv, OBJECT_TYPE_CONTEXT, sizeof(NVContext));
-    NVContext *nvCtx = (NVContext*) contextObj->obj;
-    nvCtx->drv = drv;
-    nvCtx->decoder = decoder;
-    nvCtx->profile = cfg->profile;
-    nvCtx->entrypoint = cfg->entrypoint;
-    nvCtx->width = picture_width;
-    nvCtx->height = picture_height;
-    nvCtx->codec = selectedCodec;
-    nvCtx->surfaceCount = surfaceCount;
-    pthread_mutexattr_t attrib;
-    pthread_mutexattr_init(&attrib);
-    pthread_mutexattr_settype(&attrib, PTHREAD_MUTEX_RECURSIVE);
-    pthread_mutex_init(&nvCtx->surfaceCreationMutex, &attrib);
-    pthread_mutex_init(&nvCtx->resolveMutex, NULL);
-    pthread_cond_init(&nvCtx->resolveCondition, NULL);
-    int err = pthread_create(&nvCtx->resolveThread, NULL, &resolveSurfaces, nvCtx);
-    if (err != 0) {
-        LOG("Unable to create resolve thread: %d", err);
-        deleteObject(drv, contextObj->id);
-        return VA_STATUS_ERROR_OPERATION_FAILED;
+    return reconfigureDecoder(ctx, &reconfigure) ? VA_STATUS_SUCCESS : VA_STATUS_ERROR_OPERATION_FAILED;
+}
+
+//an intra only context's decode surfaces are reused in turn, so a picture can only be submitted once the one that last
+//used it's decode surface is mapped. Besides the one being submitted, the decode surfaces are held by the frames the
+//resolve thread has mapped, the one it's mapping, and what's queued, which is limited here to keep one spare
+static bool surfaceQueueFull(NVContext *nvCtx) {
+    if (nvCtx->intraOnly && spsc_queue_size(&nvCtx->surfaceQueue) >= INTRA_SPARE_DECODE_SURFACES - 2) {
+        return true;
     }
-    *context = contextObj->id;
-    return VA_STATUS_SUCCESS;
+    return spsc_queue_full(&nvCtx->surfaceQueue);
 }
 
-static VAStatus nvDestroyContext(
-        VADriverContextP ctx,
-        VAContextID context)
-{
-    NVDriver *drv = (NVDriver*) ctx->pDriverData;
-    LOG("Destroying context: %d", context);
-    NVContext *nvCtx = (NVContext*) getObjectPtr(drv, context);
-    if (nvCtx == NULL) {
-        return VA_STATUS_ERROR_INVALID_CONTEXT;
+static bool waitForSurfaceQueueSpace(NVContext *nvCtx) {
+    while (surfaceQueueFull(nvCtx)) {
+        if (!surfaceQueueBlock || nvCtx->exiting) {
+            return false;
+        }
+        atomic_store(&nvCtx->queueSpaceWakeup.waiting, true);
+        if (surfaceQueueFull(nvCtx)) {
+            waitWakeup(&nvCtx->queueSpaceWakeup);
+        }
+        atomic_store(&nvCtx->queueSpaceWakeup.waiting, false);
     }
-    VAStatus ret = VA_STATUS_SUCCESS;
-    if (!destroyContext(drv, nvCtx)) {
-        ret = VA_STATUS_ERROR_OPERATION_FAILED;
+    return true;
+}
+
+//Video processing. Each picture is a pass of the kernels on the context's stream, every component of the source
+//region is scaled into the output region and then, if the render target is RGB, converted from Y'CbCr. The result
+//is built in a frame laid out like NVDEC's output so that it reaches the render target through resolveFrame, the
+//same as a decoded picture.
+
+//grows the buffer to at least the given size, waiting for the stream to finish with the old one first
+static bool ensureScratchBuffer(NVScratchBuffer *scratch, size_t widthInBytes, size_t rows, CUstream stream) {
+    if (scratch->ptr != (CUdeviceptr) NULL && scratch->widthInBytes >= widthInBytes && scratch->rows >= rows) {
+        return true;
+    }
+    widthInBytes = MAX(widthInBytes, scratch->widthInBytes);
+    rows = MAX(rows, scratch->rows);
+    if (scratch->ptr != (CUdeviceptr) NULL) {
+        CHECK_CUDA_RESULT(cu->cuStreamSynchronize(stream));
+        freeScratchBuffer(scratch);
+    }
+    CHECK_CUDA_RESULT_RETURN(cu->cuMemAllocPitch(&scratch->ptr, &scratch->pitch, widthInBytes, rows, 16), false);
+    scratch->widthInBytes = widthInBytes;
+    scratch->rows = rows;
+    return true;
+}
+
+static uint32_t componentCount(const NVFormatInfo *fmtInfo) {
+    return fmtInfo->isRgb ? 4 : 3;
+}
+
+//a component of the rect of a frame laid out like NVDEC's output. The components of YUV formats are Y, Cb and Cr,
+//and of RGB formats R, G, B and A
+static NVPlaneChannel frameComponent(NVFormat format, CUdeviceptr frame, size_t pitch, uint32_t frameHeight,
+                                     const VARectangle *rect, uint32_t component) {
+    //BGRA has blue first in memory
+    static const uint32_t bgraChannels[] = { 2, 1, 0, 3 };
+    const NVFormatInfo *fmtInfo = &formatsInfo[format];
+    uint32_t plane = 0, channel = component;
+    if (format == NV_FORMAT_BGRA) {
+        channel = bgraChannels[component];
+    } else if (fmtInfo->numPlanes == 3) {
+        plane = component;
+        channel = 0;
+    } else if (fmtInfo->numPlanes == 2 && component > 0) {
+        plane = 1;
+        channel = component - 1;
+    }
+    for (uint32_t i = 0; i < plane; i++) {
+        frame += (frameHeight >> fmtInfo->plane[i].ss.y) * pitch;
+    }
+    const NVFormatPlane *p = &fmtInfo->plane[plane];
+    uint32_t stride = fmtInfo->bppc * p->channelCount;
+    return (NVPlaneChannel) {
+        .ptr = frame + (rect->y >> p->ss.y) * pitch + (rect->x >> p->ss.x) * stride + channel * fmtInfo->bppc,
+        .pitch = (uint32_t) pitch,
+        .stride = stride,
+        .wide = fmtInfo->is16bits,
+        .width = rect->width >> p->ss.x,
+        .height = rect->height >> p->ss.y
+    };
+}
+
+//narrows a channel of a woven frame down to the lines of one of it's fields
+static void fieldOfChannel(NVPlaneChannel *channel, bool bottomField) {
+    if (bottomField) {
+        channel->ptr += channel->pitch;
+    }
+    channel->pitch *= 2;
+    channel->height /= 2;
+}
+
+//luma coefficients of the colour standard, BT.601 for SD and BT.709 for HD if it's not given
+static void lumaCoefficients(int standard, uint32_t height, float *kr, float *kb) {
+    switch (standard) {
+    case VAProcColorStandardBT601:
+    case VAProcColorStandardBT470BG:
+    case VAProcColorStandardSMPTE170M:
+    case VAProcColorStandardXVYCC601:
+        *kr = 0.299f;
+        *kb = 0.114f;
+        break;
+    case VAProcColorStandardBT709:
+    case VAProcColorStandardXVYCC709:
+        *kr = 0.2126f;
+        *kb = 0.0722f;
+        break;
+    case VAProcColorStandardBT2020:
+        *kr = 0.2627f;
+        *kb = 0.0593f;
+        break;
+    default:
+        *kr = height <= 576 ? 0.299f : 0.2126f;
+        *kb = height <= 576 ? 0.114f : 0.0722f;
+        break;
+    }
+}
+
+static NVColourMatrix colourMatrix(int standard, bool fullRange, uint32_t height, bool fullRangeOutput) {
+    float kr, kb;
+    lumaCoefficients(standard, height, &kr, &kb);
+    float kg = 1.0f - kr - kb;
+    //limited range has luma in 16..235 and chroma in 16..240, the matrix takes both to 0..255, or to 16..235 for
+    //limited range R'G'B'
+    float outScale = fullRangeOutput ? 1.0f : 219.0f / 255.0f;
+    float yScale = (fullRange ? 1.0f : 255.0f / 219.0f) * outScale;
+    float cScale = (fullRange ? 1.0f : 255.0f / 224.0f) * outScale;
+    return (NVColourMatrix) {
+        //the 16 added for limited range output is folded into the luma offset
+        .yOffset = (fullRange ? 0.0f : 16.0f) - (fullRangeOutput ? 0.0f : 16.0f / yScale),
+        .yScale = yScale,
+        .cOffset = 128.0f,
+        .rv = 2.0f * (1.0f - kr) * cScale,
+        .gu = -2.0f * kb * (1.0f - kb) / kg * cScale,
+        .gv = -2.0f * kr * (1.0f - kr) / kg * cScale,
+        .bu = 2.0f * (1.0f - kb) * cScale
+    };
+}
+
+//takes Y'CbCr in one colour standard and range to another, through R'G'B'
+static NVColourTransform colourTransform(float inKr, float inKb, bool inFullRange, float outKr, float outKb, bool outFullRange) {
+    float kg = 1.0f - inKr - inKb;
+    float yScale = inFullRange ? 255.0f : 219.0f, cScale = inFullRange ? 255.0f : 224.0f;
+    //code values, less their offsets, to R'G'B' in 0..1
+    const float toRgb[9] = {
+        1.0f / yScale, 0.0f, 2.0f * (1.0f - inKr) / cScale,
+        1.0f / yScale, -2.0f * inKb * (1.0f - inKb) / kg / cScale, -2.0f * inKr * (1.0f - inKr) / kg / cScale,
+        1.0f / yScale, 2.0f * (1.0f - inKb) / cScale, 0.0f
+    };
+    kg = 1.0f - outKr - outKb;
+    yScale = outFullRange ? 255.0f : 219.0f;
+    cScale = outFullRange ? 255.0f : 224.0f;
+    const float fromRgb[9] = {
+        outKr * yScale, kg * yScale, outKb * yScale,
+        -outKr / (2.0f * (1.0f - outKb)) * cScale, -kg / (2.0f * (1.0f - outKb)) * cScale, 0.5f * cScale,
+        0.5f * cScale, -kg / (2.0f * (1.0f - outKr)) * cScale, -outKb / (2.0f * (1.0f - outKr)) * cScale
+    };
+    NVColourTransform transform = { .inOffset = inFullRange ? 0.0f : 16.0f, .outOffset = outFullRange ? 0.0f : 16.0f };
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++) {
+            float sum = 0.0f;
+            for (int k = 0; k < 3; k++) {
+                sum += fromRgb[row * 3 + k] * toRgb[k * 3 + col];
+            }
+            transform.matrix[row * 3 + col] = sum;
+        }
+    }
+    return transform;
+}
+
+static NVScaleFilter scaleFilter(uint32_t filterFlags) {
+    switch (filterFlags & VA_FILTER_SCALING_MASK) {
+    case VA_FILTER_SCALING_FAST:
+        return NV_SCALE_NEAREST;
+    case VA_FILTER_SCALING_HQ:
+        return NV_SCALE_LANCZOS;
+    default:
+        return NV_SCALE_BILINEAR;
+    }
+}
+
+//the 16-bit samples of the ARGB background colour in the render target's format, limited range for YUV
+static void backgroundSamples(const NVFormatInfo *fmtInfo, uint32_t argb, uint32_t height, uint16_t samples[4]) {
+    float r = (float) ((argb >> 16) & 0xff), g = (float) ((argb >> 8) & 0xff), b = (float) (argb & 0xff);
+    float components[4] = { r, g, b, (float) (argb >> 24) };
+    if (!fmtInfo->isRgb) {
+        float kr, kb;
+        lumaCoefficients(VAProcColorStandardNone, height, &kr, &kb);
+        float y = kr * r + (1.0f - kr - kb) * g + kb * b;
+        components[0] = 16.0f + y * 219.0f / 255.0f;
+        components[1] = 128.0f + (b - y) / (2.0f * (1.0f - kb)) * 224.0f / 255.0f;
+        components[2] = 128.0f + (r - y) / (2.0f * (1.0f - kr)) * 224.0f / 255.0f;
+        components[3] = 0.0f;
+    }
+    for (int i = 0; i < 4; i++) {
+        samples[i] = (uint16_t) MIN(components[i] * 256.0f + 0.5f, 65535.0f);
+    }
+}
+
+//copies the planes of an exported surface into scratch, stacked like NVDEC's output, on the stream. Called with the
+//surface's mutex held and the context current
+static bool stageExportedFrame(NVScratchBuffer *scratch, CUstream stream, const NVSurface *src) {
+    const NVFormatInfo *fmtInfo = &formatsInfo[nvSurfaceFormat(src)];
+    uint32_t widthInBytes, rows;
+    cudaFrameSize(src, &widthInBytes, &rows);
+    bool ret = ensureScratchBuffer(scratch, widthInBytes, rows, stream);
+    uint32_t planeY = 0;
+    for (uint32_t i = 0; i < fmtInfo->numPlanes && ret; i++) {
+        const NVFormatPlane *p = &fmtInfo->plane[i];
+        CUDA_MEMCPY2D cpy = {
+            .srcMemoryType = CU_MEMORYTYPE_ARRAY,
+            .srcArray = src->backingImage->arrays[i],
+            .dstMemoryType = CU_MEMORYTYPE_DEVICE,
+            .dstDevice = scratch->ptr,
+            .dstPitch = scratch->pitch,
+            .dstY = planeY,
+            .WidthInBytes = (src->width >> p->ss.x) * fmtInfo->bppc * p->channelCount,
+            .Height = src->height >> p->ss.y
+        };
+        ret = !CHECK_CUDA_RESULT(cu->cuMemcpy2DAsync(&cpy, stream));
+        planeY += src->height >> p->ss.y;
     }
-    deleteObject(drv, context);
     return ret;
 }
 
-static VAStatus nvCreateBuffer(
-        VADriverContextP ctx,
-        VAContextID context,		/* in */
-        VABufferType type,		/* in */
-        unsigned int size,		/* in */
-        unsigned int num_elements,	/* in */
-        void *data,			/* in */
-        VABufferID *buf_id
-    )
-{
-    NVDriver *drv = (NVDriver*) ctx->pDriverData;
-    NVContext *nvCtx = (NVContext*) getObjectPtr(drv, context);
-    if (nvCtx == NULL) {
-        return VA_STATUS_ERROR_INVALID_CONTEXT;
+//where the source's frame is, staging it in procInput if the surface has been exported. Called with the context current.
+//If NVDEC made a frame from the second field and that's the one being asked for, it's used instead
+static bool videoProcSource(NVContext *nvCtx, NVSurface *src, CUdeviceptr *frame, size_t *pitch) {
+    const NVProcPipeline *pipeline = &nvCtx->procPipeline;
+    bool ret = true;
+    pthread_mutex_lock(&src->mutex);
+    if (pipeline->deinterlace && pipeline->secondField && src->hasDoubledFrame) {
+        *frame = src->doubledFrame;
+        *pitch = src->doubledFramePitch;
+    } else if (src->backingImage == NULL) {
+        *frame = src->cudaFrame;
+        *pitch = src->cudaFramePitch;
+    } else {
+        ret = stageExportedFrame(&nvCtx->procInput, nvCtx->stream, src);
+        *frame = nvCtx->procInput.ptr;
+        *pitch = nvCtx->procInput.pitch;
     }
-    int offset = 0;
-    if (nvCtx->profile == VAProfileVP8Version0_3 && type == VASliceDataBufferType) {
-        offset = (int)(((uintptr_t)data) & 0xf);
-        data = ((char *)data) - offset;
-        size += offset;
+    pthread_mutex_unlock(&src->mutex);
+    return ret && *frame != (CUdeviceptr) NULL;
+}
+
+//scales the source region into planar 16-bit Y'CbCr the size of the output region in procTemp, upsampling the chroma
+static VAStatus scaleToPlanar(NVDriver *drv, NVContext *nvCtx, NVFormat srcFormat, CUdeviceptr srcFrame, size_t srcPitch,
+                              uint32_t srcHeight, const VARectangle *srcRect, const VARectangle *dstRect, bool bob,
+                              NVScaleFilter filter, CUdeviceptr planes[3]) {
+    if (!ensureScratchBuffer(&nvCtx->procTemp, dstRect->width * sizeof(uint16_t), 3 * dstRect->height, nvCtx->stream)) {
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
     }
-    Object bufferObject = allocateObject(drv, OBJECT_TYPE_BUFFER, sizeof(NVBuffer));
-    *buf_id = bufferObject->id;
-    NVBuffer *buf = (NVBuffer*) bufferObject->obj;
-    buf->bufferType = type;
-    buf->elements = num_elements;
-    buf->size = num_elements * size;
-    buf->ptr = memalign(16, buf->size);
-    buf->offset = offset;
-    if (buf->ptr == NULL) {
-        LOG("Unable to allocate buffer of %d bytes", buf->size);
+    for (uint32_t i = 0; i < 3; i++) {
+        planes[i] = nvCtx->procTemp.ptr + i * dstRect->height * nvCtx->procTemp.pitch;
+        NVPlaneChannel to = { .ptr = planes[i], .pitch = (uint32_t) nvCtx->procTemp.pitch, .stride = sizeof(uint16_t),
+                              .wide = true, .width = dstRect->width, .height = dstRect->height };
+        NVPlaneChannel from = frameComponent(srcFormat, srcFrame, srcPitch, srcHeight, srcRect, i);
+        if (bob) {
+            fieldOfChannel(&from, nvCtx->procPipeline.bottomField);
+        }
+        if (!scalePlane(cu, &drv->kernels, &to, &from, filter, nvCtx->stream)) {
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+        }
+    }
+    return VA_STATUS_SUCCESS;
+}
+
+//queues the conversion of the picture into procOutput and from there into the render target.
+//Called with the CUDA context current
+static VAStatus processVideoProcPicture(NVDriver *drv, NVContext *nvCtx, NVSurface *src, NVSurface *dst) {
+    const NVProcPipeline *pipeline = &nvCtx->procPipeline;
+    NVFormat srcFormat = nvSurfaceFormat(src), dstFormat = nvSurfaceFormat(dst);
+    const NVFormatInfo *srcFmt = &formatsInfo[srcFormat], *dstFmt = &formatsInfo[dstFormat];
+    if (srcFmt->isRgb && !dstFmt->isRgb) {
+        LOG("Converting RGB to YUV is not supported");
+        return VA_STATUS_ERROR_UNIMPLEMENTED;
+    }
+    VARectangle srcRect, dstRect;
+    if (!surfaceRegion(src, &pipeline->surfaceRegion, &srcRect) || !surfaceRegion(dst, &pipeline->outputRegion, &dstRect)) {
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    NVScaleFilter filter = scaleFilter(pipeline->filterFlags);
+    CUstream stream = nvCtx->stream;
+    //YUV is only converted between colour standards or ranges when the output's differs from the input's
+    float inKr, inKb, outKr, outKb;
+    lumaCoefficients(pipeline->inputStandard, src->height, &inKr, &inKb);
+    if (pipeline->outputStandard == VAProcColorStandardNone) {
+        outKr = inKr;
+        outKb = inKb;
+    } else {
+        lumaCoefficients(pipeline->outputStandard, dst->height, &outKr, &outKb);
+    }
+    bool outFullRange = pipeline->outputRangeGiven ? pipeline->outputFullRange : pipeline->inputFullRange;
+    bool transform = !srcFmt->isRgb && !dstFmt->isRgb
+            && (inKr != outKr || inKb != outKb || outFullRange != pipeline->inputFullRange);
+    //the source has to have been copied out of it's decoder first, which is also when it's field flags are set
+    waitForSurfaceQueued(src);
+    pthread_mutex_lock(&src->mutex);
+    bool srcEventPending = src->resolveEventPending;
+    //frames NVDEC has already deinterlaced are used as they are, otherwise the field is stretched to a frame
+    bool bob = pipeline->deinterlace && !src->deinterlaced && !src->progressiveFrame;
+    pthread_mutex_unlock(&src->mutex);
+    if (srcEventPending) {
+        CHECK_CUDA_RESULT_RETURN(cu->cuStreamWaitEvent(stream, src->resolveEvent, 0), VA_STATUS_ERROR_OPERATION_FAILED);
+    }
+    CUdeviceptr srcFrame;
+    size_t srcPitch;
+    if (!videoProcSource(nvCtx, src, &srcFrame, &srcPitch)) {
+        LOG("Nothing has been written to the source surface");
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+    }
+
+    uint32_t widthInBytes, rows;
+    cudaFrameSize(dst, &widthInBytes, &rows);
+    if (!ensureScratchBuffer(&nvCtx->procOutput, widthInBytes, rows, stream)) {
         return VA_STATUS_ERROR_ALLOCATION_FAILED;
     }
-    if (data != NULL) {
-        memcpy(buf->ptr, data, buf->size);
+    CUdeviceptr frame = nvCtx->procOutput.ptr;
+    size_t pitch = nvCtx->procOutput.pitch;
+    const VARectangle all = { .width = dst->width, .height = dst->height };
+    const uint32_t components = componentCount(dstFmt);
+
+    if (dstRect.x != 0 || dstRect.y != 0 || dstRect.width != dst->width || dstRect.height != dst->height) {
+        //fill the rest of the render target by scaling up a single background sample
+        uint16_t samples[4];
+        backgroundSamples(dstFmt, pipeline->backgroundColour, dst->height, samples);
+        if (nvCtx->procBackground == (CUdeviceptr) NULL) {
+            CHECK_CUDA_RESULT_RETURN(cu->cuMemAlloc(&nvCtx->procBackground, sizeof(samples)), VA_STATUS_ERROR_ALLOCATION_FAILED);
+        }
+        //pageable memory is staged before this returns, so the samples can go out of scope
+        CHECK_CUDA_RESULT_RETURN(cu->cuMemcpyHtoDAsync(nvCtx->procBackground, samples, sizeof(samples), stream), VA_STATUS_ERROR_OPERATION_FAILED);
+        for (uint32_t i = 0; i < components; i++) {
+            NVPlaneChannel to = frameComponent(dstFormat, frame, pitch, dst->height, &all, i);
+            NVPlaneChannel from = { .ptr = nvCtx->procBackground + i * sizeof(uint16_t), .pitch = sizeof(samples),
+                                    .stride = sizeof(uint16_t), .wide = true, .width = 1, .height = 1 };
+            if (!scalePlane(cu, &drv->kernels, &to, &from, NV_SCALE_NEAREST, stream)) {
+                return VA_STATUS_ERROR_OPERATION_FAILED;
+            }
+        }
+    }
+
+    CUdeviceptr planes[3];
+    if (dstFmt->isRgb && !srcFmt->isRgb) {
+        //scale Y'CbCr into planar 16-bit at the output size, upsampling the chroma, then convert
+        VAStatus status = scaleToPlanar(drv, nvCtx, srcFormat, srcFrame, srcPitch, src->height, &srcRect, &dstRect, bob, filter, planes);
+        if (status != VA_STATUS_SUCCESS) {
+            return status;
+        }
+        NVColourMatrix matrix = colourMatrix(pipeline->inputStandard, pipeline->inputFullRange, src->height,
+                                             !pipeline->outputRangeGiven || pipeline->outputFullRange);
+        CUdeviceptr out = frame + dstRect.y * pitch + dstRect.x * 4;
+        if (!yuvToRgb(cu, &drv->kernels, out, (uint32_t) pitch, dstRect.width, dstRect.height, planes,
+                      (uint32_t) nvCtx->procTemp.pitch, &matrix, dstFormat == NV_FORMAT_BGRA, stream)) {
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+        }
+    } else if (transform) {
+        //the matrix is applied at the output size in planar 16-bit, which is then subsampled into the render target
+        VAStatus status = scaleToPlanar(drv, nvCtx, srcFormat, srcFrame, srcPitch, src->height, &srcRect, &dstRect, bob, filter, planes);
+        if (status != VA_STATUS_SUCCESS) {
+            return status;
+        }
+        NVColourTransform colourChange = colourTransform(inKr, inKb, pipeline->inputFullRange, outKr, outKb, outFullRange);
+        if (!transformYuv(cu, &drv->kernels, planes, (uint32_t) nvCtx->procTemp.pitch, dstRect.width, dstRect.height,
+                          &colourChange, stream)) {
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+        }
+        for (uint32_t i = 0; i < components; i++) {
+            NVPlaneChannel to = frameComponent(dstFormat, frame, pitch, dst->height, &dstRect, i);
+            NVPlaneChannel from = { .ptr = planes[i], .pitch = (uint32_t) nvCtx->procTemp.pitch, .stride = sizeof(uint16_t),
+                                    .wide = true, .width = dstRect.width, .height = dstRect.height };
+            if (!scalePlane(cu, &drv->kernels, &to, &from, NV_SCALE_BILINEAR, stream)) {
+                return VA_STATUS_ERROR_OPERATION_FAILED;
+            }
+        }
+    } else {
+        //same colour model, each component is scaled on it's own, which also takes care of any change of depth,
+        //chroma subsampling or channel order
+        for (uint32_t i = 0; i < components; i++) {
+            NVPlaneChannel to = frameComponent(dstFormat, frame, pitch, dst->height, &dstRect, i);
+            NVPlaneChannel from = frameComponent(srcFormat, srcFrame, srcPitch, src->height, &srcRect, i);
+            if (bob) {
+                fieldOfChannel(&from, pipeline->bottomField);
+            }
+            if (!scalePlane(cu, &drv->kernels, &to, &from, filter, stream)) {
+                return VA_STATUS_ERROR_OPERATION_FAILED;
+            }
+        }
     }
-    return VA_STATUS_SUCCESS;
-}
-
-static VAStatus nvBufferSetNumElements(
-        VADriverContextP ctx,
-        VABufferID buf_id,	/* in */
-        unsigned int num_elements	/* in */
-    )
-{
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
-}
 
-static VAStatus nvMapBuffer(
-        VADriverContextP ctx,
-        VABufferID buf_id,	/* in */
-        void **pbuf         /* out */
-    )
-{
-    NVDriver *drv = (NVDriver*) ctx->pDriverData;
-    NVBuffer *buf = getObjectPtr(drv, buf_id);
-    if (buf == NULL) {
-        return VA_STATUS_ERROR_INVALID_BUFFER;
+    if (!resolveFrame(drv, dst, frame, (uint32_t) pitch, stream)) {
+        return VA_STATUS_ERROR_OPERATION_FAILED;
     }
-    *pbuf = buf->ptr;
-    return VA_STATUS_SUCCESS;
+    //same as the resolve thread, keep the host copy of a derived surface up to date
+    pthread_mutex_lock(&dst->mutex);
+    NVHostFrame *detached;
+    NVHostFrame *hostFrame = refreshableHostFrame(dst, &detached);
+    bool copied = hostFrame == NULL
+            || copySurfaceToHost(dst, dstFmt, frame, pitch, &all, dst->width, dst->height, hostFrame->ptr, stream);
+    pthread_mutex_unlock(&dst->mutex);
+    releaseHostFrame(drv, detached);
+    return copied ? VA_STATUS_SUCCESS : VA_STATUS_ERROR_OPERATION_FAILED;
 }
 
-static VAStatus nvUnmapBuffer(
-        VADriverContextP ctx,
-        VABufferID buf_id	/* in */
-    )
-{
-    return VA_STATUS_SUCCESS;
+static VAStatus endVideoProcPicture(NVDriver *drv, NVContext *nvCtx) {
+    NVSurface *dst = nvCtx->renderTarget;
+    NVSurface *src = nvCtx->procPipelineSet ? (NVSurface*) getObjectPtr(drv, nvCtx->procPipeline.surface) : NULL;
+    VAStatus status = VA_STATUS_ERROR_INVALID_SURFACE;
+    bool recorded = false;
+    bool pushed = false;
+    if (src == NULL || src == dst) {
+        LOG("No source surface for video processing, or it's the render target");
+    } else if (!CHECK_CUDA_RESULT(cu->cuCtxPushCurrent(drv->cudaContext))) {
+        pushed = true;
+        status = processVideoProcPicture(drv, nvCtx, src, dst);
+        recorded = status == VA_STATUS_SUCCESS && !CHECK_CUDA_RESULT(cu->cuEventRecord(dst->resolveEvent, nvCtx->stream));
+    } else {
+        status = VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+    dst->context = nvCtx;
+    dst->decodeFailed = status != VA_STATUS_SUCCESS;
+    //the surface's fence is signalled from the stream, so the context has to still be current
+    markSurfaceResolved(dst, nvCtx->stream, recorded);
+    if (pushed) {
+        CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+    }
+    return status;
 }
 
-static VAStatus nvDestroyBuffer(
-        VADriverContextP ctx,
-        VABufferID buffer_id
-    )
-{
-    NVDriver *drv = (NVDriver*) ctx->pDriverData;
-    NVBuffer *buf = getObjectPtr(drv, buffer_id);
-    if (buf == NULL) {
-        return VA_STATUS_ERROR_INVALID_BUFFER;
+//finds the frame of a surface NVENC can't read in place from it's arrays, staging it on the stream if it's been
+//exported. Every encoder in readers may be reading from or have registered staging, so they're waited on before it's
+//written again, and told if it's reallocated
+static bool stageEncodeInput(NVContext **readers, int readerCount, NVScratchBuffer *staging, CUstream stream,
+                             NVSurface *src, NVEncodeFrame *frame) {
+    for (int i = 0; i < readerCount; i++) {
+        nvencWaitForStagedInput(readers[i]);
     }
-    if (buf->ptr != NULL) {
-        free(buf->ptr);
+    CUdeviceptr previous = staging->ptr;
+    bool ret = true;
+    pthread_mutex_lock(&src->mutex);
+    if (src->backingImage == NULL) {
+        frame->ptr = src->cudaFrame;
+        frame->pitch = src->cudaFramePitch;
+    } else {
+        ret = stageExportedFrame(staging, stream, src);
+        frame->ptr = staging->ptr;
+        frame->pitch = staging->pitch;
+        frame->staged = true;
     }
-    deleteObject(drv, buffer_id);
-    return VA_STATUS_SUCCESS;
+    pthread_mutex_unlock(&src->mutex);
+    if (previous != (CUdeviceptr) NULL && previous != staging->ptr) {
+        for (int i = 0; i < readerCount; i++) {
+            nvencForgetFrame(readers[i], previous);
+        }
+    }
+    return ret && frame->ptr != (CUdeviceptr) NULL;
 }
 
-static VAStatus nvBeginPicture(
-        VADriverContextP ctx,
-        VAContextID context,
-        VASurfaceID render_target
-    )
-{
-    NVDriver *drv = (NVDriver*) ctx->pDriverData;
-    NVContext *nvCtx = (NVContext*) getObjectPtr(drv, context);
-    NVSurface *surface = (NVSurface*) getObjectPtr(drv, render_target);
-    if (surface == NULL) {
-        return VA_STATUS_ERROR_INVALID_SURFACE;
+//finds where NVENC reads the source from, queueing a wait for it's latest frame on the context's stream. Called with
+//the context current, the frame can be encoded once the stream has completed
+static VAStatus prepareEncodeInput(NVContext *nvCtx, NVSurface *src, NVEncodeFrame *frame,
+                                   NVContext **readers, int readerCount, NVScratchBuffer *staging) {
+    //the input has to have been copied out of it's decoder, or converted into, first
+    waitForSurfaceQueued(src);
+    pthread_mutex_lock(&src->mutex);
+    bool srcEventPending = src->resolveEventPending;
+    //NVENC takes a whole frame as one resource, so of the exported surfaces only those with a single plane can be
+    //read in place. The planes of the others are separate arrays, and are staged
+    *frame = (NVEncodeFrame) {0};
+    if (src->backingImage != NULL && formatsInfo[nvSurfaceFormat(src)].numPlanes == 1) {
+        frame->array = src->backingImage->arrays[0];
     }
-    if (surface->context != NULL && surface->context != nvCtx) {
-        if (surface->backingImage != NULL) {
-            drv->backend->detachBackingImageFromSurface(drv, surface);
-        }
-        surface->pictureIdx = -1;
+    pthread_mutex_unlock(&src->mutex);
+    if (srcEventPending && CHECK_CUDA_RESULT(cu->cuStreamWaitEvent(nvCtx->stream, src->resolveEvent, 0))) {
+        return VA_STATUS_ERROR_OPERATION_FAILED;
     }
-    if (surface->pictureIdx == -1) {
-        if (nvCtx->currentPictureId == nvCtx->surfaceCount) {
-            return VA_STATUS_ERROR_MAX_NUM_EXCEEDED;
-        }
-        surface->pictureIdx = nvCtx->currentPictureId++;
+    if (frame->array == NULL && !stageEncodeInput(readers, readerCount, staging, nvCtx->stream, src, frame)) {
+        LOG("Nothing has been written to the input surface");
+        return VA_STATUS_ERROR_INVALID_SURFACE;
     }
-    pthread_mutex_lock(&surface->mutex);
-    surface->resolving = 1;
-    pthread_mutex_unlock(&surface->mutex);
-    memset(&nvCtx->pPicParams, 0, sizeof(CUVIDPICPARAMS));
-    nvCtx->renderTarget = surface;
-    nvCtx->renderTarget->progressiveFrame = true;
-    nvCtx->pPicParams.CurrPicIdx = nvCtx->renderTarget->pictureIdx;
     return VA_STATUS_SUCCESS;
 }
 
-static VAStatus nvRenderPicture(
-        VADriverContextP ctx,
-        VAContextID context,
-        VABufferID *buffers,
-        int num_buffers
-    )
-{
-    NVDriver *drv = (NVDriver*) ctx->pDriverData;
-    NVContext *nvCtx = (NVContext*) getObjectPtr(drv, context);
-    if (nvCtx == NULL) {
-        return VA_STATUS_ERROR_INVALID_CONTEXT;
+static VAStatus submitEncodeInput(NVContext *nvCtx, NVSurface *src, const NVEncodeFrame *frame) {
+    uint64_t start = statsStart(nvCtx->stats);
+    VAStatus status = nvencEncodePicture(nvCtx, src, frame);
+    statsRecord(nvCtx->stats, NV_STAT_ENCODE, start);
+    if (status == VA_STATUS_SUCCESS && !frame->staged) {
+        src->encodeRegistered = true;
     }
-    CUVIDPICPARAMS *picParams = &nvCtx->pPicParams;
-    for (int i = 0; i < num_buffers; i++) {
-        NVBuffer *buf = (NVBuffer*) getObject(drv, buffers[i])->obj;
-        if (buf == NULL || buf->ptr == NULL) {
-            LOG("Invalid buffer detected, skipping: %d", buffers[i]);
-            continue;
-        }
-        HandlerFunc func = nvCtx->codec->handlers[buf->bufferType];
-        if (func != NULL) {
-            func(nvCtx, buf, picParams);
-        } else {
-            LOG("Unhandled buffer type: %d", buf->bufferType);
-        }
+    return status;
+}
+
+static VAStatus endEncodePicture(NVDriver *drv, NVContext *nvCtx) {
+    NVSurface *src = nvCtx->renderTarget;
+    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
+    NVEncodeFrame frame;
+    VAStatus status = prepareEncodeInput(nvCtx, src, &frame, &nvCtx, 1, &nvCtx->procInput);
+    if (status == VA_STATUS_SUCCESS) {
+        //NVENC reads the frame outside of any stream, so it has to be complete
+        status = CHECK_CUDA_RESULT(cu->cuStreamSynchronize(nvCtx->stream)) ? VA_STATUS_ERROR_OPERATION_FAILED
+                                                                           : submitEncodeInput(nvCtx, src, &frame);
     }
-    return VA_STATUS_SUCCESS;
+    CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+    return status;
+}
+
+//throws away the picture rather than decoding it, the render target is marked as failed so waiting for it doesn't hang
+static VAStatus dropPicture(NVContext *nvCtx, VAStatus status) {
+    nvCtx->sliceArenaClaimed = false;
+    nvCtx->bitstreamBuffer.size = 0;
+    nvCtx->sliceOffsets.size = 0;
+    nvCtx->renderTarget->decodeFailed = true;
+    markSurfaceResolved(nvCtx->renderTarget, nvCtx->stream, false);
+    return status;
 }
 
 static VAStatus nvEndPicture(
@@ -1219,38 +4270,160 @@ static VAStatus nvEndPicture(
     )
 {
     NVDriver *drv = (NVDriver*) ctx->pDriverData;
-    NVContext *nvCtx = (NVContext*) getObject(drv, context)->obj;
+    NVContext *nvCtx = (NVContext*) getObjectPtr(drv, context);
     if (nvCtx == NULL) {
         return VA_STATUS_ERROR_INVALID_CONTEXT;
     }
+    NVTX_RANGE("vaEndPicture context %u surface %u idx %d", context,
+               nvCtx->renderTarget != NULL ? nvCtx->renderTarget->id : VA_INVALID_ID,
+               nvCtx->renderTarget != NULL ? nvCtx->renderTarget->pictureIdx : -1);
+    if (nvCtx->videoProc) {
+        return endVideoProcPicture(drv, nvCtx);
+    }
+    if (nvCtx->encoder != NULL) {
+        return endEncodePicture(drv, nvCtx);
+    }
     CUVIDPICPARAMS *picParams = &nvCtx->pPicParams;
-    picParams->pBitstreamData = nvCtx->bitstreamBuffer.buf;
+    if (nvCtx->sliceArenaClaimed) {
+        //the slice data was created in place, so the bitstream can be passed straight from the arena
+        picParams->pBitstreamData = PTROFF(nvCtx->sliceArena.buf, nvCtx->sliceArenaStart);
+    } else {
+        picParams->pBitstreamData = nvCtx->bitstreamBuffer.buf;
+    }
     picParams->pSliceDataOffsets = nvCtx->sliceOffsets.buf;
+    //this runs even if the picture ends up being dropped, so any parser state the codec keeps stays in step
+    if (nvCtx->codec->endPicture != NULL) {
+        nvCtx->codec->endPicture(nvCtx, picParams);
+    }
+    if (nvCtx->pictureStatus != VA_STATUS_SUCCESS) {
+        LOG("Dropping picture that couldn't be put together: %d", nvCtx->pictureStatus);
+        return dropPicture(nvCtx, nvCtx->pictureStatus);
+    }
+    if (nvCtx->decProcessing) {
+        VAStatus status = applyDecodeProcessing(nvCtx);
+        if (status != VA_STATUS_SUCCESS) {
+            LOG("Unable to apply decode processing, dropping picture");
+            return dropPicture(nvCtx, status);
+        }
+    }
+    //make sure the resolve thread can take this picture before submitting it, as there's no way to back out after
+    uint64_t start = statsStart(nvCtx->stats);
+    bool queued = waitForSurfaceQueueSpace(nvCtx);
+    statsRecord(nvCtx->stats, NV_STAT_QUEUE_WAIT, start);
+    if (!queued) {
+        LOG_WARN("Surface queue full, dropping picture");
+        return dropPicture(nvCtx, VA_STATUS_ERROR_HW_BUSY);
+    }
     nvCtx->bitstreamBuffer.size = 0;
     nvCtx->sliceOffsets.size = 0;
     CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
+    start = statsStart(nvCtx->stats);
+    NVTX_PUSH("cuvidDecodePicture idx %d", picParams->CurrPicIdx);
     CUresult result = cv->cuvidDecodePicture(nvCtx->decoder, picParams);
+    NVTX_POP();
+    statsRecord(nvCtx->stats, NV_STAT_DECODE, start);
+    //cuvidDecodePicture has consumed the bitstream, so the next picture can be assembled in the same buffers, which
+    //keep their size so only the largest picture so far grows them. The arena space can be reused once the buffers
+    //are destroyed
+    nvCtx->sliceArenaClaimed = false;
     CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), VA_STATUS_ERROR_OPERATION_FAILED);
     VAStatus status = VA_STATUS_SUCCESS;
     if (result != CUDA_SUCCESS) {
-        LOG("cuvidDecodePicture failed: %d", result);
+        LOG_ERROR("cuvidDecodePicture failed: %d", result);
         status = VA_STATUS_ERROR_DECODING_ERROR;
     }
     NVSurface *surface = nvCtx->renderTarget;
     surface->context = nvCtx;
     surface->topFieldFirst = !picParams->bottom_field_flag;
     surface->secondField = picParams->second_field;
+    surface->fieldPicture = picParams->field_pic_flag;
     surface->decodeFailed = status != VA_STATUS_SUCCESS;
-    pthread_mutex_lock(&nvCtx->resolveMutex);
-    nvCtx->surfaceQueue[nvCtx->surfaceQueueWriteIdx++] = nvCtx->renderTarget;
-    if (nvCtx->surfaceQueueWriteIdx >= SURFACE_QUEUE_SIZE) {
-        nvCtx->surfaceQueueWriteIdx = 0;
+    //can't fail, we're the only producer and waited for space above
+    if (nvCtx->stats != NULL) {
+        statsRecordValue(nvCtx->stats, NV_STAT_QUEUE_DEPTH, spsc_queue_size(&nvCtx->surfaceQueue));
     }
-    pthread_mutex_unlock(&nvCtx->resolveMutex);
-    pthread_cond_signal(&nvCtx->resolveCondition);
+    spsc_queue_push(&nvCtx->surfaceQueue, nvCtx->renderTarget);
+    resolveJobSchedule(&nvCtx->resolveJob);
     return status;
 }
 
+//waits for the copy out of the decoder recorded against the surface, if there is one
+static bool waitForSurfaceEvent(NVDriver *drv, NVSurface *surface) {
+    pthread_mutex_lock(&surface->mutex);
+    bool pending = surface->resolveEventPending;
+    pthread_mutex_unlock(&surface->mutex);
+    if (!pending) {
+        return true;
+    }
+    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), false);
+    bool ret = !CHECK_CUDA_RESULT(cu->cuEventSynchronize(surface->resolveEvent));
+    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), false);
+    return ret;
+}
+
+
+static uint64_t monotonicNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
+
+//waits up to timeout_ns for the surface's latest decode to be resolved, VA_TIMEOUT_INFINITE waits forever and 0 just polls
+static VAStatus syncSurface(NVDriver *drv, NVSurface *surface, uint64_t timeout_ns) {
+    if (timeout_ns == VA_TIMEOUT_INFINITE) {
+        //wait for the resolve thread to queue the copy, then for the copy itself
+        waitForSurfaceQueued(surface);
+        waitForSurfaceEncoded(surface);
+        if (!waitForSurfaceEvent(drv, surface)) {
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+        }
+        return surface->decodeFailed ? VA_STATUS_ERROR_DECODING_ERROR : VA_STATUS_SUCCESS;
+    }
+
+    uint64_t deadline = monotonicNs() + timeout_ns;
+    struct timespec abstime;
+    clock_gettime(CLOCK_REALTIME, &abstime);
+    abstime.tv_sec += (time_t) (timeout_ns / 1000000000ull);
+    abstime.tv_nsec += (long) (timeout_ns % 1000000000ull);
+    if (abstime.tv_nsec >= 1000000000L) {
+        abstime.tv_sec++;
+        abstime.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&surface->mutex);
+    while (surface->resolving || surface->encodesPending > 0) {
+        if (pthread_cond_timedwait(&surface->cond, &surface->mutex, &abstime) == ETIMEDOUT) {
+            break;
+        }
+    }
+    bool queued = !surface->resolving && surface->encodesPending == 0;
+    bool pending = surface->resolveEventPending;
+    pthread_mutex_unlock(&surface->mutex);
+    if (!queued) {
+        return VA_STATUS_ERROR_TIMEDOUT;
+    }
+
+    if (pending) {
+        CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
+        CUresult result;
+        while ((result = cu->cuEventQuery(surface->resolveEvent)) == CUDA_ERROR_NOT_READY) {
+            uint64_t now = monotonicNs();
+            if (now >= deadline) {
+                break;
+            }
+            struct timespec interval = { .tv_nsec = (long) MIN(deadline - now, SURFACE_POLL_INTERVAL_NS) };
+            nanosleep(&interval, NULL);
+        }
+        CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), VA_STATUS_ERROR_OPERATION_FAILED);
+        if (result == CUDA_ERROR_NOT_READY) {
+            return VA_STATUS_ERROR_TIMEDOUT;
+        }
+        if (CHECK_CUDA_RESULT(result)) {
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+        }
+    }
+    return surface->decodeFailed ? VA_STATUS_ERROR_DECODING_ERROR : VA_STATUS_SUCCESS;
+}
+
 static VAStatus nvSyncSurface(
         VADriverContextP ctx,
         VASurfaceID render_target
@@ -1261,13 +4434,48 @@ static VAStatus nvSyncSurface(
     if (surface == NULL) {
         return VA_STATUS_ERROR_INVALID_SURFACE;
     }
-    pthread_mutex_lock(&surface->mutex);
-    if (surface->resolving) {
-        pthread_cond_wait(&surface->cond, &surface->mutex);
+    uint64_t start = statsStart(drv->stats);
+    VAStatus status = syncSurface(drv, surface, VA_TIMEOUT_INFINITE);
+    statsRecord(drv->stats, NV_STAT_SYNC, start);
+    return status;
+}
+
+#if VA_CHECK_VERSION(1, 15, 0)
+static VAStatus nvSyncSurface2(
+        VADriverContextP ctx,
+        VASurfaceID surface,
+        uint64_t timeout_ns
+    )
+{
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    NVSurface *surfaceObj = getObjectPtr(drv, surface);
+    if (surfaceObj == NULL) {
+        return VA_STATUS_ERROR_INVALID_SURFACE;
     }
-    pthread_mutex_unlock(&surface->mutex);
-    return VA_STATUS_SUCCESS;
+    uint64_t start = statsStart(drv->stats);
+    VAStatus status = syncSurface(drv, surfaceObj, timeout_ns);
+    statsRecord(drv->stats, NV_STAT_SYNC, start);
+    return status;
+}
+#endif
+
+#if VA_CHECK_VERSION(1, 15, 0)
+static VAStatus nvSyncBuffer(
+        VADriverContextP ctx,
+        VABufferID buf_id,
+        uint64_t timeout_ns
+    )
+{
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    NVBuffer *buf = getObjectPtr(drv, buf_id);
+    if (buf == NULL) {
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+    }
+    //every other buffer is ready as soon as it's been created
+    NVContext *encodeCtx = codedBufferEncoder(drv, buf);
+    return encodeCtx != NULL ? nvencWaitForCodedBuffer(encodeCtx, buf, timeout_ns) : VA_STATUS_SUCCESS;
 }
+#endif
 
 static VAStatus nvQuerySurfaceStatus(
         VADriverContextP ctx,
@@ -1275,7 +4483,32 @@ static VAStatus nvQuerySurfaceStatus(
         VASurfaceStatus *status	/* out */
     )
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    NVSurface *surface = getObjectPtr(drv, render_target);
+    if (surface == NULL) {
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+    }
+    pthread_mutex_lock(&surface->mutex);
+    bool resolving = surface->resolving || surface->encodesPending > 0;
+    bool pending = surface->resolveEventPending;
+    pthread_mutex_unlock(&surface->mutex);
+    if (resolving) {
+        *status = VASurfaceRendering;
+        return VA_STATUS_SUCCESS;
+    }
+    //a failed decode is never resolved, so it's as ready as it'll ever be. vaSyncSurface will report the error
+    *status = VASurfaceReady;
+    if (pending) {
+        CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
+        CUresult result = cu->cuEventQuery(surface->resolveEvent);
+        CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), VA_STATUS_ERROR_OPERATION_FAILED);
+        if (result == CUDA_ERROR_NOT_READY) {
+            *status = VASurfaceRendering;
+        } else if (CHECK_CUDA_RESULT(result)) {
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+        }
+    }
+    return VA_STATUS_SUCCESS;
 }
 
 static VAStatus nvQuerySurfaceError(
@@ -1285,8 +4518,28 @@ static VAStatus nvQuerySurfaceError(
         void **error_info /*out*/
     )
 {
-    LOG("In %s", __func__);
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    NVSurface *surface = getObjectPtr(drv, render_target);
+    if (surface == NULL) {
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+    }
+    if (error_status != VA_STATUS_ERROR_DECODING_ERROR) {
+        return VA_STATUS_ERROR_UNIMPLEMENTED;
+    }
+    //NVDEC only tells us whether the picture had errors, not where, so the whole picture is reported
+    uint32_t mbCount = ((surface->width + 15) / 16) * ((surface->height + 15) / 16);
+    memset(surface->decodeErrors, 0, sizeof(surface->decodeErrors));
+    surface->decodeErrors[0].status = -1;
+    if (surface->decodeFailed || surface->decodeConcealed) {
+        surface->decodeErrors[0].status = 1;
+        surface->decodeErrors[0].start_mb = 0;
+        surface->decodeErrors[0].end_mb = mbCount - 1;
+        surface->decodeErrors[0].decode_error_type = VADecodeMBError;
+        surface->decodeErrors[0].num_mb = mbCount;
+        surface->decodeErrors[1].status = -1;
+    }
+    *error_info = surface->decodeErrors;
+    return VA_STATUS_SUCCESS;
 }
 
 static VAStatus nvPutSurface(
@@ -1306,7 +4559,7 @@ static VAStatus nvPutSurface(
         unsigned int flags
     )
 {
-    LOG("In %s", __func__);
+    LOG_TRACE("In %s", __func__);
     return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
@@ -1317,7 +4570,8 @@ static VAStatus nvQueryImageFormats(
     )
 {
     NVDriver *drv = (NVDriver*) ctx->pDriverData;
-    LOG("In %s", __func__);
+    LOG_TRACE("In %s", __func__);
+    ensureSurfaceSupport(drv);
     *num_formats = 0;
     for (unsigned int i = NV_FORMAT_NONE + 1; i < ARRAY_SIZE(formatsInfo); i++) {
         if (formatsInfo[i].is16bits && !drv->supports16BitSurface) {
@@ -1326,66 +4580,140 @@ static VAStatus nvQueryImageFormats(
         if (formatsInfo[i].isYuv444 && !drv->supports444Surface) {
             continue;
         }
+        //Q416 isn't available with older libva
+        if (formatsInfo[i].vaFormat.fourcc == 0) {
+            continue;
+        }
         format_list[(*num_formats)++] = formatsInfo[i].vaFormat;
     }
     return VA_STATUS_SUCCESS;
 }
 
-static VAStatus nvCreateImage(
-        VADriverContextP ctx,
-        VAImageFormat *format,
-        int width,
-        int height,
-        VAImage *image     /* out */
-    )
-{
-    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+//creates an image object, with it's buffer pointing at storage if it's given or a new allocation if not
+static VAStatus createImage(NVDriver *drv, const VAImageFormat *format, int width, int height, void *storage, VAImage *image) {
     NVFormat nvFormat = nvFormatFromVaFormat(format->fourcc);
     const NVFormatInfo *fmtInfo = &formatsInfo[nvFormat];
-    const NVFormatPlane *p = fmtInfo->plane;
     if (nvFormat == NV_FORMAT_NONE) {
         return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
     }
     Object imageObj = allocateObject(drv, OBJECT_TYPE_IMAGE, sizeof(NVImage));
+    if (imageObj == NULL) {
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
     image->image_id = imageObj->id;
-    LOG("created image id: %d", imageObj->id);
+    LOG_TRACE("created image id: %d", imageObj->id);
     NVImage *img = (NVImage*) imageObj->obj;
     img->width = width;
     img->height = height;
     img->format = nvFormat;
     Object imageBufferObject = allocateObject(drv, OBJECT_TYPE_BUFFER, sizeof(NVBuffer));
+    if (imageBufferObject == NULL) {
+        deleteObject(drv, imageObj->id);
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
     NVBuffer *imageBuffer = (NVBuffer*) imageBufferObject->obj;
     imageBuffer->bufferType = VAImageBufferType;
-    imageBuffer->size = 0;
-    for (uint32_t i = 0; i < fmtInfo->numPlanes; i++) {
-        imageBuffer->size += ((width * height) >> (p[i].ss.x + p[i].ss.y)) * fmtInfo->bppc * p[i].channelCount;
-    }
+    imageBuffer->context = VA_INVALID_ID;
+    imageBuffer->size = imageSize(fmtInfo, width, height);
     imageBuffer->elements = 1;
-    imageBuffer->ptr = memalign(16, imageBuffer->size);
+    if (storage != NULL) {
+        imageBuffer->ptr = storage;
+    } else {
+        //page-locked so vaGetImage's copies can run asynchronously
+        img->pinned = allocHostMemory(drv, &imageBuffer->ptr, imageBuffer->size);
+        if (!img->pinned) {
+            imageBuffer->ptr = memalign(16, imageBuffer->size);
+        }
+    }
     img->imageBuffer = imageBuffer;
+    img->imageBufferId = imageBufferObject->id;
     memcpy(&image->format, format, sizeof(VAImageFormat));
     image->buf = imageBufferObject->id;
     image->width = width;
     image->height = height;
     image->data_size = imageBuffer->size;
     image->num_planes = fmtInfo->numPlanes;
-    image->pitches[0] = width * fmtInfo->bppc;
-    image->pitches[1] = width * fmtInfo->bppc;
-    image->pitches[2] = width * fmtInfo->bppc;
-    image->offsets[0] = 0;
-    image->offsets[1] = image->offsets[0] + ((width * height) >> (p[0].ss.x + p[0].ss.y)) * fmtInfo->bppc * p[0].channelCount;
-    image->offsets[2] = image->offsets[1] + ((width * height) >> (p[1].ss.x + p[1].ss.y)) * fmtInfo->bppc * p[1].channelCount;
+    for (uint32_t i = 0; i < 3; i++) {
+        image->pitches[i] = imagePlanePitch(fmtInfo, width, i);
+        image->offsets[i] = imagePlaneOffset(fmtInfo, width, height, i);
+    }
     return VA_STATUS_SUCCESS;
 }
 
+static VAStatus nvCreateImage(
+        VADriverContextP ctx,
+        VAImageFormat *format,
+        int width,
+        int height,
+        VAImage *image     /* out */
+    )
+{
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    return createImage(drv, format, width, height, NULL, image);
+}
+
 static VAStatus nvDeriveImage(
         VADriverContextP ctx,
         VASurfaceID surface,
         VAImage *image     /* out */
     )
 {
-    LOG("In %s", __func__);
-    return VA_STATUS_ERROR_OPERATION_FAILED;
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    NVSurface *surfaceObj = (NVSurface*) getObjectPtr(drv, surface);
+    if (surfaceObj == NULL) {
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+    }
+    //a surface nothing has been written to yet fails at the copy below, vaPutImage writes without a context
+    const NVFormatInfo *fmtInfo = &formatsInfo[nvSurfaceFormat(surfaceObj)];
+    nvSyncSurface(ctx, surface);
+
+    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
+    //the surface keeps it's host copy once it's been derived, and the resolve thread refreshes it after every decode.
+    //Clients like ffmpeg derive and destroy an image for every frame they read back, so only the first one pays for a copy here.
+    //The image is a read-only snapshot, nothing the client writes into it makes it back to the surface
+    pthread_mutex_lock(&surfaceObj->mutex);
+    NVHostFrame *detached;
+    bool filled = true;
+    if (refreshableHostFrame(surfaceObj, &detached) == NULL) {
+        size_t size = imageSize(fmtInfo, surfaceObj->width, surfaceObj->height);
+        NVHostFrame *frame = calloc(1, sizeof(NVHostFrame));
+        if (frame != NULL) {
+            atomic_init(&frame->refs, 1);
+            atomic_init(&frame->mapped, 0);
+            //page-locked memory lets the resolve thread's copies run asynchronously
+            frame->pinned = allocHostMemory(drv, &frame->ptr, size);
+            if (!frame->pinned) {
+                frame->ptr = memalign(16, size);
+            }
+            surfaceObj->hostFrame = frame;
+        }
+        VARectangle rect = { .width = surfaceObj->width, .height = surfaceObj->height };
+        filled = frame != NULL && frame->ptr != NULL
+                && copySurfaceToHost(surfaceObj, fmtInfo, (CUdeviceptr) NULL, 0, &rect, surfaceObj->width, surfaceObj->height,
+                                     frame->ptr, NULL)
+                && !CHECK_CUDA_RESULT(cu->cuStreamSynchronize(NULL));
+    }
+    NVHostFrame *hostFrame = surfaceObj->hostFrame;
+    if (filled) {
+        atomic_fetch_add(&hostFrame->refs, 1);
+    }
+    pthread_mutex_unlock(&surfaceObj->mutex);
+    CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+    releaseHostFrame(drv, detached);
+    if (!filled) {
+        freeHostFrame(drv, surfaceObj);
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+
+    VAStatus status = createImage(drv, &fmtInfo->vaFormat, surfaceObj->width, surfaceObj->height, hostFrame->ptr, image);
+    if (status == VA_STATUS_SUCCESS) {
+        NVBuffer *buf = (NVBuffer*) getObjectPtr(drv, image->buf);
+        buf->derivedSurface = surface;
+        buf->hostFrame = hostFrame;
+    } else {
+        releaseHostFrame(drv, hostFrame);
+    }
+    return status;
 }
 
 static VAStatus nvDestroyImage(
@@ -1398,10 +4726,22 @@ static VAStatus nvDestroyImage(
     if (img == NULL) {
         return VA_STATUS_ERROR_INVALID_IMAGE;
     }
-    Object imageBufferObj = getObjectByPtr(drv, img->imageBuffer);
+    if (img->staging != (CUdeviceptr) NULL && !CHECK_CUDA_RESULT(cu->cuCtxPushCurrent(drv->cudaContext))) {
+        CHECK_CUDA_RESULT(cu->cuMemFree(img->staging));
+        CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+    }
+    //the buffer may have been destroyed already with vaDestroyBuffer, in which case it's id no longer resolves
+    Object imageBufferObj = getObject(drv, img->imageBufferId);
     if (imageBufferObj != NULL) {
-        if (img->imageBuffer->ptr != NULL) {
-            free(img->imageBuffer->ptr);
+        //a derived image's buffer is shared with the surface
+        if (img->imageBuffer->hostFrame != NULL) {
+            releaseHostFrame(drv, img->imageBuffer->hostFrame);
+        } else if (img->imageBuffer->ptr != NULL) {
+            if (img->pinned) {
+                freeHostMemory(drv, img->imageBuffer->ptr);
+            } else {
+                free(img->imageBuffer->ptr);
+            }
         }
         deleteObject(drv, imageBufferObj->id);
     }
@@ -1415,7 +4755,7 @@ static VAStatus nvSetImagePalette(
             unsigned char *palette
     )
 {
-    LOG("In %s", __func__);
+    LOG_TRACE("In %s", __func__);
     return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
@@ -1430,38 +4770,74 @@ static VAStatus nvGetImage(
     )
 {
     NVDriver *drv = (NVDriver*) ctx->pDriverData;
-    NVSurface *surfaceObj = (NVSurface*) getObject(drv, surface)->obj;
-    NVImage *imageObj = (NVImage*) getObject(drv, image)->obj;
+    NVSurface *surfaceObj = (NVSurface*) getObjectPtr(drv, surface);
+    NVImage *imageObj = (NVImage*) getObjectPtr(drv, image);
+    if (surfaceObj == NULL) {
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+    }
+    if (imageObj == NULL) {
+        return VA_STATUS_ERROR_INVALID_IMAGE;
+    }
     NVContext *context = (NVContext*) surfaceObj->context;
     const NVFormatInfo *fmtInfo = &formatsInfo[imageObj->format];
-    uint32_t offset = 0;
-    if (context == NULL) {
-        return VA_STATUS_ERROR_INVALID_CONTEXT;
+    //planar 4:2:0 is read back as the surface's own semi-planar format, then split
+    const NVFormatInfo *surfaceFmt = &formatsInfo[nvSurfaceFormat(surfaceObj)];
+    bool planar = fmtInfo->uploadOnly;
+    if (planar && (surfaceFmt->numPlanes != 2 || surfaceFmt->isYuv444 || surfaceFmt->isRgb)) {
+        return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
     }
-    nvSyncSurface(ctx, surface);
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
-    for (uint32_t i = 0; i < fmtInfo->numPlanes; i++) {
-        const NVFormatPlane *p = &fmtInfo->plane[i];
-        CUDA_MEMCPY2D memcpy2d = {
-            .srcXInBytes = 0, .srcY = 0,
-            .srcMemoryType = CU_MEMORYTYPE_ARRAY,
-            .srcArray = surfaceObj->backingImage->arrays[i],
-            .dstXInBytes = 0, .dstY = 0,
-            .dstMemoryType = CU_MEMORYTYPE_HOST,
-            .dstHost = (char *)imageObj->imageBuffer->ptr + offset,
-            .dstPitch = width * fmtInfo->bppc,
-            .WidthInBytes = (width >> p->ss.x) * fmtInfo->bppc * p->channelCount,
-            .Height = height >> p->ss.y
-        };
-        CUresult result = cu->cuMemcpy2D(&memcpy2d);
-        if (result != CUDA_SUCCESS) {
-                LOG("cuMemcpy2D failed: %d", result);
-                return VA_STATUS_ERROR_DECODING_ERROR;
+    //RGB surfaces can only be read back as themselves, and YUV surfaces never as RGB
+    if ((fmtInfo->isRgb || surfaceObj->rgbFormat != NV_FORMAT_NONE) && imageObj->format != nvSurfaceFormat(surfaceObj)) {
+        return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
+    }
+    if (x < 0 || y < 0 || x + width > surfaceObj->width || y + height > surfaceObj->height
+            || width > (unsigned int) imageObj->width || height > (unsigned int) imageObj->height) {
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    //only the region asked for is transferred, and it has to start on a chroma sample
+    if (!onChromaSamples(fmtInfo, (uint32_t) x, (uint32_t) y)) {
+        LOG("Unable to read back a region at %d,%d, it splits the chroma samples", x, y);
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    VARectangle rect = {
+        .x = x,
+        .y = y,
+        .width = width,
+        .height = height
+    };
+    void *staging = NULL;
+    if (planar) {
+        staging = malloc(imageSize(surfaceFmt, width, height));
+        if (staging == NULL) {
+            return VA_STATUS_ERROR_ALLOCATION_FAILED;
         }
-        offset += ((width * height) >> (p->ss.x + p->ss.y)) * fmtInfo->bppc * p->channelCount;
     }
+    //the copies are queued on the surface's own context's stream, after whatever last wrote the surface. That's usually
+    //the resolve on the same stream, but video processing or vaPutImage may have written it on another one. A surface
+    //only ever written by vaPutImage has no context, so the default stream is used
+    CUstream stream = context != NULL ? context->stream : NULL;
+    waitForSurfaceQueued(surfaceObj);
+    pthread_mutex_lock(&surfaceObj->mutex);
+    bool eventPending = surfaceObj->resolveEventPending;
+    pthread_mutex_unlock(&surfaceObj->mutex);
+    VAStatus status = VA_STATUS_SUCCESS;
+    if (CHECK_CUDA_RESULT(cu->cuCtxPushCurrent(drv->cudaContext))) {
+        free(staging);
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+    if ((eventPending && CHECK_CUDA_RESULT(cu->cuStreamWaitEvent(stream, surfaceObj->resolveEvent, 0)))
+            || !copySurfaceToHost(surfaceObj, planar ? surfaceFmt : fmtInfo, (CUdeviceptr) NULL, 0, &rect,
+                                  planar ? width : (uint32_t) imageObj->width, planar ? height : (uint32_t) imageObj->height,
+                                  planar ? staging : imageObj->imageBuffer->ptr, stream)
+            || CHECK_CUDA_RESULT(cu->cuStreamSynchronize(stream))) {
+        status = VA_STATUS_ERROR_DECODING_ERROR;
+    } else if (planar) {
+        splitToPlanar(surfaceFmt, staging, fmtInfo, imageObj->format == NV_FORMAT_YV12, width, height,
+                      imageObj->width, imageObj->height, imageObj->imageBuffer->ptr);
+    }
+    free(staging);
     CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), VA_STATUS_ERROR_OPERATION_FAILED);
-    return VA_STATUS_SUCCESS;
+    return status;
 }
 
 static VAStatus nvPutImage(
@@ -1478,8 +4854,176 @@ static VAStatus nvPutImage(
         unsigned int dest_height
     )
 {
-    LOG("In %s", __func__);
-    return VA_STATUS_SUCCESS;
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    NVSurface *surfaceObj = (NVSurface*) getObjectPtr(drv, surface);
+    NVImage *imageObj = (NVImage*) getObjectPtr(drv, image);
+    if (surfaceObj == NULL) {
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+    }
+    if (imageObj == NULL) {
+        return VA_STATUS_ERROR_INVALID_IMAGE;
+    }
+    if (src_width != dest_width || src_height != dest_height) {
+        LOG("Scaling in vaPutImage is not supported");
+        return VA_STATUS_ERROR_UNIMPLEMENTED;
+    }
+    if (src_x < 0 || src_y < 0 || src_x + src_width > (unsigned int) imageObj->width || src_y + src_height > (unsigned int) imageObj->height
+            || dest_x < 0 || dest_y < 0 || dest_x + dest_width > surfaceObj->width || dest_y + dest_height > surfaceObj->height) {
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    const NVFormatInfo *srcFmt = &formatsInfo[imageObj->format];
+    const NVFormatInfo *dstFmt = &formatsInfo[nvSurfaceFormat(surfaceObj)];
+    //8-bit images can be widened into 16-bit surfaces, and planar 4:2:0 interleaved into semi-planar, on the GPU
+    bool wide = dstFmt->is16bits && !srcFmt->is16bits;
+    bool interleave = srcFmt->numPlanes == 3 && dstFmt->numPlanes == 2;
+    if ((srcFmt->is16bits && !dstFmt->is16bits) || srcFmt->isYuv444 != dstFmt->isYuv444
+            || (srcFmt->numPlanes != dstFmt->numPlanes && !interleave)
+            || ((srcFmt->isRgb || dstFmt->isRgb) && srcFmt != dstFmt)) {
+        LOG("Unable to put image of format %d into surface of format %d", imageObj->format, nvSurfaceFormat(surfaceObj));
+        return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
+    }
+    //chroma samples can't be split, so both regions have to start on one
+    if (!onChromaSamples(srcFmt, (uint32_t) src_x, (uint32_t) src_y) || !onChromaSamples(dstFmt, (uint32_t) dest_x, (uint32_t) dest_y)) {
+        LOG("Unable to put image region at %d,%d to %d,%d, it splits the chroma samples", src_x, src_y, dest_x, dest_y);
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    uint32_t sx = src_x, sy = src_y, dx = dest_x, dy = dest_y;
+    uint32_t width = src_width, height = src_height;
+
+    //make sure the copy of a previous decode isn't still writing into the surface
+    nvSyncSurface(ctx, surface);
+    NVContext *nvCtx = (NVContext*) surfaceObj->context;
+    CUstream stream = nvCtx != NULL ? nvCtx->stream : NULL;
+    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
+    VAStatus status = VA_STATUS_SUCCESS;
+    if ((wide || interleave) && !ensureKernels(cu, &drv->kernels)) {
+        LOG("Unable to load conversion kernels");
+        status = VA_STATUS_ERROR_OPERATION_FAILED;
+        goto out;
+    }
+    //staging for the converted planes, first the uploaded source samples then the packed output
+    size_t uploadSize = imageObj->imageBuffer->size;
+    size_t stagingSize = uploadSize + imageSize(dstFmt, imageObj->width, imageObj->height);
+    if ((wide || interleave) && imageObj->stagingSize < stagingSize) {
+        if (imageObj->staging != (CUdeviceptr) NULL) {
+            CHECK_CUDA_RESULT(cu->cuMemFree(imageObj->staging));
+            imageObj->staging = (CUdeviceptr) NULL;
+            imageObj->stagingSize = 0;
+        }
+        if (CHECK_CUDA_RESULT(cu->cuMemAlloc(&imageObj->staging, stagingSize))) {
+            status = VA_STATUS_ERROR_ALLOCATION_FAILED;
+            goto out;
+        }
+        imageObj->stagingSize = stagingSize;
+    }
+
+    pthread_mutex_lock(&surfaceObj->mutex);
+    if (surfaceObj->backingImage == NULL && !allocCudaFrame(drv, surfaceObj)) {
+        pthread_mutex_unlock(&surfaceObj->mutex);
+        status = VA_STATUS_ERROR_ALLOCATION_FAILED;
+        goto out;
+    }
+    const uint8_t *host = (const uint8_t*) imageObj->imageBuffer->ptr;
+    uint32_t planeY = 0;
+    for (uint32_t i = 0; i < dstFmt->numPlanes && status == VA_STATUS_SUCCESS; i++) {
+        const NVFormatPlane *dp = &dstFmt->plane[i];
+        uint32_t dstBpp = dstFmt->bppc * dp->channelCount;
+        CUDA_MEMCPY2D cpy = {
+            .dstXInBytes = (dx >> dp->ss.x) * dstBpp,
+            .dstY = dy >> dp->ss.y,
+            .WidthInBytes = (width >> dp->ss.x) * dstBpp,
+            .Height = height >> dp->ss.y
+        };
+        if (surfaceObj->backingImage != NULL) {
+            cpy.dstMemoryType = CU_MEMORYTYPE_ARRAY;
+            cpy.dstArray = surfaceObj->backingImage->arrays[i];
+        } else {
+            cpy.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+            cpy.dstDevice = surfaceObj->cudaFrame;
+            cpy.dstPitch = surfaceObj->cudaFramePitch;
+            cpy.dstY += planeY;
+        }
+        planeY += surfaceObj->height >> dp->ss.y;
+
+        //the image planes this surface plane is built from, for 4:2:0 planar the chroma comes from U and V
+        uint32_t srcPlanes[2] = { i, 0 };
+        uint32_t srcPlaneCount = 1;
+        if (interleave && i == 1) {
+            bool yv12 = imageObj->format == NV_FORMAT_YV12;
+            srcPlanes[0] = yv12 ? 2 : 1;
+            srcPlanes[1] = yv12 ? 1 : 2;
+            srcPlaneCount = 2;
+        }
+        const NVFormatPlane *sp = &srcFmt->plane[srcPlanes[0]];
+        uint32_t srcBpp = srcFmt->bppc * sp->channelCount;
+        uint32_t srcWidthInBytes = (width >> sp->ss.x) * srcBpp;
+        uint32_t srcRows = height >> sp->ss.y;
+
+        if (!wide && srcPlaneCount == 1) {
+            //same layout, straight from the image
+            cpy.srcMemoryType = CU_MEMORYTYPE_HOST;
+            cpy.srcHost = host + imagePlaneOffset(srcFmt, imageObj->width, imageObj->height, i);
+            cpy.srcPitch = imagePlanePitch(srcFmt, imageObj->width, i);
+            cpy.srcXInBytes = (sx >> sp->ss.x) * srcBpp;
+            cpy.srcY = sy >> sp->ss.y;
+        } else {
+            CUdeviceptr upload[2] = { 0, 0 };
+            for (uint32_t j = 0; j < srcPlaneCount; j++) {
+                upload[j] = imageObj->staging + j * srcWidthInBytes * srcRows;
+                CUDA_MEMCPY2D up = {
+                    .srcMemoryType = CU_MEMORYTYPE_HOST,
+                    .srcHost = host + imagePlaneOffset(srcFmt, imageObj->width, imageObj->height, srcPlanes[j]),
+                    .srcPitch = imagePlanePitch(srcFmt, imageObj->width, srcPlanes[j]),
+                    .srcXInBytes = (sx >> sp->ss.x) * srcBpp,
+                    .srcY = sy >> sp->ss.y,
+                    .dstMemoryType = CU_MEMORYTYPE_DEVICE,
+                    .dstDevice = upload[j],
+                    .dstPitch = srcWidthInBytes,
+                    .WidthInBytes = srcWidthInBytes,
+                    .Height = srcRows
+                };
+                if (CHECK_CUDA_RESULT(cu->cuMemcpy2DAsync(&up, stream))) {
+                    status = VA_STATUS_ERROR_OPERATION_FAILED;
+                }
+            }
+            CUdeviceptr packed = imageObj->staging + uploadSize;
+            if (status == VA_STATUS_SUCCESS
+                    && !packPlane(cu, &drv->kernels, packed, cpy.WidthInBytes, upload[0], upload[1], srcWidthInBytes,
+                                  srcWidthInBytes / srcFmt->bppc, srcRows, wide, stream)) {
+                status = VA_STATUS_ERROR_OPERATION_FAILED;
+            }
+            cpy.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+            cpy.srcDevice = packed;
+            cpy.srcPitch = cpy.WidthInBytes;
+        }
+        if (status == VA_STATUS_SUCCESS && CHECK_CUDA_RESULT(cu->cuMemcpy2DAsync(&cpy, stream))) {
+            status = VA_STATUS_ERROR_OPERATION_FAILED;
+        }
+    }
+    //same as the resolve thread, keep the host copy of a derived surface up to date. If the upload didn't all make it
+    //the copy is let go instead, so the next nvDeriveImage reads back whatever the surface ended up with
+    NVHostFrame *detached;
+    NVHostFrame *hostFrame = refreshableHostFrame(surfaceObj, &detached);
+    if (status == VA_STATUS_SUCCESS && hostFrame != NULL) {
+        VARectangle all = { .width = surfaceObj->width, .height = surfaceObj->height };
+        if (!copySurfaceToHost(surfaceObj, &formatsInfo[nvSurfaceFormat(surfaceObj)], (CUdeviceptr) NULL, 0, &all,
+                               surfaceObj->width, surfaceObj->height, hostFrame->ptr, stream)) {
+            status = VA_STATUS_ERROR_OPERATION_FAILED;
+        }
+    }
+    if (status != VA_STATUS_SUCCESS && hostFrame != NULL) {
+        detached = hostFrame;
+        surfaceObj->hostFrame = NULL;
+    }
+    pthread_mutex_unlock(&surfaceObj->mutex);
+    releaseHostFrame(drv, detached);
+    //the client is free to reuse the image once we return
+    if (CHECK_CUDA_RESULT(cu->cuStreamSynchronize(stream)) && status == VA_STATUS_SUCCESS) {
+        status = VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+out:
+    CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+    return status;
 }
 
 static VAStatus nvQuerySubpictureFormats(
@@ -1489,7 +5033,7 @@ static VAStatus nvQuerySubpictureFormats(
         unsigned int *num_formats
     )
 {
-    LOG("In %s", __func__);
+    LOG_TRACE("In %s", __func__);
     *num_formats = 0;
     return VA_STATUS_SUCCESS;
 }
@@ -1500,7 +5044,7 @@ static VAStatus nvCreateSubpicture(
         VASubpictureID *subpicture
     )
 {
-    LOG("In %s", __func__);
+    LOG_TRACE("In %s", __func__);
     return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
@@ -1509,7 +5053,7 @@ static VAStatus nvDestroySubpicture(
         VASubpictureID subpicture
     )
 {
-    LOG("In %s", __func__);
+    LOG_TRACE("In %s", __func__);
     return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
@@ -1519,7 +5063,7 @@ static VAStatus nvSetSubpictureImage(
                 VAImageID image
         )
 {
-    LOG("In %s", __func__);
+    LOG_TRACE("In %s", __func__);
     return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
@@ -1531,7 +5075,7 @@ static VAStatus nvSetSubpictureChromakey(
         unsigned int chromakey_mask
     )
 {
-    LOG("In %s", __func__);
+    LOG_TRACE("In %s", __func__);
     return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
@@ -1541,7 +5085,7 @@ static VAStatus nvSetSubpictureGlobalAlpha(
         float global_alpha
     )
 {
-    LOG("In %s", __func__);
+    LOG_TRACE("In %s", __func__);
     return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
@@ -1561,7 +5105,7 @@ static VAStatus nvAssociateSubpicture(
         unsigned int flags
     )
 {
-    LOG("In %s", __func__);
+    LOG_TRACE("In %s", __func__);
     return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
@@ -1572,7 +5116,7 @@ static VAStatus nvDeassociateSubpicture(
         int num_surfaces
     )
 {
-    LOG("In %s", __func__);
+    LOG_TRACE("In %s", __func__);
     return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
@@ -1582,7 +5126,7 @@ static VAStatus nvQueryDisplayAttributes(
         int *num_attributes
         )
 {
-    LOG("In %s", __func__);
+    LOG_TRACE("In %s", __func__);
     *num_attributes = 0;
     return VA_STATUS_SUCCESS;
 }
@@ -1593,7 +5137,7 @@ static VAStatus nvGetDisplayAttributes(
         int num_attributes
         )
 {
-    LOG("In %s", __func__);
+    LOG_TRACE("In %s", __func__);
     return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
@@ -1603,10 +5147,51 @@ static VAStatus nvSetDisplayAttributes(
         int num_attributes
         )
 {
-    LOG("In %s", __func__);
+    LOG_TRACE("In %s", __func__);
     return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
+static bool videoProcFormatSupported(NVDriver *drv, NVFormat format) {
+    const NVFormatInfo *fmtInfo = &formatsInfo[format];
+    return fmtInfo->vaFormat.fourcc != 0 && !fmtInfo->uploadOnly
+            && (!fmtInfo->is16bits || drv->supports16BitSurface)
+            && (!fmtInfo->isYuv444 || drv->supports444Surface)
+            && (!fmtInfo->isRgb || backend != EGL);
+}
+
+static VAStatus queryVideoProcSurfaceAttributes(NVDriver *drv, VASurfaceAttrib *attrib_list, unsigned int *num_attribs) {
+    ensureSurfaceSupport(drv);
+    VASurfaceAttrib attribs[4 + ARRAY_SIZE(formatsInfo)];
+    unsigned int count = 0;
+    const struct { VASurfaceAttribType type; int value; } limits[] = {
+        { VASurfaceAttribMinWidth, VIDEO_PROC_MIN_SIZE },
+        { VASurfaceAttribMinHeight, VIDEO_PROC_MIN_SIZE },
+        { VASurfaceAttribMaxWidth, VIDEO_PROC_MAX_SIZE },
+        { VASurfaceAttribMaxHeight, VIDEO_PROC_MAX_SIZE },
+    };
+    for (uint32_t i = 0; i < ARRAY_SIZE(limits); i++) {
+        attribs[count++] = (VASurfaceAttrib) {
+            .type = limits[i].type,
+            .value = { .type = VAGenericValueTypeInteger, .value.i = limits[i].value }
+        };
+    }
+    for (uint32_t i = NV_FORMAT_NONE + 1; i < ARRAY_SIZE(formatsInfo); i++) {
+        if (videoProcFormatSupported(drv, i)) {
+            attribs[count++] = (VASurfaceAttrib) {
+                .type = VASurfaceAttribPixelFormat,
+                .value = { .type = VAGenericValueTypeInteger, .value.i = (int) formatsInfo[i].vaFormat.fourcc }
+            };
+        }
+    }
+    if (num_attribs != NULL) {
+        *num_attribs = count;
+    }
+    if (attrib_list != NULL) {
+        memcpy(attrib_list, attribs, count * sizeof(VASurfaceAttrib));
+    }
+    return VA_STATUS_SUCCESS;
+}
+
 static VAStatus nvQuerySurfaceAttributes(
         VADriverContextP    ctx,
 	    VAConfigID          config,
@@ -1619,7 +5204,10 @@ static VAStatus nvQuerySurfaceAttributes(
     if (cfg == NULL) {
         return VA_STATUS_ERROR_INVALID_CONFIG;
     }
-    LOG("with %d (%d) %p %d", cfg->cudaCodec, cfg->bitDepth, attrib_list, *num_attribs);
+    if (cfg->entrypoint == VAEntrypointVideoProc) {
+        return queryVideoProcSurfaceAttributes(drv, attrib_list, num_attribs);
+    }
+    LOG_TRACE("with %d (%d) %p %d", cfg->cudaCodec, cfg->bitDepth, attrib_list, *num_attribs);
     if (cfg->chromaFormat != cudaVideoChromaFormat_420 && cfg->chromaFormat != cudaVideoChromaFormat_444) {
         LOG("Unknown chrome format: %d", cfg->chromaFormat);
         return VA_STATUS_ERROR_INVALID_CONFIG;
@@ -1645,6 +5233,9 @@ static VAStatus nvQuerySurfaceAttributes(
                 cnt += 3;
             }
         }
+        if (backend == DIRECT) {
+            cnt += 3;
+        }
         *num_attribs = cnt;
     }
     if (attrib_list != NULL) {
@@ -1672,7 +5263,7 @@ static VAStatus nvQuerySurfaceAttributes(
         attrib_list[3].flags = 0;
         attrib_list[3].value.type = VAGenericValueTypeInteger;
         attrib_list[3].value.value.i = videoDecodeCaps.nMaxHeight;
-        LOG("Returning constraints: width: %d - %d, height: %d - %d", attrib_list[0].value.value.i, attrib_list[2].value.value.i, attrib_list[1].value.value.i, attrib_list[3].value.value.i);
+        LOG_TRACE("Returning constraints: width: %d - %d, height: %d - %d", attrib_list[0].value.value.i, attrib_list[2].value.value.i, attrib_list[1].value.value.i, attrib_list[3].value.value.i);
         int attrib_idx = 4;
         if (cfg->chromaFormat == cudaVideoChromaFormat_444) {
             attrib_list[attrib_idx].type = VASurfaceAttribPixelFormat;
@@ -1711,6 +5302,25 @@ static VAStatus nvQuerySurfaceAttributes(
                 attrib_idx += 1;
             }
         }
+        if (backend == DIRECT) {
+            //the surface's modifier depends on it's height, so there's no list to give, see surfaceModifierAllowed
+            attrib_list[attrib_idx].type = VASurfaceAttribDRMFormatModifiers;
+            attrib_list[attrib_idx].flags = VA_SURFACE_ATTRIB_SETTABLE;
+            attrib_list[attrib_idx].value.type = VAGenericValueTypePointer;
+            attrib_list[attrib_idx].value.value.p = NULL;
+            attrib_idx += 1;
+            //dma-bufs laid out like our own exports can be decoded into directly
+            attrib_list[attrib_idx].type = VASurfaceAttribMemoryType;
+            attrib_list[attrib_idx].flags = VA_SURFACE_ATTRIB_GETTABLE | VA_SURFACE_ATTRIB_SETTABLE;
+            attrib_list[attrib_idx].value.type = VAGenericValueTypeInteger;
+            attrib_list[attrib_idx].value.value.i = VA_SURFACE_ATTRIB_MEM_TYPE_VA | VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2;
+            attrib_idx += 1;
+            attrib_list[attrib_idx].type = VASurfaceAttribExternalBufferDescriptor;
+            attrib_list[attrib_idx].flags = VA_SURFACE_ATTRIB_SETTABLE;
+            attrib_list[attrib_idx].value.type = VAGenericValueTypePointer;
+            attrib_list[attrib_idx].value.value.p = NULL;
+            attrib_idx += 1;
+        }
     }
     return VA_STATUS_SUCCESS;
 }
@@ -1723,7 +5333,7 @@ static VAStatus nvBufferInfo(
            unsigned int *num_elements
 )
 {
-    LOG("In %s", __func__);
+    LOG_TRACE("In %s", __func__);
     *size = 0;
     *num_elements = 0;
     return VA_STATUS_SUCCESS;
@@ -1735,7 +5345,7 @@ static VAStatus nvAcquireBufferHandle(
             VABufferInfo *      buf_info
         )
 {
-    LOG("In %s", __func__);
+    LOG_TRACE("In %s", __func__);
     return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
@@ -1744,7 +5354,7 @@ static VAStatus nvReleaseBufferHandle(
             VABufferID          buf_id
         )
 {
-    LOG("In %s", __func__);
+    LOG_TRACE("In %s", __func__);
     return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
@@ -1762,7 +5372,7 @@ static VAStatus nvLockSurface(
         void **buffer
 )
 {
-    LOG("In %s", __func__);
+    LOG_TRACE("In %s", __func__);
     return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
@@ -1771,7 +5381,7 @@ static VAStatus nvUnlockSurface(
         VASurfaceID surface
 )
 {
-    LOG("In %s", __func__);
+    LOG_TRACE("In %s", __func__);
     return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
@@ -1780,8 +5390,52 @@ static VAStatus nvCreateMFContext(
             VAMFContextID *mfe_context
         )
 {
-    LOG("In %s", __func__);
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    Object obj = allocateObject(drv, OBJECT_TYPE_MF_CONTEXT, sizeof(NVMFContext));
+    if (obj == NULL) {
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+    *mfe_context = obj->id;
+    return VA_STATUS_SUCCESS;
+}
+
+static NVMFContext *getMFContext(NVDriver *drv, VAMFContextID mf_context) {
+    Object o = getObject(drv, mf_context);
+    return o != NULL && o->type == OBJECT_TYPE_MF_CONTEXT ? (NVMFContext*) o->obj : NULL;
+}
+
+//the encode contexts still in the MF context, returning how many there are
+static int resolveMFContexts(NVDriver *drv, const NVMFContext *mf, NVContext *contexts[MAX_MF_CONTEXTS]) {
+    int count = 0;
+    for (int i = 0; i < mf->contextCount; i++) {
+        NVContext *nvCtx = (NVContext*) getObjectPtr(drv, mf->contexts[i]);
+        if (nvCtx != NULL && nvCtx->encoder != NULL) {
+            contexts[count++] = nvCtx;
+        }
+    }
+    return count;
+}
+
+//frees the MF context's staging buffer once none of it's encoders are reading it. Called with the context current
+static void releaseMFStaging(NVDriver *drv, NVMFContext *mf) {
+    if (mf->staging.ptr == (CUdeviceptr) NULL) {
+        return;
+    }
+    NVContext *contexts[MAX_MF_CONTEXTS];
+    int count = resolveMFContexts(drv, mf, contexts);
+    for (int i = 0; i < count; i++) {
+        nvencForgetFrame(contexts[i], mf->staging.ptr);
+    }
+    freeScratchBuffer(&mf->staging);
+}
+
+static VAStatus destroyMFContext(NVDriver *drv, VAMFContextID mf_context) {
+    NVMFContext *mf = getMFContext(drv, mf_context);
+    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
+    releaseMFStaging(drv, mf);
+    CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+    deleteObject(drv, mf_context);
+    return VA_STATUS_SUCCESS;
 }
 
 static VAStatus nvMFAddContext(
@@ -1790,8 +5444,26 @@ static VAStatus nvMFAddContext(
             VAContextID context
         )
 {
-    LOG("In %s", __func__);
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    NVMFContext *mf = getMFContext(drv, mf_context);
+    NVContext *nvCtx = (NVContext*) getObjectPtr(drv, context);
+    if (mf == NULL || nvCtx == NULL) {
+        return VA_STATUS_ERROR_INVALID_CONTEXT;
+    }
+    //decoding and video processing have nothing to gain from being submitted together
+    if (nvCtx->encoder == NULL) {
+        return VA_STATUS_ERROR_UNSUPPORTED_ENTRYPOINT;
+    }
+    for (int i = 0; i < mf->contextCount; i++) {
+        if (mf->contexts[i] == context) {
+            return VA_STATUS_SUCCESS;
+        }
+    }
+    if (mf->contextCount == MAX_MF_CONTEXTS) {
+        return VA_STATUS_ERROR_MAX_NUM_EXCEEDED;
+    }
+    mf->contexts[mf->contextCount++] = context;
+    return VA_STATUS_SUCCESS;
 }
 
 static VAStatus nvMFReleaseContext(
@@ -1800,10 +5472,30 @@ static VAStatus nvMFReleaseContext(
             VAContextID context
         )
 {
-    LOG("In %s", __func__);
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    NVMFContext *mf = getMFContext(drv, mf_context);
+    if (mf == NULL) {
+        return VA_STATUS_ERROR_INVALID_CONTEXT;
+    }
+    for (int i = 0; i < mf->contextCount; i++) {
+        if (mf->contexts[i] != context) {
+            continue;
+        }
+        //it won't be told when the staging buffer changes any more
+        NVContext *nvCtx = (NVContext*) getObjectPtr(drv, context);
+        if (nvCtx != NULL && nvCtx->encoder != NULL && mf->staging.ptr != (CUdeviceptr) NULL
+                && !CHECK_CUDA_RESULT(cu->cuCtxPushCurrent(drv->cudaContext))) {
+            nvencForgetFrame(nvCtx, mf->staging.ptr);
+            CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+        }
+        mf->contexts[i] = mf->contexts[--mf->contextCount];
+        return VA_STATUS_SUCCESS;
+    }
+    return VA_STATUS_ERROR_INVALID_CONTEXT;
 }
 
+//ends the pictures begun on each of the contexts. Contexts encoding the same surface share the wait for it's frame
+//and it's staging copy, and the CUDA context is only made current once for all of them
 static VAStatus nvMFSubmit(
             VADriverContextP ctx,
             VAMFContextID mf_context,
@@ -1811,8 +5503,76 @@ static VAStatus nvMFSubmit(
             int num_contexts
         )
 {
-    LOG("In %s", __func__);
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    NVMFContext *mf = getMFContext(drv, mf_context);
+    if (mf == NULL) {
+        return VA_STATUS_ERROR_INVALID_CONTEXT;
+    }
+    if (num_contexts <= 0 || num_contexts > MAX_MF_CONTEXTS) {
+        return VA_STATUS_ERROR_MAX_NUM_EXCEEDED;
+    }
+    NVContext *batch[MAX_MF_CONTEXTS];
+    for (int i = 0; i < num_contexts; i++) {
+        bool member = false;
+        for (int j = 0; j < mf->contextCount && !member; j++) {
+            member = mf->contexts[j] == contexts[i];
+        }
+        batch[i] = member ? (NVContext*) getObjectPtr(drv, contexts[i]) : NULL;
+        if (batch[i] == NULL || batch[i]->encoder == NULL || batch[i]->renderTarget == NULL) {
+            return VA_STATUS_ERROR_INVALID_CONTEXT;
+        }
+    }
+    //every encoder in the MF context may have the staging buffer registered, not just the ones in this batch
+    NVContext *readers[MAX_MF_CONTEXTS];
+    int readerCount = resolveMFContexts(drv, mf, readers);
+
+    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
+    NVEncodeFrame frames[MAX_MF_CONTEXTS];
+    VAStatus statuses[MAX_MF_CONTEXTS];
+    int preparedBy[MAX_MF_CONTEXTS];
+    bool stagingUsed = false;
+    for (int i = 0; i < num_contexts; i++) {
+        NVSurface *src = batch[i]->renderTarget;
+        preparedBy[i] = i;
+        for (int j = 0; j < i; j++) {
+            if (batch[j]->renderTarget == src && statuses[j] == VA_STATUS_SUCCESS) {
+                preparedBy[i] = preparedBy[j];
+                break;
+            }
+        }
+        if (preparedBy[i] != i) {
+            frames[i] = frames[preparedBy[i]];
+            statuses[i] = VA_STATUS_SUCCESS;
+            continue;
+        }
+        //the shared staging buffer only holds one frame, any other surface that needs staging uses the context's own
+        if (!stagingUsed) {
+            statuses[i] = prepareEncodeInput(batch[i], src, &frames[i], readers, readerCount, &mf->staging);
+            stagingUsed = frames[i].staged;
+        } else {
+            statuses[i] = prepareEncodeInput(batch[i], src, &frames[i], &batch[i], 1, &batch[i]->procInput);
+        }
+    }
+    //NVENC reads the frames outside of any stream, so they have to be complete
+    for (int i = 0; i < num_contexts; i++) {
+        if (preparedBy[i] == i && statuses[i] == VA_STATUS_SUCCESS
+                && CHECK_CUDA_RESULT(cu->cuStreamSynchronize(batch[i]->stream))) {
+            statuses[i] = VA_STATUS_ERROR_OPERATION_FAILED;
+        }
+    }
+    VAStatus status = VA_STATUS_SUCCESS;
+    for (int i = 0; i < num_contexts; i++) {
+        if (statuses[preparedBy[i]] == VA_STATUS_SUCCESS) {
+            statuses[i] = submitEncodeInput(batch[i], batch[i]->renderTarget, &frames[i]);
+        } else {
+            statuses[i] = statuses[preparedBy[i]];
+        }
+        if (statuses[i] != VA_STATUS_SUCCESS && status == VA_STATUS_SUCCESS) {
+            status = statuses[i];
+        }
+    }
+    CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+    return status;
 }
 
 static VAStatus nvCreateBuffer2(
@@ -1826,7 +5586,7 @@ static VAStatus nvCreateBuffer2(
             VABufferID *buf_id
     )
 {
-    LOG("In %s", __func__);
+    LOG_TRACE("In %s", __func__);
     return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
@@ -1837,10 +5597,196 @@ static VAStatus nvQueryProcessingRate(
             unsigned int *processing_rate
         )
 {
-    LOG("In %s", __func__);
+    LOG_TRACE("In %s", __func__);
     return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
+static VAStatus nvQueryVideoProcFilters(
+        VADriverContextP ctx,
+        VAContextID context,
+        VAProcFilterType *filters,
+        unsigned int *num_filters
+    )
+{
+    //scaling and colour conversion are part of the pipeline rather than filters
+    if (*num_filters >= 1 && filters != NULL) {
+        filters[0] = VAProcFilterDeinterlacing;
+    }
+    *num_filters = 1;
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus nvQueryVideoProcFilterCaps(
+        VADriverContextP ctx,
+        VAContextID context,
+        VAProcFilterType type,
+        void *filter_caps,
+        unsigned int *num_filter_caps
+    )
+{
+    //adaptive is only really done when the decoder was created with it, the other frames are bobbed
+    static const VAProcDeinterlacingType algorithms[] = { VAProcDeinterlacingBob, VAProcDeinterlacingMotionAdaptive };
+    if (type != VAProcFilterDeinterlacing) {
+        *num_filter_caps = 0;
+        return VA_STATUS_ERROR_UNSUPPORTED_FILTER;
+    }
+    VAProcFilterCapDeinterlacing *caps = (VAProcFilterCapDeinterlacing*) filter_caps;
+    unsigned int count = MIN(*num_filter_caps, ARRAY_SIZE(algorithms));
+    for (unsigned int i = 0; i < count && caps != NULL; i++) {
+        caps[i].type = algorithms[i];
+    }
+    *num_filter_caps = caps != NULL ? count : ARRAY_SIZE(algorithms);
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus nvQueryVideoProcPipelineCaps(
+        VADriverContextP ctx,
+        VAContextID context,
+        VABufferID *filters,
+        unsigned int num_filters,
+        VAProcPipelineCaps *pipeline_caps
+    )
+{
+    static VAProcColorStandardType colourStandards[] = {
+        VAProcColorStandardBT601,
+        VAProcColorStandardBT709,
+        VAProcColorStandardBT2020,
+    };
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    for (unsigned int i = 0; i < num_filters; i++) {
+        NVBuffer *filter = (NVBuffer*) getObjectPtr(drv, filters[i]);
+        if (filter == NULL || filter->ptr == NULL
+                || ((VAProcFilterParameterBufferBase*) filter->ptr)->type != VAProcFilterDeinterlacing) {
+            return VA_STATUS_ERROR_UNSUPPORTED_FILTER;
+        }
+    }
+    ensureSurfaceSupport(drv);
+    pipeline_caps->pipeline_flags = 0;
+    pipeline_caps->filter_flags = VA_FILTER_SCALING_DEFAULT | VA_FILTER_SCALING_FAST | VA_FILTER_SCALING_HQ;
+    pipeline_caps->num_forward_references = 0;
+    pipeline_caps->num_backward_references = 0;
+    pipeline_caps->input_color_standards = colourStandards;
+    pipeline_caps->num_input_color_standards = ARRAY_SIZE(colourStandards);
+    pipeline_caps->output_color_standards = colourStandards;
+    pipeline_caps->num_output_color_standards = ARRAY_SIZE(colourStandards);
+    pipeline_caps->rotation_flags = 0;
+    pipeline_caps->blend_flags = 0;
+    pipeline_caps->mirror_flags = 0;
+    pipeline_caps->num_additional_outputs = 0;
+    //the format lists are the caller's, and only filled in if they've been given
+    uint32_t inputFormats = 0, outputFormats = 0;
+    for (uint32_t i = NV_FORMAT_NONE + 1; i < ARRAY_SIZE(formatsInfo); i++) {
+        if (!videoProcFormatSupported(drv, i)) {
+            continue;
+        }
+        //RGB can only be converted to RGB, so it's not offered as an input
+        if (!formatsInfo[i].isRgb) {
+            if (pipeline_caps->input_pixel_format != NULL && inputFormats < pipeline_caps->num_input_pixel_formats) {
+                pipeline_caps->input_pixel_format[inputFormats] = formatsInfo[i].vaFormat.fourcc;
+            }
+            inputFormats++;
+        }
+        if (pipeline_caps->output_pixel_format != NULL && outputFormats < pipeline_caps->num_output_pixel_formats) {
+            pipeline_caps->output_pixel_format[outputFormats] = formatsInfo[i].vaFormat.fourcc;
+        }
+        outputFormats++;
+    }
+    if (pipeline_caps->input_pixel_format != NULL) {
+        pipeline_caps->num_input_pixel_formats = MIN(inputFormats, pipeline_caps->num_input_pixel_formats);
+    } else {
+        pipeline_caps->num_input_pixel_formats = inputFormats;
+    }
+    if (pipeline_caps->output_pixel_format != NULL) {
+        pipeline_caps->num_output_pixel_formats = MIN(outputFormats, pipeline_caps->num_output_pixel_formats);
+    } else {
+        pipeline_caps->num_output_pixel_formats = outputFormats;
+    }
+    pipeline_caps->min_input_width = pipeline_caps->min_input_height = VIDEO_PROC_MIN_SIZE;
+    pipeline_caps->max_input_width = pipeline_caps->max_input_height = VIDEO_PROC_MAX_SIZE;
+    pipeline_caps->min_output_width = pipeline_caps->min_output_height = VIDEO_PROC_MIN_SIZE;
+    pipeline_caps->max_output_width = pipeline_caps->max_output_height = VIDEO_PROC_MAX_SIZE;
+    return VA_STATUS_SUCCESS;
+}
+
+//moves a surface over to an exportable backing image, carrying over the frame it currently holds.
+//must be called with the CUDA context current
+static bool promoteSurface(NVDriver *drv, NVSurface *surface) {
+    pthread_mutex_lock(&surface->mutex);
+    //a picture the resolve thread hasn't got to yet would still be copied into the CUDA frame
+    while (surface->resolving) {
+        pthread_cond_wait(&surface->cond, &surface->mutex);
+    }
+    //from now on the resolve thread will copy frames straight into the backing image
+    surface->exported = true;
+    CUdeviceptr frame = surface->cudaFrame;
+    size_t pitch = surface->cudaFramePitch;
+    bool eventPending = surface->resolveEventPending;
+    surface->cudaFrame = (CUdeviceptr) NULL;
+    pthread_mutex_unlock(&surface->mutex);
+    if (frame == (CUdeviceptr) NULL) {
+        uint64_t start = statsStart(drv->stats);
+        bool ret = drv->backend->realiseSurface(drv, surface);
+        statsRecord(drv->stats, NV_STAT_REALISE, start);
+        return ret;
+    }
+    LOG("Promoting surface %p to an exportable image", surface);
+    forgetEncoderInputs(drv, surface);
+    //the context's streams don't synchronise with the default one, so the copy has to wait for whatever last wrote
+    //the frame explicitly
+    bool ret = !eventPending || !CHECK_CUDA_RESULT(cu->cuStreamWaitEvent(NULL, surface->resolveEvent, 0));
+    ret = ret && drv->backend->exportCudaPtr(drv, frame, surface, pitch, NULL);
+    //the frame has to have landed in the backing image before it's handed out or the frame is released
+    ret = !CHECK_CUDA_RESULT(cu->cuStreamSynchronize(NULL)) && ret;
+    CHECK_CUDA_RESULT(cu->cuMemFree(frame));
+    vramAccount(drv, NV_VRAM_FRAMES, -cudaFrameBytes(surface, pitch));
+    return ret;
+}
+
+static bool syncobjExportSupported(NVDriver *drv) {
+    if (drv->syncobjSupport == -1) {
+        drv->syncobjSupport = supportsTimelineSyncobj(drv->drmFd);
+        if (!drv->syncobjSupport) {
+            LOG("DRM device doesn't support timeline syncobjs, exported surfaces will be waited for instead");
+        }
+    }
+    return drv->syncobjSupport == 1;
+}
+
+//puts a new fd for the surface's timeline syncobj after the descriptor's objects, with the point that's signalled once
+//the latest picture written to the surface has landed in it. The fd is -1 if there's no syncobj to hand out
+static void exportSurfaceFence(NVDriver *drv, NVSurface *surface, VADRMPRIMESurfaceDescriptor *desc, bool supported) {
+    if (desc->num_objects >= ARRAY_SIZE(desc->objects)) {
+        return;
+    }
+    int fd = -1;
+    uint64_t point = 0;
+    pthread_mutex_lock(&surface->mutex);
+    if (supported && surface->fence == NULL) {
+        uint32_t handle = createSyncobj(drv->drmFd);
+        NVSurfaceFence *fence = handle != 0 ? calloc(1, sizeof(NVSurfaceFence)) : NULL;
+        if (fence != NULL) {
+            fence->drmFd = drv->drmFd;
+            fence->handle = handle;
+            atomic_init(&fence->refs, 1);
+            //whatever was resolved before now has been waited for, point 0 can't be waited on so start at 1
+            surface->fencePoint = MAX(surface->fencePoint, 1);
+            signalSyncobjPoint(fence->drmFd, fence->handle, surface->fencePoint);
+            surface->fence = fence;
+        } else if (handle != 0) {
+            destroySyncobj(drv->drmFd, handle);
+        }
+    }
+    if (surface->fence != NULL) {
+        fd = exportSyncobj(surface->fence->drmFd, surface->fence->handle);
+        //a picture that's been submitted but not resolved yet will signal the next point
+        point = surface->fencePoint + (surface->resolving ? 1 : 0);
+    }
+    pthread_mutex_unlock(&surface->mutex);
+    desc->objects[desc->num_objects].fd = fd;
+    desc->objects[desc->num_objects].size = 0;
+    desc->objects[desc->num_objects].drm_format_modifier = point;
+}
+
 static VAStatus nvExportSurfaceHandle(
             VADriverContextP    ctx,
             VASurfaceID         surface_id,
@@ -1850,6 +5796,7 @@ static VAStatus nvExportSurfaceHandle(
 )
 {
     NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    NVTX_RANGE("vaExportSurfaceHandle surface %u", surface_id);
     if ((mem_type & VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2) == 0) {
         return VA_STATUS_ERROR_UNSUPPORTED_MEMORY_TYPE;
     }
@@ -1860,13 +5807,26 @@ static VAStatus nvExportSurfaceHandle(
     if (surface == NULL) {
         return VA_STATUS_ERROR_INVALID_SURFACE;
     }
+    bool fenced = (flags & NVD_EXPORT_SURFACE_SYNCOBJ) != 0 && syncobjExportSupported(drv);
+    pthread_mutex_lock(&surface->mutex);
+    //once the surface has a fence the consumer waits on that, the first export has to wait to promote the surface
+    bool wait = !fenced || surface->fence == NULL;
+    pthread_mutex_unlock(&surface->mutex);
+    //make sure a copy already queued for the surface has landed before handing it out
+    if (wait && !waitForSurfaceEvent(drv, surface)) {
+        LOG("Unable to wait for surface to be resolved");
+    }
     CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
-    if (!drv->backend->realiseSurface(drv, surface)) {
+    if (!promoteSurface(drv, surface)) {
         LOG("Unable to export surface");
+        CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
         return VA_STATUS_ERROR_ALLOCATION_FAILED;
     }
     VADRMPRIMESurfaceDescriptor *ptr = (VADRMPRIMESurfaceDescriptor*) descriptor;
     drv->backend->fillExportDescriptor(drv, surface, ptr);
+    if ((flags & NVD_EXPORT_SURFACE_SYNCOBJ) != 0) {
+        exportSurfaceFence(drv, surface, ptr, fenced);
+    }
     CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), VA_STATUS_ERROR_OPERATION_FAILED);
     return VA_STATUS_SUCCESS;
 }
@@ -1875,17 +5835,32 @@ static VAStatus nvTerminate( VADriverContextP ctx )
 {
     NVDriver *drv = (NVDriver*) ctx->pDriverData;
     LOG("Terminating %p", ctx);
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
-    drv->backend->destroyAllBackingImage(drv);
-    deleteAllObjects(drv);
-    drv->backend->releaseExporter(drv);
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), VA_STATUS_ERROR_OPERATION_FAILED);
+    if (atomic_load(&drv->cudaInitialised)) {
+        CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
+        drv->backend->destroyAllBackingImage(drv);
+        deleteAllObjects(drv);
+        drv->backend->releaseExporter(drv);
+        unloadKernels(cu, &drv->kernels);
+        drainDecoderPool(drv);
+        CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), VA_STATUS_ERROR_OPERATION_FAILED);
+    } else {
+        //nothing that needs CUDA can have been created, but images might have been
+        deleteAllObjects(drv);
+        drainDecoderPool(drv);
+    }
+    saveCapsTable(drv->capsTable);
+    //the contexts' counters were dumped as they were destroyed above
+    statsDestroy(drv->stats);
+    drv->stats = NULL;
     pthread_mutex_lock(&concurrency_mutex);
     instances--;
     LOG("Now have %d (%d max) instances", instances, max_instances);
     pthread_mutex_unlock(&concurrency_mutex);
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxDestroy(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
-    drv->cudaContext = NULL;
+    if (atomic_load(&drv->cudaInitialised)) {
+        destroyCudaContext(drv);
+    }
+    pthread_mutex_destroy(&drv->initMutex);
+    handle_table_free(&drv->objects);
     free(drv);
     return VA_STATUS_SUCCESS;
 }
@@ -1916,6 +5891,10 @@ static const struct VADriverVTable vtable = {
     VTABLE(RenderPicture),
     VTABLE(EndPicture),
     VTABLE(SyncSurface),
+#if VA_CHECK_VERSION(1, 15, 0)
+    VTABLE(SyncSurface2),
+    VTABLE(SyncBuffer),
+#endif
     VTABLE(QuerySurfaceStatus),
     VTABLE(QuerySurfaceError),
     VTABLE(PutSurface),
@@ -1952,6 +5931,25 @@ static const struct VADriverVTable vtable = {
     VTABLE(ExportSurfaceHandle),
 };
 
+static const struct VADriverVTableVPP vtableVpp = {
+    .version = VA_DRIVER_VTABLE_VPP_VERSION,
+    VTABLE(QueryVideoProcFilters),
+    VTABLE(QueryVideoProcFilterCaps),
+    VTABLE(QueryVideoProcPipelineCaps),
+};
+
+//identifies the device the display will end up on without needing CUDA, so the caps cache can be read before the
+//exporter is initialised
+static void capsCacheKey(const NVDriver *drv, char *key, size_t len) {
+    const char *backendName = backend == DIRECT ? "direct" : "egl";
+    struct stat st;
+    if (drv->drmFd != -1 && fstat(drv->drmFd, &st) == 0) {
+        snprintf(key, len, "%s-drm%u-%u", backendName, major(st.st_rdev), minor(st.st_rdev));
+    } else {
+        snprintf(key, len, "%s-gpu%d", backendName, drv->cudaGpuId);
+    }
+}
+
 __attribute__((visibility("default")))
 VAStatus __vaDriverInit_1_0(VADriverContextP ctx);
 
@@ -1959,7 +5957,24 @@ __attribute__((visibility("default")))
 VAStatus __vaDriverInit_1_0(VADriverContextP ctx) {
     LOG("Initialising NVIDIA VA-API Driver");
     bool isDrm = ctx->drm_state != NULL && ((struct drm_state*) ctx->drm_state)->fd > 0;
-    int drmFd = (gpu == -1 && isDrm) ? ((struct drm_state*) ctx->drm_state)->fd : -1;
+    //a placement policy overrides the device libva passed in, as headless clients mostly just open the first one
+    int placedGpu = -1;
+    if (gpu == -1 && gpuPlacement != NV_PLACEMENT_NONE) {
+        if (backend != DIRECT) {
+            LOG("GPU placement requires the direct backend, ignoring NVD_GPU_PLACEMENT");
+        } else {
+            //only the least loaded policy needs CUDA this early
+            if (gpuPlacement == NV_PLACEMENT_LEAST_LOADED && !cudaBlocked) {
+                pthread_once(&cudaLoadOnce, loadCudaFunctions);
+            }
+            char node[32];
+            placedGpu = placeGpu(gpuPlacement, cu, cux, node, sizeof(node));
+            if (placedGpu != -1) {
+                LOG("Placed display on GPU %d (%s)", placedGpu, node);
+            }
+        }
+    }
+    int drmFd = (gpu == -1 && placedGpu == -1 && isDrm) ? ((struct drm_state*) ctx->drm_state)->fd : -1;
     LOG("Got DRM FD: %d %d", isDrm, drmFd);
     if (drmFd != -1) {
         if (!isNvidiaDrmFd(drmFd, true)) {
@@ -1977,16 +5992,35 @@ VAStatus __vaDriverInit_1_0(VADriverContextP ctx) {
     }
     instances++;
     pthread_mutex_unlock(&concurrency_mutex);
-    if (cu == NULL || cv == NULL) {
+    if (cudaBlocked) {
         return VA_STATUS_ERROR_OPERATION_FAILED;
     }
     NVDriver *drv = (NVDriver*) calloc(1, sizeof(NVDriver));
     ctx->pDriverData = drv;
-    drv->cu = cu;
-    drv->cv = cv;
     drv->useCorrectNV12Format = true;
-    drv->cudaGpuId = gpu;
+    drv->cudaGpuId = placedGpu != -1 ? placedGpu : gpu;
     drv->drmFd = drmFd;
+    drv->imagePoolSize = imagePoolSize;
+    drv->poolExportedImages = poolExportedImages;
+    drv->sharedContext = sharedContext;
+    drv->filmGrainMode = filmGrainModeFromEnv();
+    drv->profileCount = -1;
+    drv->syncobjSupport = -1;
+    char key[64];
+    capsCacheKey(drv, key, sizeof(key));
+    drv->capsTable = getCapsTable(key, diskCapsCache);
+    //if the cache knows which GPU this is, a display that couldn't create a decoder on it is refused straight away
+    uint8_t uuid[16];
+    if (getCachedDeviceUuid(drv->capsTable, uuid) && !gpuHasSessionCapacity(uuid, &sessionLimits)) {
+        LOG("GPU is at its session limits, refusing to initialise");
+        free(drv);
+        ctx->pDriverData = NULL;
+        pthread_mutex_lock(&concurrency_mutex);
+        instances--;
+        pthread_mutex_unlock(&concurrency_mutex);
+        return VA_STATUS_ERROR_HW_BUSY;
+    }
+    pthread_once(&profileTableOnce, buildProfileTable);
     if (backend == EGL) {
         LOG("Selecting EGL backend");
         drv->backend = &EGL_BACKEND;
@@ -1995,12 +6029,15 @@ VAStatus __vaDriverInit_1_0(VADriverContextP ctx) {
         drv->backend = &DIRECT_BACKEND;
     }
     ctx->max_profiles = MAX_PROFILES;
-    ctx->max_entrypoints = 1;
-    ctx->max_attributes = 1;
+    ctx->max_entrypoints = 2;
+    ctx->max_attributes = 4;
     ctx->max_display_attributes = 1;
     ctx->max_image_formats = ARRAY_SIZE(formatsInfo) - 1;
     ctx->max_subpic_formats = 1;
-    if (backend == DIRECT) {
+    if (placedGpu != -1) {
+        snprintf(drv->vendorString, sizeof(drv->vendorString), "VA-API NVDEC driver [direct backend, GPU %d]", placedGpu);
+        ctx->str_vendor = drv->vendorString;
+    } else if (backend == DIRECT) {
         ctx->str_vendor = "VA-API NVDEC driver [direct backend]";
     } else if (backend == EGL) {
         ctx->str_vendor = "VA-API NVDEC driver [egl backend]";
@@ -2011,19 +6048,16 @@ VAStatus __vaDriverInit_1_0(VADriverContextP ctx) {
     pthread_mutex_init(&drv->objectCreationMutex, &attrib);
     pthread_mutex_init(&drv->imagesMutex, &attrib);
     pthread_mutex_init(&drv->exportMutex, NULL);
-    if (!drv->backend->initExporter(drv)) {
-        LOG("Exporter failed");
-        free(drv);
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    }
-    if (CHECK_CUDA_RESULT(cu->cuCtxCreate(&drv->cudaContext, CU_CTX_SCHED_BLOCKING_SYNC, drv->cudaGpuId))) {
-        drv->backend->releaseExporter(drv);
-        free(drv);
-        return VA_STATUS_ERROR_OPERATION_FAILED;
+    initKernels(&drv->kernels);
+    initDecoderPool(&drv->decoderPool);
+    pthread_mutex_init(&drv->initMutex, NULL);
+    //the exporter and CUDA context are created by initialiseCuda when they're first needed
+    atomic_init(&drv->surfaceSupportKnown, getCachedSurfaceSupport(drv->capsTable, &drv->supports16BitSurface, &drv->supports444Surface));
+    drv->stats = statsCreate("driver", 0);
+    *ctx->vtable = vtable;
+    if (ctx->vtable_vpp != NULL) {
+        *ctx->vtable_vpp = vtableVpp;
     }
-        *ctx->vtable = vtable;
-    ctx->vtable->CreateConfig = nvenc_vaCreateConfig;
-    ctx->vtable->GetConfigAttributes = nvenc_vaGetConfigAttributes;
     return VA_STATUS_SUCCESS;
 
 }
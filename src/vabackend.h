@@ -10,16 +10,55 @@
 
 #include <pthread.h>
 #include "list.h"
+#include "caps-cache.h"
+#include "film-grain.h"
+#include "kernels.h"
+#include "log.h"
+#include "nvtx.h"
+#include "stats.h"
+#include "vram.h"
+#include "resolve-pool.h"
 #include "direct/nv-driver.h"
 #include "common.h"
 
+//default depth of the queue between nvEndPicture and the resolve thread, see NVD_SURFACE_QUEUE_DEPTH
 #define SURFACE_QUEUE_SIZE 16
+//decode surfaces an intra only context has on top of it's output surfaces
+#define INTRA_SPARE_DECODE_SURFACES 4
 #define MAX_IMAGE_COUNT 64
+//VAProfile values are small and dense, this comfortably covers every profile libva currently defines
+#define MAX_VA_PROFILE 64
+#define MAX_PROFILES 32
+//driver specific config attribute, a non-zero value creates a decoder that only decodes intra pictures, see NVD_INTRA_ONLY
+#define VAConfigAttribNVDIntraOnly ((VAConfigAttribType) 0x4e560001)
+//driver specific config attribute, a cudaVideoDeinterlaceMode for NVDEC to deinterlace with as frames are mapped,
+//optionally with NVD_DEINTERLACE_DOUBLE_RATE. See NVD_DEINTERLACE
+#define VAConfigAttribNVDDeinterlace ((VAConfigAttribType) 0x4e560002)
+//also keep a frame made from the second field of each picture, for video processing to output as a frame of it's own
+#define NVD_DEINTERLACE_DOUBLE_RATE 0x100
+//driver specific config attribute, a non-zero value tunes the encoder for ultra low latency, see NVD_ENCODE_LOW_LATENCY
+#define VAConfigAttribNVDLowLatency ((VAConfigAttribType) 0x4e560003)
+//driver specific vaExportSurfaceHandle flag, hands out a timeline syncobj after the surface's objects instead of
+//waiting for the surface to be resolved, see the Direct Backend section of the README
+#define NVD_EXPORT_SURFACE_SYNCOBJ 0x40000000
+
+//maximum number of idle buffers kept per size class in a context's buffer pool
+#define BUFFER_POOL_MAX_FREE 64
+
+#ifndef VA_TIMEOUT_INFINITE
+//only defined from libva 1.15, along with vaSyncSurface2
+#define VA_TIMEOUT_INFINITE 0xFFFFFFFFFFFFFFFF
+#endif
+#ifndef VA_STATUS_ERROR_TIMEDOUT
+#define VA_STATUS_ERROR_TIMEDOUT 0x00000026
+#endif
 
 typedef struct {
     void        *buf;
     uint64_t    size;
     uint64_t    allocated;
+    CUcontext   hostContext;    //if set, storage is page-locked memory allocated in this context
+    bool        pinned;         //buf was allocated with cuMemAllocHost
 } AppendableBuffer;
 
 typedef enum
@@ -28,7 +67,8 @@ typedef enum
     OBJECT_TYPE_CONTEXT,
     OBJECT_TYPE_SURFACE,
     OBJECT_TYPE_BUFFER,
-    OBJECT_TYPE_IMAGE
+    OBJECT_TYPE_IMAGE,
+    OBJECT_TYPE_MF_CONTEXT
 } ObjectType;
 
 typedef struct Object_t
@@ -38,6 +78,16 @@ typedef struct Object_t
     void            *obj;
 } *Object;
 
+//host copy of a surface's frame handed out by nvDeriveImage. The surface and every image derived from it hold a
+//reference, so it outlives whichever is destroyed first
+typedef struct
+{
+    void            *ptr;
+    bool            pinned;
+    _Atomic int     refs;
+    _Atomic int     mapped;     //number of derived image buffers mapped, the copy isn't refreshed while it's non-zero
+} NVHostFrame;
+
 typedef struct
 {
     unsigned int    elements;
@@ -45,13 +95,77 @@ typedef struct
     VABufferType    bufferType;
     void            *ptr;
     int             offset;
+    void            *storage;   //heap allocation owned by the buffer, ptr points here unless the data is in the arena
+    size_t          capacity;   //allocated size of storage, can be larger than size when the storage is recycled
+    VAContextID     context;    //context whose buffer pool owns the storage, or VA_INVALID_ID
+    bool            inArena;    //the data lives in the context's slice arena rather than in storage
+    bool            mapped;
+    uint64_t        arenaOffset; //offset of the start of this buffer's placement (including any start code) in the arena
+    VASurfaceID     derivedSurface; //surface a derived image's buffer belongs to, or 0
+    NVHostFrame     *hostFrame;     //the derived image's reference to the surface's host copy
+    //a coded buffer the context's encoder is still encoding a picture into, guarded by the encoder
+    bool            encodePending;
+    VAStatus        encodeStatus;
 } NVBuffer;
 
+typedef enum
+{
+    BUFFER_POOL_PIC_PARAMS,
+    BUFFER_POOL_SLICE_PARAMS,
+    BUFFER_POOL_SLICE_DATA,
+    BUFFER_POOL_OTHER,
+    BUFFER_POOL_CLASS_COUNT
+} NVBufferPoolClass;
+
+typedef struct
+{
+    Array/*<Object>*/   freeList[BUFFER_POOL_CLASS_COUNT];
+    pthread_mutex_t     mutex;
+    uint64_t            hits;
+    uint64_t            misses;
+    bool                draining;   //the context is being destroyed, only changed with the driver's objectCreationMutex held
+} NVBufferPool;
+
+typedef struct
+{
+    CUVIDDECODECREATEINFO   info;           //the parameters the decoder was created with, including it's lock
+    CUvideodecoder          decoder;
+    uint64_t                releasedAt;     //CLOCK_MONOTONIC ns
+} NVPooledDecoder;
+
+//decoders of destroyed contexts, kept so a new context with the same parameters doesn't need to create one
+typedef struct
+{
+    Array/*<NVPooledDecoder>*/ idle;        //oldest first
+    pthread_mutex_t     mutex;
+    uint64_t            hits;
+    uint64_t            misses;
+} NVDecoderPool;
+
+//MAX_OUTPUT_SURFACES bounds how many frames a context can have mapped out of the decoder at once
+#define MAX_OUTPUT_SURFACES 8
+
+typedef struct
+{
+    CUdeviceptr         deviceMemory;
+    CUevent             copied;                 //recorded after the copies out of deviceMemory were queued
+} NVMappedFrame;
+
+//an eventfd used to wake a thread sleeping on a lock-free queue, the sleeper sets waiting
+//before re-checking the queue so that the other side only needs to write the eventfd when it's set
+typedef struct
+{
+    int                 fd;
+    _Atomic bool        waiting;
+} NVWakeup;
+
 struct _NVContext;
 struct _BackingImage;
+struct _NVSurfaceFence;
 
 typedef struct
 {
+    VASurfaceID             id;                     //for naming it in NVTX ranges
     uint32_t                width;
     uint32_t                height;
     cudaVideoSurfaceFormat  format;
@@ -68,6 +182,34 @@ typedef struct
     pthread_mutex_t         mutex;
     pthread_cond_t          cond;
     bool                    decodeFailed;
+    bool                    decodeConcealed;        //NVDEC reported errors in the picture, but it was still output
+    VASurfaceDecodeMBErrors decodeErrors[2];        //returned by vaQuerySurfaceError
+    CUevent                 resolveEvent;           //recorded on the context's stream after the frame has been copied out
+    bool                    resolveEventPending;    //resolveEvent has been recorded for the latest decode, guarded by mutex
+    //frames of a surface that hasn't been exported yet, laid out like NVDEC's output. Guarded by mutex
+    CUdeviceptr             cudaFrame;
+    size_t                  cudaFramePitch;
+    bool                    exported;               //the surface has been exported, frames go to backingImage
+    //host copy of the frame handed out by nvDeriveImage, refreshed by the resolve thread after every decode unless an
+    //image using it is mapped, in which case the surface lets go of it. Guarded by mutex
+    NVHostFrame             *hostFrame;
+    //VA_RT_FORMAT_RGB32 surfaces can't be decoded into, they're only written by video processing. NV_FORMAT_NONE otherwise
+    int                     rgbFormat;
+    int                     fieldPicture;           //the latest picture was a single field
+    //the frame was made by NVDEC's deinterlacer. If the context doubles the frame rate, doubledFrame holds the one
+    //made from the second field, pitch-linear and laid out like cudaFrame. Guarded by mutex
+    bool                    deinterlaced;
+    bool                    hasDoubledFrame;
+    CUdeviceptr             doubledFrame;
+    size_t                  doubledFramePitch;
+    bool                    encodeRegistered;       //an encoder may have the surface's storage registered with NVENC
+    int                     encodesPending;         //submitted pictures NVENC has yet to read from it, guarded by mutex
+    //timeline syncobj handed out with NVD_EXPORT_SURFACE_SYNCOBJ, NULL until it's first asked for. Guarded by mutex
+    struct _NVSurfaceFence  *fence;
+    uint64_t                fencePoint;             //resolves of the surface so far, each signals the next point
+    //NVD_AV1_FILM_GRAIN=driver, the grain of the latest picture, added as it's copied out of the decoder
+    bool                    applyFilmGrain;
+    NVFilmGrainParams       filmGrain;
 } NVSurface;
 
 typedef enum
@@ -78,7 +220,11 @@ typedef enum
     NV_FORMAT_P012,
     NV_FORMAT_P016,
     NV_FORMAT_444P,
-    NV_FORMAT_Q416
+    NV_FORMAT_Q416,
+    NV_FORMAT_I420,
+    NV_FORMAT_YV12,
+    NV_FORMAT_BGRA,
+    NV_FORMAT_RGBA
 } NVFormat;
 
 typedef struct
@@ -87,8 +233,38 @@ typedef struct
     int         height;
     NVFormat    format;
     NVBuffer    *imageBuffer;
+    VABufferID  imageBufferId;
+    bool        pinned;     //imageBuffer's memory is page-locked
+    CUdeviceptr staging;    //device memory vaPutImage converts the image in, kept for the next put
+    size_t      stagingSize;
 } NVImage;
 
+//device memory kept between pictures, only reallocated when a larger one comes along
+typedef struct {
+    CUdeviceptr ptr;
+    size_t      pitch;
+    size_t      widthInBytes;
+    size_t      rows;
+} NVScratchBuffer;
+
+//what a VideoProc picture was asked to do, copied out of it's VAProcPipelineParameterBuffer
+typedef struct {
+    VASurfaceID surface;
+    VARectangle surfaceRegion;      //empty for the whole surface
+    VARectangle outputRegion;       //empty for the whole render target
+    uint32_t    backgroundColour;   //ARGB, for the parts of the render target outside outputRegion
+    int         inputStandard;      //VAProcColorStandardType
+    bool        inputFullRange;
+    int         outputStandard;     //VAProcColorStandardNone to keep the input's
+    bool        outputRangeGiven;   //otherwise YUV keeps the input's range, and RGB is full range
+    bool        outputFullRange;
+    uint32_t    filterFlags;
+    //VAProcFilterDeinterlacing was given, which field to output a frame of
+    bool        deinterlace;
+    bool        bottomField;
+    bool        secondField;        //the field is the second one in time
+} NVProcPipeline;
+
 typedef struct {
     CUexternalMemory extMem;
     CUmipmappedArray mipmapArray;
@@ -109,6 +285,11 @@ typedef struct _BackingImage {
     //direct backend only
     NVCudaImage cudaImages[3];
     NVFormat    format;
+    uint64_t    lastUsed;   //when the image was last released back to the pool, for LRU trimming
+    bool        imported;   //wraps a dma-buf the client gave for the surface, so it's destroyed rather than pooled
+    //has been exported, a consumer may still be reading the dma-buf after the surface is gone so it isn't pooled
+    //unless NVD_POOL_EXPORTED_IMAGES is set
+    bool        handedOut;
 } BackingImage;
 
 struct _NVDriver;
@@ -117,33 +298,61 @@ typedef struct {
     const char *name;
     bool (*initExporter)(struct _NVDriver *drv);
     void (*releaseExporter)(struct _NVDriver *drv);
-    bool (*exportCudaPtr)(struct _NVDriver *drv, CUdeviceptr ptr, NVSurface *surface, uint32_t pitch);
+    bool (*exportCudaPtr)(struct _NVDriver *drv, CUdeviceptr ptr, NVSurface *surface, uint32_t pitch, CUstream stream);
     void (*detachBackingImageFromSurface)(struct _NVDriver *drv, NVSurface *surface);
     bool (*realiseSurface)(struct _NVDriver *drv, NVSurface *surface);
     bool (*fillExportDescriptor)(struct _NVDriver *drv, NVSurface *surface, VADRMPRIMESurfaceDescriptor *desc);
     void (*destroyAllBackingImage)(struct _NVDriver *drv);
+    //destroys unattached pooled images, least recently released first, until at least bytes have been freed.
+    //returns how much was freed
+    uint64_t (*evictBackingImages)(struct _NVDriver *drv, uint64_t bytes);
+    //optional, makes the client's dma-buf the surface's backing image, so it's frames are resolved straight into it
+    bool (*importBackingImage)(struct _NVDriver *drv, NVSurface *surface, const VADRMPRIMESurfaceDescriptor *desc);
 } NVBackend;
 
+//who adds the film grain of AV1 pictures
+typedef enum {
+    NV_FILM_GRAIN_DECODER,  //NVDEC, as part of decoding
+    NV_FILM_GRAIN_DRIVER,   //the resolve, as the clean frame is copied out of the decoder
+    NV_FILM_GRAIN_OFF,      //nobody, the clean frames are output
+} NVFilmGrainMode;
+
 typedef struct _NVDriver
 {
     CudaFunctions           *cu;
     CuvidFunctions          *cv;
     CUcontext               cudaContext;
-    Array/*<Object>*/       objects;
+    HandleTable/*<Object>*/ objects;
     pthread_mutex_t         objectCreationMutex;
-    VAGenericID             nextObjId;
     bool                    useCorrectNV12Format;
     bool                    supports16BitSurface;
     bool                    supports444Surface;
     int                     cudaGpuId;
     int                     drmFd;
+    int                     syncobjSupport;     //-1 until checked, 1 if timeline syncobjs can be made on drmFd
+    char                    vendorString[64];   //reports the GPU the placement policy picked
     int                     surfaceCount;
     pthread_mutex_t         exportMutex;
+    NVKernels               kernels;
+    NVDecoderPool           decoderPool;
+    NVCapsTable             *capsTable;
+    pthread_mutex_t         initMutex;
+    //set with initMutex held once the CUDA context and exporter are ready, and read without it
+    _Atomic bool            cudaInitialised;
+    bool                    sharedContext;      //cudaContext is the device's primary context, shared with other displays
+    NVFilmGrainMode         filmGrainMode;      //NVD_AV1_FILM_GRAIN
+    _Atomic bool            surfaceSupportKnown; //set like cudaInitialised, or at init from the caps cache
+    VAProfile               profiles[MAX_PROFILES];
+    int                     profileCount;       //-1 until the profiles have been enumerated
     pthread_mutex_t         imagesMutex;
     Array/*<NVEGLImage>*/   images;
     const NVBackend         *backend;
     //fields for direct backend
     NVDriverContext         driverContext;
+    bool                    driverContextShared;
+    int                     imagePoolSize;      //maximum number of unattached BackingImages kept for reuse
+    bool                    poolExportedImages; //the client is done with exported dma-bufs once the surface is destroyed
+    uint64_t                imagePoolClock;
     //fields for egl backend
     EGLDeviceEXT            eglDevice;
     EGLDisplay              eglDisplay;
@@ -151,37 +360,100 @@ typedef struct _NVDriver
     EGLStreamKHR            eglStream;
     CUeglStreamConnection   cuStreamConnection;
     int                     numFramesPresented;
+    NVStats                 *stats;             //NVD_STATS counters of work that isn't a context's, NULL if disabled
+    _Atomic int64_t         vram[NV_VRAM_COUNT];    //bytes this display holds, see vramAccount
 } NVDriver;
 
 struct _NVCodec;
+struct _NVEncoder;
 
 typedef struct _NVContext
 {
     NVDriver            *drv;
+    VAContextID         id;
     VAProfile           profile;
     VAEntrypoint        entrypoint;
     int                 width;
     int                 height;
     CUvideodecoder      decoder;
+    CUVIDDECODECREATEINFO decoderInfo;         //what decoder was created with, so it can be returned to the pool
+    int                 gpuSession;             //the decoder's slot in the cross process session registry
     NVSurface           *renderTarget;
     void                *lastSliceParams;
     unsigned int        lastSliceParamsCount;
+    size_t              lastSliceParamsSize;    //size of each element of lastSliceParams
     AppendableBuffer    bitstreamBuffer;
     AppendableBuffer    sliceOffsets;
     CUVIDPICPARAMS      pPicParams;
+    VAStatus            pictureStatus;          //the first error the current picture's buffers hit, it's dropped if set
     const struct _NVCodec *codec;
+    void                *codecData;             //owned by the codec's initContext/deinitContext
     int                 currentPictureId;
-    pthread_t           resolveThread;
-    pthread_mutex_t     resolveMutex;
-    pthread_cond_t      resolveCondition;
-    NVSurface*          surfaceQueue[SURFACE_QUEUE_SIZE];
-    int                 surfaceQueueReadIdx;
-    int                 surfaceQueueWriteIdx;
-    bool                exiting;
+    //only intra pictures are decoded, so the decode surfaces are used in turn instead of one per render target
+    bool                intraOnly;
+    cudaVideoDeinterlaceMode deinterlaceMode;    //what the decoder was created with
+    bool                doubleRate;             //also map the second field of interlaced pictures, into doubledFrame
+    //VA_DEC_PROCESSING, the decoder crops and scales each picture into it's render target as it's output
+    bool                decProcessing;
+    VARectangle         decodeCrop;             //from the picture's VAProcPipelineParameterBuffer, empty for the whole frame
+    VARectangle         decodeOutputRegion;     //where in the render target the picture goes, empty for all of it
+    NVResolveJob        resolveJob;             //the context's turns on it's GPU's resolve pool
+    SPSCQueue/*<NVSurface>*/ surfaceQueue;     //produced by nvEndPicture, consumed by the resolve worker
+    NVWakeup            queueSpaceWakeup;       //wakes nvEndPicture blocked on a full queue
+    _Atomic bool        exiting;
+    _Atomic bool        resolveIdle;            //the last turn emptied the queue with nothing left mapped
     pthread_mutex_t     surfaceCreationMutex;
     int                 surfaceCount;
+    NVBufferPool        bufferPool;
+    CUstream            stream;                 //non-blocking stream the decoded frames are copied out on
+    int                 numOutputSurfaces;      //ulNumOutputSurfaces the decoder was created with
+    //frames the resolve worker has mapped and is waiting for the copies of, oldest first. Only touched by the job's turns
+    NVMappedFrame       mappedFrames[MAX_OUTPUT_SURFACES];
+    int                 mappedFrameHead;
+    int                 mappedFrameCount;
+    //slice data buffers of codecs with inPlaceSliceData are written straight into this arena by nvCreateBuffer,
+    //so that the common case of the slices being rendered in creation order needs no further copy
+    AppendableBuffer    sliceArena;
+    Array/*<NVBuffer>*/ sliceArenaBuffers;      //live buffers pointing into the arena, guarded by bufferPool.mutex
+    int                 sliceArenaMapped;
+    uint64_t            sliceArenaStart;        //arena offset of the current picture's bitstream
+    uint64_t            sliceArenaCursor;       //end of the slice data claimed so far
+    bool                sliceArenaClaimed;      //the current picture's bitstream is in the arena
+    //NVD_PREALLOCATE_SURFACES worker, realises the backing images of the render targets ahead of the first decode
+    pthread_t           realiseThread;
+    bool                realiseThreadStarted;
+    VASurfaceID         *realiseTargets;
+    int                 realiseTargetCount;
+    //VAEntrypointVideoProc, the context has no decoder or resolve thread, pictures are converted by kernels on stream
+    bool                videoProc;
+    NVProcPipeline      procPipeline;
+    bool                procPipelineSet;        //a pipeline buffer was rendered since nvBeginPicture
+    NVScratchBuffer     procInput;              //sources that have been exported are staged here, laid out like NVDEC's output
+    NVScratchBuffer     procOutput;             //the converted picture, laid out like NVDEC's output
+    NVScratchBuffer     procTemp;               //planar 16-bit Y'CbCr, ahead of the conversion to RGB
+    CUdeviceptr         procBackground;         //one 16-bit sample per component of the background colour
+    //VAEntrypointEncSlice, the context's NVENC session. Like video processing there's no decoder or resolve thread,
+    //exported inputs are staged through procInput
+    struct _NVEncoder   *encoder;
+    //NVD_AV1_FILM_GRAIN=driver, the grain tables of the picture being resolved and the frame it's added into, which is
+    //then resolved in place of the mapped one. Only touched by the job's turns
+    NVFilmGrainTables   *filmGrainTables;
+    CUdeviceptr         filmGrainTablesDevice;
+    NVScratchBuffer     filmGrainFrame;
+    NVStats             *stats;                 //NVD_STATS counters, NULL if disabled
 } NVContext;
 
+//encode contexts whose pictures are submitted together by vaMFSubmit
+#define MAX_MF_CONTEXTS 16
+typedef struct
+{
+    //ids rather than pointers, so a context destroyed without being released just stops resolving
+    VAContextID         contexts[MAX_MF_CONTEXTS];
+    int                 contextCount;
+    //an exported input with several planes is staged here once for every context encoding it
+    NVScratchBuffer     staging;
+} NVMFContext;
+
 typedef struct
 {
     VAProfile               profile;
@@ -190,9 +462,18 @@ typedef struct
     cudaVideoChromaFormat   chromaFormat;
     int                     bitDepth;
     cudaVideoCodec          cudaCodec;
+    bool                    intraOnly;
+    bool                    decProcessing;  //VAConfigAttribDecProcessing was requested
+    cudaVideoDeinterlaceMode deinterlaceMode;
+    bool                    doubleRate;
+    uint32_t                rateControl;    //VA_RC_* the encoder was asked for
+    bool                    lowLatency;     //VAConfigAttribNVDLowLatency
 } NVConfig;
 
 typedef void (*HandlerFunc)(NVContext*, NVBuffer* , CUVIDPICPARAMS*);
+typedef bool (*InitContextFunc)(NVContext*);
+typedef void (*DeinitContextFunc)(NVContext*);
+typedef void (*EndPictureFunc)(NVContext*, CUVIDPICPARAMS*);
 typedef cudaVideoCodec (*ComputeCudaCodec)(VAProfile);
 
 //padding/alignment is very important to this structure as it's placed in it's own section
@@ -202,10 +483,43 @@ struct _NVCodec {
     HandlerFunc         handlers[VABufferTypeMax];
     int                 supportedProfileCount;
     const VAProfile     *supportedProfiles;
+    //slice data is placed in the bitstream arena when created, handlers use claimSliceData to avoid copying it
+    bool                inPlaceSliceData;
+    //each in place slice data buffer is preceded by a 00 00 01 start code
+    bool                sliceDataStartCode;
+    //optional, set up and tear down the codec's state in NVContext.codecData
+    InitContextFunc     initContext;
+    DeinitContextFunc   deinitContext;
+    //optional, called once all the buffers of a picture have been rendered, with pBitstreamData pointing at the
+    //complete bitstream, just before it's submitted
+    EndPictureFunc      endPicture;
+    //the decoder is created with room for larger pictures, and resized with resizeDecoder when the picture size changes
+    bool                resizableDecoder;
+    //the stream can change size at a keyframe, which the picture parameter handler passes to resizeForPicture. The
+    //decoder is created with the headroom NVD_DECODER_MAX_SIZE asks for, so it can grow as well as shrink in place
+    bool                adaptiveDecoder;
 };
 
 typedef struct _NVCodec NVCodec;
 
+typedef struct
+{
+    VAProfile               profile;
+    cudaVideoCodec          capsCodec;
+    int                     bitDepth;
+    cudaVideoChromaFormat   chromaFormat;
+} NVProfileCaps;
+
+typedef struct
+{
+    const NVCodec           *codec;         //NULL if no codec handles the profile
+    cudaVideoCodec          cudaCodec;
+    //the decoder caps that determine whether the profile is listed
+    cudaVideoCodec          capsCodec;
+    int                     bitDepth;
+    cudaVideoChromaFormat   chromaFormat;
+} NVProfileInfo;
+
 typedef struct
 {
     uint32_t bppc; // bytes per pixel per channel
@@ -215,19 +529,38 @@ typedef struct
     bool     isYuv444;
     NVFormatPlane plane[3];
     VAImageFormat vaFormat;
+    bool     uploadOnly; // only an image format, converted from and to the surface's semi-planar one
+    bool     isRgb;      // packed R'G'B'A', the only plane's channels are in vaFormat's mask order
 } NVFormatInfo;
 
 extern const NVFormatInfo formatsInfo[];
 
-void appendBuffer(AppendableBuffer *ab, const void *buf, uint64_t size);
+//returns false, leaving the buffer as it was, if it couldn't be grown
+bool appendBuffer(AppendableBuffer *ab, const void *buf, uint64_t size);
+//fails the current picture, nvRenderPicture returns status and nvEndPicture drops the picture rather than decoding it
+void failPicture(NVContext *ctx, VAStatus status);
+//checks a slice's data lies within buf, failing the picture if it doesn't
+bool sliceInBuffer(NVContext *ctx, const NVBuffer *buf, uint64_t offset, uint64_t size);
+bool claimSliceData(NVContext *ctx, NVBuffer *buf, uint32_t *offset);
+bool spillSliceData(NVContext *ctx);
+uint64_t bitstreamLength(NVContext *ctx);
+//copies the slices described by lastSliceParams out of buf into the bitstream in one pass, each preceded by a
+//00 00 01 start code if startCode is set. Returns the number of bytes added
+uint64_t gatherSliceData(NVContext *ctx, NVBuffer *buf, bool startCode);
+//reconfigures the context's decoder for pictures of the given size, output at the target size, waiting for the pictures
+//already submitted to be resolved first. Only possible up to the size a resizableDecoder codec's decoder was created with
+bool resizeDecoder(NVContext *ctx, uint32_t width, uint32_t height, uint32_t targetWidth, uint32_t targetHeight);
+//reconfigures the context's decoder if a keyframe's coded size, in units of alignment, differs from the decoder's,
+//outputting at the size of the render target
+bool resizeForPicture(NVContext *ctx, uint32_t width, uint32_t height, uint32_t alignment);
 int pictureIdxFromSurfaceId(NVDriver *ctx, VASurfaceID surf);
 NVSurface* nvSurfaceFromSurfaceId(NVDriver *drv, VASurfaceID surf);
+NVBuffer* nvBufferFromBufferId(NVDriver *drv, VABufferID buf);
+NVFormat nvSurfaceFormat(const NVSurface *surface);
 bool checkCudaErrors(CUresult err, const char *file, const char *function, const int line);
-void logger(const char *filename, const char *function, int line, const char *msg, ...);
 #define CHECK_CUDA_RESULT(err) checkCudaErrors(err, __FILE__, __func__, __LINE__)
 #define CHECK_CUDA_RESULT_RETURN(err, ret) if (checkCudaErrors(err, __FILE__, __func__, __LINE__)) { return ret; }
 #define cudaVideoCodec_NONE ((cudaVideoCodec) -1)
-#define LOG(...) logger(__FILE__, __func__, __LINE__, __VA_ARGS__);
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 #define PTROFF(base, bytes) ((void *)((unsigned char *)(base) + (bytes)))
 #define DECLARE_CODEC(name) \
@@ -8,6 +8,11 @@ static void copyVP9PicParam(NVContext *ctx, NVBuffer* buffer, CUVIDPICPARAMS *pi
 {
     VADecPictureParameterBufferVP9* buf = (VADecPictureParameterBufferVP9*) buffer->ptr;
 
+    //inter frames can be a different size to their references, which NVDEC scales, only a keyframe starts afresh
+    if (buf->pic_fields.bits.frame_type == 0) {
+        resizeForPicture(ctx, buf->frame_width, buf->frame_height, 8);
+    }
+
     picParams->PicWidthInMbs    = (buf->frame_width + 15) / 16;
     picParams->FrameHeightInMbs = (buf->frame_height + 15) / 16;
 
@@ -68,13 +73,37 @@ static void copyVP9PicParam(NVContext *ctx, NVBuffer* buffer, CUVIDPICPARAMS *pi
     }
 }
 
-static GstVp9Parser *parser;
-static void parseExtraInfo(void *buf, uint32_t size, CUVIDPICPARAMS *picParams) {
-    //TODO a bit of a hack as we don't have per decoder init/deinit functions atm
-    if (parser == NULL) {
-        parser = gst_vp9_parser_new ();
+typedef struct {
+    GstVp9Parser    *parser;
+    //where the frame is in the picture's bitstream, it's parsed once the picture is complete
+    bool            haveFrame;
+    uint32_t        frameOffset;
+    uint32_t        frameSize;
+} VP9Context;
+
+static bool initVP9Context(NVContext *ctx) {
+    VP9Context *vp9 = calloc(1, sizeof(VP9Context));
+    if (vp9 == NULL) {
+        return false;
+    }
+    vp9->parser = gst_vp9_parser_new();
+    if (vp9->parser == NULL) {
+        free(vp9);
+        return false;
+    }
+    ctx->codecData = vp9;
+    return true;
+}
+
+static void deinitVP9Context(NVContext *ctx) {
+    VP9Context *vp9 = (VP9Context*) ctx->codecData;
+    if (vp9 != NULL) {
+        gst_vp9_parser_free(vp9->parser);
+        free(vp9);
     }
+}
 
+static void parseExtraInfo(GstVp9Parser *parser, const void *buf, uint32_t size, CUVIDPICPARAMS *picParams) {
     //parse all the extra information that VA-API doesn't support, but NVDEC requires
     GstVp9FrameHdr hdr;
     GstVp9ParserResult res = gst_vp9_parser_parse_frame_header(parser, &hdr, buf, size);
@@ -108,8 +137,25 @@ static void parseExtraInfo(void *buf, uint32_t size, CUVIDPICPARAMS *picParams)
 
         picParams->CodecSpecific.vp9.colorSpace = parser->color_space;
     }
+}
 
-    //gst_vp9_parser_free(parser);
+//VA-API doesn't pass everything NVDEC needs, so the rest comes from the uncompressed header of the frame
+static void endVP9Picture(NVContext *ctx, CUVIDPICPARAMS *picParams) {
+    VP9Context *vp9 = (VP9Context*) ctx->codecData;
+    if (vp9->haveFrame) {
+        parseExtraInfo(vp9->parser, PTROFF(picParams->pBitstreamData, vp9->frameOffset), vp9->frameSize, picParams);
+        vp9->haveFrame = false;
+    }
+}
+
+//the header is at the start of the first frame of the picture
+static void recordFrame(NVContext *ctx, uint32_t offset, uint32_t size) {
+    VP9Context *vp9 = (VP9Context*) ctx->codecData;
+    if (!vp9->haveFrame) {
+        vp9->haveFrame = true;
+        vp9->frameOffset = offset;
+        vp9->frameSize = size;
+    }
 }
 
 static void copyVP9SliceParam(NVContext *ctx, NVBuffer* buffer, CUVIDPICPARAMS *picParams)
@@ -124,15 +170,42 @@ static void copyVP9SliceParam(NVContext *ctx, NVBuffer* buffer, CUVIDPICPARAMS *
 
 static void copyVP9SliceData(NVContext *ctx, NVBuffer* buf, CUVIDPICPARAMS *picParams)
 {
+    uint32_t base;
+    if (claimSliceData(ctx, buf, &base)) {
+        //the frame data is already in the bitstream arena, only the offsets need recording
+        for (unsigned int i = 0; i < ctx->lastSliceParamsCount; i++)
+        {
+            VASliceParameterBufferVP9 *sliceParams = &((VASliceParameterBufferVP9*) ctx->lastSliceParams)[i];
+            if (!sliceInBuffer(ctx, buf, sliceParams->slice_data_offset, sliceParams->slice_data_size)) {
+                return;
+            }
+            uint32_t offset = base + sliceParams->slice_data_offset;
+            if (!appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset))) {
+                failPicture(ctx, VA_STATUS_ERROR_ALLOCATION_FAILED);
+                return;
+            }
+            recordFrame(ctx, offset, sliceParams->slice_data_size);
+        }
+        picParams->nBitstreamDataLen = bitstreamLength(ctx);
+        return;
+    }
+
+    if (!spillSliceData(ctx)) {
+        return;
+    }
     for (unsigned int i = 0; i < ctx->lastSliceParamsCount; i++)
     {
         VASliceParameterBufferVP9 *sliceParams = &((VASliceParameterBufferVP9*) ctx->lastSliceParams)[i];
+        if (!sliceInBuffer(ctx, buf, sliceParams->slice_data_offset, sliceParams->slice_data_size)) {
+            return;
+        }
         uint32_t offset = (uint32_t) ctx->bitstreamBuffer.size;
-        appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset));
-        appendBuffer(&ctx->bitstreamBuffer, PTROFF(buf->ptr, sliceParams->slice_data_offset), sliceParams->slice_data_size);
-
-        //TODO this might not be the best place to call as we may not have a complete packet yet...
-        parseExtraInfo(PTROFF(buf->ptr, sliceParams->slice_data_offset), sliceParams->slice_data_size, picParams);
+        if (!appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset))
+                || !appendBuffer(&ctx->bitstreamBuffer, PTROFF(buf->ptr, sliceParams->slice_data_offset), sliceParams->slice_data_size)) {
+            failPicture(ctx, VA_STATUS_ERROR_ALLOCATION_FAILED);
+            return;
+        }
+        recordFrame(ctx, offset, sliceParams->slice_data_size);
         picParams->nBitstreamDataLen += sliceParams->slice_data_size;
     }
 }
@@ -165,4 +238,9 @@ const DECLARE_CODEC(vp9Codec) = {
     },
     .supportedProfileCount = ARRAY_SIZE(vp9SupportedProfiles),
     .supportedProfiles = vp9SupportedProfiles,
+    .inPlaceSliceData = true,
+    .initContext = initVP9Context,
+    .deinitContext = deinitVP9Context,
+    .endPicture = endVP9Picture,
+    .adaptiveDecoder = true,
 };
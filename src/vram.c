@@ -0,0 +1,70 @@
+#define _GNU_SOURCE
+
+#include "vram.h"
+#include "vabackend.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/* Every allocation the driver makes in VRAM that scales with the video is counted against the display that made it,
+ * and the process as a whole, as it's made and freed. With NVD_VRAM_BUDGET set, a display about to allocate first
+ * evicts unattached backing images from it's own pool until the process fits. Nothing in use is ever freed and an
+ * allocation is never refused, so the budget bounds the caching rather than the streams. */
+
+static uint64_t budgetBytes;     //0 for no budget
+static _Atomic int64_t processUsage[NV_VRAM_COUNT];
+
+static const NVStatGauge gauges[NV_VRAM_COUNT] = {
+    [NV_VRAM_DECODERS]  = NV_GAUGE_VRAM_DECODERS,
+    [NV_VRAM_FRAMES]    = NV_GAUGE_VRAM_FRAMES,
+    [NV_VRAM_IMAGES]    = NV_GAUGE_VRAM_IMAGES,
+    [NV_VRAM_POOLED]    = NV_GAUGE_VRAM_POOLED,
+};
+
+void vramConfigure(const char *budget) {
+    if (budget == NULL) {
+        return;
+    }
+    budgetBytes = strtoull(budget, NULL, 10) << 20;
+    if (budgetBytes > 0) {
+        LOG("Keeping VRAM under %" PRIu64 " MiB", budgetBytes >> 20);
+    }
+}
+
+void vramAccount(NVDriver *drv, NVVramKind kind, int64_t bytes) {
+    if (bytes == 0) {
+        return;
+    }
+    atomic_fetch_add_explicit(&drv->vram[kind], bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&processUsage[kind], bytes, memory_order_relaxed);
+    statsAddGauge(drv->stats, gauges[kind], bytes);
+}
+
+uint64_t vramProcessUsage(void) {
+    int64_t total = 0;
+    //pooled images are already counted as images
+    for (int i = 0; i < NV_VRAM_COUNT; i++) {
+        if (i != NV_VRAM_POOLED) {
+            total += atomic_load_explicit(&processUsage[i], memory_order_relaxed);
+        }
+    }
+    return total > 0 ? (uint64_t) total : 0;
+}
+
+void vramMakeRoom(NVDriver *drv, uint64_t bytes) {
+    if (budgetBytes == 0 || drv->backend == NULL || drv->backend->evictBackingImages == NULL) {
+        return;
+    }
+    uint64_t usage = vramProcessUsage();
+    if (usage + bytes <= budgetBytes) {
+        return;
+    }
+    uint64_t evicted = drv->backend->evictBackingImages(drv, usage + bytes - budgetBytes);
+    if (evicted > 0) {
+        LOG("Evicted %" PRIu64 " KiB of pooled backing images to stay under NVD_VRAM_BUDGET", evicted >> 10);
+        statsAddGauge(drv->stats, NV_GAUGE_VRAM_EVICTED, (int64_t) evicted);
+    } else {
+        LOG_TRACE("Over NVD_VRAM_BUDGET with nothing pooled to evict, %" PRIu64 " KiB in use", usage >> 10);
+    }
+}
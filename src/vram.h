@@ -0,0 +1,27 @@
+#ifndef VRAM_H
+#define VRAM_H
+
+#include <stdint.h>
+
+struct _NVDriver;
+
+//what the driver's VRAM is held by
+typedef enum {
+    NV_VRAM_DECODERS,   //NVDEC's decode and output surfaces, estimated from the decoder's parameters, idle pooled ones included
+    NV_VRAM_FRAMES,     //the pitch-linear frames of surfaces that haven't been exported
+    NV_VRAM_IMAGES,     //backing images, attached or pooled
+    NV_VRAM_POOLED,     //the part of NV_VRAM_IMAGES that isn't attached to a surface, so can be evicted
+    NV_VRAM_COUNT
+} NVVramKind;
+
+//reads NVD_VRAM_BUDGET, in MiB
+void vramConfigure(const char *budget);
+//adds bytes, which can be negative, to what the display and the whole process hold
+void vramAccount(struct _NVDriver *drv, NVVramKind kind, int64_t bytes);
+//everything the process holds, pooled images included
+uint64_t vramProcessUsage(void);
+//evicts the display's pooled backing images, least recently used first, until bytes more fits in the budget.
+//the allocation itself goes ahead regardless, the budget only limits what's kept around for reuse
+void vramMakeRoom(struct _NVDriver *drv, uint64_t bytes);
+
+#endif // VRAM_H